@@ -10,14 +10,24 @@
 * keep minimum overhead to achieve low latency.
 *
 * Asynchronous and synchronous requests are not treated separately, but
-* we relay on deadlines to ensure fairness.
+* we relay on deadlines to ensure fairness. Synchronous requests are
+* preferred, but only writes_starved times in a row while asynchronous
+* ones are waiting.
+*
+* Optionally (io_context_rr), each direction is served round robin
+* between the io contexts that have requests queued, rr_quantum requests
+* at a time, so that one process flooding a fifo cannot starve others.
+* Dispatch stays O(1) either way.
 *
 */
 #include <linux/blkdev.h>
 #include <linux/elevator.h>
 #include <linux/bio.h>
+#include <linux/hash.h>
+#include <linux/iocontext.h>
 #include <linux/module.h>
 #include <linux/init.h>
+#include <linux/sched.h>
 #include <linux/slab.h>
 
 enum {
@@ -30,20 +40,165 @@ static const int sync_expire = HZ / 2; /* max time before a sync is submitted. *
 static const int async_expire = 5 * HZ; /* ditto for async, these limits are SOFT! */
 static const int fifo_batch = 1; /* # of sequential requests treated as one
 by the above parameters. For throughput. */
+static const int writes_starved = 2; /* max times async can be starved by sync */
+static const int io_context_rr = 0; /* round robin between io contexts */
+static const int rr_quantum = 4; /* requests per io context per round */
+
+#define SIO_IOC_HASH_SHIFT 6
+
+/* Queued requests of one io context (or task, if it has none) */
+struct sio_ioc {
+struct hlist_node hash;
+void *key;
+int ref; /* one per allocated request */
+struct list_head fifo[2];
+struct list_head rr_entry[2];
+};
+
+/* Per request data, in rq->elevator_private */
+struct sio_rq {
+struct list_head entry; /* in ioc->fifo */
+struct sio_ioc *ioc;
+struct request *rq;
+};
+
+static struct kmem_cache *sio_ioc_pool;
+static struct kmem_cache *sio_rq_pool;
 
 /* Elevator data */
 struct sio_data {
 /* Request queues */
 struct list_head fifo_list[2];
 
+/* Io contexts with requests queued, and the one being served */
+struct list_head rr_list[2];
+struct sio_ioc *rr_active[2];
+int rr_left[2];
+struct hlist_head ioc_hash[1 << SIO_IOC_HASH_SHIFT];
+
 /* Attributes */
 unsigned int batched;
+unsigned int starved;
 
 /* Settings */
 int fifo_expire[2];
 int fifo_batch;
+int writes_starved;
+int io_context_rr;
+int rr_quantum;
 };
 
+static struct sio_ioc *
+sio_find_ioc(struct sio_data *sd, void *key)
+{
+struct hlist_head *head = &sd->ioc_hash[hash_ptr(key, SIO_IOC_HASH_SHIFT)];
+struct hlist_node *node;
+struct sio_ioc *ioc;
+
+hlist_for_each_entry(ioc, node, head, hash)
+if (ioc->key == key)
+return ioc;
+
+return NULL;
+}
+
+static int
+sio_set_request(struct request_queue *q, struct request *rq, gfp_t gfp_mask)
+{
+struct sio_data *sd = q->elevator->elevator_data;
+void *key = current->io_context;
+struct sio_ioc *ioc, *new_ioc = NULL;
+struct sio_rq *srq;
+unsigned long flags;
+
+/*
+* Without per request data, a request is just served from the
+* fifo lists; so failing here is never fatal.
+*/
+if (!key)
+key = current;
+srq = kmem_cache_alloc_node(sio_rq_pool, gfp_mask, q->node);
+if (!srq)
+return 0;
+
+spin_lock_irqsave(q->queue_lock, flags);
+ioc = sio_find_ioc(sd, key);
+if (!ioc) {
+spin_unlock_irqrestore(q->queue_lock, flags);
+new_ioc = kmem_cache_alloc_node(sio_ioc_pool, gfp_mask, q->node);
+if (!new_ioc) {
+kmem_cache_free(sio_rq_pool, srq);
+return 0;
+}
+spin_lock_irqsave(q->queue_lock, flags);
+ioc = sio_find_ioc(sd, key);
+if (!ioc) {
+ioc = new_ioc;
+new_ioc = NULL;
+ioc->key = key;
+ioc->ref = 0;
+INIT_LIST_HEAD(&ioc->fifo[SYNC]);
+INIT_LIST_HEAD(&ioc->fifo[ASYNC]);
+INIT_LIST_HEAD(&ioc->rr_entry[SYNC]);
+INIT_LIST_HEAD(&ioc->rr_entry[ASYNC]);
+hlist_add_head(&ioc->hash,
+&sd->ioc_hash[hash_ptr(key, SIO_IOC_HASH_SHIFT)]);
+}
+}
+ioc->ref++;
+spin_unlock_irqrestore(q->queue_lock, flags);
+
+if (new_ioc)
+kmem_cache_free(sio_ioc_pool, new_ioc);
+
+INIT_LIST_HEAD(&srq->entry);
+srq->ioc = ioc;
+srq->rq = rq;
+rq->elevator_private = srq;
+
+return 0;
+}
+
+static void
+sio_put_request(struct request *rq)
+{
+struct sio_data *sd = rq->q->elevator->elevator_data;
+struct sio_rq *srq = rq->elevator_private;
+struct sio_ioc *ioc;
+
+if (!srq)
+return;
+
+/* Called with the queue lock held */
+ioc = srq->ioc;
+if (!--ioc->ref) {
+hlist_del(&ioc->hash);
+if (sd->rr_active[SYNC] == ioc)
+sd->rr_active[SYNC] = NULL;
+if (sd->rr_active[ASYNC] == ioc)
+sd->rr_active[ASYNC] = NULL;
+kmem_cache_free(sio_ioc_pool, ioc);
+}
+kmem_cache_free(sio_rq_pool, srq);
+rq->elevator_private = NULL;
+}
+
+static void
+sio_remove_request(struct sio_data *sd, struct request *rq)
+{
+struct sio_rq *srq = rq->elevator_private;
+const int sync = rq_is_sync(rq);
+
+rq_fifo_clear(rq);
+
+/* Leave the round robin once the io context has nothing queued */
+if (srq && !list_empty(&srq->entry)) {
+list_del_init(&srq->entry);
+if (list_empty(&srq->ioc->fifo[sync]))
+list_del_init(&srq->ioc->rr_entry[sync]);
+}
+}
+
 static void
 sio_merged_requests(struct request_queue *q, struct request *rq,
 struct request *next)
@@ -60,13 +215,14 @@ rq_set_fifo_time(rq, rq_fifo_time(next));
 }
 
 /* Delete next request */
-rq_fifo_clear(next);
+sio_remove_request(q->elevator->elevator_data, next);
 }
 
 static void
 sio_add_request(struct request_queue *q, struct request *rq)
 {
 struct sio_data *sd = q->elevator->elevator_data;
+struct sio_rq *srq = rq->elevator_private;
 const int sync = rq_is_sync(rq);
 
 /*
@@ -75,6 +231,13 @@ const int sync = rq_is_sync(rq);
 */
 rq_set_fifo_time(rq, jiffies + sd->fifo_expire[sync]);
 list_add_tail(&rq->queuelist, &sd->fifo_list[sync]);
+
+/* And to its io context's fifo, joining the round robin if needed */
+if (srq) {
+list_add_tail(&srq->entry, &srq->ioc->fifo[sync]);
+if (list_empty(&srq->ioc->rr_entry[sync]))
+list_add_tail(&srq->ioc->rr_entry[sync], &sd->rr_list[sync]);
+}
 }
 
 static int
@@ -124,22 +287,65 @@ return async;
 
 }
 
+static struct request *
+sio_rr_request(struct sio_data *sd, int sync)
+{
+struct sio_ioc *ioc = sd->rr_active[sync];
+struct sio_rq *srq;
+
+/*
+* Stay with the active io context for rr_quantum requests, then
+* move it to the back of the round robin.
+*/
+if (!ioc || list_empty(&ioc->fifo[sync]) || sd->rr_left[sync] <= 0) {
+if (ioc && !list_empty(&ioc->rr_entry[sync]))
+list_move_tail(&ioc->rr_entry[sync], &sd->rr_list[sync]);
+
+/* Requests without an io context are only on the fifo */
+if (list_empty(&sd->rr_list[sync])) {
+sd->rr_active[sync] = NULL;
+return rq_entry_fifo(sd->fifo_list[sync].next);
+}
+
+ioc = list_first_entry(&sd->rr_list[sync], struct sio_ioc,
+rr_entry[sync]);
+sd->rr_active[sync] = ioc;
+sd->rr_left[sync] = sd->rr_quantum;
+}
+
+sd->rr_left[sync]--;
+srq = list_first_entry(&ioc->fifo[sync], struct sio_rq, entry);
+return srq->rq;
+}
+
 static struct request *
 sio_choose_request(struct sio_data *sd)
 {
+int sync;
+
 /*
 * Retrieve request from available fifo list.
-* Synchronous requests have priority over asynchronous.
+* Synchronous requests have priority over asynchronous,
+* unless asynchronous ones have been starved too often.
 */
-if (!list_empty(&sd->fifo_list[SYNC]))
-return rq_entry_fifo(sd->fifo_list[SYNC].next);
-
+if (!list_empty(&sd->fifo_list[SYNC]) &&
+(list_empty(&sd->fifo_list[ASYNC]) ||
+sd->starved < sd->writes_starved)) {
 if (!list_empty(&sd->fifo_list[ASYNC]))
-return rq_entry_fifo(sd->fifo_list[ASYNC].next);
-
+sd->starved++;
+sync = SYNC;
+} else if (!list_empty(&sd->fifo_list[ASYNC])) {
+sync = ASYNC;
+} else {
 return NULL;
 }
 
+if (sd->io_context_rr)
+return sio_rr_request(sd, sync);
+
+return rq_entry_fifo(sd->fifo_list[sync].next);
+}
+
 static inline void
 sio_dispatch_request(struct sio_data *sd, struct request *rq)
 {
@@ -147,9 +353,11 @@ sio_dispatch_request(struct sio_data *sd, struct request *rq)
 * Remove the request from the fifo list
 * and dispatch it.
 */
-rq_fifo_clear(rq);
+sio_remove_request(sd, rq);
 elv_dispatch_add_tail(rq->q, rq);
 
+if (!rq_is_sync(rq))
+sd->starved = 0;
 sd->batched++;
 }
 
@@ -211,6 +419,7 @@ static void *
 sio_init_queue(struct request_queue *q)
 {
 struct sio_data *sd;
+int i;
 
 /* Allocate structure */
 sd = kmalloc_node(sizeof(*sd), GFP_KERNEL, q->node);
@@ -221,11 +430,25 @@ return NULL;
 INIT_LIST_HEAD(&sd->fifo_list[SYNC]);
 INIT_LIST_HEAD(&sd->fifo_list[ASYNC]);
 
+/* Initialize round robin */
+INIT_LIST_HEAD(&sd->rr_list[SYNC]);
+INIT_LIST_HEAD(&sd->rr_list[ASYNC]);
+sd->rr_active[SYNC] = NULL;
+sd->rr_active[ASYNC] = NULL;
+sd->rr_left[SYNC] = 0;
+sd->rr_left[ASYNC] = 0;
+for (i = 0; i < ARRAY_SIZE(sd->ioc_hash); i++)
+INIT_HLIST_HEAD(&sd->ioc_hash[i]);
+
 /* Initialize data */
 sd->batched = 0;
+sd->starved = 0;
 sd->fifo_expire[SYNC] = sync_expire;
 sd->fifo_expire[ASYNC] = async_expire;
 sd->fifo_batch = fifo_batch;
+sd->writes_starved = writes_starved;
+sd->io_context_rr = io_context_rr;
+sd->rr_quantum = rr_quantum;
 
 return sd;
 }
@@ -237,6 +460,8 @@ struct sio_data *sd = e->elevator_data;
 
 BUG_ON(!list_empty(&sd->fifo_list[SYNC]));
 BUG_ON(!list_empty(&sd->fifo_list[ASYNC]));
+BUG_ON(!list_empty(&sd->rr_list[SYNC]));
+BUG_ON(!list_empty(&sd->rr_list[ASYNC]));
 
 /* Free structure */
 kfree(sd);
@@ -273,6 +498,9 @@ return sio_var_show(__data, (page)); \
 SHOW_FUNCTION(sio_sync_expire_show, sd->fifo_expire[SYNC], 1);
 SHOW_FUNCTION(sio_async_expire_show, sd->fifo_expire[ASYNC], 1);
 SHOW_FUNCTION(sio_fifo_batch_show, sd->fifo_batch, 0);
+SHOW_FUNCTION(sio_writes_starved_show, sd->writes_starved, 0);
+SHOW_FUNCTION(sio_io_context_rr_show, sd->io_context_rr, 0);
+SHOW_FUNCTION(sio_rr_quantum_show, sd->rr_quantum, 0);
 #undef SHOW_FUNCTION
 
 #define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX, __CONV) \
@@ -294,6 +522,9 @@ return ret; \
 STORE_FUNCTION(sio_sync_expire_store, &sd->fifo_expire[SYNC], 0, INT_MAX, 1);
 STORE_FUNCTION(sio_async_expire_store, &sd->fifo_expire[ASYNC], 0, INT_MAX, 1);
 STORE_FUNCTION(sio_fifo_batch_store, &sd->fifo_batch, 0, INT_MAX, 0);
+STORE_FUNCTION(sio_writes_starved_store, &sd->writes_starved, 0, INT_MAX, 0);
+STORE_FUNCTION(sio_io_context_rr_store, &sd->io_context_rr, 0, 1, 0);
+STORE_FUNCTION(sio_rr_quantum_store, &sd->rr_quantum, 1, INT_MAX, 0);
 #undef STORE_FUNCTION
 
 #define DD_ATTR(name) \
@@ -304,6 +535,9 @@ static struct elv_fs_entry sio_attrs[] = {
 DD_ATTR(sync_expire),
 DD_ATTR(async_expire),
 DD_ATTR(fifo_batch),
+DD_ATTR(writes_starved),
+DD_ATTR(io_context_rr),
+DD_ATTR(rr_quantum),
 __ATTR_NULL
 };
 
@@ -315,6 +549,8 @@ static struct elevator_type iosched_sio = {
 .elevator_queue_empty_fn = sio_queue_empty,
 .elevator_former_req_fn = sio_former_request,
 .elevator_latter_req_fn = sio_latter_request,
+.elevator_set_req_fn = sio_set_request,
+.elevator_put_req_fn = sio_put_request,
 .elevator_init_fn = sio_init_queue,
 .elevator_exit_fn = sio_exit_queue,
 },
@@ -326,6 +562,17 @@ static struct elevator_type iosched_sio = {
 
 static int __init sio_init(void)
 {
+/* Allocate slab caches */
+sio_ioc_pool = KMEM_CACHE(sio_ioc, 0);
+sio_rq_pool = KMEM_CACHE(sio_rq, 0);
+if (!sio_ioc_pool || !sio_rq_pool) {
+if (sio_ioc_pool)
+kmem_cache_destroy(sio_ioc_pool);
+if (sio_rq_pool)
+kmem_cache_destroy(sio_rq_pool);
+return -ENOMEM;
+}
+
 /* Register elevator */
 elv_register(&iosched_sio);
 
@@ -336,6 +583,9 @@ static void __exit sio_exit(void)
 {
 /* Unregister elevator */
 elv_unregister(&iosched_sio);
+
+kmem_cache_destroy(sio_rq_pool);
+kmem_cache_destroy(sio_ioc_pool);
 }
 
 module_init(sio_init);
@@ -17,35 +17,91 @@
 #include <linux/debugfs.h>
 #include <linux/dma-mapping.h>
 #include <linux/err.h>
+#include <linux/freezer.h>
 #include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/jiffies.h>
+#include <linux/kthread.h>
 #include <linux/list.h>
 #include <linux/module.h>
+#include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
 #include "ion_priv.h"
 
 /* #define DEBUG_PAGE_POOL_SHRINKER */
 
 static struct plist_head pools = PLIST_HEAD_INIT(pools);
+/* protects pools and refill_pool, see ion_page_pool_refill_fn */
+static DEFINE_MUTEX(pools_lock);
 static struct shrinker shrinker;
 
+/*
+ * The refill thread keeps every pool stocked with this much pre-zeroed
+ * memory, and zeroes pages returned to the pools, at idle priority.
+ */
+static unsigned int watermark_kb = 2048;
+module_param(watermark_kb, uint, 0644);
+
+static struct task_struct *refill_task;
+static DECLARE_WAIT_QUEUE_HEAD(refill_wait);
+/* set by ion_page_pool_wake_refill, cleared by the thread before each pass */
+static atomic_t refill_pending = ATOMIC_INIT(0);
+/* no refilling before this time, set after reclaim or a failed refill */
+static unsigned long refill_after;
+/* the pool the refill thread is working on, destroy waits for it */
+static struct ion_page_pool *refill_pool;
+static DECLARE_WAIT_QUEUE_HEAD(refill_idle_wait);
+
 struct ion_page_pool_item {
 	struct page *page;
 	struct list_head list;
 };
 
-static void *ion_page_pool_alloc_pages(struct ion_page_pool *pool)
+/*
+ * Each cpu keeps a small magazine of zeroed pages for allocation, and one
+ * of freed pages waiting to be zeroed, in front of the shared lists. They
+ * are refilled and drained a batch at a time, so most allocations and
+ * frees only take the uncontended per-cpu lock, never pool->mutex.
+ */
+#define ION_PAGE_POOL_MAGAZINE	32
+#define ION_PAGE_POOL_MAGAZINE_BYTES	(256 * 1024)
+
+struct ion_page_pool_cpu {
+	spinlock_t lock;
+	int clean_count;
+	int dirty_count;
+	struct page *clean[ION_PAGE_POOL_MAGAZINE];
+	struct page *dirty[ION_PAGE_POOL_MAGAZINE];
+};
+
+static void ion_page_pool_wake_refill(void)
 {
-	struct page *page = alloc_pages(pool->gfp_mask, pool->order);
-	struct scatterlist sg;
+	atomic_set(&refill_pending, 1);
+	wake_up(&refill_wait);
+}
 
-	if (!page)
-		return NULL;
+static void ion_page_pool_sync(struct ion_page_pool *pool, struct page *page)
+{
+	struct scatterlist sg;
 
 	sg_init_table(&sg, 1);
 	sg_set_page(&sg, page, PAGE_SIZE << pool->order, 0);
 	sg_dma_address(&sg) = sg_phys(&sg);
 	dma_sync_sg_for_device(NULL, &sg, 1, DMA_BIDIRECTIONAL);
+}
+
+static void *ion_page_pool_alloc_pages(struct ion_page_pool *pool)
+{
+	struct page *page = alloc_pages(pool->gfp_mask, pool->order);
+
+	if (!page)
+		return NULL;
+
+	ion_page_pool_sync(pool, page);
 
 	return page;
 }
@@ -56,7 +112,19 @@ static void ion_page_pool_free_pages(struct ion_page_pool *pool,
 	__free_pages(page, pool->order);
 }
 
-static int ion_page_pool_add(struct ion_page_pool *pool, struct page *page)
+/* zero a page that came back from a buffer and make it ready for dma */
+static void ion_page_pool_zero(struct ion_page_pool *pool, struct page *page)
+{
+	int i;
+
+	for (i = 0; i < (1 << pool->order); i++)
+		clear_highpage(page + i);
+
+	ion_page_pool_sync(pool, page);
+}
+
+static int ion_page_pool_add(struct ion_page_pool *pool, struct page *page,
+			     bool dirty)
 {
 	struct ion_page_pool_item *item;
 
@@ -66,7 +134,10 @@ static int ion_page_pool_add(struct ion_page_pool *pool, struct page *page)
 
 	mutex_lock(&pool->mutex);
 	item->page = page;
-	if (PageHighMem(page)) {
+	if (dirty) {
+		list_add_tail(&item->list, &pool->dirty_items);
+		pool->dirty_count++;
+	} else if (PageHighMem(page)) {
 		list_add_tail(&item->list, &pool->high_items);
 		pool->high_count++;
 	} else {
@@ -77,6 +148,45 @@ static int ion_page_pool_add(struct ion_page_pool *pool, struct page *page)
 	return 0;
 }
 
+static void ion_page_pool_add_batch(struct ion_page_pool *pool,
+				    struct page **pages, int n, bool dirty)
+{
+	LIST_HEAD(high_items);
+	LIST_HEAD(low_items);
+	int high_count = 0, low_count = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		struct ion_page_pool_item *item;
+
+		item = kmalloc(sizeof(struct ion_page_pool_item), GFP_KERNEL);
+		if (!item) {
+			ion_page_pool_free_pages(pool, pages[i]);
+			continue;
+		}
+		item->page = pages[i];
+		if (!dirty && PageHighMem(pages[i])) {
+			list_add_tail(&item->list, &high_items);
+			high_count++;
+		} else {
+			list_add_tail(&item->list, &low_items);
+			low_count++;
+		}
+	}
+
+	mutex_lock(&pool->mutex);
+	if (dirty) {
+		list_splice_tail(&low_items, &pool->dirty_items);
+		pool->dirty_count += low_count;
+	} else {
+		list_splice_tail(&high_items, &pool->high_items);
+		pool->high_count += high_count;
+		list_splice_tail(&low_items, &pool->low_items);
+		pool->low_count += low_count;
+	}
+	mutex_unlock(&pool->mutex);
+}
+
 static struct page *ion_page_pool_remove(struct ion_page_pool *pool, bool high)
 {
 	struct ion_page_pool_item *item;
@@ -100,32 +210,327 @@ static struct page *ion_page_pool_remove(struct ion_page_pool *pool, bool high)
 	return page;
 }
 
+static struct page *ion_page_pool_remove_dirty(struct ion_page_pool *pool)
+{
+	struct ion_page_pool_item *item;
+	struct page *page;
+
+	WARN_ON(!pool->dirty_count);
+	item = list_first_entry(&pool->dirty_items, struct ion_page_pool_item,
+				list);
+	pool->dirty_count--;
+
+	list_del(&item->list);
+	page = item->page;
+	kfree(item);
+	return page;
+}
+
+static int ion_page_pool_watermark(struct ion_page_pool *pool)
+{
+	return (watermark_kb * 1024) >> (PAGE_SHIFT + pool->order);
+}
+
+static bool ion_page_pool_needs_refill(struct ion_page_pool *pool)
+{
+	return pool->high_count + pool->low_count + pool->dirty_count <
+		ion_page_pool_watermark(pool) &&
+		time_after_eq(jiffies, refill_after);
+}
+
+/*
+ * Moves a cpu's magazines back to the shared lists: the dirty one, and the
+ * clean one as well if 'clean' is set.
+ */
+static void ion_page_pool_drain_cpu(struct ion_page_pool *pool, int cpu,
+				    bool clean)
+{
+	struct ion_page_pool_cpu *pc = per_cpu_ptr(pool->cpus, cpu);
+	struct page *clean_pages[ION_PAGE_POOL_MAGAZINE];
+	struct page *dirty_pages[ION_PAGE_POOL_MAGAZINE];
+	int clean_count = 0, dirty_count;
+
+	spin_lock(&pc->lock);
+	if (clean) {
+		clean_count = pc->clean_count;
+		memcpy(clean_pages, pc->clean, clean_count * sizeof(void *));
+		pc->clean_count = 0;
+	}
+	dirty_count = pc->dirty_count;
+	memcpy(dirty_pages, pc->dirty, dirty_count * sizeof(void *));
+	pc->dirty_count = 0;
+	spin_unlock(&pc->lock);
+
+	if (clean_count)
+		ion_page_pool_add_batch(pool, clean_pages, clean_count, false);
+	if (dirty_count)
+		ion_page_pool_add_batch(pool, dirty_pages, dirty_count, true);
+}
+
+static void ion_page_pool_drain(struct ion_page_pool *pool, bool clean)
+{
+	int cpu;
+
+	if (!pool->magazine_size)
+		return;
+	for_each_possible_cpu(cpu)
+		ion_page_pool_drain_cpu(pool, cpu, clean);
+}
+
+/*
+ * Frees up to nr pages straight out of a cpu's magazines, dirty ones first.
+ * Used from reclaim, where moving them to the shared lists would have to
+ * allocate a list item for every page.
+ */
+static int ion_page_pool_shrink_cpu(struct ion_page_pool *pool, int cpu,
+				    int nr)
+{
+	struct ion_page_pool_cpu *pc = per_cpu_ptr(pool->cpus, cpu);
+	struct page *pages[2 * ION_PAGE_POOL_MAGAZINE];
+	int n = 0, i;
+
+	spin_lock(&pc->lock);
+	while (n < nr && pc->dirty_count)
+		pages[n++] = pc->dirty[--pc->dirty_count];
+	while (n < nr && pc->clean_count)
+		pages[n++] = pc->clean[--pc->clean_count];
+	spin_unlock(&pc->lock);
+
+	for (i = 0; i < n; i++)
+		ion_page_pool_free_pages(pool, pages[i]);
+	return n;
+}
+
+static int ion_page_pool_magazine_count(struct ion_page_pool *pool)
+{
+	int cpu, count = 0;
+
+	if (!pool->magazine_size)
+		return 0;
+	for_each_possible_cpu(cpu) {
+		struct ion_page_pool_cpu *pc = per_cpu_ptr(pool->cpus, cpu);
+
+		count += pc->clean_count + pc->dirty_count;
+	}
+	return count;
+}
+
+static struct page *ion_page_pool_cpu_alloc(struct ion_page_pool *pool)
+{
+	struct ion_page_pool_cpu *pc;
+	struct page *pages[ION_PAGE_POOL_MAGAZINE];
+	struct page *page = NULL;
+	bool refill;
+	int n = 0, i;
+
+	pc = per_cpu_ptr(pool->cpus, get_cpu());
+	spin_lock(&pc->lock);
+	if (pc->clean_count)
+		page = pc->clean[--pc->clean_count];
+	spin_unlock(&pc->lock);
+	put_cpu();
+	if (page)
+		return page;
+
+	/* take a batch from the shared lists and keep the rest for later */
+	mutex_lock(&pool->mutex);
+	while (n < pool->magazine_size && (pool->high_count || pool->low_count))
+		pages[n++] = ion_page_pool_remove(pool, pool->high_count != 0);
+	refill = ion_page_pool_needs_refill(pool);
+	mutex_unlock(&pool->mutex);
+
+	if (refill)
+		ion_page_pool_wake_refill();
+	if (!n)
+		return NULL;
+
+	page = pages[--n];
+	pc = per_cpu_ptr(pool->cpus, get_cpu());
+	spin_lock(&pc->lock);
+	for (i = 0; i < n && pc->clean_count < pool->magazine_size; i++)
+		pc->clean[pc->clean_count++] = pages[i];
+	spin_unlock(&pc->lock);
+	put_cpu();
+
+	if (i < n)
+		ion_page_pool_add_batch(pool, pages + i, n - i, false);
+	return page;
+}
+
+static void ion_page_pool_cpu_free(struct ion_page_pool *pool,
+				   struct page *page)
+{
+	struct ion_page_pool_cpu *pc;
+	struct page *pages[ION_PAGE_POOL_MAGAZINE + 1];
+	int n = 0;
+
+	pc = per_cpu_ptr(pool->cpus, get_cpu());
+	spin_lock(&pc->lock);
+	if (pc->dirty_count < pool->magazine_size) {
+		pc->dirty[pc->dirty_count++] = page;
+		page = NULL;
+	} else {
+		n = pc->dirty_count;
+		memcpy(pages, pc->dirty, n * sizeof(void *));
+		pc->dirty_count = 0;
+	}
+	spin_unlock(&pc->lock);
+	put_cpu();
+	if (!page)
+		return;
+
+	/* the magazine was full, hand it to the refill thread for zeroing */
+	pages[n++] = page;
+	ion_page_pool_add_batch(pool, pages, n, true);
+	ion_page_pool_wake_refill();
+}
+
 void *ion_page_pool_alloc(struct ion_page_pool *pool)
 {
 	struct page *page = NULL;
+	bool dirty = false;
+	bool refill;
 
 	WARN_ON(!pool);
 
+	if (pool->magazine_size) {
+		page = ion_page_pool_cpu_alloc(pool);
+		if (page)
+			return page;
+	}
+
 	mutex_lock(&pool->mutex);
-	if (pool->high_count)
+	if (pool->high_count) {
 		page = ion_page_pool_remove(pool, true);
-	else if (pool->low_count)
+	} else if (pool->low_count) {
 		page = ion_page_pool_remove(pool, false);
+	} else if (pool->dirty_count) {
+		page = ion_page_pool_remove_dirty(pool);
+		dirty = true;
+	}
+	refill = ion_page_pool_needs_refill(pool);
 	mutex_unlock(&pool->mutex);
 
-	if (!page)
+	if (refill)
+		ion_page_pool_wake_refill();
+
+	if (dirty)
+		ion_page_pool_zero(pool, page);
+	else if (!page)
 		page = ion_page_pool_alloc_pages(pool);
 
 	return page;
 }
 
+/*
+ * Pages freed to the pool may hold another buffer's data. They are only
+ * handed out again once zeroed, by the refill thread or, if the pool has
+ * nothing else, by ion_page_pool_alloc.
+ */
 void ion_page_pool_free(struct ion_page_pool *pool, struct page* page)
 {
 	int ret;
 
-	ret = ion_page_pool_add(pool, page);
+	if (pool->magazine_size) {
+		ion_page_pool_cpu_free(pool, page);
+		return;
+	}
+
+	ret = ion_page_pool_add(pool, page, true);
 	if (ret)
 		ion_page_pool_free_pages(pool, page);
+	else
+		ion_page_pool_wake_refill();
+}
+
+/*
+ * Zero the pool's dirty pages, then top it up to the watermark. Refill
+ * allocations (zeroed by __GFP_ZERO in the pool's gfp_mask) must not
+ * enter direct reclaim: the pages are not needed yet, and reclaim would
+ * only drain the pools again.
+ */
+static void ion_page_pool_refill(struct ion_page_pool *pool)
+{
+	gfp_t gfp_mask = (pool->gfp_mask | __GFP_NOWARN | __GFP_NORETRY) &
+			 ~__GFP_WAIT;
+
+	for (;;) {
+		struct page *page;
+
+		mutex_lock(&pool->mutex);
+		if (pool->dirty_count) {
+			page = ion_page_pool_remove_dirty(pool);
+			mutex_unlock(&pool->mutex);
+			ion_page_pool_zero(pool, page);
+		} else if (ion_page_pool_needs_refill(pool)) {
+			mutex_unlock(&pool->mutex);
+			page = alloc_pages(gfp_mask, pool->order);
+			if (!page) {
+				refill_after = jiffies + HZ;
+				return;
+			}
+			ion_page_pool_sync(pool, page);
+		} else {
+			mutex_unlock(&pool->mutex);
+			return;
+		}
+		if (ion_page_pool_add(pool, page, false)) {
+			ion_page_pool_free_pages(pool, page);
+			return;
+		}
+		if (kthread_should_stop())
+			return;
+	}
+}
+
+/*
+ * Picks the next pool not yet visited in pass 'seq' and marks it as the one
+ * being refilled, so ion_page_pool_destroy waits for us before freeing it.
+ * pools_lock is only held here, never while pages are zeroed or allocated:
+ * ion_page_pool_create and _destroy must not stall behind a refill pass.
+ */
+static struct ion_page_pool *ion_page_pool_next_refill(unsigned int seq)
+{
+	struct ion_page_pool *pool;
+
+	mutex_lock(&pools_lock);
+	refill_pool = NULL;
+	plist_for_each_entry(pool, &pools, list) {
+		if (pool->refill_seq != seq) {
+			pool->refill_seq = seq;
+			refill_pool = pool;
+			break;
+		}
+	}
+	mutex_unlock(&pools_lock);
+	wake_up_all(&refill_idle_wait);
+
+	return refill_pool;
+}
+
+static int ion_page_pool_refill_fn(void *data)
+{
+	struct ion_page_pool *pool;
+	unsigned int seq = 0;
+
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		wait_event_freezable(refill_wait,
+				     atomic_read(&refill_pending) ||
+				     kthread_should_stop());
+		atomic_set(&refill_pending, 0);
+
+		/* new pools start at 0, so every pass visits them */
+		if (!++seq)
+			seq++;
+		while ((pool = ion_page_pool_next_refill(seq))) {
+			ion_page_pool_drain(pool, false);
+			ion_page_pool_refill(pool);
+		}
+	}
+
+	return 0;
 }
 
 static int ion_page_pool_total(bool high)
@@ -137,6 +542,8 @@ static int ion_page_pool_total(bool high)
 		total += high ? (pool->high_count + pool->low_count) *
 			(1 << pool->order) :
 			pool->low_count * (1 << pool->order);
+		total += (pool->dirty_count +
+			  ion_page_pool_magazine_count(pool)) * (1 << pool->order);
 	}
 	return total;
 }
@@ -146,7 +553,7 @@ static int ion_page_pool_shrink(struct shrinker *shrinker,
 {
 	struct ion_page_pool *pool;
 	int nr_freed = 0;
-	int i;
+	int i, cpu;
 	bool high;
 	int nr_to_scan = sc->nr_to_scan;
 
@@ -156,12 +563,27 @@ static int ion_page_pool_shrink(struct shrinker *shrinker,
 	if (nr_to_scan == 0)
 		return ion_page_pool_total(high);
 
+	/* keep the refill thread from undoing our work right away */
+	refill_after = jiffies + HZ;
+
 	plist_for_each_entry(pool, &pools, list) {
+		if (pool->magazine_size) {
+			for_each_possible_cpu(cpu) {
+				if (nr_to_scan <= 0)
+					break;
+				i = ion_page_pool_shrink_cpu(pool, cpu,
+							     nr_to_scan);
+				nr_freed += i << pool->order;
+				nr_to_scan -= i;
+			}
+		}
 		for (i = 0; i < nr_to_scan; i++) {
 			struct page *page;
 
 			mutex_lock(&pool->mutex);
-			if (high && pool->high_count) {
+			if (pool->dirty_count) {
+				page = ion_page_pool_remove_dirty(pool);
+			} else if (high && pool->high_count) {
 				page = ion_page_pool_remove(pool, true);
 			} else if (pool->low_count) {
 				page = ion_page_pool_remove(pool, false);
@@ -183,33 +605,88 @@ struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order)
 {
 	struct ion_page_pool *pool = kmalloc(sizeof(struct ion_page_pool),
 					     GFP_KERNEL);
+	int cpu;
+
 	if (!pool)
 		return NULL;
+	pool->magazine_size = min(ION_PAGE_POOL_MAGAZINE,
+			ION_PAGE_POOL_MAGAZINE_BYTES >> (PAGE_SHIFT + order));
+	pool->cpus = NULL;
+	if (pool->magazine_size) {
+		pool->cpus = alloc_percpu(struct ion_page_pool_cpu);
+		if (!pool->cpus) {
+			kfree(pool);
+			return NULL;
+		}
+		for_each_possible_cpu(cpu) {
+			struct ion_page_pool_cpu *pc;
+
+			pc = per_cpu_ptr(pool->cpus, cpu);
+			spin_lock_init(&pc->lock);
+			pc->clean_count = 0;
+			pc->dirty_count = 0;
+		}
+	}
 	pool->high_count = 0;
 	pool->low_count = 0;
+	pool->dirty_count = 0;
 	INIT_LIST_HEAD(&pool->low_items);
 	INIT_LIST_HEAD(&pool->high_items);
+	INIT_LIST_HEAD(&pool->dirty_items);
 	pool->gfp_mask = gfp_mask;
 	pool->order = order;
+	pool->refill_seq = 0;
 	mutex_init(&pool->mutex);
 	plist_node_init(&pool->list, order);
+	mutex_lock(&pools_lock);
 	plist_add(&pool->list, &pools);
+	mutex_unlock(&pools_lock);
+
+	ion_page_pool_wake_refill();
 
 	return pool;
 }
 
 void ion_page_pool_destroy(struct ion_page_pool *pool)
 {
+	mutex_lock(&pools_lock);
 	plist_del(&pool->list, &pools);
+	mutex_unlock(&pools_lock);
+	/* off the list, so the refill thread can't pick it up again */
+	wait_event(refill_idle_wait, ACCESS_ONCE(refill_pool) != pool);
+
+	ion_page_pool_drain(pool, true);
+	free_percpu(pool->cpus);
+	while (pool->dirty_count)
+		ion_page_pool_free_pages(pool,
+					 ion_page_pool_remove_dirty(pool));
+	while (pool->high_count)
+		ion_page_pool_free_pages(pool,
+					 ion_page_pool_remove(pool, true));
+	while (pool->low_count)
+		ion_page_pool_free_pages(pool,
+					 ion_page_pool_remove(pool, false));
 	kfree(pool);
 }
 
 static int __init ion_page_pool_init(void)
 {
+	struct sched_param param = { .sched_priority = 0 };
+
 	shrinker.shrink = ion_page_pool_shrink;
 	shrinker.seeks = DEFAULT_SEEKS;
 	shrinker.batch = 0;
 	register_shrinker(&shrinker);
+
+	refill_task = kthread_run(ion_page_pool_refill_fn, NULL,
+				  "ion_page_pool");
+	if (IS_ERR(refill_task)) {
+		pr_err("%s: creating thread for pool refill failed\n",
+		       __func__);
+		refill_task = NULL;
+	} else {
+		sched_setscheduler(refill_task, SCHED_IDLE, &param);
+	}
 #ifdef DEBUG_PAGE_POOL_SHRINKER
 	debugfs_create_file("ion_pools_shrink", 0644, NULL, NULL,
 			    &debug_drop_pools_fops);
@@ -221,6 +698,8 @@ static int __init ion_page_pool_init(void)
 
 static void __exit ion_page_pool_exit(void)
 {
+	if (refill_task)
+		kthread_stop(refill_task);
 	unregister_shrinker(&shrinker);
 }
 
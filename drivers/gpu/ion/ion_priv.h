@@ -264,8 +264,10 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
  * struct ion_page_pool - pagepool struct
  * @high_count:		number of highmem items in the pool
  * @low_count:		number of lowmem items in the pool
+ * @dirty_count:	number of items waiting to be zeroed
  * @high_items:		list of highmem items
  * @low_items:		list of lowmem items
+ * @dirty_items:	list of items freed to the pool but not zeroed yet
  * @shrinker:		a shrinker for the items
  * @mutex:		lock protecting this struct and especially the count
  *			item list
@@ -275,6 +277,8 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
  *			when the shrinker fires
  * @gfp_mask:		gfp_mask to use from alloc
  * @order:		order of pages in the pool
+ * @magazine_size:	capacity of each per-cpu magazine, 0 if there are none
+ * @cpus:		per-cpu magazines in front of the lists above
  * @list:		plist node for list of pools
  *
  * Allows you to keep a pool of pre allocated pages to use from your heap.
@@ -285,13 +289,18 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
 struct ion_page_pool {
 	int high_count;
 	int low_count;
+	int dirty_count;
 	struct list_head high_items;
 	struct list_head low_items;
+	struct list_head dirty_items;
 	struct mutex mutex;
 	void *(*alloc)(struct ion_page_pool *pool);
 	void (*free)(struct ion_page_pool *pool, struct page *page);
 	gfp_t gfp_mask;
 	unsigned int order;
+	int magazine_size;
+	struct ion_page_pool_cpu __percpu *cpus;
+	unsigned int refill_seq;
 	struct plist_node list;
 };
 
@@ -20,6 +20,7 @@
 #include <linux/err.h>
 #include <linux/highmem.h>
 #include <linux/ion.h>
+#include <linux/ktime.h>
 #include <linux/mm.h>
 #include <linux/scatterlist.h>
 #include <linux/seq_file.h>
@@ -35,6 +36,13 @@ static unsigned int low_order_gfp_flags  = (GFP_HIGHUSER | __GFP_ZERO |
 					 __GFP_NOWARN);
 static const unsigned int orders[] = {8, 4, 0};
 static const int num_orders = ARRAY_SIZE(orders);
+#define NUM_ORDERS ARRAY_SIZE(orders)
+
+/*
+ * Bucket i counts page allocations that took less than 2^i microseconds,
+ * and at least half that; the last bucket also counts everything slower.
+ */
+#define ION_LATENCY_BUCKETS 16
 static int order_to_index(unsigned int order)
 {
 	int i;
@@ -53,8 +61,22 @@ static unsigned int order_to_size(int order)
 struct ion_system_heap {
 	struct ion_heap heap;
 	struct ion_page_pool **pools;
+	atomic_t latency[NUM_ORDERS][ION_LATENCY_BUCKETS];
 };
 
+static void ion_system_heap_add_latency(struct ion_system_heap *heap,
+					int index, ktime_t start)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
+	int bucket = 0;
+
+	while (us > 0 && bucket < ION_LATENCY_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+	atomic_inc(&heap->latency[index][bucket]);
+}
+
 struct page_info {
 	struct page *page;
 	unsigned int order;
@@ -122,6 +144,7 @@ static struct page_info *alloc_largest_available(struct ion_system_heap *heap,
 {
 	struct page *page;
 	struct page_info *info;
+	ktime_t start;
 	int i;
 
 	for (i = 0; i < num_orders; i++) {
@@ -130,9 +153,11 @@ static struct page_info *alloc_largest_available(struct ion_system_heap *heap,
 		if (max_order < orders[i])
 			continue;
 
+		start = ktime_get();
 		page = alloc_buffer_page(heap, buffer, orders[i]);
 		if (!page)
 			continue;
+		ion_system_heap_add_latency(heap, i, start);
 
 		info = kmalloc(sizeof(struct page_info), GFP_KERNEL);
 		if (info) {
@@ -222,16 +247,12 @@ void ion_system_heap_free(struct ion_buffer *buffer)
 							struct ion_system_heap,
 							heap);
 	struct sg_table *table = buffer->sg_table;
-	bool cached = ion_buffer_cached(buffer);
 	struct scatterlist *sg;
 	LIST_HEAD(pages);
 	int i;
 
-	/* uncached pages come from the page pools, zero them before returning
-	   for security purposes (other allocations are zerod at alloc time */
-	if (!cached)
-		ion_heap_buffer_zero(buffer);
-
+	/* uncached pages go back to the page pools, which zero them before
+	   they are reused (other allocations are zeroed at alloc time) */
 	for_each_sg(table->sgl, sg, table->nents, i)
 		free_buffer_page(sys_heap, buffer, sg_page(sg),
 				get_order(sg_dma_len(sg)));
@@ -268,7 +289,7 @@ static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 	struct ion_system_heap *sys_heap = container_of(heap,
 							struct ion_system_heap,
 							heap);
-	int i;
+	int i, j;
 	for (i = 0; i < num_orders; i++) {
 		struct ion_page_pool *pool = sys_heap->pools[i];
 		seq_printf(s, "%d order %u highmem pages in pool = %lu total\n",
@@ -277,6 +298,17 @@ static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 		seq_printf(s, "%d order %u lowmem pages in pool = %lu total\n",
 			   pool->low_count, pool->order,
 			   (1 << pool->order) * PAGE_SIZE * pool->low_count);
+		seq_printf(s, "%d order %u pages waiting to be zeroed = %lu total\n",
+			   pool->dirty_count, pool->order,
+			   (1 << pool->order) * PAGE_SIZE * pool->dirty_count);
+	}
+	for (i = 0; i < num_orders; i++) {
+		seq_printf(s, "order %u allocation latency:", orders[i]);
+		for (j = 0; j < ION_LATENCY_BUCKETS - 1; j++)
+			seq_printf(s, " <%uus %d", 1 << j,
+				   atomic_read(&sys_heap->latency[i][j]));
+		seq_printf(s, " >=%uus %d\n", 1 << (j - 1),
+			   atomic_read(&sys_heap->latency[i][j]));
 	}
 	return 0;
 }
@@ -19,6 +19,7 @@
 #include <linux/fdtable.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
@@ -29,29 +30,104 @@
 #include <linux/debugfs.h>
 #include <linux/proc_fs.h>
 #include <linux/rbtree.h>
+#include <linux/rwsem.h>
 #include <linux/sched.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/uaccess.h>
 #include <linux/vmalloc.h>
 
 #include "binder.h"
+#include "binder_trace.h"
 
-static DEFINE_MUTEX(binder_lock);
+/*
+ * Locking
+ *
+ * No lock is shared by unrelated processes on the ioctl path. A binder_proc
+ * is pinned by proc->tmp_ref: its open file holds one reference and
+ * binder_deferred_release() drops it after tearing the process down and
+ * setting is_dead, but the allocator and the proc itself are only freed by
+ * binder_free_proc() when the last reference goes. A binder_thread holds a
+ * reference on its proc and is itself pinned by thread->tmp_ref, which its
+ * entry in proc->threads holds until binder_thread_release(). Another
+ * process is only ever reached through node->proc, read under node->lock,
+ * or a transaction's from thread, read with binder_get_txn_from(); both
+ * take a reference before the pointer is used.
+ *
+ * proc->lock protects the process's threads, nodes, refs_by_desc and
+ * refs_by_node trees, the fields of its binder_refs, is_dead, its thread
+ * counts and the looper state, transaction_stack, is_dead and return_error
+ * of its threads. It is only held while that state changes: commands and
+ * transaction payloads are copied from and to user memory without it. A
+ * transaction also takes the target's proc->lock to translate objects and
+ * queue the work, always in address order (see binder_lock_procs()), and
+ * fails with BR_DEAD_REPLY if the target has died by then.
+ *
+ * t->lock protects a transaction's from, to_proc and to_thread pointers,
+ * which the threads at either end clear when they are released.
+ *
+ * proc->alloc_lock protects the buffer allocator and the link between a
+ * buffer and its transaction.
+ *
+ * node->lock protects a node's reference counts and flags, node->proc, its
+ * refs list, the death pointers of those refs and async_todo. The counts
+ * are updated with binder_node_lock(), which also takes the owning
+ * process's inner_lock. A dead node's tmp_refs is also protected by
+ * binder_dead_nodes_lock, which the dumps pin dead nodes under.
+ *
+ * proc->inner_lock protects proc->todo, delivered_death and the todo lists
+ * of the process's threads. Work is only ever appended to another process's
+ * lists; it is removed by the owning process with its proc->lock held.
+ *
+ * binder_context_mgr_lock protects binder_context_mgr_node, which is
+ * pinned with a node tmp_ref before use.
+ *
+ * Lock order:
+ *   binder_procs_lock
+ *     proc->lock
+ *       target proc->lock
+ *         proc->alloc_lock
+ *           mmap_sem
+ *         binder_context_mgr_lock
+ *           node->lock
+ *             proc->inner_lock
+ *               t->lock
+ *             binder_dead_nodes_lock
+ *
+ * proc->alloc_lock also protects the process's page LRU. The shrinker walks
+ * binder_procs under a trylock of binder_procs_lock and takes each
+ * proc->alloc_lock with a trylock.
+ */
+static DEFINE_MUTEX(binder_procs_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
 static DEFINE_MUTEX(binder_mmap_lock);
+static DEFINE_SPINLOCK(binder_context_mgr_lock);
+static DEFINE_SPINLOCK(binder_dead_nodes_lock);
 
 static HLIST_HEAD(binder_procs);
 static HLIST_HEAD(binder_deferred_list);
 static HLIST_HEAD(binder_dead_nodes);
 
+/*
+ * Pages of freed buffers stay mapped in the kernel and in the owning
+ * process, on that process's LRU, until the shrinker reclaims them, so the
+ * next transaction that needs them skips allocating, zeroing and mapping
+ * them again. binder_lru_count is the total over all processes.
+ */
+static atomic_t binder_lru_count;
+static atomic_t binder_page_hits;
+static atomic_t binder_page_misses;
+static atomic_t binder_page_reclaimed;
+
 static struct dentry *binder_debugfs_dir_entry_root;
 static struct dentry *binder_debugfs_dir_entry_proc;
+static struct dentry *binder_debugfs_dir_entry_counters;
 static struct proc_dir_entry *binder_proc_dir_entry_root;
 static struct proc_dir_entry *binder_proc_dir_entry_proc;
 static struct binder_node *binder_context_mgr_node;
 static uid_t binder_context_mgr_uid = -1;
-static int binder_last_id;
+static atomic_t binder_last_id;
 static struct workqueue_struct *binder_deferred_workqueue;
 
 #define BINDER_DEBUG_ENTRY(name) \
@@ -87,6 +163,15 @@ static int procfs_binder_read_proc_proc(char *page, char **start, off_t off,
 
 #define BINDER_SMALL_BUF_SIZE (PAGE_SIZE * 64)
 
+/*
+ * Free extents smaller than this are kept on per-size lists, one for each
+ * multiple of sizeof(void *), and are only merged with their neighbours
+ * when the tree of larger extents cannot satisfy an allocation.
+ */
+#define BINDER_SMALL_BUFFER_MAX             256
+#define BINDER_SMALL_BUCKETS                \
+	(BINDER_SMALL_BUFFER_MAX / sizeof(void *))
+
 enum {
 	BINDER_DEBUG_USER_ERROR             = 1U << 0,
 	BINDER_DEBUG_FAILED_TRANSACTION     = 1U << 1,
@@ -153,22 +238,22 @@ enum binder_stat_types {
 };
 
 struct binder_stats {
-	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
-	int obj_created[BINDER_STAT_COUNT];
-	int obj_deleted[BINDER_STAT_COUNT];
+	atomic_t br[_IOC_NR(BR_FAILED_REPLY) + 1];
+	atomic_t bc[_IOC_NR(BC_REPLY_SG) + 1];
+	atomic_t obj_created[BINDER_STAT_COUNT];
+	atomic_t obj_deleted[BINDER_STAT_COUNT];
 };
 
 static struct binder_stats binder_stats;
 
 static inline void binder_stats_deleted(enum binder_stat_types type)
 {
-	binder_stats.obj_deleted[type]++;
+	atomic_inc(&binder_stats.obj_deleted[type]);
 }
 
 static inline void binder_stats_created(enum binder_stat_types type)
 {
-	binder_stats.obj_created[type]++;
+	atomic_inc(&binder_stats.obj_created[type]);
 }
 
 struct binder_transaction_log_entry {
@@ -184,27 +269,38 @@ struct binder_transaction_log_entry {
 	int offsets_size;
 };
 struct binder_transaction_log {
-	int next;
+	atomic_t cur;
 	int full;
 	struct binder_transaction_log_entry entry[32];
 };
-static struct binder_transaction_log binder_transaction_log;
-static struct binder_transaction_log binder_transaction_log_failed;
+static struct binder_transaction_log binder_transaction_log = {
+	.cur = ATOMIC_INIT(-1),
+};
+static struct binder_transaction_log binder_transaction_log_failed = {
+	.cur = ATOMIC_INIT(-1),
+};
 
 static struct binder_transaction_log_entry *binder_transaction_log_add(
 	struct binder_transaction_log *log)
 {
 	struct binder_transaction_log_entry *e;
-	e = &log->entry[log->next];
-	memset(e, 0, sizeof(*e));
-	log->next++;
-	if (log->next == ARRAY_SIZE(log->entry)) {
-		log->next = 0;
+	unsigned int cur = atomic_inc_return(&log->cur);
+
+	if (cur % ARRAY_SIZE(log->entry) == ARRAY_SIZE(log->entry) - 1)
 		log->full = 1;
-	}
+	e = &log->entry[cur % ARRAY_SIZE(log->entry)];
+	memset(e, 0, sizeof(*e));
 	return e;
 }
 
+static unsigned int binder_transaction_log_next(
+	struct binder_transaction_log *log)
+{
+	unsigned int cur = atomic_read(&log->cur);
+
+	return (cur + 1) % ARRAY_SIZE(log->entry);
+}
+
 struct binder_work {
 	struct list_head entry;
 	enum {
@@ -219,6 +315,7 @@ struct binder_work {
 
 struct binder_node {
 	int debug_id;
+	spinlock_t lock;
 	struct binder_work work;
 	union {
 		struct rb_node rb_node;
@@ -229,6 +326,7 @@ struct binder_node {
 	int internal_strong_refs;
 	int local_weak_refs;
 	int local_strong_refs;
+	int tmp_refs;		/* pins the node itself, see binder_put_node() */
 	void __user *ptr;
 	void __user *cookie;
 	unsigned has_strong_ref:1;
@@ -237,8 +335,21 @@ struct binder_node {
 	unsigned pending_weak_ref:1;
 	unsigned has_async_transaction:1;
 	unsigned accept_fds:1;
+	unsigned inherit_rt:1;
 	unsigned min_priority:8;
 	struct list_head async_todo;
+	struct binder_node_latency *latency;
+};
+
+/*
+ * Bucket i counts transactions that took less than 2^i microseconds, and at
+ * least half that; the last bucket also counts everything slower.
+ */
+#define BINDER_LATENCY_BUCKETS 20
+
+struct binder_node_latency {
+	u32 queue[BINDER_LATENCY_BUCKETS];	/* sent until delivered */
+	u32 handle[BINDER_LATENCY_BUCKETS];	/* delivered until replied */
 };
 
 struct binder_ref_death {
@@ -263,21 +374,32 @@ struct binder_ref {
 	struct binder_ref_death *death;
 };
 
+struct binder_lru_page {
+	struct list_head lru;	/* on proc->lru while not in use */
+	struct page *page_ptr;
+	struct binder_proc *proc;
+	int users;		/* allocated buffers overlapping the page */
+};
+
 struct binder_buffer {
 	struct list_head entry; /* free and allocated entries by addesss */
-	struct rb_node rb_node; /* free entry by size or allocated entry */
-				/* by address */
+	struct rb_node rb_node; /* large free entry by size or allocated */
+				/* entry by address */
+	struct list_head bucket_entry; /* small free entry */
 	unsigned free:1;
 	unsigned allow_user_free:1;
 	unsigned async_transaction:1;
-	unsigned debug_id:29;
+	unsigned bucketed:1;
+	unsigned debug_id:28;
 
 	struct binder_transaction *transaction;
 
 	struct binder_node *target_node;
 	size_t data_size;
 	size_t offsets_size;
-	uint8_t data[0];
+	size_t extra_buffers_size;
+	size_t size; /* of the extent, not the transaction */
+	void *data;
 };
 
 enum binder_deferred_state {
@@ -288,6 +410,11 @@ enum binder_deferred_state {
 
 struct binder_proc {
 	struct hlist_node proc_node;
+	atomic_t tmp_ref;
+	int is_dead;
+	struct mutex lock;
+	struct mutex alloc_lock;
+	spinlock_t inner_lock;
 	struct rb_root threads;
 	struct rb_root nodes;
 	struct rb_root refs_by_desc;
@@ -303,10 +430,16 @@ struct binder_proc {
 
 	struct list_head buffers;
 	struct rb_root free_buffers;
+	struct list_head free_small[BINDER_SMALL_BUCKETS];
+	DECLARE_BITMAP(free_small_map, BINDER_SMALL_BUCKETS);
 	struct rb_root allocated_buffers;
 	size_t free_async_space;
+	size_t allocated_size;
+	size_t allocated_size_max;
 
-	struct page **pages;
+	struct binder_lru_page *pages;
+	struct list_head lru;	/* cached pages, oldest first */
+	int lru_count;
 	size_t buffer_size;
 	uint32_t buffer_free;
 	struct list_head todo;
@@ -319,6 +452,7 @@ struct binder_proc {
 	int ready_threads;
 	long default_priority;
 	struct dentry *debugfs_entry;
+	struct dentry *debugfs_counters;
 };
 
 enum {
@@ -333,6 +467,8 @@ enum {
 struct binder_thread {
 	struct binder_proc *proc;
 	struct rb_node rb_node;
+	atomic_t tmp_ref;
+	int is_dead;
 	int pid;
 	int looper;
 	struct binder_transaction *transaction_stack;
@@ -345,9 +481,16 @@ struct binder_thread {
 	struct binder_stats stats;
 };
 
+struct binder_priority {
+	unsigned int sched_policy;
+	int prio;	/* rt_priority for SCHED_FIFO/SCHED_RR, otherwise nice */
+	unsigned reset_on_fork:1;
+};
+
 struct binder_transaction {
 	int debug_id;
 	struct binder_work work;
+	spinlock_t lock;
 	struct binder_thread *from;
 	struct binder_transaction *from_parent;
 	struct binder_proc *to_proc;
@@ -359,9 +502,11 @@ struct binder_transaction {
 	struct binder_buffer *buffer;
 	unsigned int	code;
 	unsigned int	flags;
-	long	priority;
-	long	saved_priority;
+	struct binder_priority	priority;
+	struct binder_priority	saved_priority;
 	uid_t	sender_euid;
+	ktime_t	start_time;
+	ktime_t	deliver_time;
 };
 
 static void
@@ -522,14 +667,53 @@ static void binder_set_nice(long nice)
 	binder_user_error("binder: %d RLIMIT_NICE not set\n", current->pid);
 }
 
-static size_t binder_buffer_size(struct binder_proc *proc,
-				 struct binder_buffer *buffer)
+static int binder_is_rt_policy(unsigned int policy)
 {
-	if (list_is_last(&buffer->entry, &proc->buffers))
-		return proc->buffer + proc->buffer_size - (void *)buffer->data;
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static struct binder_priority binder_get_priority(struct task_struct *task)
+{
+	struct binder_priority prio;
+
+	prio.sched_policy = task->policy;
+	prio.reset_on_fork = task->sched_reset_on_fork;
+	if (binder_is_rt_policy(prio.sched_policy))
+		prio.prio = task->rt_priority;
 	else
-		return (size_t)list_entry(buffer->entry.next,
-			struct binder_buffer, entry) - (size_t)buffer->data;
+		prio.prio = task_nice(task);
+	return prio;
+}
+
+/* Lower is more urgent, as for task_struct->prio */
+static int binder_kernel_prio(struct binder_priority prio)
+{
+	if (binder_is_rt_policy(prio.sched_policy))
+		return MAX_RT_PRIO - 1 - prio.prio;
+	return MAX_RT_PRIO + 20 + prio.prio;
+}
+
+static void binder_set_priority(struct binder_priority prio)
+{
+	struct sched_param param = { .sched_priority = 0 };
+	unsigned int policy = prio.sched_policy;
+
+	if (prio.reset_on_fork)
+		policy |= SCHED_RESET_ON_FORK;
+
+	if (binder_is_rt_policy(prio.sched_policy)) {
+		if (current->policy == prio.sched_policy &&
+		    current->rt_priority == prio.prio &&
+		    current->sched_reset_on_fork == prio.reset_on_fork)
+			return;
+		param.sched_priority = prio.prio;
+		sched_setscheduler_nocheck(current, policy, &param);
+		return;
+	}
+	if (current->policy != prio.sched_policy ||
+	    current->sched_reset_on_fork != prio.reset_on_fork)
+		sched_setscheduler_nocheck(current, policy, &param);
+	binder_set_nice(prio.prio);
 }
 
 static void binder_insert_free_buffer(struct binder_proc *proc,
@@ -538,25 +722,29 @@ static void binder_insert_free_buffer(struct binder_proc *proc,
 	struct rb_node **p = &proc->free_buffers.rb_node;
 	struct rb_node *parent = NULL;
 	struct binder_buffer *buffer;
-	size_t buffer_size;
-	size_t new_buffer_size;
 
 	BUG_ON(!new_buffer->free);
 
-	new_buffer_size = binder_buffer_size(proc, new_buffer);
-
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: add free buffer, size %zd, "
-		     "at %p\n", proc->pid, new_buffer_size, new_buffer);
+		     "at %p\n", proc->pid, new_buffer->size, new_buffer->data);
+
+	if (new_buffer->size < BINDER_SMALL_BUFFER_MAX) {
+		int i = new_buffer->size / sizeof(void *);
+
+		new_buffer->bucketed = 1;
+		list_add(&new_buffer->bucket_entry, &proc->free_small[i]);
+		__set_bit(i, proc->free_small_map);
+		return;
+	}
+	new_buffer->bucketed = 0;
 
 	while (*p) {
 		parent = *p;
 		buffer = rb_entry(parent, struct binder_buffer, rb_node);
 		BUG_ON(!buffer->free);
 
-		buffer_size = binder_buffer_size(proc, buffer);
-
-		if (new_buffer_size < buffer_size)
+		if (new_buffer->size < buffer->size)
 			p = &parent->rb_left;
 		else
 			p = &parent->rb_right;
@@ -565,6 +753,21 @@ static void binder_insert_free_buffer(struct binder_proc *proc,
 	rb_insert_color(&new_buffer->rb_node, &proc->free_buffers);
 }
 
+static void binder_erase_free_buffer(struct binder_proc *proc,
+				     struct binder_buffer *buffer)
+{
+	BUG_ON(!buffer->free);
+
+	if (buffer->bucketed) {
+		int i = buffer->size / sizeof(void *);
+
+		list_del(&buffer->bucket_entry);
+		if (list_empty(&proc->free_small[i]))
+			__clear_bit(i, proc->free_small_map);
+	} else
+		rb_erase(&buffer->rb_node, &proc->free_buffers);
+}
+
 static void binder_insert_allocated_buffer(struct binder_proc *proc,
 					   struct binder_buffer *new_buffer)
 {
@@ -579,9 +782,9 @@ static void binder_insert_allocated_buffer(struct binder_proc *proc,
 		buffer = rb_entry(parent, struct binder_buffer, rb_node);
 		BUG_ON(buffer->free);
 
-		if (new_buffer < buffer)
+		if (new_buffer->data < buffer->data)
 			p = &parent->rb_left;
-		else if (new_buffer > buffer)
+		else if (new_buffer->data > buffer->data)
 			p = &parent->rb_right;
 		else
 			BUG();
@@ -595,18 +798,19 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 {
 	struct rb_node *n = proc->allocated_buffers.rb_node;
 	struct binder_buffer *buffer;
-	struct binder_buffer *kern_ptr;
+	void *kern_ptr;
 
-	kern_ptr = user_ptr - proc->user_buffer_offset
-		- offsetof(struct binder_buffer, data);
+	lockdep_assert_held(&proc->alloc_lock);
+
+	kern_ptr = user_ptr - proc->user_buffer_offset;
 
 	while (n) {
 		buffer = rb_entry(n, struct binder_buffer, rb_node);
 		BUG_ON(buffer->free);
 
-		if (kern_ptr < buffer)
+		if (kern_ptr < buffer->data)
 			n = n->rb_left;
-		else if (kern_ptr > buffer)
+		else if (kern_ptr > buffer->data)
 			n = n->rb_right;
 		else
 			return buffer;
@@ -614,6 +818,27 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 	return NULL;
 }
 
+/* Both are called with page->proc->alloc_lock held */
+static void binder_lru_add(struct binder_lru_page *page)
+{
+	list_add_tail(&page->lru, &page->proc->lru);
+	page->proc->lru_count++;
+	atomic_inc(&binder_lru_count);
+}
+
+static void binder_lru_del(struct binder_lru_page *page)
+{
+	list_del_init(&page->lru);
+	page->proc->lru_count--;
+	atomic_dec(&binder_lru_count);
+}
+
+/*
+ * Pages are counted by the allocated buffers overlapping them. Dropping
+ * the last user only moves a page to proc->lru. Allocating takes cached
+ * pages back off it, and only the pages that were reclaimed in the
+ * meantime need mmap_sem to be mapped again.
+ */
 static int binder_update_page_range(struct binder_proc *proc, int allocate,
 				    void *start, void *end,
 				    struct vm_area_struct *vma)
@@ -621,8 +846,9 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	void *page_addr;
 	unsigned long user_page_addr;
 	struct vm_struct tmp_area;
-	struct page **page;
+	struct binder_lru_page *page;
 	struct mm_struct *mm;
+	int need_mm = 0;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: %s pages %p-%p\n", proc->pid,
@@ -631,6 +857,23 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	if (end <= start)
 		return 0;
 
+	if (allocate == 0)
+		goto free_range;
+
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (page->users++)
+			continue;
+		if (page->page_ptr) {
+			BUG_ON(list_empty(&page->lru));
+			binder_lru_del(page);
+			atomic_inc(&binder_page_hits);
+		} else
+			need_mm = 1;
+	}
+	if (!need_mm)
+		return 0;
+
 	if (vma)
 		mm = NULL;
 	else
@@ -646,9 +889,6 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		}
 	}
 
-	if (allocate == 0)
-		goto free_range;
-
 	if (vma == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf failed to "
 		       "map pages in userspace, no vma\n", proc->pid);
@@ -660,16 +900,18 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		struct page **page_array_ptr;
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 
-		BUG_ON(*page);
-		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
-		if (*page == NULL) {
+		if (page->page_ptr)
+			continue;
+		atomic_inc(&binder_page_misses);
+		page->page_ptr = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (page->page_ptr == NULL) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "for page at %p\n", proc->pid, page_addr);
 			goto err_alloc_page_failed;
 		}
 		tmp_area.addr = page_addr;
 		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
+		page_array_ptr = &page->page_ptr;
 		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
@@ -679,7 +921,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		}
 		user_page_addr =
 			(uintptr_t)page_addr + proc->user_buffer_offset;
-		ret = vm_insert_page(vma, user_page_addr, page[0]);
+		ret = vm_insert_page(vma, user_page_addr, page->page_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "to map page at %lx in userspace\n",
@@ -695,38 +937,191 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	return 0;
 
 free_range:
-	for (page_addr = end - PAGE_SIZE; page_addr >= start;
-	     page_addr -= PAGE_SIZE) {
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (uintptr_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
+		BUG_ON(!page->page_ptr || !page->users);
+		if (--page->users == 0)
+			binder_lru_add(page);
+	}
+	return 0;
+
 err_vm_insert_page_failed:
-		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
 err_map_kernel_failed:
-		__free_page(*page);
-		*page = NULL;
+	__free_page(page->page_ptr);
+	page->page_ptr = NULL;
 err_alloc_page_failed:
-		;
-	}
 err_no_vma:
 	if (mm) {
 		up_write(&mm->mmap_sem);
 		mmput(mm);
 	}
+	/* Drop the range again, caching the pages that got mapped */
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (--page->users == 0 && page->page_ptr)
+			binder_lru_add(page);
+	}
 	return -ENOMEM;
 }
 
-static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
-					      size_t data_size,
-					      size_t offsets_size, int is_async)
+/*
+ * Called with proc->alloc_lock held and the page off proc->lru. Fails if
+ * the user mapping cannot be removed without waiting for mmap_sem.
+ */
+static int binder_reclaim_page(struct binder_proc *proc,
+			       struct binder_lru_page *page)
+{
+	void *page_addr = proc->buffer + (page - proc->pages) * PAGE_SIZE;
+	struct vm_area_struct *vma;
+	struct mm_struct *mm;
+
+	mm = get_task_mm(proc->tsk);
+	if (mm) {
+		if (!down_read_trylock(&mm->mmap_sem)) {
+			mmput(mm);
+			return -EBUSY;
+		}
+		vma = proc->vma;
+		if (vma && vma->vm_mm == mm)
+			zap_page_range(vma, (uintptr_t)page_addr +
+				proc->user_buffer_offset, PAGE_SIZE, NULL);
+		up_read(&mm->mmap_sem);
+		mmput(mm);
+	}
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	__free_page(page->page_ptr);
+	page->page_ptr = NULL;
+	atomic_inc(&binder_page_reclaimed);
+	return 0;
+}
+
+/*
+ * Each process gives up pages in proportion to how many it has cached,
+ * oldest first. Processes that are busy allocating are skipped.
+ */
+static int binder_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	unsigned long nr = sc->nr_to_scan;
+	int total = atomic_read(&binder_lru_count);
+	struct binder_lru_page *page;
+	struct binder_proc *proc;
+	struct hlist_node *pos;
+
+	if (nr == 0 || total == 0)
+		return total;
+
+	/* A proc is unhashed under this before its pages can be freed */
+	if (!mutex_trylock(&binder_procs_lock))
+		return -1;
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		unsigned long share;
+
+		if (nr == 0)
+			break;
+		if (!proc->lru_count || !mutex_trylock(&proc->alloc_lock))
+			continue;
+		share = DIV_ROUND_UP(sc->nr_to_scan * proc->lru_count, total);
+		while (share-- && nr && !list_empty(&proc->lru)) {
+			page = list_first_entry(&proc->lru,
+						struct binder_lru_page, lru);
+			binder_lru_del(page);
+			if (binder_reclaim_page(proc, page)) {
+				binder_lru_add(page);
+				break;
+			}
+			nr--;
+		}
+		mutex_unlock(&proc->alloc_lock);
+	}
+	mutex_unlock(&binder_procs_lock);
+
+	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+		     "binder: shrink %lu, %d pages cached\n",
+		     sc->nr_to_scan, atomic_read(&binder_lru_count));
+	return atomic_read(&binder_lru_count);
+}
+
+static struct shrinker binder_shrinker = {
+	.shrink = binder_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+/*
+ * Best fit: the smallest non-empty size list that fits, which is O(1) for
+ * the common small transaction, then the tree of larger extents.
+ */
+static struct binder_buffer *binder_find_free_buffer(struct binder_proc *proc,
+						     size_t size)
 {
 	struct rb_node *n = proc->free_buffers.rb_node;
 	struct binder_buffer *buffer;
-	size_t buffer_size;
-	struct rb_node *best_fit = NULL;
-	void *has_page_addr;
-	void *end_page_addr;
+	struct binder_buffer *best_fit = NULL;
+
+	if (size < BINDER_SMALL_BUFFER_MAX) {
+		unsigned long i;
+
+		i = find_next_bit(proc->free_small_map, BINDER_SMALL_BUCKETS,
+				  size / sizeof(void *));
+		if (i < BINDER_SMALL_BUCKETS)
+			return list_first_entry(&proc->free_small[i],
+						struct binder_buffer,
+						bucket_entry);
+	}
+
+	while (n) {
+		buffer = rb_entry(n, struct binder_buffer, rb_node);
+		BUG_ON(!buffer->free);
+
+		if (size < buffer->size) {
+			best_fit = buffer;
+			n = n->rb_left;
+		} else if (size > buffer->size)
+			n = n->rb_right;
+		else
+			return buffer;
+	}
+	return best_fit;
+}
+
+/* Merges every run of adjacent free extents, small ones included */
+static void binder_merge_free_buffers(struct binder_proc *proc)
+{
+	struct binder_buffer *buffer;
+	struct binder_buffer *next;
+
+	list_for_each_entry(buffer, &proc->buffers, entry) {
+		int merged = 0;
+
+		if (!buffer->free)
+			continue;
+		while (!list_is_last(&buffer->entry, &proc->buffers)) {
+			next = list_entry(buffer->entry.next,
+					  struct binder_buffer, entry);
+			if (!next->free)
+				break;
+			if (!merged)
+				binder_erase_free_buffer(proc, buffer);
+			merged = 1;
+			binder_erase_free_buffer(proc, next);
+			buffer->size += next->size;
+			list_del(&next->entry);
+			kfree(next);
+		}
+		if (merged)
+			binder_insert_free_buffer(proc, buffer);
+	}
+}
+
+static struct binder_buffer *__binder_alloc_buf(struct binder_proc *proc,
+						size_t data_size,
+						size_t offsets_size,
+						size_t extra_buffers_size,
+						int is_async)
+{
+	struct binder_buffer *buffer;
+	struct binder_buffer *new_buffer = NULL;
+	size_t data_offsets_size;
 	size_t size;
 
 	if (proc->vma == NULL) {
@@ -735,14 +1130,24 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		return NULL;
 	}
 
-	size = ALIGN(data_size, sizeof(void *)) +
+	data_offsets_size = ALIGN(data_size, sizeof(void *)) +
 		ALIGN(offsets_size, sizeof(void *));
 
-	if (size < data_size || size < offsets_size) {
+	if (data_offsets_size < data_size ||
+	    data_offsets_size < offsets_size) {
 		binder_user_error("binder: %d: got transaction with invalid "
 			"size %zd-%zd\n", proc->pid, data_size, offsets_size);
 		return NULL;
 	}
+	size = data_offsets_size + ALIGN(extra_buffers_size, sizeof(void *));
+	if (size < data_offsets_size || size < extra_buffers_size) {
+		binder_user_error("binder: %d: got transaction with invalid "
+			"extra_buffers_size %zd\n", proc->pid,
+			extra_buffers_size);
+		return NULL;
+	}
+	/* Allocated buffers are looked up by address, so none is empty */
+	size = max(size, sizeof(void *));
 
 	if (is_async &&
 	    proc->free_async_space < size + sizeof(struct binder_buffer)) {
@@ -752,65 +1157,51 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		return NULL;
 	}
 
-	while (n) {
-		buffer = rb_entry(n, struct binder_buffer, rb_node);
-		BUG_ON(!buffer->free);
-		buffer_size = binder_buffer_size(proc, buffer);
-
-		if (size < buffer_size) {
-			best_fit = n;
-			n = n->rb_left;
-		} else if (size > buffer_size)
-			n = n->rb_right;
-		else {
-			best_fit = n;
-			break;
-		}
+	buffer = binder_find_free_buffer(proc, size);
+	if (buffer == NULL) {
+		binder_merge_free_buffers(proc);
+		buffer = binder_find_free_buffer(proc, size);
 	}
-	if (best_fit == NULL) {
+	if (buffer == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf size %zd failed, "
 		       "no address space\n", proc->pid, size);
 		return NULL;
 	}
-	if (n == NULL) {
-		buffer = rb_entry(best_fit, struct binder_buffer, rb_node);
-		buffer_size = binder_buffer_size(proc, buffer);
-	}
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_alloc_buf size %zd got buff"
-		     "er %p size %zd\n", proc->pid, size, buffer, buffer_size);
+		     "er %p size %zd\n", proc->pid, size, buffer->data,
+		     buffer->size);
 
-	has_page_addr =
-		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK);
-	if (n == NULL) {
-		if (size + sizeof(struct binder_buffer) + 4 >= buffer_size)
-			buffer_size = size; /* no room for other buffers */
-		else
-			buffer_size = size + sizeof(struct binder_buffer);
+	if (buffer->size != size) {
+		new_buffer = kzalloc(sizeof(*new_buffer), GFP_KERNEL);
+		if (new_buffer == NULL)
+			return NULL;
 	}
-	end_page_addr =
-		(void *)PAGE_ALIGN((uintptr_t)buffer->data + buffer_size);
-	if (end_page_addr > has_page_addr)
-		end_page_addr = has_page_addr;
 	if (binder_update_page_range(proc, 1,
-	    (void *)PAGE_ALIGN((uintptr_t)buffer->data), end_page_addr, NULL))
+	    (void *)((uintptr_t)buffer->data & PAGE_MASK),
+	    (void *)PAGE_ALIGN((uintptr_t)buffer->data + size), NULL)) {
+		kfree(new_buffer);
 		return NULL;
+	}
 
-	rb_erase(best_fit, &proc->free_buffers);
+	binder_erase_free_buffer(proc, buffer);
 	buffer->free = 0;
-	binder_insert_allocated_buffer(proc, buffer);
-	if (buffer_size != size) {
-		struct binder_buffer *new_buffer = (void *)buffer->data + size;
-		list_add(&new_buffer->entry, &buffer->entry);
+	if (new_buffer) {
+		new_buffer->data = buffer->data + size;
+		new_buffer->size = buffer->size - size;
 		new_buffer->free = 1;
+		list_add(&new_buffer->entry, &buffer->entry);
 		binder_insert_free_buffer(proc, new_buffer);
+		buffer->size = size;
 	}
+	binder_insert_allocated_buffer(proc, buffer);
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_alloc_buf size %zd got "
-		     "%p\n", proc->pid, size, buffer);
+		     "%p\n", proc->pid, size, buffer->data);
 	buffer->data_size = data_size;
 	buffer->offsets_size = offsets_size;
+	buffer->extra_buffers_size = extra_buffers_size;
 	buffer->async_transaction = is_async;
 	if (is_async) {
 		proc->free_async_space -= size + sizeof(struct binder_buffer);
@@ -819,86 +1210,55 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 			     "async free %zd\n", proc->pid, size,
 			     proc->free_async_space);
 	}
+	proc->allocated_size += size;
+	if (proc->allocated_size > proc->allocated_size_max)
+		proc->allocated_size_max = proc->allocated_size;
 
 	return buffer;
 }
 
-static void *buffer_start_page(struct binder_buffer *buffer)
-{
-	return (void *)((uintptr_t)buffer & PAGE_MASK);
-}
-
-static void *buffer_end_page(struct binder_buffer *buffer)
+static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
+					      size_t data_size,
+					      size_t offsets_size,
+					      size_t extra_buffers_size,
+					      int is_async)
 {
-	return (void *)(((uintptr_t)(buffer + 1) - 1) & PAGE_MASK);
-}
+	struct binder_buffer *buffer;
 
-static void binder_delete_free_buffer(struct binder_proc *proc,
-				      struct binder_buffer *buffer)
-{
-	struct binder_buffer *prev, *next = NULL;
-	int free_page_end = 1;
-	int free_page_start = 1;
-
-	BUG_ON(proc->buffers.next == &buffer->entry);
-	prev = list_entry(buffer->entry.prev, struct binder_buffer, entry);
-	BUG_ON(!prev->free);
-	if (buffer_end_page(prev) == buffer_start_page(buffer)) {
-		free_page_start = 0;
-		if (buffer_end_page(prev) == buffer_end_page(buffer))
-			free_page_end = 0;
-		binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
-			     "binder: %d: merge free, buffer %p "
-			     "share page with %p\n", proc->pid, buffer, prev);
+	mutex_lock(&proc->alloc_lock);
+	buffer = __binder_alloc_buf(proc, data_size, offsets_size,
+				    extra_buffers_size, is_async);
+	if (buffer) {
+		buffer->allow_user_free = 0;
+		buffer->transaction = NULL;
 	}
+	mutex_unlock(&proc->alloc_lock);
 
-	if (!list_is_last(&buffer->entry, &proc->buffers)) {
-		next = list_entry(buffer->entry.next,
-				  struct binder_buffer, entry);
-		if (buffer_start_page(next) == buffer_end_page(buffer)) {
-			free_page_end = 0;
-			if (buffer_start_page(next) ==
-			    buffer_start_page(buffer))
-				free_page_start = 0;
-			binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
-				     "binder: %d: merge free, buffer"
-				     " %p share page with %p\n", proc->pid,
-				     buffer, prev);
-		}
-	}
-	list_del(&buffer->entry);
-	if (free_page_start || free_page_end) {
-		binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
-			     "binder: %d: merge free, buffer %p do "
-			     "not share page%s%s with with %p or %p\n",
-			     proc->pid, buffer, free_page_start ? "" : " end",
-			     free_page_end ? "" : " start", prev, next);
-		binder_update_page_range(proc, 0, free_page_start ?
-			buffer_start_page(buffer) : buffer_end_page(buffer),
-			(free_page_end ? buffer_end_page(buffer) :
-			buffer_start_page(buffer)) + PAGE_SIZE, NULL);
-	}
+	return buffer;
 }
 
 static void binder_free_buf(struct binder_proc *proc,
 			    struct binder_buffer *buffer)
 {
-	size_t size, buffer_size;
-
-	buffer_size = binder_buffer_size(proc, buffer);
+	size_t size;
 
+	trace_binder_free_buf(proc, buffer);
+	mutex_lock(&proc->alloc_lock);
 	size = ALIGN(buffer->data_size, sizeof(void *)) +
-		ALIGN(buffer->offsets_size, sizeof(void *));
+		ALIGN(buffer->offsets_size, sizeof(void *)) +
+		ALIGN(buffer->extra_buffers_size, sizeof(void *));
+	size = max(size, sizeof(void *));
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_free_buf %p size %zd buffer"
-		     "_size %zd\n", proc->pid, buffer, size, buffer_size);
+		     "_size %zd\n", proc->pid, buffer->data, size,
+		     buffer->size);
 
 	BUG_ON(buffer->free);
-	BUG_ON(size > buffer_size);
+	BUG_ON(size > buffer->size);
 	BUG_ON(buffer->transaction != NULL);
-	BUG_ON((void *)buffer < proc->buffer);
-	BUG_ON((void *)buffer > proc->buffer + proc->buffer_size);
+	BUG_ON(buffer->data < proc->buffer);
+	BUG_ON(buffer->data > proc->buffer + proc->buffer_size);
 
 	if (buffer->async_transaction) {
 		proc->free_async_space += size + sizeof(struct binder_buffer);
@@ -910,29 +1270,38 @@ static void binder_free_buf(struct binder_proc *proc,
 	}
 
 	binder_update_page_range(proc, 0,
-		(void *)PAGE_ALIGN((uintptr_t)buffer->data),
-		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK),
+		(void *)((uintptr_t)buffer->data & PAGE_MASK),
+		(void *)PAGE_ALIGN((uintptr_t)buffer->data + buffer->size),
 		NULL);
 	rb_erase(&buffer->rb_node, &proc->allocated_buffers);
+	proc->allocated_size -= buffer->size;
 	buffer->free = 1;
+	if (buffer->size < BINDER_SMALL_BUFFER_MAX)
+		goto insert; /* likely to be reused at this size */
 	if (!list_is_last(&buffer->entry, &proc->buffers)) {
 		struct binder_buffer *next = list_entry(buffer->entry.next,
 						struct binder_buffer, entry);
 		if (next->free) {
-			rb_erase(&next->rb_node, &proc->free_buffers);
-			binder_delete_free_buffer(proc, next);
+			binder_erase_free_buffer(proc, next);
+			buffer->size += next->size;
+			list_del(&next->entry);
+			kfree(next);
 		}
 	}
 	if (proc->buffers.next != &buffer->entry) {
 		struct binder_buffer *prev = list_entry(buffer->entry.prev,
 						struct binder_buffer, entry);
 		if (prev->free) {
-			binder_delete_free_buffer(proc, buffer);
-			rb_erase(&prev->rb_node, &proc->free_buffers);
+			binder_erase_free_buffer(proc, prev);
+			prev->size += buffer->size;
+			list_del(&buffer->entry);
+			kfree(buffer);
 			buffer = prev;
 		}
 	}
+insert:
 	binder_insert_free_buffer(proc, buffer);
+	mutex_unlock(&proc->alloc_lock);
 }
 
 static struct binder_node *binder_get_node(struct binder_proc *proc,
@@ -941,6 +1310,8 @@ static struct binder_node *binder_get_node(struct binder_proc *proc,
 	struct rb_node *n = proc->nodes.rb_node;
 	struct binder_node *node;
 
+	lockdep_assert_held(&proc->lock);
+
 	while (n) {
 		node = rb_entry(n, struct binder_node, rb_node);
 
@@ -954,6 +1325,36 @@ static struct binder_node *binder_get_node(struct binder_proc *proc,
 	return NULL;
 }
 
+static void binder_free_node(struct binder_node *node)
+{
+	kfree(node->latency);
+	kfree(node);
+	binder_stats_deleted(BINDER_STAT_NODE);
+}
+
+/*
+ * Called with node->proc->lock held, which serialises the updates to a
+ * node's histograms.
+ */
+static void binder_node_add_latency(struct binder_node *node, int handled,
+				    ktime_t start, ktime_t end)
+{
+	s64 us = ktime_us_delta(end, start);
+	int i = us > 0 ? fls64(us) : 0;
+
+	if (node->latency == NULL) {
+		node->latency = kzalloc(sizeof(*node->latency), GFP_KERNEL);
+		if (node->latency == NULL)
+			return;
+	}
+	if (i >= BINDER_LATENCY_BUCKETS)
+		i = BINDER_LATENCY_BUCKETS - 1;
+	if (handled)
+		node->latency->handle[i]++;
+	else
+		node->latency->queue[i]++;
+}
+
 static struct binder_node *binder_new_node(struct binder_proc *proc,
 					   void __user *ptr,
 					   void __user *cookie)
@@ -980,7 +1381,8 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 	binder_stats_created(BINDER_STAT_NODE);
 	rb_link_node(&node->rb_node, parent, p);
 	rb_insert_color(&node->rb_node, &proc->nodes);
-	node->debug_id = ++binder_last_id;
+	node->debug_id = atomic_inc_return(&binder_last_id);
+	spin_lock_init(&node->lock);
 	node->proc = proc;
 	node->ptr = ptr;
 	node->cookie = cookie;
@@ -994,9 +1396,30 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 	return node;
 }
 
+/*
+ * node->proc only changes under node->lock, so it is stable between these
+ * two.
+ */
+static void binder_node_lock(struct binder_node *node)
+{
+	spin_lock(&node->lock);
+	if (node->proc)
+		spin_lock(&node->proc->inner_lock);
+}
+
+static void binder_node_unlock(struct binder_node *node)
+{
+	if (node->proc)
+		spin_unlock(&node->proc->inner_lock);
+	spin_unlock(&node->lock);
+}
+
 static int binder_inc_node(struct binder_node *node, int strong, int internal,
 			   struct list_head *target_list)
 {
+	int ret = 0;
+
+	binder_node_lock(node);
 	if (strong) {
 		if (internal) {
 			if (target_list == NULL &&
@@ -1005,7 +1428,8 @@ static int binder_inc_node(struct binder_node *node, int strong, int internal,
 			    node->has_strong_ref)) {
 				printk(KERN_ERR "binder: invalid inc strong "
 					"node for %d\n", node->debug_id);
-				return -EINVAL;
+				ret = -EINVAL;
+				goto out;
 			}
 			node->internal_strong_refs++;
 		} else
@@ -1021,16 +1445,29 @@ static int binder_inc_node(struct binder_node *node, int strong, int internal,
 			if (target_list == NULL) {
 				printk(KERN_ERR "binder: invalid inc weak node "
 					"for %d\n", node->debug_id);
-				return -EINVAL;
+				ret = -EINVAL;
+				goto out;
 			}
 			list_add_tail(&node->work.entry, target_list);
 		}
 	}
-	return 0;
+out:
+	binder_node_unlock(node);
+	return ret;
 }
 
-static int binder_dec_node(struct binder_node *node, int strong, int internal)
+/*
+ * Called with binder_node_lock() held. A node that still belongs to a
+ * process is never freed here, since other processes drop references to it
+ * without holding its proc->lock: it is queued to its owner instead, and
+ * binder_thread_read frees it once the owner finds it unused. Returns
+ * nonzero if the caller must free a dead node after unlocking it.
+ */
+static int binder_dec_node_locked(struct binder_node *node, int strong,
+				  int internal)
 {
+	int unused;
+
 	if (strong) {
 		if (internal)
 			node->internal_strong_refs--;
@@ -1044,34 +1481,119 @@ static int binder_dec_node(struct binder_node *node, int strong, int internal)
 		if (node->local_weak_refs || !hlist_empty(&node->refs))
 			return 0;
 	}
-	if (node->proc && (node->has_strong_ref || node->has_weak_ref)) {
-		if (list_empty(&node->work.entry)) {
+	unused = hlist_empty(&node->refs) && !node->local_strong_refs &&
+		 !node->local_weak_refs && !node->tmp_refs;
+	if (node->proc) {
+		if (list_empty(&node->work.entry) &&
+		    (node->has_strong_ref || node->has_weak_ref || unused)) {
 			list_add_tail(&node->work.entry, &node->proc->todo);
 			wake_up_interruptible(&node->proc->wait);
 		}
-	} else {
-		if (hlist_empty(&node->refs) && !node->local_strong_refs &&
-		    !node->local_weak_refs) {
-			list_del_init(&node->work.entry);
-			if (node->proc) {
-				rb_erase(&node->rb_node, &node->proc->nodes);
-				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
-					     "binder: refless node %d deleted\n",
-					     node->debug_id);
-			} else {
-				hlist_del(&node->dead_node);
-				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
-					     "binder: dead node %d deleted\n",
-					     node->debug_id);
-			}
-			kfree(node);
-			binder_stats_deleted(BINDER_STAT_NODE);
+	} else if (unused) {
+		spin_lock(&binder_dead_nodes_lock);
+		/* The dumps pin dead nodes without node->lock */
+		if (node->tmp_refs) {
+			spin_unlock(&binder_dead_nodes_lock);
+			return 0;
 		}
+		hlist_del(&node->dead_node);
+		spin_unlock(&binder_dead_nodes_lock);
+		binder_debug(BINDER_DEBUG_INTERNAL_REFS,
+			     "binder: dead node %d deleted\n",
+			     node->debug_id);
+		return 1;
 	}
 
 	return 0;
 }
 
+static int binder_dec_node(struct binder_node *node, int strong, int internal)
+{
+	int free_node;
+
+	binder_node_lock(node);
+	free_node = binder_dec_node_locked(node, strong, internal);
+	binder_node_unlock(node);
+	if (free_node) {
+		binder_free_node(node);
+	}
+	return 0;
+}
+
+/*
+ * A temporary reference keeps a node from being freed while it is used
+ * without the lock that found it, but does not count as a reference for
+ * the owning process. The caller must already know the node is alive.
+ */
+static void binder_inc_node_tmpref(struct binder_node *node)
+{
+	binder_node_lock(node);
+	if (node->proc == NULL)
+		spin_lock(&binder_dead_nodes_lock);
+	node->tmp_refs++;
+	if (node->proc == NULL)
+		spin_unlock(&binder_dead_nodes_lock);
+	binder_node_unlock(node);
+}
+
+static void binder_put_node(struct binder_node *node)
+{
+	int free_node;
+
+	binder_node_lock(node);
+	if (node->proc == NULL)
+		spin_lock(&binder_dead_nodes_lock);
+	node->tmp_refs--;
+	if (node->proc == NULL)
+		spin_unlock(&binder_dead_nodes_lock);
+	free_node = binder_dec_node_locked(node, 0, 1);
+	binder_node_unlock(node);
+	if (free_node)
+		binder_free_node(node);
+}
+
+static struct binder_node *binder_get_context_mgr_node(void)
+{
+	struct binder_node *node;
+
+	spin_lock(&binder_context_mgr_lock);
+	node = binder_context_mgr_node;
+	if (node)
+		binder_inc_node_tmpref(node);
+	spin_unlock(&binder_context_mgr_lock);
+	return node;
+}
+
+static void binder_proc_inc_tmpref(struct binder_proc *proc)
+{
+	atomic_inc(&proc->tmp_ref);
+}
+
+static void binder_free_proc(struct binder_proc *proc);
+
+/* Must be called without any binder lock held, as it may free the proc */
+static void binder_proc_dec_tmpref(struct binder_proc *proc)
+{
+	if (atomic_dec_and_test(&proc->tmp_ref))
+		binder_free_proc(proc);
+}
+
+/*
+ * Returns the process that owns a node, with a temporary reference on it,
+ * or NULL if that process has died.
+ */
+static struct binder_proc *binder_get_node_proc(struct binder_node *node)
+{
+	struct binder_proc *proc;
+
+	spin_lock(&node->lock);
+	proc = node->proc;
+	if (proc)
+		binder_proc_inc_tmpref(proc);
+	spin_unlock(&node->lock);
+	return proc;
+}
+
 
 static struct binder_ref *binder_get_ref(struct binder_proc *proc,
 					 uint32_t desc)
@@ -1079,6 +1601,8 @@ static struct binder_ref *binder_get_ref(struct binder_proc *proc,
 	struct rb_node *n = proc->refs_by_desc.rb_node;
 	struct binder_ref *ref;
 
+	lockdep_assert_held(&proc->lock);
+
 	while (n) {
 		ref = rb_entry(n, struct binder_ref, rb_node_desc);
 
@@ -1100,6 +1624,8 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	struct rb_node *parent = NULL;
 	struct binder_ref *ref, *new_ref;
 
+	lockdep_assert_held(&proc->lock);
+
 	while (*p) {
 		parent = *p;
 		ref = rb_entry(parent, struct binder_ref, rb_node_node);
@@ -1115,7 +1641,7 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	if (new_ref == NULL)
 		return NULL;
 	binder_stats_created(BINDER_STAT_REF);
-	new_ref->debug_id = ++binder_last_id;
+	new_ref->debug_id = atomic_inc_return(&binder_last_id);
 	new_ref->proc = proc;
 	new_ref->node = node;
 	rb_link_node(&new_ref->rb_node_node, parent, p);
@@ -1144,7 +1670,9 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	rb_link_node(&new_ref->rb_node_desc, parent, p);
 	rb_insert_color(&new_ref->rb_node_desc, &proc->refs_by_desc);
 	if (node) {
+		binder_node_lock(node);
 		hlist_add_head(&new_ref->node_entry, &node->refs);
+		binder_node_unlock(node);
 
 		binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 			     "binder: %d new ref %d desc %d for "
@@ -1161,6 +1689,9 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 
 static void binder_delete_ref(struct binder_ref *ref)
 {
+	struct binder_node *node = ref->node;
+	int free_node;
+
 	binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 		     "binder: %d delete ref %d desc %d for "
 		     "node %d\n", ref->proc->pid, ref->debug_id,
@@ -1168,16 +1699,23 @@ static void binder_delete_ref(struct binder_ref *ref)
 
 	rb_erase(&ref->rb_node_desc, &ref->proc->refs_by_desc);
 	rb_erase(&ref->rb_node_node, &ref->proc->refs_by_node);
+	binder_node_lock(node);
 	if (ref->strong)
-		binder_dec_node(ref->node, 1, 1);
+		binder_dec_node_locked(node, 1, 1);
 	hlist_del(&ref->node_entry);
-	binder_dec_node(ref->node, 0, 1);
+	free_node = binder_dec_node_locked(node, 0, 1);
+	binder_node_unlock(node);
+	if (free_node) {
+		binder_free_node(node);
+	}
 	if (ref->death) {
 		binder_debug(BINDER_DEBUG_DEAD_BINDER,
 			     "binder: %d delete ref %d desc %d "
 			     "has death notification\n", ref->proc->pid,
 			     ref->debug_id, ref->desc);
+		spin_lock(&ref->proc->inner_lock);
 		list_del(&ref->death->work.entry);
+		spin_unlock(&ref->proc->inner_lock);
 		kfree(ref->death);
 		binder_stats_deleted(BINDER_STAT_DEATH);
 	}
@@ -1240,83 +1778,247 @@ static int binder_dec_ref(struct binder_ref *ref, int strong)
 	return 0;
 }
 
+static void binder_enqueue_work(struct binder_proc *proc,
+				struct binder_work *work,
+				struct list_head *target_list)
+{
+	spin_lock(&proc->inner_lock);
+	list_add_tail(&work->entry, target_list);
+	spin_unlock(&proc->inner_lock);
+}
+
+static void binder_free_thread(struct binder_thread *thread)
+{
+	struct binder_proc *proc = thread->proc;
+
+	kfree(thread);
+	binder_stats_deleted(BINDER_STAT_THREAD);
+	binder_proc_dec_tmpref(proc);
+}
+
+/* Must be called without any binder lock held, as it may free the thread */
+static void binder_thread_dec_tmpref(struct binder_thread *thread)
+{
+	if (atomic_dec_and_test(&thread->tmp_ref))
+		binder_free_thread(thread);
+}
+
+/*
+ * Returns the sending thread of a transaction with a temporary reference on
+ * it, or NULL if it has exited. The caller must keep t itself alive.
+ */
+static struct binder_thread *binder_get_txn_from(
+		struct binder_transaction *t)
+{
+	struct binder_thread *from;
+
+	spin_lock(&t->lock);
+	from = t->from;
+	if (from)
+		atomic_inc(&from->tmp_ref);
+	spin_unlock(&t->lock);
+	return from;
+}
+
+/*
+ * Called with thread->proc->lock held. A second error is kept behind the
+ * first, so a failed reply to a dead process doesn't hide the failure of
+ * the call the thread is waiting on.
+ */
+static void binder_set_return_error(struct binder_thread *thread,
+				    uint32_t return_error)
+{
+	if (thread->return_error != BR_OK &&
+	    thread->return_error2 == BR_OK)
+		thread->return_error2 = thread->return_error;
+	thread->return_error = return_error;
+}
+
+/*
+ * Called with target_thread->proc->lock held, if target_thread is set. The
+ * receiving process, if any, is still alive: a thread clears to_proc in the
+ * transactions it is handling when it is released, and queued transactions
+ * are freed before their process is.
+ */
 static void binder_pop_transaction(struct binder_thread *target_thread,
 				   struct binder_transaction *t)
 {
+	struct binder_proc *to_proc;
+
 	if (target_thread) {
 		BUG_ON(target_thread->transaction_stack != t);
 		BUG_ON(target_thread->transaction_stack->from != target_thread);
 		target_thread->transaction_stack =
 			target_thread->transaction_stack->from_parent;
+		spin_lock(&t->lock);
 		t->from = NULL;
+		spin_unlock(&t->lock);
 	}
 	t->need_reply = 0;
-	if (t->buffer)
-		t->buffer->transaction = NULL;
+	spin_lock(&t->lock);
+	to_proc = t->to_proc;
+	spin_unlock(&t->lock);
+	if (to_proc) {
+		mutex_lock(&to_proc->alloc_lock);
+		if (t->buffer)
+			t->buffer->transaction = NULL;
+		mutex_unlock(&to_proc->alloc_lock);
+	}
 	kfree(t);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 }
 
+/*
+ * Called without any binder lock held. Once a transaction has been taken off
+ * the replying thread's stack, or its target thread has died, nothing else
+ * can reach it but its sender, so only the sender's proc->lock is needed to
+ * hand it the error.
+ */
 static void binder_send_failed_reply(struct binder_transaction *t,
 				     uint32_t error_code)
 {
 	struct binder_thread *target_thread;
+	struct binder_transaction *next;
+
 	BUG_ON(t->flags & TF_ONE_WAY);
 	while (1) {
-		target_thread = t->from;
+		target_thread = binder_get_txn_from(t);
 		if (target_thread) {
-			if (target_thread->return_error != BR_OK &&
-			   target_thread->return_error2 == BR_OK) {
-				target_thread->return_error2 =
-					target_thread->return_error;
-				target_thread->return_error = BR_OK;
+			mutex_lock(&target_thread->proc->lock);
+			if (t->from != target_thread) {
+				/* Exited since; it no longer owns t */
+				mutex_unlock(&target_thread->proc->lock);
+				binder_thread_dec_tmpref(target_thread);
+				continue;
 			}
-			if (target_thread->return_error == BR_OK) {
-				binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
-					     "binder: send failed reply for "
-					     "transaction %d to %d:%d\n",
-					      t->debug_id, target_thread->proc->pid,
-					      target_thread->pid);
-
-				binder_pop_transaction(target_thread, t);
-				target_thread->return_error = error_code;
-				wake_up_interruptible(&target_thread->wait);
-			} else {
+			binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
+				     "binder: send failed reply for "
+				     "transaction %d to %d:%d\n",
+				     t->debug_id, target_thread->proc->pid,
+				     target_thread->pid);
+			binder_pop_transaction(target_thread, t);
+			if (target_thread->return_error != BR_OK &&
+			    target_thread->return_error2 != BR_OK)
 				printk(KERN_ERR "binder: reply failed, target "
 					"thread, %d:%d, has error code %d "
 					"already\n", target_thread->proc->pid,
 					target_thread->pid,
 					target_thread->return_error);
-			}
+			else
+				binder_set_return_error(target_thread,
+							error_code);
+			wake_up_interruptible(&target_thread->wait);
+			mutex_unlock(&target_thread->proc->lock);
+			binder_thread_dec_tmpref(target_thread);
 			return;
-		} else {
-			struct binder_transaction *next = t->from_parent;
+		}
+		next = t->from_parent;
 
-			binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
-				     "binder: send failed reply "
-				     "for transaction %d, target dead\n",
-				     t->debug_id);
+		binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
+			     "binder: send failed reply "
+			     "for transaction %d, target dead\n",
+			     t->debug_id);
 
-			binder_pop_transaction(target_thread, t);
-			if (next == NULL) {
-				binder_debug(BINDER_DEBUG_DEAD_BINDER,
-					     "binder: reply failed,"
-					     " no target thread at root\n");
-				return;
-			}
-			t = next;
+		binder_pop_transaction(NULL, t);
+		if (next == NULL) {
 			binder_debug(BINDER_DEBUG_DEAD_BINDER,
-				     "binder: reply failed, no target "
-				     "thread -- retry %d\n", t->debug_id);
+				     "binder: reply failed,"
+				     " no target thread at root\n");
+			return;
 		}
+		t = next;
+		binder_debug(BINDER_DEBUG_DEAD_BINDER,
+			     "binder: reply failed, no target "
+			     "thread -- retry %d\n", t->debug_id);
+	}
+}
+
+/*
+ * Returns the size of the object at 'offset' in the buffer's data, or 0 if
+ * the offset is misaligned or the object does not fit. Unknown types are
+ * sized as a flat_binder_object so the caller can report them.
+ */
+static size_t binder_validate_object(struct binder_buffer *buffer,
+				     size_t offset)
+{
+	unsigned long *type;
+	size_t object_size;
+
+	if (offset > buffer->data_size - sizeof(*type) ||
+	    buffer->data_size < sizeof(*type) ||
+	    !IS_ALIGNED(offset, sizeof(void *)))
+		return 0;
+
+	type = (unsigned long *)(buffer->data + offset);
+	switch (*type) {
+	case BINDER_TYPE_PTR:
+		object_size = sizeof(struct binder_buffer_object);
+		break;
+	case BINDER_TYPE_FDA:
+		object_size = sizeof(struct binder_fd_array_object);
+		break;
+	default:
+		object_size = sizeof(struct flat_binder_object);
+		break;
+	}
+	if (offset > buffer->data_size - object_size ||
+	    buffer->data_size < object_size)
+		return 0;
+	return object_size;
+}
+
+/*
+ * Returns the BINDER_TYPE_PTR object at 'index' in the offsets array, if
+ * that is one of the first 'num_valid' (already translated) objects.
+ */
+static struct binder_buffer_object *binder_validate_ptr(
+	struct binder_buffer *buffer, size_t index,
+	size_t *off_start, size_t num_valid)
+{
+	struct binder_buffer_object *bp;
+
+	if (index >= num_valid)
+		return NULL;
+	if (!binder_validate_object(buffer, off_start[index]))
+		return NULL;
+	bp = (struct binder_buffer_object *)(buffer->data + off_start[index]);
+	if (bp->type != BINDER_TYPE_PTR)
+		return NULL;
+	return bp;
+}
+
+/*
+ * Fixups into parent buffers must move forward, so that no fixup can
+ * overwrite a pointer or fd that was translated before it. A fixup at
+ * 'fixup_offset' in 'b' is allowed if 'b' is the last buffer fixed up
+ * or copied, or one of its ancestors, and the offset is past everything
+ * already fixed up in 'b'.
+ */
+static bool binder_validate_fixup(struct binder_buffer *buffer,
+				  size_t *off_start,
+				  struct binder_buffer_object *b,
+				  size_t fixup_offset,
+				  struct binder_buffer_object *last_obj,
+				  size_t last_min_offset)
+{
+	if (last_obj == NULL)
+		return false;
+
+	while (last_obj != b) {
+		if (!(last_obj->flags & BINDER_BUFFER_FLAG_HAS_PARENT))
+			return false;
+		last_min_offset = last_obj->parent_offset + sizeof(void *);
+		last_obj = (struct binder_buffer_object *)
+			(buffer->data + off_start[last_obj->parent]);
 	}
+	return fixup_offset >= last_min_offset;
 }
 
 static void binder_transaction_buffer_release(struct binder_proc *proc,
 					      struct binder_buffer *buffer,
 					      size_t *failed_at)
 {
-	size_t *offp, *off_end;
+	size_t *offp, *off_start, *off_end;
 	int debug_id = buffer->debug_id;
 
 	binder_debug(BINDER_DEBUG_TRANSACTION,
@@ -1327,16 +2029,15 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 	if (buffer->target_node)
 		binder_dec_node(buffer->target_node, 1, 0);
 
-	offp = (size_t *)(buffer->data + ALIGN(buffer->data_size, sizeof(void *)));
+	off_start = (size_t *)(buffer->data +
+			       ALIGN(buffer->data_size, sizeof(void *)));
 	if (failed_at)
 		off_end = failed_at;
 	else
-		off_end = (void *)offp + buffer->offsets_size;
-	for (; offp < off_end; offp++) {
+		off_end = (void *)off_start + buffer->offsets_size;
+	for (offp = off_start; offp < off_end; offp++) {
 		struct flat_binder_object *fp;
-		if (*offp > buffer->data_size - sizeof(*fp) ||
-		    buffer->data_size < sizeof(*fp) ||
-		    !IS_ALIGNED(*offp, sizeof(void *))) {
+		if (!binder_validate_object(buffer, *offp)) {
 			printk(KERN_ERR "binder: transaction release %d bad"
 					"offset %zd, size %zd\n", debug_id,
 					*offp, buffer->data_size);
@@ -1379,6 +2080,35 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 				task_close_fd(proc, fp->handle);
 			break;
 
+		case BINDER_TYPE_PTR:
+			/* copied into this buffer, nothing to release */
+			break;
+
+		case BINDER_TYPE_FDA: {
+			struct binder_fd_array_object *fda;
+			struct binder_buffer_object *parent;
+			u32 *fd_array;
+			size_t i;
+
+			if (!failed_at)
+				break;
+			fda = (struct binder_fd_array_object *)fp;
+			parent = binder_validate_ptr(buffer, fda->parent,
+						     off_start,
+						     offp - off_start);
+			if (parent == NULL) {
+				printk(KERN_ERR "binder: transaction release %d"
+				       " bad fd array parent %zd\n",
+				       debug_id, fda->parent);
+				break;
+			}
+			fd_array = (u32 *)((uintptr_t)parent->buffer -
+					   proc->user_buffer_offset +
+					   fda->parent_offset);
+			for (i = 0; i < fda->num_fds; i++)
+				task_close_fd(proc, fd_array[i]);
+		} break;
+
 		default:
 			printk(KERN_ERR "binder: transaction release %d bad "
 			       "object type %lx\n", debug_id, fp->type);
@@ -1387,14 +2117,125 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 	}
 }
 
+/*
+ * Called with proc->lock held. Hands the next queued one-way transaction
+ * of the buffer's node to thread, then drops the references the buffer
+ * holds and frees it.
+ */
+static void binder_release_buffer(struct binder_proc *proc,
+				  struct binder_thread *thread,
+				  struct binder_buffer *buffer)
+{
+	if (buffer->async_transaction && buffer->target_node) {
+		struct binder_node *node = buffer->target_node;
+
+		binder_node_lock(node);
+		BUG_ON(!node->has_async_transaction);
+		if (list_empty(&node->async_todo))
+			node->has_async_transaction = 0;
+		else
+			list_move_tail(node->async_todo.next, &thread->todo);
+		binder_node_unlock(node);
+	}
+	binder_transaction_buffer_release(proc, buffer, NULL);
+	binder_free_buf(proc, buffer);
+}
+
+/*
+ * Takes the proc->lock of the sender and of the target of a transaction,
+ * in address order so two processes calling each other can't deadlock.
+ */
+static void binder_lock_procs(struct binder_proc *proc,
+			      struct binder_proc *target_proc)
+{
+	if (target_proc == proc) {
+		mutex_lock(&proc->lock);
+	} else if (target_proc < proc) {
+		mutex_lock(&target_proc->lock);
+		mutex_lock_nested(&proc->lock, SINGLE_DEPTH_NESTING);
+	} else {
+		mutex_lock(&proc->lock);
+		mutex_lock_nested(&target_proc->lock, SINGLE_DEPTH_NESTING);
+	}
+}
+
+static void binder_unlock_procs(struct binder_proc *proc,
+				struct binder_proc *target_proc)
+{
+	if (target_proc != proc)
+		mutex_unlock(&target_proc->lock);
+	mutex_unlock(&proc->lock);
+}
+
+/*
+ * Installs each fd of an fd array in the target process and rewrites the
+ * array, which has already been copied into the target buffer, in place.
+ * On failure the fds installed so far are closed again.
+ */
+static int binder_translate_fd_array(struct binder_fd_array_object *fda,
+				     struct binder_buffer_object *parent,
+				     struct binder_transaction *t,
+				     struct binder_thread *thread)
+{
+	struct binder_proc *proc = thread->proc;
+	struct binder_proc *target_proc = t->to_proc;
+	u32 *fd_array;
+	size_t i;
+	int ret;
+
+	fd_array = (u32 *)((uintptr_t)parent->buffer -
+			   target_proc->user_buffer_offset +
+			   fda->parent_offset);
+	for (i = 0; i < fda->num_fds; i++) {
+		struct file *file;
+		int target_fd;
+
+		file = fget(fd_array[i]);
+		if (file == NULL) {
+			binder_user_error("binder: %d:%d got transaction with "
+				"invalid fd, %u\n", proc->pid, thread->pid,
+				fd_array[i]);
+			ret = -EBADF;
+			goto err;
+		}
+		target_fd = task_get_unused_fd_flags(target_proc, O_CLOEXEC);
+		if (target_fd < 0) {
+			fput(file);
+			ret = target_fd;
+			goto err;
+		}
+		task_fd_install(target_proc, target_fd, file);
+		binder_debug(BINDER_DEBUG_TRANSACTION,
+			     "        fd %u -> %d\n", fd_array[i], target_fd);
+		fd_array[i] = target_fd;
+	}
+	return 0;
+
+err:
+	while (i--)
+		task_close_fd(target_proc, fd_array[i]);
+	return ret;
+}
+
+/*
+ * Called without any binder lock held. The sender's proc->lock is held to
+ * find and pin the target, the payload is copied into the target's buffer
+ * with no lock held, and the two processes are only locked together to
+ * translate the objects in it and queue the work.
+ */
 static void binder_transaction(struct binder_proc *proc,
 			       struct binder_thread *thread,
-			       struct binder_transaction_data *tr, int reply)
+			       struct binder_transaction_data *tr, int reply,
+			       size_t extra_buffers_size)
 {
 	struct binder_transaction *t;
 	struct binder_work *tcomplete;
-	size_t *offp, *off_end;
-	struct binder_proc *target_proc;
+	size_t *offp, *off_start, *off_end;
+	size_t off_min;
+	void *sg_bufp, *sg_buf_end;
+	struct binder_buffer_object *last_fixup_obj = NULL;
+	size_t last_fixup_min_off = 0;
+	struct binder_proc *target_proc = NULL;
 	struct binder_thread *target_thread = NULL;
 	struct binder_node *target_node = NULL;
 	struct list_head *target_list;
@@ -1402,6 +2243,7 @@ static void binder_transaction(struct binder_proc *proc,
 	struct binder_transaction *in_reply_to = NULL;
 	struct binder_transaction_log_entry *e;
 	uint32_t return_error;
+	int locked_node = 0;
 
 	e = binder_transaction_log_add(&binder_transaction_log);
 	e->call_type = reply ? 2 : !!(tr->flags & TF_ONE_WAY);
@@ -1411,17 +2253,24 @@ static void binder_transaction(struct binder_proc *proc,
 	e->data_size = tr->data_size;
 	e->offsets_size = tr->offsets_size;
 
+	mutex_lock(&proc->lock);
 	if (reply) {
 		in_reply_to = thread->transaction_stack;
 		if (in_reply_to == NULL) {
+			mutex_unlock(&proc->lock);
 			binder_user_error("binder: %d:%d got reply transaction "
 					  "with no transaction stack\n",
 					  proc->pid, thread->pid);
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
-		binder_set_nice(in_reply_to->saved_priority);
+		binder_set_priority(in_reply_to->saved_priority);
+		if (in_reply_to->buffer && in_reply_to->buffer->target_node)
+			binder_node_add_latency(in_reply_to->buffer->target_node,
+						1, in_reply_to->deliver_time,
+						ktime_get());
 		if (in_reply_to->to_thread != thread) {
+			spin_lock(&in_reply_to->lock);
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad transaction stack,"
 				" transaction %d has target %d:%d\n",
@@ -1430,35 +2279,27 @@ static void binder_transaction(struct binder_proc *proc,
 				in_reply_to->to_proc->pid : 0,
 				in_reply_to->to_thread ?
 				in_reply_to->to_thread->pid : 0);
+			spin_unlock(&in_reply_to->lock);
+			mutex_unlock(&proc->lock);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
 			goto err_bad_call_stack;
 		}
-		thread->transaction_stack = in_reply_to->to_parent;
-		target_thread = in_reply_to->from;
-		if (target_thread == NULL) {
-			return_error = BR_DEAD_REPLY;
-			goto err_dead_binder;
-		}
-		if (target_thread->transaction_stack != in_reply_to) {
-			binder_user_error("binder: %d:%d got reply transaction "
-				"with bad target transaction stack %d, "
-				"expected %d\n",
-				proc->pid, thread->pid,
-				target_thread->transaction_stack ?
-				target_thread->transaction_stack->debug_id : 0,
-				in_reply_to->debug_id);
-			return_error = BR_FAILED_REPLY;
-			in_reply_to = NULL;
-			target_thread = NULL;
+		thread->transaction_stack = in_reply_to->to_parent;
+		mutex_unlock(&proc->lock);
+		target_thread = binder_get_txn_from(in_reply_to);
+		if (target_thread == NULL) {
+			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
 		target_proc = target_thread->proc;
+		binder_proc_inc_tmpref(target_proc);
 	} else {
 		if (tr->target.handle) {
 			struct binder_ref *ref;
 			ref = binder_get_ref(proc, tr->target.handle);
 			if (ref == NULL) {
+				mutex_unlock(&proc->lock);
 				binder_user_error("binder: %d:%d got "
 					"transaction to invalid handle\n",
 					proc->pid, thread->pid);
@@ -1466,23 +2307,27 @@ static void binder_transaction(struct binder_proc *proc,
 				goto err_invalid_target_handle;
 			}
 			target_node = ref->node;
+			binder_inc_node_tmpref(target_node);
 		} else {
-			target_node = binder_context_mgr_node;
+			target_node = binder_get_context_mgr_node();
 			if (target_node == NULL) {
+				mutex_unlock(&proc->lock);
 				return_error = BR_DEAD_REPLY;
 				goto err_no_context_mgr_node;
 			}
 		}
 		e->to_node = target_node->debug_id;
-		target_proc = target_node->proc;
+		target_proc = binder_get_node_proc(target_node);
 		if (target_proc == NULL) {
+			mutex_unlock(&proc->lock);
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
 		if (!(tr->flags & TF_ONE_WAY) && thread->transaction_stack) {
-			struct binder_transaction *tmp;
+			struct binder_transaction *tmp, *match = NULL;
 			tmp = thread->transaction_stack;
 			if (tmp->to_thread != thread) {
+				spin_lock(&tmp->lock);
 				binder_user_error("binder: %d:%d got new "
 					"transaction with bad transaction stack"
 					", transaction %d has target %d:%d\n",
@@ -1490,24 +2335,25 @@ static void binder_transaction(struct binder_proc *proc,
 					tmp->to_proc ? tmp->to_proc->pid : 0,
 					tmp->to_thread ?
 					tmp->to_thread->pid : 0);
+				spin_unlock(&tmp->lock);
+				mutex_unlock(&proc->lock);
 				return_error = BR_FAILED_REPLY;
 				goto err_bad_call_stack;
 			}
 			while (tmp) {
+				spin_lock(&tmp->lock);
 				if (tmp->from && tmp->from->proc == target_proc)
-					target_thread = tmp->from;
+					match = tmp;
+				spin_unlock(&tmp->lock);
 				tmp = tmp->from_parent;
 			}
+			if (match)
+				target_thread = binder_get_txn_from(match);
 		}
+		mutex_unlock(&proc->lock);
 	}
-	if (target_thread) {
+	if (target_thread)
 		e->to_thread = target_thread->pid;
-		target_list = &target_thread->todo;
-		target_wait = &target_thread->wait;
-	} else {
-		target_list = &target_proc->todo;
-		target_wait = &target_proc->wait;
-	}
 	e->to_proc = target_proc->pid;
 
 	/* TODO: reuse incoming transaction for reply */
@@ -1517,6 +2363,7 @@ static void binder_transaction(struct binder_proc *proc,
 		goto err_alloc_t_failed;
 	}
 	binder_stats_created(BINDER_STAT_TRANSACTION);
+	spin_lock_init(&t->lock);
 
 	tcomplete = kzalloc(sizeof(*tcomplete), GFP_KERNEL);
 	if (tcomplete == NULL) {
@@ -1525,7 +2372,7 @@ static void binder_transaction(struct binder_proc *proc,
 	}
 	binder_stats_created(BINDER_STAT_TRANSACTION_COMPLETE);
 
-	t->debug_id = ++binder_last_id;
+	t->debug_id = atomic_inc_return(&binder_last_id);
 	e->debug_id = t->debug_id;
 
 	if (reply)
@@ -1554,9 +2401,17 @@ static void binder_transaction(struct binder_proc *proc,
 	t->to_thread = target_thread;
 	t->code = tr->code;
 	t->flags = tr->flags;
-	t->priority = task_nice(current);
+	t->priority = binder_get_priority(current);
+	if (binder_is_rt_policy(t->priority.sched_policy) &&
+	    !(target_node && target_node->inherit_rt)) {
+		/* Only nodes that asked for it get the RT class lent to them */
+		t->priority.sched_policy = SCHED_NORMAL;
+		t->priority.prio = task_nice(current);
+	}
+	t->start_time = ktime_get();
 	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
-		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
+		tr->offsets_size, extra_buffers_size,
+		!reply && (t->flags & TF_ONE_WAY));
 	if (t->buffer == NULL) {
 		return_error = BR_FAILED_REPLY;
 		goto err_binder_alloc_buf_failed;
@@ -1564,12 +2419,16 @@ static void binder_transaction(struct binder_proc *proc,
 	t->buffer->allow_user_free = 0;
 	t->buffer->debug_id = t->debug_id;
 	t->buffer->transaction = t;
-	t->buffer->target_node = target_node;
-	if (target_node)
-		binder_inc_node(target_node, 1, 0, NULL);
+	trace_binder_alloc_buf(target_proc, t->buffer);
 
-	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
+	off_start = (size_t *)(t->buffer->data +
+			       ALIGN(tr->data_size, sizeof(void *)));
+	offp = off_start;
 
+	/*
+	 * The buffer stays allocated, and the target's pages mapped, for as
+	 * long as we hold target_proc, so it is filled in without any lock.
+	 */
 	if (copy_from_user(t->buffer->data, tr->data.ptr.buffer, tr->data_size)) {
 		binder_user_error("binder: %d:%d got transaction with invalid "
 			"data ptr\n", proc->pid, thread->pid);
@@ -1589,18 +2448,184 @@ static void binder_transaction(struct binder_proc *proc,
 		return_error = BR_FAILED_REPLY;
 		goto err_bad_offset;
 	}
-	off_end = (void *)offp + tr->offsets_size;
+	if (!IS_ALIGNED(extra_buffers_size, sizeof(void *))) {
+		binder_user_error("binder: %d:%d got transaction with "
+			"unaligned buffers size, %zd\n",
+			proc->pid, thread->pid, extra_buffers_size);
+		return_error = BR_FAILED_REPLY;
+		goto err_bad_offset;
+	}
+	off_end = (void *)off_start + tr->offsets_size;
+	sg_bufp = (void *)off_start + ALIGN(tr->offsets_size, sizeof(void *));
+	sg_buf_end = sg_bufp + extra_buffers_size;
+	off_min = 0;
 	for (; offp < off_end; offp++) {
 		struct flat_binder_object *fp;
-		if (*offp > t->buffer->data_size - sizeof(*fp) ||
-		    t->buffer->data_size < sizeof(*fp) ||
-		    !IS_ALIGNED(*offp, sizeof(void *))) {
+		size_t object_size;
+
+		/* Objects must be in order and must not overlap */
+		object_size = binder_validate_object(t->buffer, *offp);
+		if (object_size == 0 || *offp < off_min) {
 			binder_user_error("binder: %d:%d got transaction with "
-				"invalid offset, %zd\n",
-				proc->pid, thread->pid, *offp);
+				"invalid offset (%zd, min %zd max %zd)\n",
+				proc->pid, thread->pid, *offp, off_min,
+				t->buffer->data_size);
 			return_error = BR_FAILED_REPLY;
 			goto err_bad_offset;
 		}
+		off_min = *offp + object_size;
+		fp = (struct flat_binder_object *)(t->buffer->data + *offp);
+		switch (fp->type) {
+		case BINDER_TYPE_BINDER:
+		case BINDER_TYPE_WEAK_BINDER:
+		case BINDER_TYPE_HANDLE:
+		case BINDER_TYPE_WEAK_HANDLE:
+			/* Translated below, with both processes locked */
+			break;
+
+		case BINDER_TYPE_FD:
+			if (reply) {
+				if (!(in_reply_to->flags & TF_ACCEPT_FDS)) {
+					binder_user_error("binder: %d:%d got reply with fd, %ld, but target does not allow fds\n",
+						proc->pid, thread->pid, fp->handle);
+					return_error = BR_FAILED_REPLY;
+					goto err_fd_not_allowed;
+				}
+			} else if (!target_node->accept_fds) {
+				binder_user_error("binder: %d:%d got transaction with fd, %ld, but target does not allow fds\n",
+					proc->pid, thread->pid, fp->handle);
+				return_error = BR_FAILED_REPLY;
+				goto err_fd_not_allowed;
+			}
+			break;
+
+		case BINDER_TYPE_PTR: {
+			struct binder_buffer_object *bp, *parent;
+
+			bp = (struct binder_buffer_object *)fp;
+			if (bp->length > sg_buf_end - sg_bufp) {
+				binder_user_error("binder: %d:%d got transaction with too large buffer, %zd\n",
+					proc->pid, thread->pid, bp->length);
+				return_error = BR_FAILED_REPLY;
+				goto err_bad_offset;
+			}
+			if (copy_from_user(sg_bufp, bp->buffer, bp->length)) {
+				binder_user_error("binder: %d:%d got transaction with invalid buffer ptr\n",
+					proc->pid, thread->pid);
+				return_error = BR_FAILED_REPLY;
+				goto err_copy_data_failed;
+			}
+			bp->buffer = sg_bufp + target_proc->user_buffer_offset;
+			sg_bufp += ALIGN(bp->length, sizeof(void *));
+			binder_debug(BINDER_DEBUG_TRANSACTION,
+				     "        buffer size %zd -> %p\n",
+				     bp->length, bp->buffer);
+
+			if (bp->flags & BINDER_BUFFER_FLAG_HAS_PARENT) {
+				parent = binder_validate_ptr(t->buffer,
+					bp->parent, off_start, offp - off_start);
+				if (parent == NULL ||
+				    !IS_ALIGNED(bp->parent_offset,
+						sizeof(void *)) ||
+				    parent->length < sizeof(void *) ||
+				    bp->parent_offset >
+						parent->length - sizeof(void *) ||
+				    !binder_validate_fixup(t->buffer, off_start,
+						parent, bp->parent_offset,
+						last_fixup_obj,
+						last_fixup_min_off)) {
+					binder_user_error("binder: %d:%d got transaction with invalid parent %zd offset %zd\n",
+						proc->pid, thread->pid,
+						bp->parent, bp->parent_offset);
+					return_error = BR_FAILED_REPLY;
+					goto err_bad_parent;
+				}
+				*(void **)((uintptr_t)parent->buffer -
+					   target_proc->user_buffer_offset +
+					   bp->parent_offset) = bp->buffer;
+			}
+			last_fixup_obj = bp;
+			last_fixup_min_off = 0;
+		} break;
+
+		case BINDER_TYPE_FDA: {
+			struct binder_fd_array_object *fda;
+			struct binder_buffer_object *parent;
+			size_t fds_size;
+
+			fda = (struct binder_fd_array_object *)fp;
+			parent = binder_validate_ptr(t->buffer, fda->parent,
+						     off_start, offp - off_start);
+			fds_size = fda->num_fds * sizeof(u32);
+			if (parent == NULL ||
+			    fda->num_fds > ~(size_t)0 / sizeof(u32) ||
+			    !IS_ALIGNED(fda->parent_offset, sizeof(u32)) ||
+			    fds_size > parent->length ||
+			    fda->parent_offset > parent->length - fds_size ||
+			    !binder_validate_fixup(t->buffer, off_start,
+						   parent, fda->parent_offset,
+						   last_fixup_obj,
+						   last_fixup_min_off)) {
+				binder_user_error("binder: %d:%d got transaction with invalid fd array parent %zd offset %zd\n",
+					proc->pid, thread->pid,
+					fda->parent, fda->parent_offset);
+				return_error = BR_FAILED_REPLY;
+				goto err_bad_parent;
+			}
+			if (reply) {
+				if (!(in_reply_to->flags & TF_ACCEPT_FDS)) {
+					binder_user_error("binder: %d:%d got reply with fd array, but target does not allow fds\n",
+						proc->pid, thread->pid);
+					return_error = BR_FAILED_REPLY;
+					goto err_fd_not_allowed;
+				}
+			} else if (!target_node->accept_fds) {
+				binder_user_error("binder: %d:%d got transaction with fd array, but target does not allow fds\n",
+					proc->pid, thread->pid);
+				return_error = BR_FAILED_REPLY;
+				goto err_fd_not_allowed;
+			}
+			last_fixup_obj = parent;
+			last_fixup_min_off = fda->parent_offset + fds_size;
+		} break;
+
+		default:
+			binder_user_error("binder: %d:%d got transactio"
+				"n with invalid object type, %lx\n",
+				proc->pid, thread->pid, fp->type);
+			return_error = BR_FAILED_REPLY;
+			goto err_bad_object_type;
+		}
+	}
+
+	binder_lock_procs(proc, target_proc);
+	if (target_proc->is_dead ||
+	    (target_thread && target_thread->is_dead)) {
+		binder_unlock_procs(proc, target_proc);
+		return_error = BR_DEAD_REPLY;
+		goto err_dead_target;
+	}
+	if (reply && (in_reply_to->from != target_thread ||
+		      target_thread->transaction_stack != in_reply_to)) {
+		binder_user_error("binder: %d:%d got reply transaction "
+			"with bad target transaction stack %d, "
+			"expected %d\n",
+			proc->pid, thread->pid,
+			target_thread->transaction_stack ?
+			target_thread->transaction_stack->debug_id : 0,
+			in_reply_to->debug_id);
+		binder_unlock_procs(proc, target_proc);
+		return_error = BR_FAILED_REPLY;
+		in_reply_to = NULL;
+		goto err_bad_target_stack;
+	}
+	t->buffer->target_node = target_node;
+	if (target_node)
+		binder_inc_node(target_node, 1, 0, NULL);
+
+	for (offp = off_start; offp < off_end; offp++) {
+		struct flat_binder_object *fp;
+
 		fp = (struct flat_binder_object *)(t->buffer->data + *offp);
 		switch (fp->type) {
 		case BINDER_TYPE_BINDER:
@@ -1615,6 +2640,7 @@ static void binder_transaction(struct binder_proc *proc,
 				}
 				node->min_priority = fp->flags & FLAT_BINDER_FLAG_PRIORITY_MASK;
 				node->accept_fds = !!(fp->flags & FLAT_BINDER_FLAG_ACCEPTS_FDS);
+				node->inherit_rt = !!(fp->flags & FLAT_BINDER_FLAG_INHERIT_RT);
 			}
 			if (fp->cookie != node->cookie) {
 				binder_user_error("binder: %d:%d sending u%p "
@@ -1686,20 +2712,6 @@ static void binder_transaction(struct binder_proc *proc,
 			int target_fd;
 			struct file *file;
 
-			if (reply) {
-				if (!(in_reply_to->flags & TF_ACCEPT_FDS)) {
-					binder_user_error("binder: %d:%d got reply with fd, %ld, but target does not allow fds\n",
-						proc->pid, thread->pid, fp->handle);
-					return_error = BR_FAILED_REPLY;
-					goto err_fd_not_allowed;
-				}
-			} else if (!target_node->accept_fds) {
-				binder_user_error("binder: %d:%d got transaction with fd, %ld, but target does not allow fds\n",
-					proc->pid, thread->pid, fp->handle);
-				return_error = BR_FAILED_REPLY;
-				goto err_fd_not_allowed;
-			}
-
 			file = fget(fp->handle);
 			if (file == NULL) {
 				binder_user_error("binder: %d:%d got transaction with invalid fd, %ld\n",
@@ -1720,14 +2732,32 @@ static void binder_transaction(struct binder_proc *proc,
 			fp->handle = target_fd;
 		} break;
 
+		case BINDER_TYPE_FDA: {
+			struct binder_fd_array_object *fda;
+			struct binder_buffer_object *parent;
+
+			/* Checked above, so this can't fail */
+			fda = (struct binder_fd_array_object *)fp;
+			parent = binder_validate_ptr(t->buffer, fda->parent,
+						     off_start, offp - off_start);
+			if (binder_translate_fd_array(fda, parent, t, thread)) {
+				return_error = BR_FAILED_REPLY;
+				goto err_translate_fd_array_failed;
+			}
+		} break;
+
 		default:
-			binder_user_error("binder: %d:%d got transactio"
-				"n with invalid object type, %lx\n",
-				proc->pid, thread->pid, fp->type);
-			return_error = BR_FAILED_REPLY;
-			goto err_bad_object_type;
+			/* BINDER_TYPE_PTR, already copied */
+			break;
 		}
 	}
+	if (target_thread) {
+		target_list = &target_thread->todo;
+		target_wait = &target_thread->wait;
+	} else {
+		target_list = &target_proc->todo;
+		target_wait = &target_proc->wait;
+	}
 	if (reply) {
 		BUG_ON(t->buffer->async_transaction != 0);
 		binder_pop_transaction(target_thread, in_reply_to);
@@ -1739,30 +2769,57 @@ static void binder_transaction(struct binder_proc *proc,
 	} else {
 		BUG_ON(target_node == NULL);
 		BUG_ON(t->buffer->async_transaction != 1);
+		binder_node_lock(target_node);
+		locked_node = 1;
 		if (target_node->has_async_transaction) {
 			target_list = &target_node->async_todo;
 			target_wait = NULL;
 		} else
 			target_node->has_async_transaction = 1;
 	}
+	if (reply)
+		trace_binder_reply(t, target_node);
+	else
+		trace_binder_transaction(t, target_node);
 	t->work.type = BINDER_WORK_TRANSACTION;
-	list_add_tail(&t->work.entry, target_list);
+	if (locked_node) {
+		list_add_tail(&t->work.entry, target_list);
+		binder_node_unlock(target_node);
+	} else
+		binder_enqueue_work(target_proc, &t->work, target_list);
 	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
-	list_add_tail(&tcomplete->entry, &thread->todo);
-	if (target_wait)
+	binder_enqueue_work(proc, tcomplete, &thread->todo);
+	if (target_wait) {
+		trace_binder_wakeup(target_proc, target_thread);
 		wake_up_interruptible(target_wait);
+	}
+	binder_unlock_procs(proc, target_proc);
+	if (target_thread)
+		binder_thread_dec_tmpref(target_thread);
+	binder_proc_dec_tmpref(target_proc);
+	if (target_node)
+		binder_put_node(target_node);
 	return;
 
+err_translate_fd_array_failed:
 err_get_unused_fd_failed:
 err_fget_failed:
-err_fd_not_allowed:
 err_binder_get_ref_for_node_failed:
 err_binder_get_ref_failed:
 err_binder_new_node_failed:
+	binder_transaction_buffer_release(target_proc, t->buffer, offp);
+	binder_unlock_procs(proc, target_proc);
+	goto err_free_buf;
+
+err_bad_target_stack:
+err_dead_target:
+err_bad_parent:
+err_fd_not_allowed:
 err_bad_object_type:
 err_bad_offset:
 err_copy_data_failed:
-	binder_transaction_buffer_release(target_proc, t->buffer, offp);
+	/* Nothing in the buffer has been translated yet */
+err_free_buf:
 	t->buffer->transaction = NULL;
 	binder_free_buf(target_proc, t->buffer);
 err_binder_alloc_buf_failed:
@@ -1777,6 +2834,13 @@ err_empty_call_stack:
 err_dead_binder:
 err_invalid_target_handle:
 err_no_context_mgr_node:
+	if (target_thread)
+		binder_thread_dec_tmpref(target_thread);
+	if (target_proc)
+		binder_proc_dec_tmpref(target_proc);
+	if (target_node)
+		binder_put_node(target_node);
+
 	binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
 		     "binder: %d:%d transaction failed %d, size %zd-%zd\n",
 		     proc->pid, thread->pid, return_error,
@@ -1788,12 +2852,12 @@ err_no_context_mgr_node:
 		*fe = *e;
 	}
 
-	BUG_ON(thread->return_error != BR_OK);
-	if (in_reply_to) {
-		thread->return_error = BR_TRANSACTION_COMPLETE;
+	mutex_lock(&proc->lock);
+	binder_set_return_error(thread, in_reply_to ?
+				BR_TRANSACTION_COMPLETE : return_error);
+	mutex_unlock(&proc->lock);
+	if (in_reply_to)
 		binder_send_failed_reply(in_reply_to, return_error);
-	} else
-		thread->return_error = return_error;
 }
 
 int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
@@ -1808,9 +2872,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
 		if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.bc)) {
-			binder_stats.bc[_IOC_NR(cmd)]++;
-			proc->stats.bc[_IOC_NR(cmd)]++;
-			thread->stats.bc[_IOC_NR(cmd)]++;
+			atomic_inc(&binder_stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&proc->stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&thread->stats.bc[_IOC_NR(cmd)]);
 		}
 		switch (cmd) {
 		case BC_INCREFS:
@@ -1821,14 +2885,19 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			struct binder_ref *ref;
 			const char *debug_string;
 
+			struct binder_node *ctx_mgr_node = NULL;
+
 			if (get_user(target, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
-			if (target == 0 && binder_context_mgr_node &&
-			    (cmd == BC_INCREFS || cmd == BC_ACQUIRE)) {
+			if (target == 0 &&
+			    (cmd == BC_INCREFS || cmd == BC_ACQUIRE))
+				ctx_mgr_node = binder_get_context_mgr_node();
+			mutex_lock(&proc->lock);
+			if (ctx_mgr_node) {
 				ref = binder_get_ref_for_node(proc,
-					       binder_context_mgr_node);
-				if (ref->desc != target) {
+					       ctx_mgr_node);
+				if (ref && ref->desc != target) {
 					binder_user_error("binder: %d:"
 						"%d tried to acquire "
 						"reference to desc 0, "
@@ -1839,6 +2908,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			} else
 				ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
+				mutex_unlock(&proc->lock);
+				if (ctx_mgr_node)
+					binder_put_node(ctx_mgr_node);
 				binder_user_error("binder: %d:%d refcou"
 					"nt change on invalid ref %d\n",
 					proc->pid, thread->pid, target);
@@ -1863,10 +2935,13 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				binder_dec_ref(ref, 0);
 				break;
 			}
+			mutex_unlock(&proc->lock);
+			if (ctx_mgr_node)
+				binder_put_node(ctx_mgr_node);
 			binder_debug(BINDER_DEBUG_USER_REFS,
-				     "binder: %d:%d %s ref %d desc %d s %d w %d for node %d\n",
-				     proc->pid, thread->pid, debug_string, ref->debug_id,
-				     ref->desc, ref->strong, ref->weak, ref->node->debug_id);
+				     "binder: %d:%d %s desc %d\n",
+				     proc->pid, thread->pid, debug_string,
+				     target);
 			break;
 		}
 		case BC_INCREFS_DONE:
@@ -1881,8 +2956,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
+			mutex_lock(&proc->lock);
 			node = binder_get_node(proc, node_ptr);
 			if (node == NULL) {
+				mutex_unlock(&proc->lock);
 				binder_user_error("binder: %d:%d "
 					"%s u%p no match\n",
 					proc->pid, thread->pid,
@@ -1893,6 +2970,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				break;
 			}
 			if (cookie != node->cookie) {
+				mutex_unlock(&proc->lock);
 				binder_user_error("binder: %d:%d %s u%p node %d"
 					" cookie mismatch %p != %p\n",
 					proc->pid, thread->pid,
@@ -1902,8 +2980,11 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					cookie, node->cookie);
 				break;
 			}
+			binder_node_lock(node);
 			if (cmd == BC_ACQUIRE_DONE) {
 				if (node->pending_strong_ref == 0) {
+					binder_node_unlock(node);
+					mutex_unlock(&proc->lock);
 					binder_user_error("binder: %d:%d "
 						"BC_ACQUIRE_DONE node %d has "
 						"no pending acquire request\n",
@@ -1914,6 +2995,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				node->pending_strong_ref = 0;
 			} else {
 				if (node->pending_weak_ref == 0) {
+					binder_node_unlock(node);
+					mutex_unlock(&proc->lock);
 					binder_user_error("binder: %d:%d "
 						"BC_INCREFS_DONE node %d has "
 						"no pending increfs request\n",
@@ -1923,12 +3006,14 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				}
 				node->pending_weak_ref = 0;
 			}
-			binder_dec_node(node, cmd == BC_ACQUIRE_DONE, 0);
+			binder_node_unlock(node);
 			binder_debug(BINDER_DEBUG_USER_REFS,
 				     "binder: %d:%d %s node %d ls %d lw %d\n",
 				     proc->pid, thread->pid,
 				     cmd == BC_INCREFS_DONE ? "BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
 				     node->debug_id, node->local_strong_refs, node->local_weak_refs);
+			binder_dec_node(node, cmd == BC_ACQUIRE_DONE, 0);
+			mutex_unlock(&proc->lock);
 			break;
 		}
 		case BC_ATTEMPT_ACQUIRE:
@@ -1946,14 +3031,20 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 			ptr += sizeof(void *);
 
+			mutex_lock(&proc->lock);
+			mutex_lock(&proc->alloc_lock);
 			buffer = binder_buffer_lookup(proc, data_ptr);
 			if (buffer == NULL) {
+				mutex_unlock(&proc->alloc_lock);
+				mutex_unlock(&proc->lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p no match\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
 			if (!buffer->allow_user_free) {
+				mutex_unlock(&proc->alloc_lock);
+				mutex_unlock(&proc->lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p matched "
 					"unreturned buffer\n",
@@ -1969,15 +3060,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				buffer->transaction->buffer = NULL;
 				buffer->transaction = NULL;
 			}
-			if (buffer->async_transaction && buffer->target_node) {
-				BUG_ON(!buffer->target_node->has_async_transaction);
-				if (list_empty(&buffer->target_node->async_todo))
-					buffer->target_node->has_async_transaction = 0;
-				else
-					list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
-			}
-			binder_transaction_buffer_release(proc, buffer, NULL);
-			binder_free_buf(proc, buffer);
+			mutex_unlock(&proc->alloc_lock);
+			binder_release_buffer(proc, thread, buffer);
+			mutex_unlock(&proc->lock);
 			break;
 		}
 
@@ -1988,7 +3073,20 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (copy_from_user(&tr, ptr, sizeof(tr)))
 				return -EFAULT;
 			ptr += sizeof(tr);
-			binder_transaction(proc, thread, &tr, cmd == BC_REPLY);
+			binder_transaction(proc, thread, &tr,
+					   cmd == BC_REPLY, 0);
+			break;
+		}
+
+		case BC_TRANSACTION_SG:
+		case BC_REPLY_SG: {
+			struct binder_transaction_data_sg tr;
+
+			if (copy_from_user(&tr, ptr, sizeof(tr)))
+				return -EFAULT;
+			ptr += sizeof(tr);
+			binder_transaction(proc, thread, &tr.transaction_data,
+					   cmd == BC_REPLY_SG, tr.buffers_size);
 			break;
 		}
 
@@ -1996,6 +3094,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_REGISTER_LOOPER\n",
 				     proc->pid, thread->pid);
+			mutex_lock(&proc->lock);
 			if (thread->looper & BINDER_LOOPER_STATE_ENTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -2013,11 +3112,13 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				proc->requested_threads_started++;
 			}
 			thread->looper |= BINDER_LOOPER_STATE_REGISTERED;
+			mutex_unlock(&proc->lock);
 			break;
 		case BC_ENTER_LOOPER:
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_ENTER_LOOPER\n",
 				     proc->pid, thread->pid);
+			mutex_lock(&proc->lock);
 			if (thread->looper & BINDER_LOOPER_STATE_REGISTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -2026,12 +3127,15 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					proc->pid, thread->pid);
 			}
 			thread->looper |= BINDER_LOOPER_STATE_ENTERED;
+			mutex_unlock(&proc->lock);
 			break;
 		case BC_EXIT_LOOPER:
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_EXIT_LOOPER\n",
 				     proc->pid, thread->pid);
+			mutex_lock(&proc->lock);
 			thread->looper |= BINDER_LOOPER_STATE_EXITED;
+			mutex_unlock(&proc->lock);
 			break;
 
 		case BC_REQUEST_DEATH_NOTIFICATION:
@@ -2047,8 +3151,31 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void __user * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
+			if (cmd == BC_REQUEST_DEATH_NOTIFICATION) {
+				death = kzalloc(sizeof(*death), GFP_KERNEL);
+				if (death == NULL) {
+					mutex_lock(&proc->lock);
+					binder_set_return_error(thread,
+								BR_ERROR);
+					mutex_unlock(&proc->lock);
+					binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
+						     "binder: %d:%d "
+						     "BC_REQUEST_DEATH_NOTIFICATION failed\n",
+						     proc->pid, thread->pid);
+					break;
+				}
+				binder_stats_created(BINDER_STAT_DEATH);
+				INIT_LIST_HEAD(&death->work.entry);
+				death->cookie = cookie;
+			}
+			mutex_lock(&proc->lock);
 			ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
+				mutex_unlock(&proc->lock);
+				if (cmd == BC_REQUEST_DEATH_NOTIFICATION) {
+					kfree(death);
+					binder_stats_deleted(BINDER_STAT_DEATH);
+				}
 				binder_user_error("binder: %d:%d %s "
 					"invalid ref %d\n",
 					proc->pid, thread->pid,
@@ -2068,8 +3195,18 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     cookie, ref->debug_id, ref->desc,
 				     ref->strong, ref->weak, ref->node->debug_id);
 
+			/*
+			 * node->lock orders this against the owner's death,
+			 * which queues BR_DEAD_BINDER for every ref->death it
+			 * finds once node->proc is cleared.
+			 */
+			spin_lock(&ref->node->lock);
 			if (cmd == BC_REQUEST_DEATH_NOTIFICATION) {
 				if (ref->death) {
+					spin_unlock(&ref->node->lock);
+					mutex_unlock(&proc->lock);
+					kfree(death);
+					binder_stats_deleted(BINDER_STAT_DEATH);
 					binder_user_error("binder: %d:%"
 						"d BC_REQUEST_DEATH_NOTI"
 						"FICATION death notific"
@@ -2077,30 +3214,20 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						proc->pid, thread->pid);
 					break;
 				}
-				death = kzalloc(sizeof(*death), GFP_KERNEL);
-				if (death == NULL) {
-					thread->return_error = BR_ERROR;
-					binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
-						     "binder: %d:%d "
-						     "BC_REQUEST_DEATH_NOTIFICATION failed\n",
-						     proc->pid, thread->pid);
-					break;
-				}
-				binder_stats_created(BINDER_STAT_DEATH);
-				INIT_LIST_HEAD(&death->work.entry);
-				death->cookie = cookie;
 				ref->death = death;
 				if (ref->node->proc == NULL) {
 					ref->death->work.type = BINDER_WORK_DEAD_BINDER;
 					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
-						list_add_tail(&ref->death->work.entry, &thread->todo);
+						binder_enqueue_work(proc, &ref->death->work, &thread->todo);
 					} else {
-						list_add_tail(&ref->death->work.entry, &proc->todo);
+						binder_enqueue_work(proc, &ref->death->work, &proc->todo);
 						wake_up_interruptible(&proc->wait);
 					}
 				}
 			} else {
 				if (ref->death == NULL) {
+					spin_unlock(&ref->node->lock);
+					mutex_unlock(&proc->lock);
 					binder_user_error("binder: %d:%"
 						"d BC_CLEAR_DEATH_NOTIFI"
 						"CATION death notificat"
@@ -2110,6 +3237,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				}
 				death = ref->death;
 				if (death->cookie != cookie) {
+					spin_unlock(&ref->node->lock);
+					mutex_unlock(&proc->lock);
 					binder_user_error("binder: %d:%"
 						"d BC_CLEAR_DEATH_NOTIFI"
 						"CATION death notificat"
@@ -2120,6 +3249,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					break;
 				}
 				ref->death = NULL;
+				spin_lock(&proc->inner_lock);
 				if (list_empty(&death->work.entry)) {
 					death->work.type = BINDER_WORK_CLEAR_DEATH_NOTIFICATION;
 					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
@@ -2132,7 +3262,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					BUG_ON(death->work.type != BINDER_WORK_DEAD_BINDER);
 					death->work.type = BINDER_WORK_DEAD_BINDER_AND_CLEAR;
 				}
+				spin_unlock(&proc->inner_lock);
 			}
+			spin_unlock(&ref->node->lock);
+			mutex_unlock(&proc->lock);
 		} break;
 		case BC_DEAD_BINDER_DONE: {
 			struct binder_work *w;
@@ -2142,6 +3275,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 
 			ptr += sizeof(void *);
+			mutex_lock(&proc->lock);
+			spin_lock(&proc->inner_lock);
 			list_for_each_entry(w, &proc->delivered_death, entry) {
 				struct binder_ref_death *tmp_death = container_of(w, struct binder_ref_death, work);
 				if (tmp_death->cookie == cookie) {
@@ -2153,6 +3288,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     "binder: %d:%d BC_DEAD_BINDER_DONE %p found %p\n",
 				     proc->pid, thread->pid, cookie, death);
 			if (death == NULL) {
+				spin_unlock(&proc->inner_lock);
+				mutex_unlock(&proc->lock);
 				binder_user_error("binder: %d:%d BC_DEAD"
 					"_BINDER_DONE %p not found\n",
 					proc->pid, thread->pid, cookie);
@@ -2169,6 +3306,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					wake_up_interruptible(&proc->wait);
 				}
 			}
+			spin_unlock(&proc->inner_lock);
+			mutex_unlock(&proc->lock);
 		} break;
 
 		default:
@@ -2185,9 +3324,9 @@ void binder_stat_br(struct binder_proc *proc, struct binder_thread *thread,
 		    uint32_t cmd)
 {
 	if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.br)) {
-		binder_stats.br[_IOC_NR(cmd)]++;
-		proc->stats.br[_IOC_NR(cmd)]++;
-		thread->stats.br[_IOC_NR(cmd)]++;
+		atomic_inc(&binder_stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&proc->stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&thread->stats.br[_IOC_NR(cmd)]);
 	}
 }
 
@@ -2222,32 +3361,39 @@ static int binder_thread_read(struct binder_proc *proc,
 	}
 
 retry:
+	mutex_lock(&proc->lock);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 				list_empty(&thread->todo);
 
 	if (thread->return_error != BR_OK && ptr < end) {
+		uint32_t return_error;
+		int more;
+
 		if (thread->return_error2 != BR_OK) {
-			if (put_user(thread->return_error2, (uint32_t __user *)ptr))
-				return -EFAULT;
-			ptr += sizeof(uint32_t);
-			binder_stat_br(proc, thread, thread->return_error2);
-			if (ptr == end)
-				goto done;
+			return_error = thread->return_error2;
 			thread->return_error2 = BR_OK;
+			more = 1;
+		} else {
+			return_error = thread->return_error;
+			thread->return_error = BR_OK;
+			more = 0;
 		}
-		if (put_user(thread->return_error, (uint32_t __user *)ptr))
+		mutex_unlock(&proc->lock);
+		if (put_user(return_error, (uint32_t __user *)ptr))
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
-		binder_stat_br(proc, thread, thread->return_error);
-		thread->return_error = BR_OK;
+		binder_stat_br(proc, thread, return_error);
+		if (more && ptr < end)
+			goto retry;
 		goto done;
 	}
 
 
+	trace_binder_wait_for_work(thread, wait_for_proc_work);
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
 	if (wait_for_proc_work)
 		proc->ready_threads++;
-	mutex_unlock(&binder_lock);
+	mutex_unlock(&proc->lock);
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 					BINDER_LOOPER_STATE_ENTERED))) {
@@ -2271,10 +3417,11 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
-	mutex_lock(&binder_lock);
+	mutex_lock(&proc->lock);
 	if (wait_for_proc_work)
 		proc->ready_threads--;
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
+	mutex_unlock(&proc->lock);
 
 	if (ret)
 		return ret;
@@ -2284,25 +3431,48 @@ retry:
 		struct binder_transaction_data tr;
 		struct binder_work *w;
 		struct binder_transaction *t = NULL;
+		struct binder_thread *t_from;
 
+		/*
+		 * Other processes only ever append to our lists, so the entry
+		 * picked here stays at the head while we hold proc->lock.
+		 */
+		mutex_lock(&proc->lock);
+		spin_lock(&proc->inner_lock);
 		if (!list_empty(&thread->todo))
 			w = list_first_entry(&thread->todo, struct binder_work, entry);
 		else if (!list_empty(&proc->todo) && wait_for_proc_work)
 			w = list_first_entry(&proc->todo, struct binder_work, entry);
-		else {
-			if (ptr - buffer == 4 && !(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN)) /* no data added */
+		else
+			w = NULL;
+		spin_unlock(&proc->inner_lock);
+		if (w == NULL) {
+			int need_return = thread->looper &
+					  BINDER_LOOPER_STATE_NEED_RETURN;
+
+			mutex_unlock(&proc->lock);
+			if (ptr - buffer == 4 && !need_return) /* no data added */
 				goto retry;
 			break;
 		}
 
-		if (end - ptr < sizeof(tr) + 4)
+		if (end - ptr < sizeof(tr) + 4) {
+			mutex_unlock(&proc->lock);
 			break;
+		}
 
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION: {
 			t = container_of(w, struct binder_transaction, work);
 		} break;
 		case BINDER_WORK_TRANSACTION_COMPLETE: {
+			spin_lock(&proc->inner_lock);
+			list_del(&w->entry);
+			spin_unlock(&proc->inner_lock);
+			mutex_unlock(&proc->lock);
+			kfree(w);
+			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
+
 			cmd = BR_TRANSACTION_COMPLETE;
 			if (put_user(cmd, (uint32_t __user *)ptr))
 				return -EFAULT;
@@ -2312,17 +3482,20 @@ retry:
 			binder_debug(BINDER_DEBUG_TRANSACTION_COMPLETE,
 				     "binder: %d:%d BR_TRANSACTION_COMPLETE\n",
 				     proc->pid, thread->pid);
-
-			list_del(&w->entry);
-			kfree(w);
-			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 		} break;
 		case BINDER_WORK_NODE: {
 			struct binder_node *node = container_of(w, struct binder_node, work);
 			uint32_t cmd = BR_NOOP;
 			const char *cmd_name;
-			int strong = node->internal_strong_refs || node->local_strong_refs;
-			int weak = !hlist_empty(&node->refs) || node->local_weak_refs || strong;
+			int strong, weak;
+			int free_node = 0;
+			int node_debug_id = node->debug_id;
+			void __user *node_ptr = node->ptr;
+			void __user *node_cookie = node->cookie;
+
+			binder_node_lock(node);
+			strong = node->internal_strong_refs || node->local_strong_refs;
+			weak = !hlist_empty(&node->refs) || node->local_weak_refs || strong;
 			if (weak && !node->has_weak_ref) {
 				cmd = BR_INCREFS;
 				cmd_name = "BR_INCREFS";
@@ -2344,36 +3517,42 @@ retry:
 				cmd_name = "BR_DECREFS";
 				node->has_weak_ref = 0;
 			}
+			if (cmd == BR_NOOP) {
+				list_del_init(&w->entry);
+				if (!weak && !strong && !node->tmp_refs) {
+					rb_erase(&node->rb_node, &proc->nodes);
+					free_node = 1;
+				}
+			}
+			binder_node_unlock(node);
+			mutex_unlock(&proc->lock);
 			if (cmd != BR_NOOP) {
 				if (put_user(cmd, (uint32_t __user *)ptr))
 					return -EFAULT;
 				ptr += sizeof(uint32_t);
-				if (put_user(node->ptr, (void * __user *)ptr))
+				if (put_user(node_ptr, (void * __user *)ptr))
 					return -EFAULT;
 				ptr += sizeof(void *);
-				if (put_user(node->cookie, (void * __user *)ptr))
+				if (put_user(node_cookie, (void * __user *)ptr))
 					return -EFAULT;
 				ptr += sizeof(void *);
 
 				binder_stat_br(proc, thread, cmd);
 				binder_debug(BINDER_DEBUG_USER_REFS,
 					     "binder: %d:%d %s %d u%p c%p\n",
-					     proc->pid, thread->pid, cmd_name, node->debug_id, node->ptr, node->cookie);
+					     proc->pid, thread->pid, cmd_name, node_debug_id, node_ptr, node_cookie);
 			} else {
-				list_del_init(&w->entry);
-				if (!weak && !strong) {
+				if (free_node) {
 					binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 						     "binder: %d:%d node %d u%p c%p deleted\n",
-						     proc->pid, thread->pid, node->debug_id,
-						     node->ptr, node->cookie);
-					rb_erase(&node->rb_node, &proc->nodes);
-					kfree(node);
-					binder_stats_deleted(BINDER_STAT_NODE);
+						     proc->pid, thread->pid, node_debug_id,
+						     node_ptr, node_cookie);
+					binder_free_node(node);
 				} else {
 					binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 						     "binder: %d:%d node %d u%p c%p state unchanged\n",
-						     proc->pid, thread->pid, node->debug_id, node->ptr,
-						     node->cookie);
+						     proc->pid, thread->pid, node_debug_id, node_ptr,
+						     node_cookie);
 				}
 			}
 		} break;
@@ -2381,17 +3560,31 @@ retry:
 		case BINDER_WORK_DEAD_BINDER_AND_CLEAR:
 		case BINDER_WORK_CLEAR_DEATH_NOTIFICATION: {
 			struct binder_ref_death *death;
+			void __user *cookie;
 			uint32_t cmd;
 
 			death = container_of(w, struct binder_ref_death, work);
+			cookie = death->cookie;
 			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION)
 				cmd = BR_CLEAR_DEATH_NOTIFICATION_DONE;
 			else
 				cmd = BR_DEAD_BINDER;
+			spin_lock(&proc->inner_lock);
+			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION)
+				list_del(&w->entry);
+			else
+				list_move(&w->entry, &proc->delivered_death);
+			spin_unlock(&proc->inner_lock);
+			mutex_unlock(&proc->lock);
+			if (cmd == BR_CLEAR_DEATH_NOTIFICATION_DONE) {
+				kfree(death);
+				binder_stats_deleted(BINDER_STAT_DEATH);
+			}
+
 			if (put_user(cmd, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
-			if (put_user(death->cookie, (void * __user *)ptr))
+			if (put_user(cookie, (void * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
 			binder_stat_br(proc, thread, cmd);
@@ -2401,14 +3594,8 @@ retry:
 				      cmd == BR_DEAD_BINDER ?
 				      "BR_DEAD_BINDER" :
 				      "BR_CLEAR_DEATH_NOTIFICATION_DONE",
-				      death->cookie);
+				      cookie);
 
-			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION) {
-				list_del(&w->entry);
-				kfree(death);
-				binder_stats_deleted(BINDER_STAT_DEATH);
-			} else
-				list_move(&w->entry, &proc->delivered_death);
 			if (cmd == BR_DEAD_BINDER)
 				goto done; /* DEAD_BINDER notifications can cause transactions */
 		} break;
@@ -2417,17 +3604,44 @@ retry:
 		if (!t)
 			continue;
 
+		/* Still holding proc->lock from picking t */
 		BUG_ON(t->buffer == NULL);
 		if (t->buffer->target_node) {
 			struct binder_node *target_node = t->buffer->target_node;
+			struct binder_priority node_prio = {
+				.sched_policy = SCHED_NORMAL,
+				.prio = target_node->min_priority,
+			};
 			tr.target.ptr = target_node->ptr;
 			tr.cookie =  target_node->cookie;
-			t->saved_priority = task_nice(current);
-			if (t->priority < target_node->min_priority &&
-			    !(t->flags & TF_ONE_WAY))
-				binder_set_nice(t->priority);
+			t->saved_priority = binder_get_priority(current);
+			t->deliver_time = ktime_get();
+			binder_node_add_latency(target_node, 0, t->start_time,
+						t->deliver_time);
+			/*
+			 * A real-time caller lends its whole scheduling class
+			 * to the thread handling its call, until the reply,
+			 * if the node opted in; see binder_transaction(). The
+			 * thread resets on fork meanwhile so children don't
+			 * keep the borrowed class.
+			 */
+			if (!(t->flags & TF_ONE_WAY) &&
+			    binder_is_rt_policy(t->priority.sched_policy) &&
+			    target_node->inherit_rt) {
+				if (binder_kernel_prio(t->priority) <
+				    binder_kernel_prio(t->saved_priority)) {
+					struct binder_priority prio = t->priority;
+
+					prio.reset_on_fork = 1;
+					binder_set_priority(prio);
+				}
+			} else if (binder_kernel_prio(t->priority) <
+				   binder_kernel_prio(node_prio) &&
+				   !(t->flags & TF_ONE_WAY))
+				binder_set_nice(t->priority.prio);
 			else if (!(t->flags & TF_ONE_WAY) ||
-				 t->saved_priority > target_node->min_priority)
+				 binder_kernel_prio(t->saved_priority) >
+				 binder_kernel_prio(node_prio))
 				binder_set_nice(target_node->min_priority);
 			cmd = BR_TRANSACTION;
 		} else {
@@ -2439,8 +3653,9 @@ retry:
 		tr.flags = t->flags;
 		tr.sender_euid = t->sender_euid;
 
-		if (t->from) {
-			struct task_struct *sender = t->from->proc->tsk;
+		t_from = binder_get_txn_from(t);
+		if (t_from) {
+			struct task_struct *sender = t_from->proc->tsk;
 			tr.sender_pid = task_tgid_nr_ns(sender,
 							current->nsproxy->pid_ns);
 		} else {
@@ -2455,12 +3670,31 @@ retry:
 					ALIGN(t->buffer->data_size,
 					    sizeof(void *));
 
-		if (put_user(cmd, (uint32_t __user *)ptr))
-			return -EFAULT;
-		ptr += sizeof(uint32_t);
-		if (copy_to_user(ptr, &tr, sizeof(tr)))
+		spin_lock(&proc->inner_lock);
+		list_del(&t->work.entry);
+		spin_unlock(&proc->inner_lock);
+		mutex_unlock(&proc->lock);
+
+		/*
+		 * t is off the todo list and not yet on our stack, so only its
+		 * sender can reach it until we push or free it below.
+		 */
+		if (put_user(cmd, (uint32_t __user *)ptr) ||
+		    copy_to_user(ptr + sizeof(uint32_t), &tr, sizeof(tr))) {
+			struct binder_buffer *t_buffer = t->buffer;
+
+			if (t_from)
+				binder_thread_dec_tmpref(t_from);
+			if (t->need_reply)
+				binder_send_failed_reply(t, BR_FAILED_REPLY);
+			else
+				binder_pop_transaction(NULL, t);
+			mutex_lock(&proc->lock);
+			binder_release_buffer(proc, thread, t_buffer);
+			mutex_unlock(&proc->lock);
 			return -EFAULT;
-		ptr += sizeof(tr);
+		}
+		ptr += sizeof(uint32_t) + sizeof(tr);
 
 		binder_stat_br(proc, thread, cmd);
 		binder_debug(BINDER_DEBUG_TRANSACTION,
@@ -2469,44 +3703,55 @@ retry:
 			     proc->pid, thread->pid,
 			     (cmd == BR_TRANSACTION) ? "BR_TRANSACTION" :
 			     "BR_REPLY",
-			     t->debug_id, t->from ? t->from->proc->pid : 0,
-			     t->from ? t->from->pid : 0, cmd,
+			     t->debug_id, t_from ? t_from->proc->pid : 0,
+			     t_from ? t_from->pid : 0, cmd,
 			     t->buffer->data_size, t->buffer->offsets_size,
 			     tr.data.ptr.buffer, tr.data.ptr.offsets);
+		trace_binder_transaction_received(t, thread);
+		if (t_from)
+			binder_thread_dec_tmpref(t_from);
 
-		list_del(&t->work.entry);
+		mutex_lock(&proc->lock);
+		mutex_lock(&proc->alloc_lock);
 		t->buffer->allow_user_free = 1;
 		if (cmd == BR_TRANSACTION && !(t->flags & TF_ONE_WAY)) {
+			mutex_unlock(&proc->alloc_lock);
 			t->to_parent = thread->transaction_stack;
 			t->to_thread = thread;
 			thread->transaction_stack = t;
 		} else {
 			t->buffer->transaction = NULL;
+			mutex_unlock(&proc->alloc_lock);
 			kfree(t);
 			binder_stats_deleted(BINDER_STAT_TRANSACTION);
 		}
+		mutex_unlock(&proc->lock);
 		break;
 	}
 
 done:
 
 	*consumed = ptr - buffer;
+	mutex_lock(&proc->lock);
 	if (proc->requested_threads + proc->ready_threads == 0 &&
 	    proc->requested_threads_started < proc->max_threads &&
 	    (thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 	     BINDER_LOOPER_STATE_ENTERED)) /* the user-space code fails to */
 	     /*spawn a new thread if we leave this out */) {
 		proc->requested_threads++;
+		mutex_unlock(&proc->lock);
 		binder_debug(BINDER_DEBUG_THREADS,
 			     "binder: %d:%d BR_SPAWN_LOOPER\n",
 			     proc->pid, thread->pid);
 		if (put_user(BR_SPAWN_LOOPER, (uint32_t __user *)buffer))
 			return -EFAULT;
 		binder_stat_br(proc, thread, BR_SPAWN_LOOPER);
-	}
+	} else
+		mutex_unlock(&proc->lock);
 	return 0;
 }
 
+/* Called without any binder lock held */
 static void binder_release_work(struct list_head *list)
 {
 	struct binder_work *w;
@@ -2520,6 +3765,8 @@ static void binder_release_work(struct list_head *list)
 			t = container_of(w, struct binder_transaction, work);
 			if (t->buffer->target_node && !(t->flags & TF_ONE_WAY))
 				binder_send_failed_reply(t, BR_DEAD_REPLY);
+			else
+				binder_pop_transaction(NULL, t);
 		} break;
 		case BINDER_WORK_TRANSACTION_COMPLETE: {
 			kfree(w);
@@ -2532,6 +3779,7 @@ static void binder_release_work(struct list_head *list)
 
 }
 
+/* Called with proc->lock held */
 static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 {
 	struct binder_thread *thread = NULL;
@@ -2555,6 +3803,8 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 			return NULL;
 		binder_stats_created(BINDER_STAT_THREAD);
 		thread->proc = proc;
+		binder_proc_inc_tmpref(proc);
+		atomic_set(&thread->tmp_ref, 1);
 		thread->pid = current->pid;
 		init_waitqueue_head(&thread->wait);
 		INIT_LIST_HEAD(&thread->todo);
@@ -2567,14 +3817,21 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 	return thread;
 }
 
-static int binder_free_thread(struct binder_proc *proc,
-			      struct binder_thread *thread)
+/*
+ * Called without any binder lock held. Unlinks the thread from its
+ * process and from the transactions on its stack, fails the call it was
+ * handling and drops the reference proc->threads held on it.
+ */
+static int binder_thread_release(struct binder_proc *proc,
+				 struct binder_thread *thread)
 {
 	struct binder_transaction *t;
 	struct binder_transaction *send_reply = NULL;
 	int active_transactions = 0;
 
+	mutex_lock(&proc->lock);
 	rb_erase(&thread->rb_node, &proc->threads);
+	thread->is_dead = 1;
 	t = thread->transaction_stack;
 	if (t && t->to_thread == thread)
 		send_reply = t;
@@ -2587,24 +3844,31 @@ static int binder_free_thread(struct binder_proc *proc,
 			     (t->to_thread == thread) ? "in" : "out");
 
 		if (t->to_thread == thread) {
+			spin_lock(&t->lock);
 			t->to_proc = NULL;
 			t->to_thread = NULL;
+			spin_unlock(&t->lock);
+			mutex_lock(&proc->alloc_lock);
 			if (t->buffer) {
 				t->buffer->transaction = NULL;
 				t->buffer = NULL;
 			}
+			mutex_unlock(&proc->alloc_lock);
 			t = t->to_parent;
 		} else if (t->from == thread) {
+			spin_lock(&t->lock);
 			t->from = NULL;
+			spin_unlock(&t->lock);
 			t = t->from_parent;
 		} else
 			BUG();
 	}
+	mutex_unlock(&proc->lock);
+
 	if (send_reply)
 		binder_send_failed_reply(send_reply, BR_DEAD_REPLY);
 	binder_release_work(&thread->todo);
-	kfree(thread);
-	binder_stats_deleted(BINDER_STAT_THREAD);
+	binder_thread_dec_tmpref(thread);
 	return active_transactions;
 }
 
@@ -2615,12 +3879,16 @@ static unsigned int binder_poll(struct file *filp,
 	struct binder_thread *thread = NULL;
 	int wait_for_proc_work;
 
-	mutex_lock(&binder_lock);
+	mutex_lock(&proc->lock);
 	thread = binder_get_thread(proc);
+	if (thread == NULL) {
+		mutex_unlock(&proc->lock);
+		return POLLERR;
+	}
 
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 		list_empty(&thread->todo) && thread->return_error == BR_OK;
-	mutex_unlock(&binder_lock);
+	mutex_unlock(&proc->lock);
 
 	if (wait_for_proc_work) {
 		if (binder_has_proc_work(proc, thread))
@@ -2638,6 +3906,60 @@ static unsigned int binder_poll(struct file *filp,
 	return 0;
 }
 
+static int binder_set_context_mgr(struct binder_proc *proc)
+{
+	struct binder_node *node;
+	int ret = 0;
+
+	mutex_lock(&proc->lock);
+	spin_lock(&binder_context_mgr_lock);
+	if (binder_context_mgr_node != NULL) {
+		printk(KERN_ERR "binder: BINDER_SET_CONTEXT_MGR already set\n");
+		ret = -EBUSY;
+		goto out;
+	}
+	if (binder_context_mgr_uid != -1) {
+		if (binder_context_mgr_uid != current->cred->euid) {
+			printk(KERN_ERR "binder: BINDER_SET_"
+			       "CONTEXT_MGR bad uid %d != %d\n",
+			       current->cred->euid,
+			       binder_context_mgr_uid);
+			ret = -EPERM;
+			goto out;
+		}
+	} else
+		binder_context_mgr_uid = current->cred->euid;
+	spin_unlock(&binder_context_mgr_lock);
+
+	node = binder_new_node(proc, NULL, NULL);
+	if (node == NULL) {
+		ret = -ENOMEM;
+		goto out_unlocked;
+	}
+	node->local_weak_refs++;
+	node->local_strong_refs++;
+	node->has_strong_ref = 1;
+	node->has_weak_ref = 1;
+
+	spin_lock(&binder_context_mgr_lock);
+	if (binder_context_mgr_node == NULL) {
+		binder_context_mgr_node = node;
+		goto out;
+	}
+	/* Lost a race with another process, node is still unused */
+	spin_unlock(&binder_context_mgr_lock);
+	rb_erase(&node->rb_node, &proc->nodes);
+	binder_free_node(node);
+	printk(KERN_ERR "binder: BINDER_SET_CONTEXT_MGR already set\n");
+	ret = -EBUSY;
+	goto out_unlocked;
+out:
+	spin_unlock(&binder_context_mgr_lock);
+out_unlocked:
+	mutex_unlock(&proc->lock);
+	return ret;
+}
+
 static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	int ret;
@@ -2652,8 +3974,13 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	if (ret)
 		return ret;
 
-	mutex_lock(&binder_lock);
+	/*
+	 * The open file pins proc, and only this thread can release its own
+	 * binder_thread while the ioctl runs, so neither needs a reference.
+	 */
+	mutex_lock(&proc->lock);
 	thread = binder_get_thread(proc);
+	mutex_unlock(&proc->lock);
 	if (thread == NULL) {
 		ret = -ENOMEM;
 		goto err;
@@ -2704,43 +4031,27 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		break;
 	}
-	case BINDER_SET_MAX_THREADS:
-		if (copy_from_user(&proc->max_threads, ubuf, sizeof(proc->max_threads))) {
+	case BINDER_SET_MAX_THREADS: {
+		int max_threads;
+
+		if (copy_from_user(&max_threads, ubuf, sizeof(max_threads))) {
 			ret = -EINVAL;
 			goto err;
 		}
+		mutex_lock(&proc->lock);
+		proc->max_threads = max_threads;
+		mutex_unlock(&proc->lock);
 		break;
+	}
 	case BINDER_SET_CONTEXT_MGR:
-		if (binder_context_mgr_node != NULL) {
-			printk(KERN_ERR "binder: BINDER_SET_CONTEXT_MGR already set\n");
-			ret = -EBUSY;
-			goto err;
-		}
-		if (binder_context_mgr_uid != -1) {
-			if (binder_context_mgr_uid != current->cred->euid) {
-				printk(KERN_ERR "binder: BINDER_SET_"
-				       "CONTEXT_MGR bad uid %d != %d\n",
-				       current->cred->euid,
-				       binder_context_mgr_uid);
-				ret = -EPERM;
-				goto err;
-			}
-		} else
-			binder_context_mgr_uid = current->cred->euid;
-		binder_context_mgr_node = binder_new_node(proc, NULL, NULL);
-		if (binder_context_mgr_node == NULL) {
-			ret = -ENOMEM;
+		ret = binder_set_context_mgr(proc);
+		if (ret)
 			goto err;
-		}
-		binder_context_mgr_node->local_weak_refs++;
-		binder_context_mgr_node->local_strong_refs++;
-		binder_context_mgr_node->has_strong_ref = 1;
-		binder_context_mgr_node->has_weak_ref = 1;
 		break;
 	case BINDER_THREAD_EXIT:
 		binder_debug(BINDER_DEBUG_THREADS, "binder: %d:%d exit\n",
 			     proc->pid, thread->pid);
-		binder_free_thread(proc, thread);
+		binder_thread_release(proc, thread);
 		thread = NULL;
 		break;
 	case BINDER_VERSION:
@@ -2759,9 +4070,11 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	}
 	ret = 0;
 err:
-	if (thread)
+	if (thread) {
+		mutex_lock(&proc->lock);
 		thread->looper &= ~BINDER_LOOPER_STATE_NEED_RETURN;
-	mutex_unlock(&binder_lock);
+		mutex_unlock(&proc->lock);
+	}
 	wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 	if (ret && ret != -ERESTARTSYS)
 		printk(KERN_INFO "binder: %d:%d ioctl %x %lx returned %d\n", proc->pid, current->pid, cmd, arg, ret);
@@ -2802,6 +4115,7 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	struct binder_proc *proc = filp->private_data;
 	const char *failure_string;
 	struct binder_buffer *buffer;
+	int i;
 
 	if ((vma->vm_end - vma->vm_start) > SZ_4M)
 		vma->vm_end = vma->vm_start + SZ_4M;
@@ -2851,17 +4165,22 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		goto err_alloc_pages_failed;
 	}
 	proc->buffer_size = vma->vm_end - vma->vm_start;
+	for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+		INIT_LIST_HEAD(&proc->pages[i].lru);
+		proc->pages[i].proc = proc;
+	}
 
 	vma->vm_ops = &binder_vm_ops;
 	vma->vm_private_data = proc;
 
-	if (binder_update_page_range(proc, 1, proc->buffer, proc->buffer + PAGE_SIZE, vma)) {
+	buffer = kzalloc(sizeof(*buffer), GFP_KERNEL);
+	if (buffer == NULL) {
 		ret = -ENOMEM;
-		failure_string = "alloc small buf";
-		goto err_alloc_small_buf_failed;
+		failure_string = "alloc buffer struct";
+		goto err_alloc_buf_struct_failed;
 	}
-	buffer = proc->buffer;
-	INIT_LIST_HEAD(&proc->buffers);
+	buffer->data = proc->buffer;
+	buffer->size = proc->buffer_size;
 	list_add(&buffer->entry, &proc->buffers);
 	buffer->free = 1;
 	binder_insert_free_buffer(proc, buffer);
@@ -2874,7 +4193,7 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		 proc->pid, vma->vm_start, vma->vm_end, proc->buffer);*/
 	return 0;
 
-err_alloc_small_buf_failed:
+err_alloc_buf_struct_failed:
 	kfree(proc->pages);
 	proc->pages = NULL;
 err_alloc_pages_failed:
@@ -2916,9 +4235,69 @@ static int exist_proc_entry(const char *name, struct proc_dir_entry *parent)
 	return de != NULL;
 }
 
+/*
+ * The file only holds the pid: an open fd can outlive the binder_proc, so
+ * each read looks the process up again under binder_procs_lock, which
+ * binder_deferred_release() holds while it unhashes it.
+ */
+static int binder_counters_open(struct inode *inode, struct file *file)
+{
+	file->private_data = inode->i_private;
+	return 0;
+}
+
+static ssize_t binder_counters_read(struct file *file, char __user *ubuf,
+				    size_t count, loff_t *ppos)
+{
+	int pid = (int)(unsigned long)file->private_data;
+	struct binder_proc *proc;
+	struct hlist_node *pos;
+	struct binder_proc_counters c;
+	int found = 0;
+	int i;
+
+	BUILD_BUG_ON(ARRAY_SIZE(c.br) != ARRAY_SIZE(proc->stats.br));
+	BUILD_BUG_ON(ARRAY_SIZE(c.bc) != ARRAY_SIZE(proc->stats.bc));
+
+	memset(&c, 0, sizeof(c));
+	c.version = BINDER_COUNTERS_VERSION;
+	mutex_lock(&binder_procs_lock);
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		if (proc->pid == pid) {
+			found = 1;
+			break;
+		}
+	}
+	if (!found) {
+		mutex_unlock(&binder_procs_lock);
+		return -ESRCH;
+	}
+	/* The counters themselves are read racily */
+	c.pid = proc->pid;
+	c.ready_threads = proc->ready_threads;
+	c.requested_threads = proc->requested_threads;
+	c.buffer_allocated = proc->allocated_size;
+	c.buffer_allocated_max = proc->allocated_size_max;
+	for (i = 0; i < ARRAY_SIZE(c.br); i++)
+		c.br[i] = atomic_read(&proc->stats.br[i]);
+	for (i = 0; i < ARRAY_SIZE(c.bc); i++)
+		c.bc[i] = atomic_read(&proc->stats.bc[i]);
+	mutex_unlock(&binder_procs_lock);
+
+	return simple_read_from_buffer(ubuf, count, ppos, &c, sizeof(c));
+}
+
+static const struct file_operations binder_counters_fops = {
+	.owner = THIS_MODULE,
+	.open = binder_counters_open,
+	.read = binder_counters_read,
+	.llseek = default_llseek,
+};
+
 static int binder_open(struct inode *nodp, struct file *filp)
 {
 	struct binder_proc *proc;
+	int i;
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE, "binder_open: %d:%d\n",
 		     current->group_leader->pid, current->pid);
@@ -2929,15 +4308,23 @@ static int binder_open(struct inode *nodp, struct file *filp)
 	get_task_struct(current);
 	proc->tsk = current;
 	INIT_LIST_HEAD(&proc->todo);
+	INIT_LIST_HEAD(&proc->lru);
 	init_waitqueue_head(&proc->wait);
 	proc->default_priority = task_nice(current);
-	mutex_lock(&binder_lock);
-	binder_stats_created(BINDER_STAT_PROC);
-	hlist_add_head(&proc->proc_node, &binder_procs);
+	mutex_init(&proc->lock);
+	mutex_init(&proc->alloc_lock);
+	spin_lock_init(&proc->inner_lock);
 	proc->pid = current->group_leader->pid;
 	INIT_LIST_HEAD(&proc->delivered_death);
+	INIT_LIST_HEAD(&proc->buffers);
+	for (i = 0; i < BINDER_SMALL_BUCKETS; i++)
+		INIT_LIST_HEAD(&proc->free_small[i]);
+	atomic_set(&proc->tmp_ref, 1);
+	binder_stats_created(BINDER_STAT_PROC);
+	mutex_lock(&binder_procs_lock);
+	hlist_add_head(&proc->proc_node, &binder_procs);
+	mutex_unlock(&binder_procs_lock);
 	filp->private_data = proc;
-	mutex_unlock(&binder_lock);
 
 	if (binder_debugfs_dir_entry_proc) {
 		char strbuf[11];
@@ -2945,6 +4332,14 @@ static int binder_open(struct inode *nodp, struct file *filp)
 		proc->debugfs_entry = debugfs_create_file(strbuf, S_IRUGO,
 			binder_debugfs_dir_entry_proc, proc, &binder_proc_fops);
 	}
+	if (binder_debugfs_dir_entry_counters) {
+		char strbuf[11];
+		snprintf(strbuf, sizeof(strbuf), "%u", proc->pid);
+		proc->debugfs_counters = debugfs_create_file(strbuf, S_IRUGO,
+			binder_debugfs_dir_entry_counters,
+			(void *)(unsigned long)proc->pid,
+			&binder_counters_fops);
+	}
 
 	if (binder_proc_dir_entry_proc) {
 		char strbuf[11];
@@ -2973,6 +4368,8 @@ static void binder_deferred_flush(struct binder_proc *proc)
 {
 	struct rb_node *n;
 	int wake_count = 0;
+
+	mutex_lock(&proc->lock);
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n)) {
 		struct binder_thread *thread = rb_entry(n, struct binder_thread, rb_node);
 		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
@@ -2981,6 +4378,7 @@ static void binder_deferred_flush(struct binder_proc *proc)
 			wake_count++;
 		}
 	}
+	mutex_unlock(&proc->lock);
 	wake_up_interruptible_all(&proc->wait);
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
@@ -2992,6 +4390,7 @@ static int binder_release(struct inode *nodp, struct file *filp)
 {
 	struct binder_proc *proc = filp->private_data;
 	debugfs_remove(proc->debugfs_entry);
+	debugfs_remove(proc->debugfs_counters);
 	if (binder_proc_dir_entry_proc) {
 		char strbuf[11];
 		snprintf(strbuf, sizeof(strbuf), "%u", proc->pid);
@@ -3002,63 +4401,167 @@ static int binder_release(struct inode *nodp, struct file *filp)
 	return 0;
 }
 
+/*
+ * Frees what a transaction in flight may still write to or look up: the
+ * buffer space and the allocator. Only called once nothing can reach the
+ * process any more.
+ */
+static void binder_free_proc(struct binder_proc *proc)
+{
+	struct binder_transaction *t;
+	struct rb_node *n;
+	int buffers, page_count;
+
+	BUG_ON(!list_empty(&proc->todo));
+	BUG_ON(!RB_EMPTY_ROOT(&proc->threads));
+	buffers = 0;
+	while ((n = rb_first(&proc->allocated_buffers))) {
+		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer,
+							rb_node);
+		t = buffer->transaction;
+		if (t) {
+			t->buffer = NULL;
+			buffer->transaction = NULL;
+			printk(KERN_ERR "binder: release proc %d, "
+			       "transaction %d, not freed\n",
+			       proc->pid, t->debug_id);
+			/*BUG();*/
+		}
+		binder_free_buf(proc, buffer);
+		buffers++;
+	}
+	while (!list_empty(&proc->buffers)) {
+		struct binder_buffer *buffer;
+
+		buffer = list_first_entry(&proc->buffers, struct binder_buffer,
+					  entry);
+		list_del(&buffer->entry);
+		kfree(buffer);
+	}
+
+	page_count = 0;
+	if (proc->pages) {
+		int i;
+
+		/* Keeps the shrinker away from pages we are about to free */
+		mutex_lock(&proc->alloc_lock);
+		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+			if (!list_empty(&proc->pages[i].lru))
+				binder_lru_del(&proc->pages[i]);
+		}
+		mutex_unlock(&proc->alloc_lock);
+
+		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+			if (proc->pages[i].page_ptr) {
+				void *page_addr = proc->buffer + i * PAGE_SIZE;
+				binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+					     "binder_release: %d: "
+					     "page %d at %p not freed\n",
+					     proc->pid, i,
+					     page_addr);
+				unmap_kernel_range((unsigned long)page_addr,
+					PAGE_SIZE);
+				__free_page(proc->pages[i].page_ptr);
+				page_count++;
+			}
+		}
+		kfree(proc->pages);
+		vfree(proc->buffer);
+	}
+
+	put_task_struct(proc->tsk);
+	binder_stats_deleted(BINDER_STAT_PROC);
+
+	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
+		     "binder_release: %d freed, buffers %d, pages %d\n",
+		     proc->pid, buffers, page_count);
+
+	kfree(proc);
+}
+
 static void binder_deferred_release(struct binder_proc *proc)
 {
 	struct hlist_node *pos;
-	struct binder_transaction *t;
 	struct rb_node *n;
-	int threads, nodes, incoming_refs, outgoing_refs, buffers, active_transactions, page_count;
+	LIST_HEAD(async_work);
+	int threads, nodes, incoming_refs, outgoing_refs, active_transactions;
 
 	BUG_ON(proc->vma);
 	BUG_ON(proc->files);
 
+	mutex_lock(&binder_procs_lock);
 	hlist_del(&proc->proc_node);
+	mutex_unlock(&binder_procs_lock);
+
+	spin_lock(&binder_context_mgr_lock);
 	if (binder_context_mgr_node && binder_context_mgr_node->proc == proc) {
 		binder_debug(BINDER_DEBUG_DEAD_BINDER,
 			     "binder_release: %d context_mgr_node gone\n",
 			     proc->pid);
 		binder_context_mgr_node = NULL;
 	}
+	spin_unlock(&binder_context_mgr_lock);
 
+	mutex_lock(&proc->lock);
+	/* Transactions still being built check this before delivering */
+	proc->is_dead = 1;
+	/* Keeps the proc around until its threads are gone */
+	binder_proc_inc_tmpref(proc);
 	threads = 0;
 	active_transactions = 0;
 	while ((n = rb_first(&proc->threads))) {
-		struct binder_thread *thread = rb_entry(n, struct binder_thread, rb_node);
+		struct binder_thread *thread = rb_entry(n, struct binder_thread,
+							rb_node);
+
+		mutex_unlock(&proc->lock);
 		threads++;
-		active_transactions += binder_free_thread(proc, thread);
+		active_transactions += binder_thread_release(proc, thread);
+		mutex_lock(&proc->lock);
 	}
+
 	nodes = 0;
 	incoming_refs = 0;
 	while ((n = rb_first(&proc->nodes))) {
 		struct binder_node *node = rb_entry(n, struct binder_node, rb_node);
+		struct binder_ref *ref;
+		int death = 0;
+		int free_node;
 
 		nodes++;
 		rb_erase(&node->rb_node, &proc->nodes);
+		binder_node_lock(node);
 		list_del_init(&node->work.entry);
-		if (hlist_empty(&node->refs)) {
-			kfree(node);
-			binder_stats_deleted(BINDER_STAT_NODE);
-		} else {
-			struct binder_ref *ref;
-			int death = 0;
-
+		list_splice_init(&node->async_todo, &async_work);
+		spin_unlock(&proc->inner_lock);
+		free_node = hlist_empty(&node->refs) && !node->tmp_refs;
+		if (!free_node) {
 			node->proc = NULL;
 			node->local_strong_refs = 0;
 			node->local_weak_refs = 0;
+			spin_lock(&binder_dead_nodes_lock);
 			hlist_add_head(&node->dead_node, &binder_dead_nodes);
+			spin_unlock(&binder_dead_nodes_lock);
+		}
 
-			hlist_for_each_entry(ref, pos, &node->refs, node_entry) {
-				incoming_refs++;
-				if (ref->death) {
-					death++;
-					if (list_empty(&ref->death->work.entry)) {
-						ref->death->work.type = BINDER_WORK_DEAD_BINDER;
-						list_add_tail(&ref->death->work.entry, &ref->proc->todo);
-						wake_up_interruptible(&ref->proc->wait);
-					} else
-						BUG();
-				}
+		hlist_for_each_entry(ref, pos, &node->refs, node_entry) {
+			incoming_refs++;
+			if (ref->death) {
+				death++;
+				spin_lock(&ref->proc->inner_lock);
+				if (list_empty(&ref->death->work.entry)) {
+					ref->death->work.type = BINDER_WORK_DEAD_BINDER;
+					list_add_tail(&ref->death->work.entry,
+						      &ref->proc->todo);
+					wake_up_interruptible(&ref->proc->wait);
+				} else
+					BUG();
+				spin_unlock(&ref->proc->inner_lock);
 			}
+		}
+		spin_unlock(&node->lock);
+		if (free_node) {
+			binder_free_node(node);
+		} else {
 			binder_debug(BINDER_DEBUG_DEAD_BINDER,
 				     "binder: node %d now dead, "
 				     "refs %d, death %d\n", node->debug_id,
@@ -3072,58 +4575,20 @@ static void binder_deferred_release(struct binder_proc *proc)
 		outgoing_refs++;
 		binder_delete_ref(ref);
 	}
-	binder_release_work(&proc->todo);
-	buffers = 0;
-
-	while ((n = rb_first(&proc->allocated_buffers))) {
-		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer,
-							rb_node);
-		t = buffer->transaction;
-		if (t) {
-			t->buffer = NULL;
-			buffer->transaction = NULL;
-			printk(KERN_ERR "binder: release proc %d, "
-			       "transaction %d, not freed\n",
-			       proc->pid, t->debug_id);
-			/*BUG();*/
-		}
-		binder_free_buf(proc, buffer);
-		buffers++;
-	}
+	mutex_unlock(&proc->lock);
 
-	binder_stats_deleted(BINDER_STAT_PROC);
-
-	page_count = 0;
-	if (proc->pages) {
-		int i;
-		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
-			if (proc->pages[i]) {
-				void *page_addr = proc->buffer + i * PAGE_SIZE;
-				binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
-					     "binder_release: %d: "
-					     "page %d at %p not freed\n",
-					     proc->pid, i,
-					     page_addr);
-				unmap_kernel_range((unsigned long)page_addr,
-					PAGE_SIZE);
-				__free_page(proc->pages[i]);
-				page_count++;
-			}
-		}
-		kfree(proc->pages);
-		vfree(proc->buffer);
-	}
-
-	put_task_struct(proc->tsk);
+	binder_release_work(&async_work);
+	binder_release_work(&proc->todo);
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
 		     "binder_release: %d threads %d, nodes %d (ref %d), "
-		     "refs %d, active transactions %d, buffers %d, "
-		     "pages %d\n",
+		     "refs %d, active transactions %d\n",
 		     proc->pid, threads, nodes, incoming_refs, outgoing_refs,
-		     active_transactions, buffers, page_count);
+		     active_transactions);
 
-	kfree(proc);
+	/* The reference taken above, then the one the file held */
+	binder_proc_dec_tmpref(proc);
+	binder_proc_dec_tmpref(proc);
 }
 
 static void binder_deferred_func(struct work_struct *work)
@@ -3133,7 +4598,6 @@ static void binder_deferred_func(struct work_struct *work)
 
 	int defer;
 	do {
-		mutex_lock(&binder_lock);
 		mutex_lock(&binder_deferred_lock);
 		if (!hlist_empty(&binder_deferred_list)) {
 			proc = hlist_entry(binder_deferred_list.first,
@@ -3149,18 +4613,19 @@ static void binder_deferred_func(struct work_struct *work)
 
 		files = NULL;
 		if (defer & BINDER_DEFERRED_PUT_FILES) {
+			mutex_lock(&proc->lock);
 			files = proc->files;
 			if (files)
 				proc->files = NULL;
+			mutex_unlock(&proc->lock);
 		}
 
 		if (defer & BINDER_DEFERRED_FLUSH)
 			binder_deferred_flush(proc);
 
 		if (defer & BINDER_DEFERRED_RELEASE)
-			binder_deferred_release(proc); /* frees proc */
+			binder_deferred_release(proc); /* drops the file's ref */
 
-		mutex_unlock(&binder_lock);
 		if (files)
 			put_files_struct(files);
 	} while (proc);
@@ -3180,17 +4645,33 @@ binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer)
 	mutex_unlock(&binder_deferred_lock);
 }
 
+/*
+ * Called with proc->lock held, where proc is the process whose thread or
+ * list t was found on. The buffer is only printed if it belongs to proc,
+ * as nothing else keeps it from being freed.
+ */
 static void print_binder_transaction(struct seq_file *m, const char *prefix,
+				     struct binder_proc *proc,
 				     struct binder_transaction *t)
 {
+	struct binder_proc *to_proc;
+
+	spin_lock(&t->lock);
+	to_proc = t->to_proc;
 	seq_printf(m,
-		   "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %ld r%d",
+		   "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %d:%d r%d",
 		   prefix, t->debug_id, t,
 		   t->from ? t->from->proc->pid : 0,
 		   t->from ? t->from->pid : 0,
 		   t->to_proc ? t->to_proc->pid : 0,
 		   t->to_thread ? t->to_thread->pid : 0,
-		   t->code, t->flags, t->priority, t->need_reply);
+		   t->code, t->flags, t->priority.sched_policy,
+		   t->priority.prio, t->need_reply);
+	spin_unlock(&t->lock);
+	if (proc == NULL || proc != to_proc) {
+		seq_puts(m, "\n");
+		return;
+	}
 	if (t->buffer == NULL) {
 		seq_puts(m, " buffer free\n");
 		return;
@@ -3212,7 +4693,8 @@ static void print_binder_buffer(struct seq_file *m, const char *prefix,
 		   buffer->transaction ? "active" : "delivered");
 }
 
-static void print_binder_work(struct seq_file *m, const char *prefix,
+static void print_binder_work(struct seq_file *m, struct binder_proc *proc,
+			      const char *prefix,
 			      const char *transaction_prefix,
 			      struct binder_work *w)
 {
@@ -3222,7 +4704,7 @@ static void print_binder_work(struct seq_file *m, const char *prefix,
 	switch (w->type) {
 	case BINDER_WORK_TRANSACTION:
 		t = container_of(w, struct binder_transaction, work);
-		print_binder_transaction(m, transaction_prefix, t);
+		print_binder_transaction(m, transaction_prefix, proc, t);
 		break;
 	case BINDER_WORK_TRANSACTION_COMPLETE:
 		seq_printf(m, "%stransaction complete\n", prefix);
@@ -3261,25 +4743,30 @@ static void print_binder_thread(struct seq_file *m,
 	t = thread->transaction_stack;
 	while (t) {
 		if (t->from == thread) {
-			print_binder_transaction(m,
-						 "    outgoing transaction", t);
+			print_binder_transaction(m, "    outgoing transaction",
+						 thread->proc, t);
 			t = t->from_parent;
 		} else if (t->to_thread == thread) {
-			print_binder_transaction(m,
-						 "    incoming transaction", t);
+			print_binder_transaction(m, "    incoming transaction",
+						 thread->proc, t);
 			t = t->to_parent;
 		} else {
-			print_binder_transaction(m, "    bad transaction", t);
+			print_binder_transaction(m, "    bad transaction",
+						 thread->proc, t);
 			t = NULL;
 		}
 	}
+	spin_lock(&thread->proc->inner_lock);
 	list_for_each_entry(w, &thread->todo, entry) {
-		print_binder_work(m, "    ", "    pending transaction", w);
+		print_binder_work(m, thread->proc, "    ",
+				  "    pending transaction", w);
 	}
+	spin_unlock(&thread->proc->inner_lock);
 	if (!print_always && m->count == header_pos)
 		m->count = start_pos;
 }
 
+/* Called with node->lock held */
 static void print_binder_node(struct seq_file *m, struct binder_node *node)
 {
 	struct binder_ref *ref;
@@ -3303,7 +4790,7 @@ static void print_binder_node(struct seq_file *m, struct binder_node *node)
 	}
 	seq_puts(m, "\n");
 	list_for_each_entry(w, &node->async_todo, entry)
-		print_binder_work(m, "    ",
+		print_binder_work(m, node->proc, "    ",
 				  "    pending async transaction", w);
 }
 
@@ -3331,8 +4818,10 @@ static void print_binder_proc(struct seq_file *m,
 	for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n)) {
 		struct binder_node *node = rb_entry(n, struct binder_node,
 						    rb_node);
+		spin_lock(&node->lock);
 		if (print_all || node->has_async_transaction)
 			print_binder_node(m, node);
+		spin_unlock(&node->lock);
 	}
 	if (print_all) {
 		for (n = rb_first(&proc->refs_by_desc);
@@ -3341,33 +4830,49 @@ static void print_binder_proc(struct seq_file *m,
 			print_binder_ref(m, rb_entry(n, struct binder_ref,
 						     rb_node_desc));
 	}
+	mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		print_binder_buffer(m, "  buffer",
 				    rb_entry(n, struct binder_buffer, rb_node));
+	mutex_unlock(&proc->alloc_lock);
+	spin_lock(&proc->inner_lock);
 	list_for_each_entry(w, &proc->todo, entry)
-		print_binder_work(m, "  ", "  pending transaction", w);
+		print_binder_work(m, proc, "  ", "  pending transaction", w);
 	list_for_each_entry(w, &proc->delivered_death, entry) {
 		seq_puts(m, "  has delivered dead binder\n");
 		break;
 	}
+	spin_unlock(&proc->inner_lock);
 	if (!print_all && m->count == header_pos)
 		m->count = start_pos;
 }
 
+/* See print_binder_transaction() */
 static char *procfs_print_binder_transaction(char *buf, char *end, const char *prefix,
+				      struct binder_proc *proc,
 				      struct binder_transaction *t)
 {
+	struct binder_proc *to_proc;
+
+	spin_lock(&t->lock);
+	to_proc = t->to_proc;
 	buf += snprintf(buf, end - buf,
 			"%s %d: %p from %d:%d to %d:%d code %x "
-			"flags %x pri %ld r%d",
+			"flags %x pri %d:%d r%d",
 			prefix, t->debug_id, t,
 			t->from ? t->from->proc->pid : 0,
 			t->from ? t->from->pid : 0,
 			t->to_proc ? t->to_proc->pid : 0,
 			t->to_thread ? t->to_thread->pid : 0,
-			t->code, t->flags, t->priority, t->need_reply);
+			t->code, t->flags, t->priority.sched_policy,
+			t->priority.prio, t->need_reply);
+	spin_unlock(&t->lock);
 	if (buf >= end)
 		return buf;
+	if (proc == NULL || proc != to_proc) {
+		buf += snprintf(buf, end - buf, "\n");
+		return buf;
+	}
 	if (t->buffer == NULL) {
 		buf += snprintf(buf, end - buf, " buffer free\n");
 		return buf;
@@ -3394,7 +4899,8 @@ static char *procfs_print_binder_buffer(char *buf, char *end, const char *prefix
 	return buf;
 }
 
-static char *procfs_print_binder_work(char *buf, char *end, const char *prefix,
+static char *procfs_print_binder_work(char *buf, char *end,
+			       struct binder_proc *proc, const char *prefix,
 			       const char *transaction_prefix,
 			       struct binder_work *w)
 {
@@ -3404,7 +4910,8 @@ static char *procfs_print_binder_work(char *buf, char *end, const char *prefix,
 	switch (w->type) {
 	case BINDER_WORK_TRANSACTION:
 		t = container_of(w, struct binder_transaction, work);
-		buf = procfs_print_binder_transaction(buf, end, transaction_prefix, t);
+		buf = procfs_print_binder_transaction(buf, end, transaction_prefix,
+						      proc, t);
 		break;
 	case BINDER_WORK_TRANSACTION_COMPLETE:
 		buf += snprintf(buf, end - buf,
@@ -3453,29 +4960,35 @@ static char *procfs_print_binder_thread(char *buf, char *end,
 			break;
 		if (t->from == thread) {
 			buf = procfs_print_binder_transaction(buf, end,
-						"    outgoing transaction", t);
+						"    outgoing transaction",
+						thread->proc, t);
 			t = t->from_parent;
 		} else if (t->to_thread == thread) {
 			buf = procfs_print_binder_transaction(buf, end,
-						"    incoming transaction", t);
+						"    incoming transaction",
+						thread->proc, t);
 			t = t->to_parent;
 		} else {
 			buf = procfs_print_binder_transaction(buf, end,
-						"    bad transaction", t);
+						"    bad transaction",
+						thread->proc, t);
 			t = NULL;
 		}
 	}
+	spin_lock(&thread->proc->inner_lock);
 	list_for_each_entry(w, &thread->todo, entry) {
 		if (buf >= end)
 			break;
-		buf = procfs_print_binder_work(buf, end, "    ",
+		buf = procfs_print_binder_work(buf, end, thread->proc, "    ",
 					"    pending transaction", w);
 	}
+	spin_unlock(&thread->proc->inner_lock);
 	if (!print_always && buf == header_buf)
 		buf = start_buf;
 	return buf;
 }
 
+/* Called with node->lock held */
 static char *procfs_print_binder_node(char *buf, char *end, struct binder_node *node)
 {
 	struct binder_ref *ref;
@@ -3510,7 +5023,7 @@ static char *procfs_print_binder_node(char *buf, char *end, struct binder_node *
 	list_for_each_entry(w, &node->async_todo, entry) {
 		if (buf >= end)
 			break;
-		buf = procfs_print_binder_work(buf, end, "    ",
+		buf = procfs_print_binder_work(buf, end, node->proc, "    ",
 					"    pending async transaction", w);
 	}
 	return buf;
@@ -3548,8 +5061,10 @@ static char *procfs_print_binder_proc(char *buf, char *end,
 	     n = rb_next(n)) {
 		struct binder_node *node = rb_entry(n, struct binder_node,
 						    rb_node);
+		spin_lock(&node->lock);
 		if (print_all || node->has_async_transaction)
 			buf = procfs_print_binder_node(buf, end, node);
+		spin_unlock(&node->lock);
 	}
 	if (print_all) {
 		for (n = rb_first(&proc->refs_by_desc);
@@ -3559,16 +5074,19 @@ static char *procfs_print_binder_proc(char *buf, char *end,
 					       rb_entry(n, struct binder_ref,
 							rb_node_desc));
 	}
+	mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers);
 	     n != NULL && buf < end;
 	     n = rb_next(n))
 		buf = procfs_print_binder_buffer(buf, end, "  buffer",
 					  rb_entry(n, struct binder_buffer,
 						   rb_node));
+	mutex_unlock(&proc->alloc_lock);
+	spin_lock(&proc->inner_lock);
 	list_for_each_entry(w, &proc->todo, entry) {
 		if (buf >= end)
 			break;
-		buf = procfs_print_binder_work(buf, end, "  ",
+		buf = procfs_print_binder_work(buf, end, proc, "  ",
 					"  pending transaction", w);
 	}
 	list_for_each_entry(w, &proc->delivered_death, entry) {
@@ -3578,6 +5096,7 @@ static char *procfs_print_binder_proc(char *buf, char *end,
 				"  has delivered dead binder\n");
 		break;
 	}
+	spin_unlock(&proc->inner_lock);
 	if (!print_all && buf == header_buf)
 		buf = start_buf;
 	return buf;
@@ -3621,7 +5140,9 @@ static const char *binder_command_strings[] = {
 	"BC_EXIT_LOOPER",
 	"BC_REQUEST_DEATH_NOTIFICATION",
 	"BC_CLEAR_DEATH_NOTIFICATION",
-	"BC_DEAD_BINDER_DONE"
+	"BC_DEAD_BINDER_DONE",
+	"BC_TRANSACTION_SG",
+	"BC_REPLY_SG",
 };
 
 static const char *binder_objstat_strings[] = {
@@ -3642,17 +5163,21 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->bc) !=
 		     ARRAY_SIZE(binder_command_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->bc); i++) {
-		if (stats->bc[i])
+		int temp = atomic_read(&stats->bc[i]);
+
+		if (temp)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_command_strings[i], stats->bc[i]);
+				   binder_command_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->br) !=
 		     ARRAY_SIZE(binder_return_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->br); i++) {
-		if (stats->br[i])
+		int temp = atomic_read(&stats->br[i]);
+
+		if (temp)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_return_strings[i], stats->br[i]);
+				   binder_return_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
@@ -3660,12 +5185,40 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
 		     ARRAY_SIZE(stats->obj_deleted));
 	for (i = 0; i < ARRAY_SIZE(stats->obj_created); i++) {
-		if (stats->obj_created[i] || stats->obj_deleted[i])
+		int created = atomic_read(&stats->obj_created[i]);
+		int deleted = atomic_read(&stats->obj_deleted[i]);
+
+		if (created || deleted)
 			seq_printf(m, "%s%s: active %d total %d\n", prefix,
 				binder_objstat_strings[i],
-				stats->obj_created[i] - stats->obj_deleted[i],
-				stats->obj_created[i]);
+				created - deleted, created);
+	}
+}
+
+struct binder_buffer_space {
+	size_t free_size;
+	size_t largest_free;
+	int free_extents;
+	int fragmentation; /* percent of free space outside the largest */
+};
+
+static void binder_get_buffer_space(struct binder_proc *proc,
+				    struct binder_buffer_space *space)
+{
+	struct binder_buffer *buffer;
+
+	memset(space, 0, sizeof(*space));
+	list_for_each_entry(buffer, &proc->buffers, entry) {
+		if (!buffer->free)
+			continue;
+		space->free_extents++;
+		space->free_size += buffer->size;
+		if (buffer->size > space->largest_free)
+			space->largest_free = buffer->size;
 	}
+	if (space->free_size)
+		space->fragmentation = 100 - space->largest_free * 100 /
+					     space->free_size;
 }
 
 static void print_binder_proc_stats(struct seq_file *m,
@@ -3673,6 +5226,7 @@ static void print_binder_proc_stats(struct seq_file *m,
 {
 	struct binder_work *w;
 	struct rb_node *n;
+	struct binder_buffer_space space;
 	int count, strong, weak;
 
 	seq_printf(m, "proc %d\n", proc->pid);
@@ -3702,11 +5256,20 @@ static void print_binder_proc_stats(struct seq_file *m,
 	seq_printf(m, "  refs: %d s %d w %d\n", count, strong, weak);
 
 	count = 0;
+	mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		count++;
+	binder_get_buffer_space(proc, &space);
+	mutex_unlock(&proc->alloc_lock);
 	seq_printf(m, "  buffers: %d\n", count);
+	seq_printf(m, "  buffer space: allocated %zd max %zd, free %zd in %d "
+		   "extents, largest %zd, fragmentation %d%%\n",
+		   proc->allocated_size, proc->allocated_size_max,
+		   space.free_size, space.free_extents, space.largest_free,
+		   space.fragmentation);
 
 	count = 0;
+	spin_lock(&proc->inner_lock);
 	list_for_each_entry(w, &proc->todo, entry) {
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION:
@@ -3716,12 +5279,34 @@ static void print_binder_proc_stats(struct seq_file *m,
 			break;
 		}
 	}
+	spin_unlock(&proc->inner_lock);
 	seq_printf(m, "  pending transactions: %d\n", count);
 
 	print_binder_stats(m, "  ", &proc->stats);
 }
 
 
+/*
+ * Returns the dead node after last, with a temporary reference held so
+ * that it stays on the list while it is printed, and drops the reference
+ * on last. Called with no binder locks held.
+ */
+static struct binder_node *binder_next_dead_node(struct binder_node *last)
+{
+	struct binder_node *node;
+	struct hlist_node *pos;
+
+	spin_lock(&binder_dead_nodes_lock);
+	pos = last ? last->dead_node.next : binder_dead_nodes.first;
+	node = pos ? hlist_entry(pos, struct binder_node, dead_node) : NULL;
+	if (node)
+		node->tmp_refs++;
+	spin_unlock(&binder_dead_nodes_lock);
+	if (last)
+		binder_put_node(last);
+	return node;
+}
+
 static int binder_state_show(struct seq_file *m, void *unused)
 {
 	struct binder_proc *proc;
@@ -3729,20 +5314,28 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	struct binder_node *node;
 	int do_lock = !binder_debug_no_lock;
 
-	if (do_lock)
-		mutex_lock(&binder_lock);
-
 	seq_puts(m, "binder state:\n");
 
-	if (!hlist_empty(&binder_dead_nodes))
+	node = binder_next_dead_node(NULL);
+	if (node)
 		seq_puts(m, "dead nodes:\n");
-	hlist_for_each_entry(node, pos, &binder_dead_nodes, dead_node)
+	for (; node; node = binder_next_dead_node(node)) {
+		spin_lock(&node->lock);
 		print_binder_node(m, node);
+		spin_unlock(&node->lock);
+	}
 
-	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
+	if (do_lock)
+		mutex_lock(&binder_procs_lock);
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		if (do_lock)
+			mutex_lock(&proc->lock);
 		print_binder_proc(m, proc, 1);
+		if (do_lock)
+			mutex_unlock(&proc->lock);
+	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_procs_lock);
 	return 0;
 }
 
@@ -3752,17 +5345,26 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 	struct hlist_node *pos;
 	int do_lock = !binder_debug_no_lock;
 
-	if (do_lock)
-		mutex_lock(&binder_lock);
-
 	seq_puts(m, "binder stats:\n");
 
 	print_binder_stats(m, "", &binder_stats);
+	seq_printf(m, "page cache: hits %d misses %d reclaimed %d cached %d\n",
+		   atomic_read(&binder_page_hits),
+		   atomic_read(&binder_page_misses),
+		   atomic_read(&binder_page_reclaimed),
+		   atomic_read(&binder_lru_count));
 
-	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
+	if (do_lock)
+		mutex_lock(&binder_procs_lock);
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		if (do_lock)
+			mutex_lock(&proc->lock);
 		print_binder_proc_stats(m, proc);
+		if (do_lock)
+			mutex_unlock(&proc->lock);
+	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_procs_lock);
 	return 0;
 }
 
@@ -3772,28 +5374,39 @@ static int binder_transactions_show(struct seq_file *m, void *unused)
 	struct hlist_node *pos;
 	int do_lock = !binder_debug_no_lock;
 
-	if (do_lock)
-		mutex_lock(&binder_lock);
-
 	seq_puts(m, "binder transactions:\n");
-	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
+	if (do_lock)
+		mutex_lock(&binder_procs_lock);
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		if (do_lock)
+			mutex_lock(&proc->lock);
 		print_binder_proc(m, proc, 0);
+		if (do_lock)
+			mutex_unlock(&proc->lock);
+	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_procs_lock);
 	return 0;
 }
 
 static int binder_proc_show(struct seq_file *m, void *unused)
 {
+	struct binder_proc *itr;
 	struct binder_proc *proc = m->private;
-	int do_lock = !binder_debug_no_lock;
+	struct hlist_node *pos;
 
-	if (do_lock)
-		mutex_lock(&binder_lock);
 	seq_puts(m, "binder proc state:\n");
-	print_binder_proc(m, proc, 1);
-	if (do_lock)
-		mutex_unlock(&binder_lock);
+	/* The file can outlive proc, so only print it if it is still listed */
+	mutex_lock(&binder_procs_lock);
+	hlist_for_each_entry(itr, pos, &binder_procs, proc_node) {
+		if (itr != proc)
+			continue;
+		mutex_lock(&proc->lock);
+		print_binder_proc(m, proc, 1);
+		mutex_unlock(&proc->lock);
+		break;
+	}
+	mutex_unlock(&binder_procs_lock);
 	return 0;
 }
 
@@ -3811,17 +5424,68 @@ static void print_binder_transaction_log_entry(struct seq_file *m,
 static int binder_transaction_log_show(struct seq_file *m, void *unused)
 {
 	struct binder_transaction_log *log = m->private;
+	unsigned int next = binder_transaction_log_next(log);
 	int i;
 
 	if (log->full) {
-		for (i = log->next; i < ARRAY_SIZE(log->entry); i++)
+		for (i = next; i < ARRAY_SIZE(log->entry); i++)
 			print_binder_transaction_log_entry(m, &log->entry[i]);
 	}
-	for (i = 0; i < log->next; i++)
+	for (i = 0; i < next; i++)
 		print_binder_transaction_log_entry(m, &log->entry[i]);
 	return 0;
 }
 
+static void print_binder_latency(struct seq_file *m, const char *name,
+				 u32 *hist)
+{
+	int i;
+
+	seq_printf(m, "    %s:", name);
+	for (i = 0; i < BINDER_LATENCY_BUCKETS; i++)
+		seq_printf(m, " %u", hist[i]);
+	seq_puts(m, "\n");
+}
+
+static int binder_latency_show(struct seq_file *m, void *unused)
+{
+	struct binder_proc *proc;
+	struct hlist_node *pos;
+	struct rb_node *n;
+	int do_lock = !binder_debug_no_lock;
+
+	seq_printf(m, "binder latency: bucket i counts calls under 2^i us, "
+		   "last bucket open\n");
+	if (do_lock)
+		mutex_lock(&binder_procs_lock);
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		int header = 0;
+
+		if (do_lock)
+			mutex_lock(&proc->lock);
+
+		for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n)) {
+			struct binder_node *node = rb_entry(n,
+						struct binder_node, rb_node);
+
+			if (node->latency == NULL)
+				continue;
+			if (!header)
+				seq_printf(m, "proc %d\n", proc->pid);
+			header = 1;
+			seq_printf(m, "  node %d: u%p c%p\n", node->debug_id,
+				   node->ptr, node->cookie);
+			print_binder_latency(m, "queue", node->latency->queue);
+			print_binder_latency(m, "handle", node->latency->handle);
+		}
+		if (do_lock)
+			mutex_unlock(&proc->lock);
+	}
+	if (do_lock)
+		mutex_unlock(&binder_procs_lock);
+	return 0;
+}
+
 static char *procfs_print_binder_stats(char *buf, char *end, const char *prefix,
 				struct binder_stats *stats)
 {
@@ -3830,10 +5494,11 @@ static char *procfs_print_binder_stats(char *buf, char *end, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->bc) !=
 			ARRAY_SIZE(binder_command_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->bc); i++) {
-		if (stats->bc[i])
+		int temp = atomic_read(&stats->bc[i]);
+
+		if (temp)
 			buf += snprintf(buf, end - buf, "%s%s: %d\n", prefix,
-					binder_command_strings[i],
-					stats->bc[i]);
+					binder_command_strings[i], temp);
 		if (buf >= end)
 			return buf;
 	}
@@ -3841,9 +5506,11 @@ static char *procfs_print_binder_stats(char *buf, char *end, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->br) !=
 			ARRAY_SIZE(binder_return_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->br); i++) {
-		if (stats->br[i])
+		int temp = atomic_read(&stats->br[i]);
+
+		if (temp)
 			buf += snprintf(buf, end - buf, "%s%s: %d\n", prefix,
-					binder_return_strings[i], stats->br[i]);
+					binder_return_strings[i], temp);
 		if (buf >= end)
 			return buf;
 	}
@@ -3853,13 +5520,14 @@ static char *procfs_print_binder_stats(char *buf, char *end, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
 			ARRAY_SIZE(stats->obj_deleted));
 	for (i = 0; i < ARRAY_SIZE(stats->obj_created); i++) {
-		if (stats->obj_created[i] || stats->obj_deleted[i])
+		int created = atomic_read(&stats->obj_created[i]);
+		int deleted = atomic_read(&stats->obj_deleted[i]);
+
+		if (created || deleted)
 			buf += snprintf(buf, end - buf,
 					"%s%s: active %d total %d\n", prefix,
 					binder_objstat_strings[i],
-					stats->obj_created[i] -
-						stats->obj_deleted[i],
-					stats->obj_created[i]);
+					created - deleted, created);
 		if (buf >= end)
 			return buf;
 	}
@@ -3871,6 +5539,7 @@ static char *procfs_print_binder_proc_stats(char *buf, char *end,
 {
 	struct binder_work *w;
 	struct rb_node *n;
+	struct binder_buffer_space space;
 	int count, strong, weak;
 
 	buf += snprintf(buf, end - buf, "proc %d\n", proc->pid);
@@ -3911,13 +5580,25 @@ static char *procfs_print_binder_proc_stats(char *buf, char *end,
 		return buf;
 
 	count = 0;
+	mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		count++;
+	binder_get_buffer_space(proc, &space);
+	mutex_unlock(&proc->alloc_lock);
 	buf += snprintf(buf, end - buf, "  buffers: %d\n", count);
 	if (buf >= end)
 		return buf;
+	buf += snprintf(buf, end - buf, "  buffer space: allocated %zd max %zd, "
+			"free %zd in %d extents, largest %zd, "
+			"fragmentation %d%%\n",
+			proc->allocated_size, proc->allocated_size_max,
+			space.free_size, space.free_extents, space.largest_free,
+			space.fragmentation);
+	if (buf >= end)
+		return buf;
 
 	count = 0;
+	spin_lock(&proc->inner_lock);
 	list_for_each_entry(w, &proc->todo, entry) {
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION:
@@ -3927,6 +5608,7 @@ static char *procfs_print_binder_proc_stats(char *buf, char *end,
 			break;
 		}
 	}
+	spin_unlock(&proc->inner_lock);
 	buf += snprintf(buf, end - buf, "  pending transactions: %d\n", count);
 	if (buf >= end)
 		return buf;
@@ -3951,26 +5633,34 @@ static int procfs_binder_read_proc_state(char *page, char **start, off_t off,
 	if (off)
 		return 0;
 
-	if (do_lock)
-		mutex_lock(&binder_lock);
-
 	buf += snprintf(buf, end - buf, "binder state:\n");
 
-	if (!hlist_empty(&binder_dead_nodes))
+	node = binder_next_dead_node(NULL);
+	if (node)
 		buf += snprintf(buf, end - buf, "dead nodes:\n");
-	hlist_for_each_entry(node, pos, &binder_dead_nodes, dead_node) {
-		if (buf >= end)
+	for (; node; node = binder_next_dead_node(node)) {
+		if (buf >= end) {
+			binder_put_node(node);
 			break;
+		}
+		spin_lock(&node->lock);
 		buf = procfs_print_binder_node(buf, end, node);
+		spin_unlock(&node->lock);
 	}
 
+	if (do_lock)
+		mutex_lock(&binder_procs_lock);
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
 		if (buf >= end)
 			break;
+		if (do_lock)
+			mutex_lock(&proc->lock);
 		buf = procfs_print_binder_proc(buf, end, proc, 1);
+		if (do_lock)
+			mutex_unlock(&proc->lock);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_procs_lock);
 	if (buf > page + PAGE_SIZE)
 		buf = page + PAGE_SIZE;
 
@@ -3997,20 +5687,30 @@ static int procfs_binder_read_proc_stats(char *page, char **start, off_t off,
 	if (off)
 		return 0;
 
-	if (do_lock)
-		mutex_lock(&binder_lock);
-
 	p += snprintf(p, PAGE_SIZE, "binder stats:\n");
 
 	p = procfs_print_binder_stats(p, page + PAGE_SIZE, "", &binder_stats);
+	if (p < page + PAGE_SIZE)
+		p += snprintf(p, page + PAGE_SIZE - p,
+			      "page cache: hits %d misses %d reclaimed %d "
+			      "cached %d\n", atomic_read(&binder_page_hits),
+			      atomic_read(&binder_page_misses),
+			      atomic_read(&binder_page_reclaimed),
+			      atomic_read(&binder_lru_count));
 
+	if (do_lock)
+		mutex_lock(&binder_procs_lock);
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
 		if (p >= page + PAGE_SIZE)
 			break;
+		if (do_lock)
+			mutex_lock(&proc->lock);
 		p = procfs_print_binder_proc_stats(p, page + PAGE_SIZE, proc);
+		if (do_lock)
+			mutex_unlock(&proc->lock);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_procs_lock);
 	if (p > page + PAGE_SIZE)
 		p = page + PAGE_SIZE;
 
@@ -4038,17 +5738,20 @@ static int procfs_binder_read_proc_transactions(char *page, char **start, off_t
 	if (off)
 		return 0;
 
-	if (do_lock)
-		mutex_lock(&binder_lock);
-
 	buf += snprintf(buf, end - buf, "binder transactions:\n");
+	if (do_lock)
+		mutex_lock(&binder_procs_lock);
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
 		if (buf >= end)
 			break;
+		if (do_lock)
+			mutex_lock(&proc->lock);
 		buf = procfs_print_binder_proc(buf, end, proc, 0);
+		if (do_lock)
+			mutex_unlock(&proc->lock);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_procs_lock);
 	if (buf > page + PAGE_SIZE)
 		buf = page + PAGE_SIZE;
 
@@ -4066,20 +5769,27 @@ static int procfs_binder_read_proc_transactions(char *page, char **start, off_t
 static int procfs_binder_read_proc_proc(char *page, char **start, off_t off,
 				 int count, int *eof, void *data)
 {
+	struct binder_proc *itr;
 	struct binder_proc *proc = data;
+	struct hlist_node *pos;
 	int len = 0;
 	char *p = page;
-	int do_lock = !binder_debug_no_lock;
 
 	if (off)
 		return 0;
 
-	if (do_lock)
-		mutex_lock(&binder_lock);
 	p += snprintf(p, PAGE_SIZE, "binder proc state:\n");
-	p = procfs_print_binder_proc(p, page + PAGE_SIZE, proc, 1);
-	if (do_lock)
-		mutex_unlock(&binder_lock);
+	/* See binder_proc_show() */
+	mutex_lock(&binder_procs_lock);
+	hlist_for_each_entry(itr, pos, &binder_procs, proc_node) {
+		if (itr != proc)
+			continue;
+		mutex_lock(&proc->lock);
+		p = procfs_print_binder_proc(p, page + PAGE_SIZE, proc, 1);
+		mutex_unlock(&proc->lock);
+		break;
+	}
+	mutex_unlock(&binder_procs_lock);
 
 	if (p > page + PAGE_SIZE)
 		p = page + PAGE_SIZE;
@@ -4111,6 +5821,7 @@ static int procfs_binder_read_proc_transaction_log(
 	char *page, char **start, off_t off, int count, int *eof, void *data)
 {
 	struct binder_transaction_log *log = data;
+	unsigned int next = binder_transaction_log_next(log);
 	int len = 0;
 	int i;
 	char *buf = page;
@@ -4120,14 +5831,14 @@ static int procfs_binder_read_proc_transaction_log(
 		return 0;
 
 	if (log->full) {
-		for (i = log->next; i < ARRAY_SIZE(log->entry); i++) {
+		for (i = next; i < ARRAY_SIZE(log->entry); i++) {
 			if (buf >= end)
 				break;
 			buf = procfs_print_binder_transaction_log_entry(buf, end,
 								&log->entry[i]);
 		}
 	}
-	for (i = 0; i < log->next; i++) {
+	for (i = 0; i < next; i++) {
 		if (buf >= end)
 			break;
 		buf = procfs_print_binder_transaction_log_entry(buf, end,
@@ -4165,6 +5876,7 @@ BINDER_DEBUG_ENTRY(state);
 BINDER_DEBUG_ENTRY(stats);
 BINDER_DEBUG_ENTRY(transactions);
 BINDER_DEBUG_ENTRY(transaction_log);
+BINDER_DEBUG_ENTRY(latency);
 
 static int __init binder_init(void)
 {
@@ -4175,13 +5887,17 @@ static int __init binder_init(void)
 		return -ENOMEM;
 
 	binder_debugfs_dir_entry_root = debugfs_create_dir("binder", NULL);
-	if (binder_debugfs_dir_entry_root)
+	if (binder_debugfs_dir_entry_root) {
 		binder_debugfs_dir_entry_proc = debugfs_create_dir("proc",
 						 binder_debugfs_dir_entry_root);
+		binder_debugfs_dir_entry_counters = debugfs_create_dir(
+			"counters", binder_debugfs_dir_entry_root);
+	}
 	binder_proc_dir_entry_root = proc_mkdir("binder", NULL);
 	if (binder_proc_dir_entry_root)
 		binder_proc_dir_entry_proc = proc_mkdir("proc",
 						binder_proc_dir_entry_root);
+	register_shrinker(&binder_shrinker);
 	ret = misc_register(&binder_miscdev);
 	if (binder_debugfs_dir_entry_root) {
 		debugfs_create_file("state",
@@ -4209,6 +5925,11 @@ static int __init binder_init(void)
 				    binder_debugfs_dir_entry_root,
 				    &binder_transaction_log_failed,
 				    &binder_transaction_log_fops);
+		debugfs_create_file("latency",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_latency_fops);
 	}
 
 	if (binder_proc_dir_entry_root) {
@@ -4243,4 +5964,7 @@ static int __init binder_init(void)
 
 device_initcall(binder_init);
 
+#define CREATE_TRACE_POINTS
+#include "binder_trace.h"
+
 MODULE_LICENSE("GPL v2");
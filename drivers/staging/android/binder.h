@@ -21,6 +21,7 @@
 #define _LINUX_BINDER_H
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 #define B_PACK_CHARS(c1, c2, c3, c4) \
 	((((c1)<<24)) | (((c2)<<16)) | (((c3)<<8)) | (c4))
@@ -32,11 +33,15 @@ enum {
 	BINDER_TYPE_HANDLE	= B_PACK_CHARS('s', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_WEAK_HANDLE	= B_PACK_CHARS('w', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_FD		= B_PACK_CHARS('f', 'd', '*', B_TYPE_LARGE),
+	BINDER_TYPE_PTR		= B_PACK_CHARS('p', 't', '*', B_TYPE_LARGE),
+	BINDER_TYPE_FDA		= B_PACK_CHARS('f', 'd', 'a', B_TYPE_LARGE),
 };
 
 enum {
 	FLAT_BINDER_FLAG_PRIORITY_MASK = 0xff,
 	FLAT_BINDER_FLAG_ACCEPTS_FDS = 0x100,
+	/* Calls from real-time threads run at the caller's RT priority */
+	FLAT_BINDER_FLAG_INHERIT_RT = 0x800,
 };
 
 /*
@@ -61,6 +66,38 @@ struct flat_binder_object {
 	void			*cookie;
 };
 
+/*
+ * A BINDER_TYPE_PTR object describes a separate user buffer that the
+ * driver copies straight into the target's buffer, after the data and
+ * offsets, and rewrites 'buffer' to point at the copy. If the object has
+ * a parent, the pointer at 'parent_offset' in the parent buffer (the
+ * parent'th entry of the offsets array) is rewritten as well.
+ */
+struct binder_buffer_object {
+	unsigned long		type;
+	unsigned long		flags;
+	void			*buffer;
+	size_t			length;
+	size_t			parent;
+	size_t			parent_offset;
+};
+
+enum {
+	BINDER_BUFFER_FLAG_HAS_PARENT = 0x01,
+};
+
+/*
+ * A BINDER_TYPE_FDA object describes 'num_fds' 32-bit file descriptors
+ * at 'parent_offset' in the buffer of the BINDER_TYPE_PTR object at
+ * offsets index 'parent'. Each is translated in place for the target.
+ */
+struct binder_fd_array_object {
+	unsigned long		type;
+	unsigned long		num_fds;
+	size_t			parent;
+	size_t			parent_offset;
+};
+
 /*
  * On 64-bit platforms where user code may run in 32-bits the driver must
  * translate the buffer (and local binder) addresses apropriately.
@@ -147,6 +184,15 @@ struct binder_transaction_data {
 	} data;
 };
 
+/*
+ * For BC_TRANSACTION_SG and BC_REPLY_SG: 'buffers_size' is the total
+ * size of the BINDER_TYPE_PTR buffers, each rounded up to sizeof(void *).
+ */
+struct binder_transaction_data_sg {
+	struct binder_transaction_data	transaction_data;
+	size_t				buffers_size;
+};
+
 struct binder_ptr_cookie {
 	void *ptr;
 	void *cookie;
@@ -324,6 +370,32 @@ enum BinderDriverCommandProtocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 17, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 18, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: the sent command, which may
+	 * carry BINDER_TYPE_PTR and BINDER_TYPE_FDA objects.
+	 */
+};
+
+/*
+ * Read from the binary debugfs file binder/counters/<pid>. The br and bc
+ * arrays count the return and command codes by _IOC_NR().
+ */
+#define BINDER_COUNTERS_VERSION		2
+#define BINDER_COUNTERS_BR		(_IOC_NR(BR_FAILED_REPLY) + 1)
+#define BINDER_COUNTERS_BC		(_IOC_NR(BC_REPLY_SG) + 1)
+
+struct binder_proc_counters {
+	__u32	version;
+	__s32	pid;
+	__u32	ready_threads;
+	__u32	requested_threads;
+	__u32	buffer_allocated;	/* bytes */
+	__u32	buffer_allocated_max;
+	__u32	br[BINDER_COUNTERS_BR];
+	__u32	bc[BINDER_COUNTERS_BC];
 };
 
 #endif /* _LINUX_BINDER_H */
@@ -0,0 +1,181 @@
+/* drivers/staging/android/binder_trace.h
+ *
+ * Copyright (C) 2012 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#if !defined(_BINDER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BINDER_TRACE_H
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE binder_trace
+
+#include <linux/tracepoint.h>
+
+struct binder_buffer;
+struct binder_node;
+struct binder_proc;
+struct binder_thread;
+struct binder_transaction;
+
+DECLARE_EVENT_CLASS(binder_transaction_class,
+
+	TP_PROTO(struct binder_transaction *t, struct binder_node *target_node),
+
+	TP_ARGS(t, target_node),
+
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, target_node)
+		__field(int, from_proc)
+		__field(int, from_thread)
+		__field(int, to_proc)
+		__field(int, to_thread)
+		__field(unsigned int, code)
+		__field(unsigned int, flags)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->target_node = target_node ? target_node->debug_id : 0;
+		__entry->from_proc = t->from ? t->from->proc->pid : 0;
+		__entry->from_thread = t->from ? t->from->pid : 0;
+		__entry->to_proc = t->to_proc ? t->to_proc->pid : 0;
+		__entry->to_thread = t->to_thread ? t->to_thread->pid : 0;
+		__entry->code = t->code;
+		__entry->flags = t->flags;
+	),
+
+	TP_printk("transaction=%d from %d:%d to %d:%d dest_node=%d "
+		  "code=0x%x flags=0x%x",
+		  __entry->debug_id, __entry->from_proc, __entry->from_thread,
+		  __entry->to_proc, __entry->to_thread, __entry->target_node,
+		  __entry->code, __entry->flags)
+);
+
+DEFINE_EVENT(binder_transaction_class, binder_transaction,
+	TP_PROTO(struct binder_transaction *t, struct binder_node *target_node),
+	TP_ARGS(t, target_node));
+
+DEFINE_EVENT(binder_transaction_class, binder_reply,
+	TP_PROTO(struct binder_transaction *t, struct binder_node *target_node),
+	TP_ARGS(t, target_node));
+
+TRACE_EVENT(binder_transaction_received,
+
+	TP_PROTO(struct binder_transaction *t, struct binder_thread *thread),
+
+	TP_ARGS(t, thread),
+
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, proc)
+		__field(int, thread)
+		__field(int, reply)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->proc = thread->proc->pid;
+		__entry->thread = thread->pid;
+		__entry->reply = t->buffer->target_node == NULL;
+	),
+
+	TP_printk("transaction=%d by %d:%d reply=%d",
+		  __entry->debug_id, __entry->proc, __entry->thread,
+		  __entry->reply)
+);
+
+DECLARE_EVENT_CLASS(binder_buffer_class,
+
+	TP_PROTO(struct binder_proc *proc, struct binder_buffer *buf),
+
+	TP_ARGS(proc, buf),
+
+	TP_STRUCT__entry(
+		__field(int, proc)
+		__field(int, debug_id)
+		__field(size_t, data_size)
+		__field(size_t, offsets_size)
+		__field(size_t, size)
+	),
+
+	TP_fast_assign(
+		__entry->proc = proc->pid;
+		__entry->debug_id = buf->debug_id;
+		__entry->data_size = buf->data_size;
+		__entry->offsets_size = buf->offsets_size;
+		__entry->size = buf->size;
+	),
+
+	TP_printk("proc=%d transaction=%d data_size=%zd offsets_size=%zd "
+		  "size=%zd",
+		  __entry->proc, __entry->debug_id, __entry->data_size,
+		  __entry->offsets_size, __entry->size)
+);
+
+DEFINE_EVENT(binder_buffer_class, binder_alloc_buf,
+	TP_PROTO(struct binder_proc *proc, struct binder_buffer *buf),
+	TP_ARGS(proc, buf));
+
+DEFINE_EVENT(binder_buffer_class, binder_free_buf,
+	TP_PROTO(struct binder_proc *proc, struct binder_buffer *buf),
+	TP_ARGS(proc, buf));
+
+TRACE_EVENT(binder_wait_for_work,
+
+	TP_PROTO(struct binder_thread *thread, bool proc_work),
+
+	TP_ARGS(thread, proc_work),
+
+	TP_STRUCT__entry(
+		__field(int, proc)
+		__field(int, thread)
+		__field(bool, proc_work)
+	),
+
+	TP_fast_assign(
+		__entry->proc = thread->proc->pid;
+		__entry->thread = thread->pid;
+		__entry->proc_work = proc_work;
+	),
+
+	TP_printk("%d:%d proc_work=%d",
+		  __entry->proc, __entry->thread, __entry->proc_work)
+);
+
+TRACE_EVENT(binder_wakeup,
+
+	TP_PROTO(struct binder_proc *proc, struct binder_thread *thread),
+
+	TP_ARGS(proc, thread),
+
+	TP_STRUCT__entry(
+		__field(int, proc)
+		__field(int, thread)
+	),
+
+	TP_fast_assign(
+		__entry->proc = proc->pid;
+		__entry->thread = thread ? thread->pid : 0;
+	),
+
+	TP_printk("%d:%d", __entry->proc, __entry->thread)
+);
+
+#endif /* _BINDER_TRACE_H */
+
+#include <trace/define_trace.h>
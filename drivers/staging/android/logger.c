@@ -25,43 +25,81 @@
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/pagemap.h>
+#include <linux/mm.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
+#include <asm/io.h>
 
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * There is no lock. Positions in the log are byte counts since creation (so
+ * they only ever grow); the buffer offset is position modulo size. A write
+ * goes through three steps:
+ *
+ * 	1) reserve [start, end) by bumping 'reserved'
+ * 	2) in reservation order, move 'head' past anything the new entry is
+ * 	   about to overwrite, then pass 'fixed' on to the next writer
+ * 	3) copy the entry in, in parallel with other writers, and then, in
+ * 	   reservation order again, publish it by moving 'committed' to 'end'
+ *
+ * Writers run with preemption disabled from 1) to 3), so waiting for the
+ * writers ahead of us takes no longer than they need to copy an entry.
+ * Readers consume [r_pos, committed) and afterwards check against 'reserved'
+ * that what they read was not overwritten in the meantime.
+ *
+ * The positions live in their own page, which readers can mmap() together
+ * with the buffer; see struct logger_mmap_ctl.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
+	struct logger_ctl	*ctl;	/* positions in the log */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
-	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
 };
 
+/*
+ * struct logger_ctl - positions in a log, laid out as struct logger_mmap_ctl
+ */
+struct logger_ctl {
+	atomic_long_t		reserved; /* end of the last reserved entry */
+	atomic_long_t		fixed;	/* 'head' is fixed up up to here */
+	atomic_long_t		committed; /* readable up to here */
+	unsigned long		head;	/* new readers start here */
+};
+
+/* A logger_ctl padded to a page of its own, so it can be mapped */
+union logger_ctl_page {
+	struct logger_ctl	ctl;
+	unsigned char		page[PAGE_SIZE];
+};
+
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by reader->mutex, which
+ * only serializes users of the same file.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
-	struct list_head	list;	/* entry in logger_log's list */
-	size_t			r_off;	/* current read head offset */
+	struct mutex		mutex;	/* mutex protecting the below */
+	unsigned long		r_pos;	/* current read head position */
+	int			batch;	/* read() returns all entries that fit */
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
+/* logger_before - does position 'a' come before position 'b'? */
+#define logger_before(a, b)	((long)((a) - (b)) < 0)
+
 /*
  * file_get_log - Given a file structure, return the associated log
  *
@@ -89,7 +127,7 @@ static inline struct logger_log *file_get_log(struct file *file)
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * The result can only be trusted if the entry is intact, see logger_intact().
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
@@ -107,17 +145,95 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 	return sizeof(struct logger_entry) + val;
 }
 
+/*
+ * logger_intact - has nothing from position 'pos' on been handed out to a
+ * writer since it was last written? Call after reading the data in question.
+ */
+static inline int logger_intact(struct logger_log *log, unsigned long pos)
+{
+	smp_rmb();
+	return !logger_before(pos, atomic_long_read(&log->ctl->reserved) - log->size);
+}
+
+/*
+ * fix_up_reader - pull a reader lapped by the writers forward to the head.
+ *
+ * Caller must hold reader->mutex.
+ */
+static void fix_up_reader(struct logger_log *log, struct logger_reader *reader)
+{
+	unsigned long head = ACCESS_ONCE(log->ctl->head);
+
+	if (logger_before(reader->r_pos, head))
+		reader->r_pos = head;
+}
+
+/*
+ * get_next_entry_len - returns the length of the entry at the reader's
+ * position, or 0 if there is none. Lapped readers are moved forward first.
+ *
+ * Caller must hold reader->mutex.
+ */
+static __u32 get_next_entry_len(struct logger_log *log,
+				struct logger_reader *reader)
+{
+	__u32 len;
+
+	for (;;) {
+		fix_up_reader(log, reader);
+		if (reader->r_pos == atomic_long_read(&log->ctl->committed))
+			return 0;
+		smp_rmb();
+
+		len = get_entry_len(log, logger_offset(reader->r_pos));
+		if (logger_intact(log, reader->r_pos))
+			return len;
+
+		/* lapped; the head is about to move past us */
+		cpu_relax();
+	}
+}
+
+/*
+ * get_batch_len - returns the length of the run of whole entries at the
+ * reader's position that fits into 'count' bytes. 'len' is the length of
+ * the first entry.
+ *
+ * Like get_entry_len(), the result is only good if the run is found to be
+ * intact after it was read.
+ */
+static size_t get_batch_len(struct logger_log *log,
+			    struct logger_reader *reader,
+			    size_t len, size_t count)
+{
+	unsigned long committed = atomic_long_read(&log->ctl->committed);
+	unsigned long pos = reader->r_pos + len;
+	size_t total = len;
+
+	smp_rmb();
+	while (logger_before(pos, committed)) {
+		len = get_entry_len(log, logger_offset(pos));
+		if (total + len > count)
+			break;
+		total += len;
+		pos += len;
+	}
+
+	return total;
+}
+
 /*
  * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
  * user-space buffer 'buf'. Returns 'count' on success.
  *
- * Caller must hold log->mutex.
+ * Caller must hold reader->mutex.
  */
 static ssize_t do_read_log_to_user(struct logger_log *log,
 				   struct logger_reader *reader,
 				   char __user *buf,
 				   size_t count)
 {
+	size_t off = logger_offset(reader->r_pos);
 	size_t len;
 
 	/*
@@ -125,8 +241,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the current read head offset up to 'count' bytes or to the end of
 	 * the log, whichever comes first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	len = min(count, log->size - off);
+	if (copy_to_user(buf, log->buffer + off, len))
 		return -EFAULT;
 
 	/*
@@ -137,8 +253,6 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off + count);
-
 	return count;
 }
 
@@ -149,7 +263,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
  *
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * 	- Atomically reads exactly one log entry, or after LOGGER_SET_BATCH_READ
+ * 	  as many whole entries as fit into the buffer
  *
  * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
@@ -162,14 +277,13 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
-start:
+	mutex_lock(&reader->mutex);
+
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
-		if (!ret)
+		ret = get_next_entry_len(log, reader);
+		if (ret)
 			break;
 
 		if (file->f_flags & O_NONBLOCK) {
@@ -182,136 +296,181 @@ start:
 			break;
 		}
 
+		mutex_unlock(&reader->mutex);
 		schedule();
+		mutex_lock(&reader->mutex);
 	}
 
 	finish_wait(&log->wq, &wait);
-	if (ret)
-		return ret;
+	if (ret < 0)
+		goto out;
 
-	mutex_lock(&log->mutex);
+	while (1) {
+		if (count < ret) {
+			ret = -EINVAL;
+			goto out;
+		}
 
-	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
-		goto start;
-	}
+		if (reader->batch)
+			ret = get_batch_len(log, reader, ret, count);
 
-	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
+		/* get the entries from the log */
+		ret = do_read_log_to_user(log, reader, buf, ret);
+		if (ret < 0)
+			goto out;
+
+		/* did a writer overwrite it while we were copying it out? */
+		if (logger_intact(log, reader->r_pos))
+			break;
+
+		ret = get_next_entry_len(log, reader);
 	}
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	reader->r_pos += ret;
 
 out:
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
- *
- * Caller must hold log->mutex.
+ * move_head - advance log->head to 'pos', unless it already is further on.
+ * Both writers and LOGGER_FLUSH_LOG move it.
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static void move_head(struct logger_log *log, unsigned long pos)
 {
-	size_t count = 0;
+	unsigned long head = ACCESS_ONCE(log->ctl->head);
 
-	do {
-		size_t nr = get_entry_len(log, off);
-		off = logger_offset(off + nr);
-		count += nr;
-	} while (count < len);
+	while (logger_before(head, pos)) {
+		unsigned long old = cmpxchg(&log->ctl->head, head, pos);
 
-	return off;
+		if (old == head)
+			break;
+		head = old;
+	}
 }
 
 /*
- * clock_interval - is a < c < b in mod-space? Put another way, does the line
- * from a to b cross c?
+ * get_next_entry - return the position of the first entry at or after 'pos',
+ * walking forward from entry 'off'.
+ *
+ * Every entry walked over must be committed and not yet reserved again.
  */
-static inline int clock_interval(size_t a, size_t b, size_t c)
+static unsigned long get_next_entry(struct logger_log *log, unsigned long off,
+				    unsigned long pos)
 {
-	if (b < a) {
-		if (a < c || b >= c)
-			return 1;
-	} else {
-		if (a < c && b >= c)
-			return 1;
-	}
+	while (logger_before(off, pos))
+		off += get_entry_len(log, logger_offset(off));
 
-	return 0;
+	return off;
 }
 
 /*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
+ * fix_up_head - move the "start head" to the first entry that the write of
+ * [start, end) leaves intact. Readers fix themselves up when they find they
+ * were lapped, so there is nothing else to walk.
  *
- * The caller needs to hold log->mutex.
+ * Runs in reservation order, with preemption disabled.
  */
-static void fix_up_readers(struct logger_log *log, size_t len)
+static void fix_up_head(struct logger_log *log, unsigned long start,
+			unsigned long end)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
-	struct logger_reader *reader;
+	unsigned long limit = end - log->size;
+
+	/* wait for the writers ahead of us to fix up the head */
+	while (atomic_long_read(&log->ctl->fixed) != start)
+		cpu_relax();
+
+	/* the entries we step over must have been written completely */
+	while (logger_before(atomic_long_read(&log->ctl->committed), limit))
+		cpu_relax();
+	smp_rmb();
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	move_head(log, get_next_entry(log, ACCESS_ONCE(log->ctl->head), limit));
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	smp_mb();
+	atomic_long_set(&log->ctl->fixed, end);
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * commit_entry - make [start, end) visible to readers once all entries
+ * before it are.
  *
- * The caller needs to hold log->mutex.
+ * Runs with preemption disabled.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void commit_entry(struct logger_log *log, unsigned long start,
+			 unsigned long end)
 {
+	while (atomic_long_read(&log->ctl->committed) != start)
+		cpu_relax();
+
+	smp_wmb();
+	atomic_long_set(&log->ctl->committed, end);
+}
+
+/*
+ * do_write_log - writes 'count' bytes from 'buf' to 'log' at position 'pos'
+ */
+static void do_write_log(struct logger_log *log, unsigned long pos,
+			 const void *buf, size_t count)
+{
+	size_t off = logger_offset(pos);
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
+}
+
+/*
+ * do_zero_log - zeroes 'count' bytes of 'log' at position 'pos'
+ */
+static void do_zero_log(struct logger_log *log, unsigned long pos,
+			size_t count)
+{
+	size_t off = logger_offset(pos);
+	size_t len;
 
-	log->w_off = logger_offset(log->w_off + count);
+	len = min(count, log->size - off);
+	memset(log->buffer + off, 0, len);
 
+	if (count != len)
+		memset(log->buffer, 0, count - len);
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * do_write_log_user - writes 'count' bytes from the user-space buffer 'buf'
+ * to the log 'log' at position 'pos'
  *
- * The caller needs to hold log->mutex.
+ * Runs with page faults disabled; the caller faulted the buffer in before.
+ * Should it have gone away again, the rest of the payload is zeroed.
  *
  * Returns 'count' on success, negative error code on failure.
  */
 static ssize_t do_write_log_from_user(struct logger_log *log,
+				      unsigned long pos,
 				      const void __user *buf, size_t count)
 {
-	size_t len;
+	size_t off = logger_offset(pos);
+	size_t len, left = 0;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	len = min(count, log->size - off);
+	if (len)
+		left = __copy_from_user_inatomic(log->buffer + off, buf, len);
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			return -EFAULT;
+	if (!left && count != len)
+		left = __copy_from_user_inatomic(log->buffer, buf + len,
+						 count - len);
 
-	log->w_off = logger_offset(log->w_off + count);
+	if (unlikely(left)) {
+		size_t done = count - left;
+
+		do_zero_log(log, pos + done, left);
+		return -EFAULT;
+	}
 
 	return count;
 }
@@ -325,9 +484,10 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
+	unsigned long start, end, pos;
+	unsigned long seg;
 	ssize_t ret = 0;
 
 	now = current_kernel_time();
@@ -342,19 +502,32 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
 	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
+	 * The payload is copied in with preemption disabled, so fault it in
+	 * now. This is also the last point at which we can fail cleanly.
 	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+	for (seg = 0; seg < nr_segs && ret < header.len; seg++) {
+		size_t len = min_t(size_t, iov[seg].iov_len, header.len - ret);
+
+		if (!access_ok(VERIFY_READ, iov[seg].iov_base, len) ||
+		    fault_in_pages_readable(iov[seg].iov_base, len))
+			return -EFAULT;
+		ret += len;
+	}
+
+	preempt_disable();
+
+	end = atomic_long_add_return(sizeof(struct logger_entry) + header.len,
+				     &log->ctl->reserved);
+	start = end - sizeof(struct logger_entry) - header.len;
 
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	fix_up_head(log, start, end);
 
-	while (nr_segs-- > 0) {
+	do_write_log(log, start, &header, sizeof(struct logger_entry));
+	pos = start + sizeof(struct logger_entry);
+
+	pagefault_disable();
+	for (ret = 0; nr_segs-- > 0 && ret < header.len; iov++) {
 		size_t len;
 		ssize_t nr;
 
@@ -362,18 +535,22 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		len = min_t(size_t, iov->iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		nr = do_write_log_from_user(log, pos, iov->iov_base, len);
 		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+			/* the entry is already reserved, so finish it */
+			do_zero_log(log, pos + len, header.len - ret - len);
+			ret = nr;
+			break;
 		}
 
-		iov++;
+		pos += nr;
 		ret += nr;
 	}
+	pagefault_enable();
 
-	mutex_unlock(&log->mutex);
+	commit_entry(log, start, end);
+
+	preempt_enable();
 
 	/* wake up any blocked readers */
 	wake_up_interruptible(&log->wq);
@@ -383,6 +560,38 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 
 static struct logger_log *get_log_from_minor(int);
 
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps the log read-only: the page of positions first, the ring buffer
+ * right after it. Only the whole thing can be mapped.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_log *log = file_get_log(file);
+	unsigned long start = vma->vm_start;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+
+	if (vma->vm_pgoff || vma->vm_end - start != PAGE_SIZE + log->size)
+		return -EINVAL;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	ret = remap_pfn_range(vma, start, virt_to_phys(log->ctl) >> PAGE_SHIFT,
+			      PAGE_SIZE, vma->vm_page_prot);
+	if (ret)
+		return ret;
+
+	return remap_pfn_range(vma, start + PAGE_SIZE,
+			       virt_to_phys(log->buffer) >> PAGE_SHIFT,
+			       log->size, vma->vm_page_prot);
+}
+
 /*
  * logger_open - the log's open() file operation
  *
@@ -409,12 +618,9 @@ static int logger_open(struct inode *inode, struct file *file)
 			return -ENOMEM;
 
 		reader->log = log;
-		INIT_LIST_HEAD(&reader->list);
-
-		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
-		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		mutex_init(&reader->mutex);
+		reader->r_pos = ACCESS_ONCE(log->ctl->head);
+		reader->batch = 0;
 
 		file->private_data = reader;
 	} else
@@ -432,10 +638,6 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
-		struct logger_log *log = reader->log;
-		mutex_lock(&log->mutex);
-		list_del(&reader->list);
-		mutex_unlock(&log->mutex);
 		kfree(reader);
 	}
 
@@ -465,10 +667,8 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	if (atomic_long_read(&log->ctl->committed) != ACCESS_ONCE(reader->r_pos))
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
 
 	return ret;
 }
@@ -479,8 +679,6 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	struct logger_reader *reader;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
-
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
 		ret = log->size;
@@ -491,10 +689,10 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		mutex_lock(&reader->mutex);
+		fix_up_reader(log, reader);
+		ret = atomic_long_read(&log->ctl->committed) - reader->r_pos;
+		mutex_unlock(&reader->mutex);
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -502,25 +700,32 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
-			ret = get_entry_len(log, reader->r_off);
-		else
-			ret = 0;
+		mutex_lock(&reader->mutex);
+		ret = get_next_entry_len(log, reader);
+		mutex_unlock(&reader->mutex);
+		break;
+	case LOGGER_SET_BATCH_READ:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		mutex_lock(&reader->mutex);
+		reader->batch = !!arg;
+		mutex_unlock(&reader->mutex);
+		ret = 0;
 		break;
 	case LOGGER_FLUSH_LOG:
 		if (!(file->f_mode & FMODE_WRITE)) {
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+		/* readers find themselves behind the head and catch up */
+		move_head(log, atomic_long_read(&log->ctl->committed));
 		ret = 0;
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
-
 	return ret;
 }
 
@@ -529,6 +734,7 @@ static const struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -537,13 +743,15 @@ static const struct file_operations logger_fops = {
 
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN and PAGE_SIZE,
+ * and less than LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+static unsigned char _buf_ ## VAR[SIZE] __aligned(PAGE_SIZE); \
+static union logger_ctl_page _ctl_ ## VAR __aligned(PAGE_SIZE); \
 static struct logger_log VAR = { \
 	.buffer = _buf_ ## VAR, \
+	.ctl = &_ctl_ ## VAR.ctl, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -551,10 +759,6 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
-	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
-	.w_off = 0, \
-	.head = 0, \
 	.size = SIZE, \
 };
 
@@ -597,6 +801,13 @@ static int __init logger_init(void)
 {
 	int ret;
 
+	BUILD_BUG_ON(offsetof(struct logger_ctl, reserved) !=
+		     offsetof(struct logger_mmap_ctl, reserved));
+	BUILD_BUG_ON(offsetof(struct logger_ctl, committed) !=
+		     offsetof(struct logger_mmap_ctl, committed));
+	BUILD_BUG_ON(offsetof(struct logger_ctl, head) !=
+		     offsetof(struct logger_mmap_ctl, head));
+
 	ret = init_log(&log_main);
 	if (unlikely(ret))
 		goto out;
@@ -45,6 +45,26 @@ struct logger_entry {
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_SET_BATCH_READ		_IO(__LOGGERIO, 5) /* read() many */
+
+/*
+ * A log opened for reading can be mapped read-only: a page holding this
+ * structure first, followed by the ring buffer (LOGGER_GET_LOG_BUF_SIZE
+ * bytes) at the next page. Positions count bytes since the log was
+ * created; an entry at position 'pos' is at offset 'pos & (size - 1)' in
+ * the buffer, and may wrap around its end.
+ *
+ * To drain the log, start at 'head' and read entries up to 'committed'.
+ * After copying an entry out, check that 'pos >= reserved - size' (as a
+ * signed difference); if it is not, writers have lapped the reader and
+ * it continues at 'head'.
+ */
+struct logger_mmap_ctl {
+	unsigned long	reserved;	/* writers have claimed up to here */
+	unsigned long	__fixed;	/* private to writers */
+	unsigned long	committed;	/* whole entries up to here */
+	unsigned long	head;		/* oldest entry not overwritten */
+};
 
 #endif /* _LINUX_LOGGER_H */
 
@@ -16,6 +16,17 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Processes are kept on one list per oom_adj value, together with a cached
+ * rss, so picking a victim only looks at the highest populated bucket that
+ * may be killed instead of walking every process in the system.
+ *
+ * With pressure_mode set, the driver also acts on how well page reclaim is
+ * doing, as reported by vmpressure. Once the share of scanned pages that
+ * could not be reclaimed reaches pressure_notify percent, readers of
+ * /dev/lowmemorykiller are woken up with the pressure value. At
+ * pressure_kill percent, tasks with an oom_adj of at least pressure_min_adj
+ * are killed in one go until pressure_kill_target pages are freed.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -34,10 +45,20 @@
 #include <linux/mm.h>
 #include <linux/oom.h>
 #include <linux/sched.h>
+#include <linux/spinlock.h>
 #include <linux/notifier.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/vmpressure.h>
 
 #define DEBUG_LEVEL_DEATHPENDING 6
 
+#define LOWMEM_NR_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+#define LOWMEM_SELECT_TRIES	4
+#define LOWMEM_KILL_BATCH	8
+
 static uint32_t lowmem_debug_level = 1;
 static int lowmem_adj[6] = {
 	0,
@@ -68,6 +89,20 @@ static struct task_struct *lowmem_deathpending;
 static unsigned long lowmem_deathpending_timeout;
 static uint32_t lowmem_check_filepages = 0;
 
+static uint32_t lowmem_pressure_mode;
+static uint32_t lowmem_pressure_notify = 60;
+static uint32_t lowmem_pressure_kill = 95;
+static int lowmem_pressure_min_adj = 12;
+static uint32_t lowmem_pressure_kill_target = 4 * 1024;	/* 16MB */
+
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_event_wait);
+static atomic_t lowmem_event_seq = ATOMIC_INIT(0);
+static unsigned long lowmem_event_pressure;
+
+/* Thread group leaders, by oom_adj; protected by lowmem_bucket_lock */
+static struct list_head lowmem_buckets[LOWMEM_NR_BUCKETS];
+static DEFINE_SPINLOCK(lowmem_bucket_lock);
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level)) {	\
@@ -87,6 +122,17 @@ static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 {
 	struct task_struct *task = data;
+	unsigned long flags;
+
+	/*
+	 * Only holders of a reference add tasks to a bucket, so nobody can
+	 * be racing with us to do so now.
+	 */
+	if (!list_empty(&task->lowmem_node)) {
+		spin_lock_irqsave(&lowmem_bucket_lock, flags);
+		list_del_init(&task->lowmem_node);
+		spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+	}
 
 	if (task == lowmem_deathpending) {
 		lowmem_deathpending = NULL;
@@ -97,6 +143,123 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 	return NOTIFY_OK;
 }
 
+static unsigned long lowmem_task_rss(struct task_struct *task)
+{
+	unsigned long rss = 0;
+
+	task_lock(task);
+	if (task->mm)
+		rss = get_mm_rss(task->mm);
+	task_unlock(task);
+
+	return rss;
+}
+
+/*
+ * (Re)file thread group leader @task under its current oom_adj. Called
+ * at fork, when oom_adj is written, and for existing tasks at init.
+ */
+static void lowmem_bucket_task(struct task_struct *task)
+{
+	unsigned long rss = lowmem_task_rss(task);
+	unsigned long flags;
+	int oom_adj;
+
+	spin_lock_irqsave(&lowmem_bucket_lock, flags);
+	/*
+	 * Read oom_adj under our lock: if several updates race, the one
+	 * that gets here last is guaranteed to see the final value.
+	 */
+	oom_adj = task->signal->oom_adj;
+	task->lowmem_rss = rss;
+	list_move_tail(&task->lowmem_node,
+		       &lowmem_buckets[oom_adj - OOM_DISABLE]);
+	spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+}
+
+static int
+oom_adj_notify_func(struct notifier_block *self, unsigned long val,
+		    void *data)
+{
+	lowmem_bucket_task(data);
+	return NOTIFY_OK;
+}
+
+static struct notifier_block oom_adj_nb = {
+	.notifier_call	= oom_adj_notify_func,
+};
+
+/*
+ * Pick the largest task, by cached rss, from the highest populated bucket
+ * at or above min_adj. The cache is refreshed for the task picked; if it
+ * turns out to have shrunk a lot (or exited) we look again. Returns the
+ * task with a reference held.
+ */
+static struct task_struct *lowmem_select(int min_adj, int *oom_adj,
+					 int *tasksize)
+{
+	struct task_struct *p, *selected;
+	unsigned long selected_rss, rss, flags;
+	int tries, adj;
+
+	for (tries = 0; tries < LOWMEM_SELECT_TRIES; tries++) {
+		selected = NULL;
+		selected_rss = 0;
+
+		spin_lock_irqsave(&lowmem_bucket_lock, flags);
+		for (adj = OOM_ADJUST_MAX; adj >= min_adj; adj--) {
+			list_for_each_entry(p, &lowmem_buckets[adj - OOM_DISABLE],
+					    lowmem_node) {
+				if (p->lowmem_rss > selected_rss) {
+					selected = p;
+					selected_rss = p->lowmem_rss;
+				}
+			}
+			if (selected)
+				break;
+		}
+		/*
+		 * A task stays on its bucket until the task_free notifier,
+		 * which runs after the last reference is gone. Don't take
+		 * one on a task that is already being freed.
+		 */
+		if (selected && !atomic_inc_not_zero(&selected->usage)) {
+			list_del_init(&selected->lowmem_node);
+			spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+			continue;
+		}
+		spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+
+		if (!selected)
+			return NULL;
+
+		rss = lowmem_task_rss(selected);
+		selected->lowmem_rss = rss;
+		if (rss > 0 && rss >= selected_rss / 2) {
+			*oom_adj = adj;
+			*tasksize = rss;
+			return selected;
+		}
+
+		lowmem_print(3, "rss of %d (%s) dropped from %lu to %lu\n",
+			     selected->pid, selected->comm, selected_rss, rss);
+		put_task_struct(selected);
+	}
+
+	return NULL;
+}
+
+static void lowmem_kill(struct task_struct *p, int oom_adj, int tasksize)
+{
+	lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
+		     p->pid, p->comm, oom_adj, tasksize);
+	/* Not worth picking again while it dies */
+	p->lowmem_rss = 0;
+	lowmem_deathpending = p;
+	lowmem_deathpending_timeout = jiffies + HZ;
+	force_sig(SIGKILL, p);
+}
+
 static void dump_deathpending(struct task_struct *t_deathpending)
 {
 	struct task_struct *p;
@@ -135,10 +298,8 @@ static void dump_deathpending(struct task_struct *t_deathpending)
 
 static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 {
-	struct task_struct *p;
-	struct task_struct *selected = NULL;
+	struct task_struct *selected;
 	int rem = 0;
-	int tasksize;
 	int i;
 	int min_adj = OOM_ADJUST_MAX + 1;
 	int selected_tasksize = 0;
@@ -191,55 +352,15 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 			     sc->nr_to_scan, sc->gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
-
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
-	}
+	selected = lowmem_select(min_adj, &selected_oom_adj,
+				 &selected_tasksize);
 	if (selected) {
-		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
-			     selected->pid, selected->comm,
-			     selected_oom_adj, selected_tasksize);
-		lowmem_deathpending = selected;
-		lowmem_deathpending_timeout = jiffies + HZ;
-		force_sig(SIGKILL, selected);
+		lowmem_kill(selected, selected_oom_adj, selected_tasksize);
+		put_task_struct(selected);
 		rem -= selected_tasksize;
 	}
 	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
 		     sc->nr_to_scan, sc->gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
@@ -248,16 +369,180 @@ static struct shrinker lowmem_shrinker = {
 	.seeks = DEFAULT_SEEKS * 16
 };
 
+static void lowmem_event(unsigned long pressure)
+{
+	lowmem_event_pressure = pressure;
+	smp_wmb();
+	atomic_inc(&lowmem_event_seq);
+	wake_up_interruptible(&lowmem_event_wait);
+}
+
+/*
+ * Kill tasks, most expendable first, until pressure_kill_target pages
+ * are on their way back or LOWMEM_KILL_BATCH tasks have been killed.
+ */
+static void lowmem_kill_batch(unsigned long pressure)
+{
+	struct task_struct *p;
+	int oom_adj, tasksize;
+	int nr_killed = 0;
+	unsigned long freed = 0;
+
+	if (lowmem_deathpending &&
+	    time_before_eq(jiffies, lowmem_deathpending_timeout))
+		return;
+
+	while (nr_killed < LOWMEM_KILL_BATCH &&
+	       freed < lowmem_pressure_kill_target) {
+		p = lowmem_select(lowmem_pressure_min_adj, &oom_adj, &tasksize);
+		if (!p)
+			break;
+
+		lowmem_kill(p, oom_adj, tasksize);
+		put_task_struct(p);
+		freed += tasksize;
+		nr_killed++;
+	}
+
+	if (nr_killed)
+		lowmem_print(2, "pressure %lu, killed %d tasks, %lu pages\n",
+			     pressure, nr_killed, freed);
+}
+
+static int lowmem_vmpressure_notify(struct notifier_block *self,
+				    unsigned long pressure, void *data)
+{
+	if (!lowmem_pressure_mode || pressure < lowmem_pressure_notify)
+		return NOTIFY_OK;
+
+	lowmem_print(3, "vmpressure %lu\n", pressure);
+
+	/* Userspace hears about it first, it may free memory itself */
+	lowmem_event(pressure);
+
+	if (pressure >= lowmem_pressure_kill)
+		lowmem_kill_batch(pressure);
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block lowmem_vmpressure_nb = {
+	.notifier_call	= lowmem_vmpressure_notify,
+};
+
+static int lowmem_event_open(struct inode *inode, struct file *file)
+{
+	/* Only events after open are reported */
+	file->private_data = (void *)(long)atomic_read(&lowmem_event_seq);
+	return nonseekable_open(inode, file);
+}
+
+static unsigned int lowmem_event_poll(struct file *file, poll_table *wait)
+{
+	int seen = (long)file->private_data;
+
+	poll_wait(file, &lowmem_event_wait, wait);
+	if (atomic_read(&lowmem_event_seq) != seen)
+		return POLLIN | POLLRDNORM;
+
+	return 0;
+}
+
+/*
+ * Each read returns the pressure of the latest event not yet seen through
+ * this file, as a decimal number followed by a newline.
+ */
+static ssize_t lowmem_event_read(struct file *file, char __user *buf,
+				 size_t count, loff_t *pos)
+{
+	int seen = (long)file->private_data;
+	char tmp[16];
+	int seq, len, ret;
+
+	if (atomic_read(&lowmem_event_seq) == seen) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		ret = wait_event_interruptible(lowmem_event_wait,
+				atomic_read(&lowmem_event_seq) != seen);
+		if (ret)
+			return ret;
+	}
+
+	seq = atomic_read(&lowmem_event_seq);
+	smp_rmb();
+	len = scnprintf(tmp, sizeof(tmp), "%lu\n", lowmem_event_pressure);
+	if (count < len)
+		return -EINVAL;
+	if (copy_to_user(buf, tmp, len))
+		return -EFAULT;
+
+	file->private_data = (void *)(long)seq;
+	return len;
+}
+
+static const struct file_operations lowmem_event_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_event_open,
+	.poll = lowmem_event_poll,
+	.read = lowmem_event_read,
+	.llseek = no_llseek,
+};
+
+static struct miscdevice lowmem_event_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "lowmemorykiller",
+	.fops = &lowmem_event_fops,
+};
+
 static int __init lowmem_init(void)
 {
+	struct task_struct *p;
+	int i;
+
+	for (i = 0; i < LOWMEM_NR_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_buckets[i]);
+
 	task_free_register(&task_nb);
+	register_oom_adj_notifier(&oom_adj_nb);
+
+	/*
+	 * Pick up the processes that already exist. Tasks forked from here
+	 * on are reported by the notifier, possibly on top of this loop,
+	 * which is harmless. A task we see here is not freed before the
+	 * tasklist_lock is dropped, so it is always removed again.
+	 */
+	read_lock(&tasklist_lock);
+	for_each_process(p)
+		lowmem_bucket_task(p);
+	read_unlock(&tasklist_lock);
+
 	register_shrinker(&lowmem_shrinker);
+	register_vmpressure_notifier(&lowmem_vmpressure_nb);
+
+	if (misc_register(&lowmem_event_misc))
+		printk(KERN_ERR "lowmem: failed to register event device\n");
+
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+	struct task_struct *p, *tmp;
+	unsigned long flags;
+	int i;
+
+	misc_deregister(&lowmem_event_misc);
+	unregister_vmpressure_notifier(&lowmem_vmpressure_nb);
 	unregister_shrinker(&lowmem_shrinker);
+	unregister_oom_adj_notifier(&oom_adj_nb);
+
+	spin_lock_irqsave(&lowmem_bucket_lock, flags);
+	for (i = 0; i < LOWMEM_NR_BUCKETS; i++)
+		list_for_each_entry_safe(p, tmp, &lowmem_buckets[i],
+					 lowmem_node)
+			list_del_init(&p->lowmem_node);
+	spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+
 	task_free_unregister(&task_nb);
 }
 
@@ -273,6 +558,17 @@ module_param_named(check_filepages , lowmem_check_filepages, uint,
 module_param_array_named(minfile, lowmem_minfile, uint, &lowmem_minfile_size,
 			 S_IRUGO | S_IWUSR);
 
+module_param_named(pressure_mode, lowmem_pressure_mode, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_notify, lowmem_pressure_notify, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_kill, lowmem_pressure_kill, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_min_adj, lowmem_pressure_min_adj, int,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_kill_target, lowmem_pressure_kill_target, uint,
+		   S_IRUGO | S_IWUSR);
+
 module_init(lowmem_init);
 module_exit(lowmem_exit);
 
@@ -0,0 +1,108 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+#include <linux/lzo.h>
+#ifdef CONFIG_ZRAM_LZ4
+#include <linux/lz4.h>
+#endif
+
+#include "zram_comp.h"
+
+static int zram_lzo_compress(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *workmem)
+{
+	return lzo1x_1_compress(src, PAGE_SIZE, dst, dst_len, workmem);
+}
+
+static int zram_lzo_decompress(const unsigned char *src, size_t src_len,
+			unsigned char *dst)
+{
+	size_t dst_len = PAGE_SIZE;
+
+	return lzo1x_decompress_safe(src, src_len, dst, &dst_len);
+}
+
+#ifdef CONFIG_ZRAM_LZ4
+static int zram_lz4_compress(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *workmem)
+{
+	*dst_len = 2 * PAGE_SIZE;
+	return lz4_compress(src, PAGE_SIZE, dst, dst_len, workmem);
+}
+
+static int zram_lz4_decompress(const unsigned char *src, size_t src_len,
+			unsigned char *dst)
+{
+	size_t dst_len = PAGE_SIZE;
+
+	return lz4_decompress_safe(src, src_len, dst, &dst_len);
+}
+#endif
+
+/* First entry is the default */
+static const struct zram_compressor zram_compressors[] = {
+	{
+		.name		= "lzo",
+		.workmem_size	= LZO1X_MEM_COMPRESS,
+		.compress	= zram_lzo_compress,
+		.decompress	= zram_lzo_decompress,
+	},
+#ifdef CONFIG_ZRAM_LZ4
+	{
+		.name		= "lz4",
+		.workmem_size	= LZ4_MEM_COMPRESS,
+		.compress	= zram_lz4_compress,
+		.decompress	= zram_lz4_decompress,
+	},
+#endif
+};
+
+const struct zram_compressor *zram_default_compressor(void)
+{
+	return &zram_compressors[0];
+}
+
+const struct zram_compressor *zram_find_compressor(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(zram_compressors); i++) {
+		if (sysfs_streq(name, zram_compressors[i].name))
+			return &zram_compressors[i];
+	}
+
+	return NULL;
+}
+
+/* List available backends, with the current one in brackets */
+ssize_t zram_show_compressors(const struct zram_compressor *cur, char *buf)
+{
+	int i;
+	ssize_t len = 0;
+
+	for (i = 0; i < ARRAY_SIZE(zram_compressors); i++) {
+		const struct zram_compressor *comp = &zram_compressors[i];
+
+		if (comp == cur)
+			len += sprintf(buf + len, "[%s] ", comp->name);
+		else
+			len += sprintf(buf + len, "%s ", comp->name);
+	}
+
+	len += sprintf(buf + len, "\n");
+	return len;
+}
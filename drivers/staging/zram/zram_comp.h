@@ -0,0 +1,51 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#ifndef _ZRAM_COMP_H_
+#define _ZRAM_COMP_H_
+
+#include <linux/types.h>
+
+/*
+ * Compression backend. Each zram device uses exactly one backend,
+ * selected through the comp_algorithm sysfs node before the device
+ * is initialized.
+ */
+struct zram_compressor {
+	const char *name;
+
+	/* Size of per-stream working memory passed to compress() */
+	size_t workmem_size;
+
+	/*
+	 * Compress one page from 'src' into 'dst' (which is 2 pages
+	 * long). Returns 0 and sets *dst_len on success.
+	 */
+	int (*compress)(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *workmem);
+
+	/*
+	 * Decompress 'src_len' bytes into the page at 'dst'.
+	 * Returns 0 on success.
+	 */
+	int (*decompress)(const unsigned char *src, size_t src_len,
+			unsigned char *dst);
+};
+
+extern const struct zram_compressor *zram_default_compressor(void);
+extern const struct zram_compressor *zram_find_compressor(const char *name);
+extern ssize_t zram_show_compressors(const struct zram_compressor *cur,
+			char *buf);
+
+#endif
@@ -0,0 +1,147 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/highmem.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "zram_drv.h"
+
+/*
+ * Content index of compressed objects. Objects are hashed on their
+ * compressed bytes; identical pages compress identically, so there is
+ * no need to keep the uncompressed data around for comparison.
+ */
+
+static struct hlist_head *zram_dedup_bucket(struct zram *zram, u32 checksum)
+{
+	return &zram->dedup_table[checksum & zram->dedup_mask];
+}
+
+int zram_dedup_init(struct zram *zram, size_t num_pages)
+{
+	size_t i, nr_buckets;
+
+	/* Aim for a handful of objects per bucket on a full device */
+	nr_buckets = roundup_pow_of_two(max_t(size_t, num_pages >> 3, 1));
+
+	zram->dedup_table = vmalloc(nr_buckets * sizeof(struct hlist_head));
+	if (!zram->dedup_table) {
+		pr_err("Error allocating dedup table\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nr_buckets; i++)
+		INIT_HLIST_HEAD(&zram->dedup_table[i]);
+	zram->dedup_mask = nr_buckets - 1;
+
+	return 0;
+}
+
+/* All entries must have been released through zram_dedup_put() */
+void zram_dedup_destroy(struct zram *zram)
+{
+	vfree(zram->dedup_table);
+	zram->dedup_table = NULL;
+	zram->dedup_mask = 0;
+}
+
+u32 zram_dedup_checksum(const void *buf, size_t len)
+{
+	return jhash(buf, len, 0);
+}
+
+/*
+ * Look for an object with the given contents. On success, a reference
+ * is taken on the returned entry on behalf of the caller's table entry.
+ */
+struct zram_dedup_entry *zram_dedup_find(struct zram *zram,
+			const void *buf, size_t len, u32 checksum)
+{
+	struct hlist_node *pos;
+	struct zram_dedup_entry *entry;
+
+	spin_lock(&zram->dedup_lock);
+	hlist_for_each_entry(entry, pos, zram_dedup_bucket(zram, checksum),
+				node) {
+		unsigned char *cmem;
+		int match;
+
+		if (entry->checksum != checksum || entry->len != len)
+			continue;
+
+		cmem = zs_map_object(zram->mem_pool, entry->handle,
+					ZS_MM_RO);
+		match = !memcmp(cmem, buf, len);
+		zs_unmap_object(zram->mem_pool, entry->handle);
+
+		if (match) {
+			entry->refcount++;
+			spin_unlock(&zram->dedup_lock);
+			return entry;
+		}
+	}
+	spin_unlock(&zram->dedup_lock);
+
+	return NULL;
+}
+
+/*
+ * Index a newly stored object. Returns NULL if no memory is available,
+ * in which case the caller stores the object without deduplication.
+ */
+struct zram_dedup_entry *zram_dedup_insert(struct zram *zram,
+			unsigned long handle, size_t len, u32 checksum)
+{
+	struct zram_dedup_entry *entry;
+
+	entry = kmalloc(sizeof(*entry), GFP_NOIO);
+	if (!entry)
+		return NULL;
+
+	entry->handle = handle;
+	entry->len = len;
+	entry->checksum = checksum;
+	entry->refcount = 1;
+
+	spin_lock(&zram->dedup_lock);
+	hlist_add_head(&entry->node, zram_dedup_bucket(zram, checksum));
+	spin_unlock(&zram->dedup_lock);
+
+	return entry;
+}
+
+/*
+ * Drop a reference. Returns 1 if this was the last one; the entry is
+ * then unhashed and the caller must free the object and the entry.
+ */
+int zram_dedup_put(struct zram *zram, struct zram_dedup_entry *entry)
+{
+	int last;
+
+	spin_lock(&zram->dedup_lock);
+	last = !--entry->refcount;
+	if (last)
+		hlist_del(&entry->node);
+	spin_unlock(&zram->dedup_lock);
+
+	return last;
+}
@@ -24,8 +24,9 @@
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/kthread.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
+#include <linux/ktime.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
 
@@ -38,14 +39,14 @@ struct zram *devices;
 /* Module params (documentation at end) */
 unsigned int num_devices;
 
-static void zram_stat_inc(u32 *v)
+static void zram_stat_inc(atomic_t *v)
 {
-	*v = *v + 1;
+	atomic_inc(v);
 }
 
-static void zram_stat_dec(u32 *v)
+static void zram_stat_dec(atomic_t *v)
 {
-	*v = *v - 1;
+	atomic_dec(v);
 }
 
 static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
@@ -73,30 +74,107 @@ static int zram_test_flag(struct zram *zram, u32 index,
 	return zram->table[index].flags & BIT(flag);
 }
 
-static void zram_set_flag(struct zram *zram, u32 index,
+static void zram_clear_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	zram->table[index].flags |= BIT(flag);
+	zram->table[index].flags &= ~BIT(flag);
 }
 
-static void zram_clear_flag(struct zram *zram, u32 index,
-			enum zram_pageflags flag)
+static rwlock_t *zram_table_lock(struct zram *zram, u32 index)
 {
-	zram->table[index].flags &= ~BIT(flag);
+	return &zram->table_lock[index & (ZRAM_NR_TABLE_LOCKS - 1)];
+}
+
+/*
+ * Get the compression stream of the current CPU. The writer may sleep
+ * (and migrate) while holding the stream, so it is protected by a mutex
+ * rather than by disabling preemption.
+ */
+static struct zram_comp_stream *zram_comp_stream_get(struct zram *zram)
+{
+	struct zram_comp_stream *zstrm;
+
+	zstrm = per_cpu_ptr(zram->comp_streams, raw_smp_processor_id());
+	mutex_lock(&zstrm->lock);
+
+	return zstrm;
+}
+
+static void zram_comp_stream_put(struct zram_comp_stream *zstrm)
+{
+	mutex_unlock(&zstrm->lock);
+}
+
+static void zram_free_comp_streams(struct zram *zram)
+{
+	int cpu;
+
+	if (!zram->comp_streams)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct zram_comp_stream *zstrm;
+
+		zstrm = per_cpu_ptr(zram->comp_streams, cpu);
+		kfree(zstrm->workmem);
+		free_pages((unsigned long)zstrm->buffer, 1);
+	}
+
+	free_percpu(zram->comp_streams);
+	zram->comp_streams = NULL;
+}
+
+static int zram_alloc_comp_streams(struct zram *zram)
+{
+	int cpu;
+
+	zram->comp_streams = alloc_percpu(struct zram_comp_stream);
+	if (!zram->comp_streams)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct zram_comp_stream *zstrm;
+
+		zstrm = per_cpu_ptr(zram->comp_streams, cpu);
+		mutex_init(&zstrm->lock);
+
+		zstrm->workmem = kzalloc(zram->comp->workmem_size, GFP_KERNEL);
+		if (!zstrm->workmem) {
+			pr_err("Error allocating compressor working memory!\n");
+			goto fail;
+		}
+
+		zstrm->buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
+		if (!zstrm->buffer) {
+			pr_err("Error allocating compressor buffer space\n");
+			goto fail;
+		}
+	}
+
+	return 0;
+
+fail:
+	zram_free_comp_streams(zram);
+	return -ENOMEM;
 }
 
-static int page_zero_filled(void *ptr)
+/*
+ * Check if the page consists of one repeated word. If so, the word is
+ * returned in *element; a zero filled page yields *element == 0.
+ */
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
 			return 0;
 	}
 
+	*element = page[0];
 	return 1;
 }
 
@@ -129,39 +207,130 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+struct zram_bd_read {
+	struct work_struct work;
+	struct list_head list;	/* on zram->bd_reads */
+	struct zram *zram;
+	struct page *page;
+	unsigned long block;
+	int free_block;		/* freed while being read */
+	int ret;
+};
+
+static unsigned long zram_alloc_bd_block(struct zram *zram)
+{
+	unsigned long block;
+
+	spin_lock(&zram->bd_lock);
+	/* Block 0 is never used so that 0 can mean "no block" */
+	block = find_next_zero_bit(zram->bd_bitmap, zram->nr_bd_pages, 1);
+	if (block < zram->nr_bd_pages)
+		__set_bit(block, zram->bd_bitmap);
+	else
+		block = 0;
+	spin_unlock(&zram->bd_lock);
+
+	return block;
+}
+
+static void zram_free_bd_block(struct zram *zram, unsigned long block)
+{
+	struct zram_bd_read *rd;
+	int busy = 0;
+
+	/* A block still being read is released by the last reader */
+	spin_lock(&zram->bd_lock);
+	list_for_each_entry(rd, &zram->bd_reads, list) {
+		if (rd->block == block) {
+			rd->free_block = 1;
+			busy = 1;
+		}
+	}
+	if (!busy)
+		__clear_bit(block, zram->bd_bitmap);
+	spin_unlock(&zram->bd_lock);
+}
+#else
+static void zram_free_bd_block(struct zram *zram, unsigned long block)
+{
+}
+#endif
+
+/*
+ * Free memory associated with the given table entry.
+ * Caller must hold the table lock of this entry for writing.
+ */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
-	void *obj;
-
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
-
-	if (unlikely(!page)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
-			zram_stat_dec(&zram->stats.pages_zero);
+
+	/* Cancels a writeback in progress; see zram_wb_complete() */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_free_bd_block(zram, zram->table[index].bd_block);
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram->table[index].bd_block = 0;
+		zram_stat_dec(&zram->stats.pages_wb);
+		zram_stat_dec(&zram->stats.pages_stored);
+		return;
+	}
+
+	/*
+	 * No memory is allocated for zero or same filled pages.
+	 * Simply clear the flag.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
+		zram_clear_flag(zram, index, ZRAM_ZERO);
+		zram_stat_dec(&zram->stats.pages_zero);
+		return;
+	}
+
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		zram_stat_dec(&zram->stats.pages_same);
+		zram->table[index].element = 0;
+		return;
+	}
+
+	if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+		struct zram_dedup_entry *entry = zram->table[index].entry;
+
+		clen = entry->len;
+		zram_clear_flag(zram, index, ZRAM_DEDUP);
+		zram->table[index].entry = NULL;
+
+		if (clen <= PAGE_SIZE / 2)
+			zram_stat_dec(&zram->stats.good_compress);
+		zram_stat_dec(&zram->stats.pages_stored);
+
+		if (!zram_dedup_put(zram, entry)) {
+			/* Object is still used by other table entries */
+			zram_stat_dec(&zram->stats.pages_dup);
+			zram_stat64_sub(zram, &zram->stats.dup_size, clen);
+			return;
 		}
+
+		zs_free(zram->mem_pool, entry->handle);
+		kfree(entry);
+		zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 		return;
 	}
 
+	if (unlikely(!zram->table[index].handle))
+		return;
+
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		clen = PAGE_SIZE;
-		__free_page(page);
+		__free_page(zram->table[index].page);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
-
-	xv_free(zram->mem_pool, page, offset);
+	clen = zram->table[index].size;
+	zs_free(zram->mem_pool, zram->table[index].handle);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
@@ -169,16 +338,22 @@ out:
 	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	zram->table[index].handle = 0;
+	zram->table[index].size = 0;
 }
 
-static void handle_zero_page(struct page *page)
+static void handle_same_page(struct page *page, unsigned long element)
 {
-	void *user_mem;
+	unsigned int pos;
+	unsigned long *user_mem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	memset(user_mem, 0, PAGE_SIZE);
+	if (!element) {
+		memset(user_mem, 0, PAGE_SIZE);
+	} else {
+		for (pos = 0; pos != PAGE_SIZE / sizeof(*user_mem); pos++)
+			user_mem[pos] = element;
+	}
 	kunmap_atomic(user_mem, KM_USER0);
 
 	flush_dcache_page(page);
@@ -190,8 +365,7 @@ static void handle_uncompressed_page(struct zram *zram,
 	unsigned char *user_mem, *cmem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-			zram->table[index].offset;
+	cmem = kmap_atomic(zram->table[index].page, KM_USER1);
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
@@ -200,204 +374,746 @@ static void handle_uncompressed_page(struct zram *zram,
 	flush_dcache_page(page);
 }
 
-static int zram_read(struct zram *zram, struct bio *bio)
+/*
+ * Decompress (or copy) the page stored at table entry 'index' into 'page'.
+ * Caller must hold the table lock of this entry.
+ */
+static int zram_read_page(struct zram *zram, struct page *page, u32 index)
 {
+	int ret;
+	ktime_t start;
+	unsigned char *user_mem, *cmem;
+	unsigned long handle;
+	u16 size;
 
-	int i;
-	u32 index;
-	struct bio_vec *bvec;
+	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
+		handle_same_page(page, 0);
+		return 0;
+	}
 
-	if (unlikely(!zram->init_done)) {
-		set_bit(BIO_UPTODATE, &bio->bi_flags);
-		bio_endio(bio, 0);
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		handle_same_page(page, zram->table[index].element);
 		return 0;
 	}
 
-	zram_stat64_inc(zram, &zram->stats.num_reads);
-	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+	/* Requested page is not present in compressed area */
+	if (unlikely(!zram->table[index].handle)) {
+		pr_debug("Read before write: index=%u\n", index);
+		/* Do nothing */
+		return 0;
+	}
 
-	bio_for_each_segment(bvec, bio, i) {
-		int ret;
-		size_t clen;
-		struct page *page;
-		struct zobj_header *zheader;
-		unsigned char *user_mem, *cmem;
+	/* Page is stored uncompressed since it's incompressible */
+	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		handle_uncompressed_page(zram, page, index);
+		return 0;
+	}
+
+	if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+		handle = zram->table[index].entry->handle;
+		size = zram->table[index].entry->len;
+	} else {
+		handle = zram->table[index].handle;
+		size = zram->table[index].size;
+	}
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
 
-		page = bvec->bv_page;
+	start = ktime_get();
+	ret = zram->comp->decompress(cmem, size, user_mem);
 
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			handle_zero_page(page);
-			continue;
+	zs_unmap_object(zram->mem_pool, handle);
+	kunmap_atomic(user_mem, KM_USER0);
+
+	zram_stat64_add(zram, &zram->stats.decompr_time,
+		ktime_to_ns(ktime_sub(ktime_get(), start)));
+	zram_stat64_inc(zram, &zram->stats.num_decompr);
+
+	/* Should NEVER happen. Return bio error if it does. */
+	if (unlikely(ret)) {
+		pr_err("Decompression failed! err=%d, page=%u\n",
+			ret, index);
+		return ret;
+	}
+
+	flush_dcache_page(page);
+	return 0;
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+/* One batch of pages being written to the backing device */
+struct zram_wb_ctx {
+	int nr;
+	atomic_t pending;
+	struct completion done;
+	u32 index[ZRAM_WB_BATCH];
+	unsigned long block[ZRAM_WB_BATCH];
+	struct bio *bio[ZRAM_WB_BATCH];
+	struct page *page[ZRAM_WB_BATCH];
+};
+
+
+static void zram_bd_end_io(struct bio *bio, int err)
+{
+	struct completion *done = bio->bi_private;
+
+	complete(done);
+}
+
+static void zram_bd_read_work(struct work_struct *work)
+{
+	struct zram_bd_read *rd = container_of(work, struct zram_bd_read,
+						work);
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio) {
+		rd->ret = -ENOMEM;
+		return;
+	}
+
+	bio->bi_bdev = rd->zram->bdev;
+	bio->bi_sector = rd->block << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_end_io = zram_bd_end_io;
+	bio->bi_private = &done;
+	bio_add_page(bio, rd->page, PAGE_SIZE, 0);
+
+	submit_bio(READ_SYNC, bio);
+	wait_for_completion(&done);
+
+	rd->ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+}
+
+/*
+ * Read the page of ZRAM_WB entry 'index' back from the backing device.
+ * Called with the table lock held for reading, which is dropped here.
+ *
+ * The read is listed in bd_reads before the lock is dropped, so that
+ * the block can't be freed and reused by writeback under us; see
+ * zram_free_bd_block(). We are called from our make_request function,
+ * where bios submitted by this task are only issued once it returns;
+ * so the read is done from a worker instead.
+ */
+static int zram_bdev_read(struct zram *zram, struct page *page, u32 index,
+			rwlock_t *lock)
+{
+	struct zram_bd_read *other;
+	struct zram_bd_read rd = {
+		.zram = zram,
+		.page = page,
+		.block = zram->table[index].bd_block,
+	};
+
+	spin_lock(&zram->bd_lock);
+	list_add(&rd.list, &zram->bd_reads);
+	spin_unlock(&zram->bd_lock);
+	read_unlock(lock);
+
+	INIT_WORK_ONSTACK(&rd.work, zram_bd_read_work);
+	schedule_work(&rd.work);
+	flush_work(&rd.work);
+	destroy_work_on_stack(&rd.work);
+
+	spin_lock(&zram->bd_lock);
+	list_del(&rd.list);
+	if (rd.free_block) {
+		list_for_each_entry(other, &zram->bd_reads, list) {
+			if (other->block == rd.block) {
+				rd.free_block = 0;
+				break;
+			}
 		}
+		if (rd.free_block)
+			__clear_bit(rd.block, zram->bd_bitmap);
+	}
+	spin_unlock(&zram->bd_lock);
+
+	if (rd.ret)
+		pr_err("Error reading block %lu from backing device\n",
+			rd.block);
+	else
+		flush_dcache_page(page);
+
+	zram_stat64_inc(zram, &zram->stats.bd_reads);
+	return rd.ret;
+}
+
+static void zram_wb_end_io(struct bio *bio, int err)
+{
+	struct zram_wb_ctx *ctx = bio->bi_private;
+
+	if (atomic_dec_and_test(&ctx->pending))
+		complete(&ctx->done);
+}
 
-		/* Requested page is not present in compressed area */
-		if (unlikely(!zram->table[index].page)) {
-			pr_debug("Read before write: sector=%lu, size=%u",
-				(ulong)(bio->bi_sector), bio->bi_size);
-			/* Do nothing */
+/*
+ * Move the pages of a written batch from memory to the backing device.
+ * An entry that was freed or rewritten while its write was in flight
+ * no longer has ZRAM_UNDER_WB set; its block is simply released.
+ */
+static void zram_wb_complete(struct zram *zram, struct zram_wb_ctx *ctx)
+{
+	int i;
+
+	for (i = 0; i < ctx->nr; i++) {
+		u32 index = ctx->index[i];
+		rwlock_t *lock = zram_table_lock(zram, index);
+		int ok = test_bit(BIO_UPTODATE, &ctx->bio[i]->bi_flags);
+
+		bio_put(ctx->bio[i]);
+
+		write_lock(lock);
+		if (!ok || !zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			write_unlock(lock);
+
+			zram_free_bd_block(zram, ctx->block[i]);
+			if (!ok)
+				zram_stat64_inc(zram,
+					&zram->stats.failed_bd_writes);
 			continue;
 		}
 
-		/* Page is stored uncompressed since it's incompressible */
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-			handle_uncompressed_page(zram, page, index);
+		zram_free_page(zram, index);
+		zram->table[index].bd_block = ctx->block[i];
+		zram->table[index].size = 0;
+		zram->table[index].flags = BIT(ZRAM_WB);
+		write_unlock(lock);
+
+		zram_stat_inc(&zram->stats.pages_wb);
+		zram_stat_inc(&zram->stats.pages_stored);
+		zram_stat64_inc(zram, &zram->stats.bd_writes);
+	}
+
+	ctx->nr = 0;
+}
+
+static void zram_wb_submit(struct zram *zram, struct zram_wb_ctx *ctx)
+{
+	int i;
+
+	if (!ctx->nr)
+		return;
+
+	atomic_set(&ctx->pending, ctx->nr);
+	INIT_COMPLETION(ctx->done);
+
+	for (i = 0; i < ctx->nr; i++)
+		submit_bio(WRITE, ctx->bio[i]);
+
+	wait_for_completion(&ctx->done);
+	zram_wb_complete(zram, ctx);
+}
+
+/*
+ * Pages eligible for writeback: incompressible pages, and (if enabled)
+ * compressed pages not accessed for wb_idle_age seconds. Shared and
+ * same-filled pages are never written back.
+ */
+static int zram_wb_eligible(struct zram *zram, u32 index, u8 idle_age)
+{
+	if (zram->table[index].flags & (BIT(ZRAM_ZERO) | BIT(ZRAM_SAME) |
+			BIT(ZRAM_DEDUP) | BIT(ZRAM_WB) | BIT(ZRAM_UNDER_WB)))
+		return 0;
+
+	if (!zram->table[index].handle)
+		return 0;
+
+	if (zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))
+		return 1;
+
+	return idle_age && zram->table[index].age >= idle_age;
+}
+
+/*
+ * Scan the table, ageing entries if 'do_age' is set, and write
+ * eligible pages to the backing device in batches.
+ */
+static void zram_writeback(struct zram *zram, struct zram_wb_ctx *ctx,
+			int do_age)
+{
+	u32 index, num_pages;
+	unsigned long block = 0;
+	int bd_full = 0;
+	u8 idle_age = 0;
+
+	if (zram->wb_idle_age)
+		idle_age = min_t(unsigned, ZRAM_MAX_AGE,
+			DIV_ROUND_UP(zram->wb_idle_age, wb_scan_period));
+
+	atomic_set(&zram->wb_pending, 0);
+	num_pages = zram->disksize >> PAGE_SHIFT;
+
+	for (index = 0; index < num_pages; index++) {
+		rwlock_t *lock = zram_table_lock(zram, index);
+		struct bio *bio;
+		int i = ctx->nr;
+
+		if (!(index % 1024))
+			cond_resched();
+
+		if (!block && !bd_full) {
+			block = zram_alloc_bd_block(zram);
+			if (!block) {
+				/* Keep going only to age the entries */
+				bd_full = 1;
+				if (!do_age)
+					break;
+			}
+		}
+
+		write_lock(lock);
+		if (do_age && zram->table[index].age < ZRAM_MAX_AGE)
+			zram->table[index].age++;
+
+		if (!block || !zram_wb_eligible(zram, index, idle_age) ||
+				zram_read_page(zram, ctx->page[i], index)) {
+			write_unlock(lock);
 			continue;
 		}
 
-		user_mem = kmap_atomic(page, KM_USER0);
-		clen = PAGE_SIZE;
+		zram->table[index].flags |= BIT(ZRAM_UNDER_WB);
+		write_unlock(lock);
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+		bio = bio_alloc(GFP_NOIO, 1);
+		if (!bio) {
+			write_lock(lock);
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			write_unlock(lock);
+			break;
+		}
 
-		ret = lzo1x_decompress_safe(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			user_mem, &clen);
+		bio->bi_bdev = zram->bdev;
+		bio->bi_sector = block << SECTORS_PER_PAGE_SHIFT;
+		bio->bi_end_io = zram_wb_end_io;
+		bio->bi_private = ctx;
+		bio_add_page(bio, ctx->page[i], PAGE_SIZE, 0);
 
-		kunmap_atomic(user_mem, KM_USER0);
-		kunmap_atomic(cmem, KM_USER1);
+		ctx->index[i] = index;
+		ctx->block[i] = block;
+		ctx->bio[i] = bio;
+		ctx->nr++;
+		block = 0;
 
-		/* Should NEVER happen. Return bio error if it does. */
-		if (unlikely(ret != LZO_E_OK)) {
-			pr_err("Decompression failed! err=%d, page=%u\n",
-				ret, index);
-			zram_stat64_inc(zram, &zram->stats.failed_reads);
+		if (ctx->nr == ZRAM_WB_BATCH)
+			zram_wb_submit(zram, ctx);
+	}
+
+	zram_wb_submit(zram, ctx);
+	if (block)
+		zram_free_bd_block(zram, block);
+}
+
+static int zram_wb_thread(void *data)
+{
+	int i;
+	struct zram *zram = data;
+	struct zram_wb_ctx *ctx;
+	unsigned long next_age = jiffies + wb_scan_period * HZ;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		goto out;
+
+	init_completion(&ctx->done);
+	for (i = 0; i < ZRAM_WB_BATCH; i++) {
+		ctx->page[i] = alloc_page(GFP_KERNEL);
+		if (!ctx->page[i])
 			goto out;
+	}
+
+	while (!kthread_should_stop()) {
+		int do_age;
+
+		wait_event_interruptible_timeout(zram->wb_wait,
+			atomic_read(&zram->wb_pending) >= ZRAM_WB_BATCH ||
+			kthread_should_stop(), wb_scan_period * HZ);
+		if (kthread_should_stop())
+			break;
+
+		do_age = time_after_eq(jiffies, next_age);
+		if (do_age)
+			next_age = jiffies + wb_scan_period * HZ;
+
+		zram_writeback(zram, ctx, do_age);
+	}
+
+out:
+	if (ctx) {
+		for (i = 0; i < ZRAM_WB_BATCH; i++) {
+			if (ctx->page[i])
+				__free_page(ctx->page[i]);
 		}
+		kfree(ctx);
+	}
 
-		flush_dcache_page(page);
-		index++;
+	/* Wait to be stopped if we bailed out early */
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule();
 	}
+	__set_current_state(TASK_RUNNING);
 
-	set_bit(BIO_UPTODATE, &bio->bi_flags);
-	bio_endio(bio, 0);
 	return 0;
+}
+
+static int zram_start_writeback(struct zram *zram)
+{
+	if (!zram->bdev)
+		return 0;
+
+	atomic_set(&zram->wb_pending, 0);
+	zram->wb_thread = kthread_run(zram_wb_thread, zram, "zram_wb/%s",
+					zram->disk->disk_name);
+	if (IS_ERR(zram->wb_thread)) {
+		int ret = PTR_ERR(zram->wb_thread);
+
+		zram->wb_thread = NULL;
+		pr_err("Error starting writeback thread\n");
+		return ret;
+	}
 
-out:
-	bio_io_error(bio);
 	return 0;
 }
 
-static int zram_write(struct zram *zram, struct bio *bio)
+static void zram_stop_writeback(struct zram *zram)
 {
-	int i, ret;
+	if (zram->wb_thread) {
+		kthread_stop(zram->wb_thread);
+		zram->wb_thread = NULL;
+	}
+}
+
+static void zram_close_backing_dev(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	close_bdev_exclusive(zram->bdev, FMODE_READ | FMODE_WRITE);
+	vfree(zram->bd_bitmap);
+	zram->bdev = NULL;
+	zram->bd_bitmap = NULL;
+	zram->nr_bd_pages = 0;
+}
+
+/*
+ * Called through sysfs before the device is initialized.
+ * Caller must hold init_lock.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	size_t bitmap_size;
+	unsigned long nr_pages;
+	struct block_device *bdev;
+
+	bdev = open_bdev_exclusive(path, FMODE_READ | FMODE_WRITE, zram);
+	if (IS_ERR(bdev)) {
+		pr_err("Error opening backing device %s\n", path);
+		return PTR_ERR(bdev);
+	}
+
+	nr_pages = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (nr_pages < 2) {
+		close_bdev_exclusive(bdev, FMODE_READ | FMODE_WRITE);
+		return -EINVAL;
+	}
+
+	zram_close_backing_dev(zram);
+
+	bitmap_size = BITS_TO_LONGS(nr_pages) * sizeof(long);
+	zram->bd_bitmap = vmalloc(bitmap_size);
+	if (!zram->bd_bitmap) {
+		close_bdev_exclusive(bdev, FMODE_READ | FMODE_WRITE);
+		return -ENOMEM;
+	}
+	memset(zram->bd_bitmap, 0, bitmap_size);
+
+	zram->bdev = bdev;
+	zram->nr_bd_pages = nr_pages;
+
+	pr_info("Using %s as backing device (%lu pages)\n", path, nr_pages);
+	return 0;
+}
+#else
+static int zram_bdev_read(struct zram *zram, struct page *page, u32 index,
+			rwlock_t *lock)
+{
+	read_unlock(lock);
+	return -EIO;
+}
+
+static int zram_start_writeback(struct zram *zram)
+{
+	return 0;
+}
+
+static void zram_stop_writeback(struct zram *zram)
+{
+}
+
+static void zram_close_backing_dev(struct zram *zram)
+{
+}
+#endif
+
+/*
+ * Read the page at table entry 'index', from memory or from the
+ * backing device. Marks the entry as recently accessed.
+ */
+static int zram_read_index(struct zram *zram, struct page *page, u32 index)
+{
+	int ret;
+	rwlock_t *lock = zram_table_lock(zram, index);
+
+	read_lock(lock);
+	/*
+	 * Other readers may clear it too; the writeback scanner only
+	 * changes it under the write lock. Skip the store if already
+	 * clear, to keep hot entries' cache lines clean.
+	 */
+	if (zram->table[index].age)
+		ACCESS_ONCE(zram->table[index].age) = 0;
+
+	/* Drops the lock, as it can't sleep under it */
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB)))
+		return zram_bdev_read(zram, page, index, lock);
+
+	ret = zram_read_page(zram, page, index);
+	read_unlock(lock);
+
+	return ret;
+}
+
+static int zram_read(struct zram *zram, struct bio *bio)
+{
+
+	int i;
 	u32 index;
 	struct bio_vec *bvec;
 
 	if (unlikely(!zram->init_done)) {
-		ret = zram_init_device(zram);
-		if (ret)
-			goto out;
+		set_bit(BIO_UPTODATE, &bio->bi_flags);
+		bio_endio(bio, 0);
+		return 0;
 	}
 
-	zram_stat64_inc(zram, &zram->stats.num_writes);
+	zram_stat64_inc(zram, &zram->stats.num_reads);
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
 	bio_for_each_segment(bvec, bio, i) {
-		u32 offset;
-		size_t clen;
-		struct zobj_header *zheader;
-		struct page *page, *page_store;
-		unsigned char *user_mem, *cmem, *src;
+		int ret;
 
-		page = bvec->bv_page;
-		src = zram->compress_buffer;
+		ret = zram_read_index(zram, bvec->bv_page, index);
+		if (unlikely(ret)) {
+			zram_stat64_inc(zram, &zram->stats.failed_reads);
+			goto out;
+		}
 
-		/*
-		 * System overwrites unused sectors. Free memory associated
-		 * with this sector now.
-		 */
-		if (zram->table[index].page ||
-				zram_test_flag(zram, index, ZRAM_ZERO))
-			zram_free_page(zram, index);
+		index++;
+	}
 
-		mutex_lock(&zram->lock);
+	set_bit(BIO_UPTODATE, &bio->bi_flags);
+	bio_endio(bio, 0);
+	return 0;
 
-		user_mem = kmap_atomic(page, KM_USER0);
-		if (page_zero_filled(user_mem)) {
-			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
+out:
+	bio_io_error(bio);
+	return 0;
+}
+
+/*
+ * Replace table entry 'index' with 'new', freeing whatever was
+ * stored there before. Statistics for the new entry are left to
+ * the caller.
+ */
+static void zram_set_entry(struct zram *zram, u32 index, struct table *new)
+{
+	rwlock_t *lock = zram_table_lock(zram, index);
+
+	write_lock(lock);
+
+	/*
+	 * System overwrites unused sectors. Free memory associated
+	 * with this sector now.
+	 */
+	zram_free_page(zram, index);
+	zram->table[index] = *new;
+
+	write_unlock(lock);
+}
+
+static void zram_stat_stored(struct zram *zram, size_t clen)
+{
+	zram_stat_inc(&zram->stats.pages_stored);
+	if (clen <= PAGE_SIZE / 2)
+		zram_stat_inc(&zram->stats.good_compress);
+}
+
+static int zram_write_page(struct zram *zram, struct page *page, u32 index)
+{
+	int ret;
+	u32 checksum = 0;
+	size_t clen;
+	ktime_t start;
+	unsigned long element, handle;
+	struct table new = { };
+	struct zram_comp_stream *zstrm;
+	struct zram_dedup_entry *entry;
+	struct page *page_store;
+	unsigned char *user_mem, *cmem;
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	if (page_same_filled(user_mem, &element)) {
+		kunmap_atomic(user_mem, KM_USER0);
+		if (!element) {
+			new.flags = BIT(ZRAM_ZERO);
+			zram_set_entry(zram, index, &new);
 			zram_stat_inc(&zram->stats.pages_zero);
-			zram_set_flag(zram, index, ZRAM_ZERO);
-			continue;
+		} else {
+			new.element = element;
+			new.flags = BIT(ZRAM_SAME);
+			zram_set_entry(zram, index, &new);
+			zram_stat_inc(&zram->stats.pages_same);
 		}
+		return 0;
+	}
+	kunmap_atomic(user_mem, KM_USER0);
 
-		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-					zram->compress_workmem);
+	/*
+	 * Compression runs outside of any table or pool lock; only the
+	 * stream of this CPU is held until the object has been copied out.
+	 */
+	zstrm = zram_comp_stream_get(zram);
 
-		kunmap_atomic(user_mem, KM_USER0);
+	start = ktime_get();
+	user_mem = kmap_atomic(page, KM_USER0);
+	ret = zram->comp->compress(user_mem, zstrm->buffer, &clen,
+				zstrm->workmem);
+	kunmap_atomic(user_mem, KM_USER0);
 
-		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
-			pr_err("Compression failed! err=%d\n", ret);
-			zram_stat64_inc(zram, &zram->stats.failed_writes);
-			goto out;
-		}
+	zram_stat64_add(zram, &zram->stats.compr_time,
+		ktime_to_ns(ktime_sub(ktime_get(), start)));
+	zram_stat64_inc(zram, &zram->stats.num_compr);
 
-		/*
-		 * Page is incompressible. Store it as-is (uncompressed)
-		 * since we do not want to return too many disk write
-		 * errors which has side effect of hanging the system.
-		 */
-		if (unlikely(clen > max_zpage_size)) {
-			clen = PAGE_SIZE;
-			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
-			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
-				pr_info("Error allocating memory for "
-					"incompressible page: %u\n", index);
-				zram_stat64_inc(zram,
-					&zram->stats.failed_writes);
-				goto out;
-			}
+	if (unlikely(ret)) {
+		zram_comp_stream_put(zstrm);
+		pr_err("Compression failed! err=%d\n", ret);
+		return ret;
+	}
 
-			offset = 0;
-			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
-			src = kmap_atomic(page, KM_USER0);
-			goto memstore;
+	/*
+	 * Page is incompressible. Store it as-is (uncompressed)
+	 * since we do not want to return too many disk write
+	 * errors which has side effect of hanging the system.
+	 */
+	if (unlikely(clen > max_zpage_size)) {
+		zram_comp_stream_put(zstrm);
+
+		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+		if (unlikely(!page_store)) {
+			pr_info("Error allocating memory for "
+				"incompressible page: %u\n", index);
+			return -ENOMEM;
 		}
 
-		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
-				GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
-			pr_info("Error allocating memory for compressed "
-				"page: %u, size=%zu\n", index, clen);
-			zram_stat64_inc(zram, &zram->stats.failed_writes);
-			goto out;
+		user_mem = kmap_atomic(page, KM_USER0);
+		cmem = kmap_atomic(page_store, KM_USER1);
+		memcpy(cmem, user_mem, PAGE_SIZE);
+		kunmap_atomic(cmem, KM_USER1);
+		kunmap_atomic(user_mem, KM_USER0);
+
+		new.page = page_store;
+		new.flags = BIT(ZRAM_UNCOMPRESSED);
+		zram_set_entry(zram, index, &new);
+
+		zram_stat_inc(&zram->stats.pages_expand);
+		zram_stat64_add(zram, &zram->stats.compr_size, PAGE_SIZE);
+		zram_stat_stored(zram, PAGE_SIZE);
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+		/* Move incompressible pages out in batches */
+		if (zram->bdev && atomic_inc_return(&zram->wb_pending) ==
+				ZRAM_WB_BATCH)
+			wake_up(&zram->wb_wait);
+#endif
+		return 0;
+	}
+
+	if (zram->dedup_enable) {
+		checksum = zram_dedup_checksum(zstrm->buffer, clen);
+		entry = zram_dedup_find(zram, zstrm->buffer, clen, checksum);
+		if (entry) {
+			zram_comp_stream_put(zstrm);
+
+			new.entry = entry;
+			new.flags = BIT(ZRAM_DEDUP);
+			zram_set_entry(zram, index, &new);
+
+			zram_stat_inc(&zram->stats.pages_dup);
+			zram_stat64_add(zram, &zram->stats.dup_size, clen);
+			zram_stat_stored(zram, clen);
+			return 0;
 		}
+	}
+
+	handle = zs_malloc(zram->mem_pool, clen, GFP_NOIO | __GFP_HIGHMEM);
+	if (!handle) {
+		zram_comp_stream_put(zstrm);
+		pr_info("Error allocating memory for compressed "
+			"page: %u, size=%zu\n", index, clen);
+		return -ENOMEM;
+	}
 
-memstore:
-		zram->table[index].offset = offset;
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
+	memcpy(cmem, zstrm->buffer, clen);
+	zs_unmap_object(zram->mem_pool, handle);
+	zram_comp_stream_put(zstrm);
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+	new.handle = handle;
+	new.size = clen;
 
-#if 0
-		/* Back-reference needed for memory defragmentation */
-		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-			zheader = (struct zobj_header *)cmem;
-			zheader->table_idx = index;
-			cmem += sizeof(*zheader);
+	if (zram->dedup_enable) {
+		entry = zram_dedup_insert(zram, handle, clen, checksum);
+		if (entry) {
+			new.entry = entry;
+			new.size = 0;
+			new.flags = BIT(ZRAM_DEDUP);
 		}
-#endif
+	}
 
-		memcpy(cmem, src, clen);
+	/* Object is complete; only now make it visible to readers */
+	zram_set_entry(zram, index, &new);
 
-		kunmap_atomic(cmem, KM_USER1);
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			kunmap_atomic(src, KM_USER0);
+	zram_stat64_add(zram, &zram->stats.compr_size, clen);
+	zram_stat_stored(zram, clen);
+	return 0;
+}
 
-		/* Update stats */
-		zram_stat64_add(zram, &zram->stats.compr_size, clen);
-		zram_stat_inc(&zram->stats.pages_stored);
-		if (clen <= PAGE_SIZE / 2)
-			zram_stat_inc(&zram->stats.good_compress);
+static int zram_write(struct zram *zram, struct bio *bio)
+{
+	int i, ret;
+	u32 index;
+	struct bio_vec *bvec;
+
+	if (unlikely(!zram->init_done)) {
+		ret = zram_init_device(zram);
+		if (ret)
+			goto out;
+	}
+
+	zram_stat64_inc(zram, &zram->stats.num_writes);
+	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+
+	bio_for_each_segment(bvec, bio, i) {
+		ret = zram_write_page(zram, bvec->bv_page, index);
+		if (unlikely(ret)) {
+			zram_stat64_inc(zram, &zram->stats.failed_writes);
+			goto out;
+		}
 
-		mutex_unlock(&zram->lock);
 		index++;
 	}
 
@@ -467,36 +1183,50 @@ void zram_reset_device(struct zram *zram)
 	mutex_lock(&zram->init_lock);
 	zram->init_done = 0;
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
+	zram_stop_writeback(zram);
 
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	/* Free various per-device buffers */
+	zram_free_comp_streams(zram);
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
+		unsigned long handle;
 
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
+		if (zram_test_flag(zram, index, ZRAM_ZERO) ||
+				zram_test_flag(zram, index, ZRAM_SAME) ||
+				zram_test_flag(zram, index, ZRAM_WB))
+			continue;
 
-		if (!page)
+		if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+			struct zram_dedup_entry *entry;
+
+			entry = zram->table[index].entry;
+			if (zram_dedup_put(zram, entry)) {
+				zs_free(zram->mem_pool, entry->handle);
+				kfree(entry);
+			}
+			continue;
+		}
+
+		handle = zram->table[index].handle;
+		if (!handle)
 			continue;
 
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
+			__free_page(zram->table[index].page);
 		else
-			xv_free(zram->mem_pool, page, offset);
+			zs_free(zram->mem_pool, handle);
 	}
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
+	zram_dedup_destroy(zram);
+	zram_close_backing_dev(zram);
+
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
 
@@ -518,19 +1248,9 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
+	ret = zram_alloc_comp_streams(zram);
+	if (ret)
 		goto fail;
-	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
 
 	num_pages = zram->disksize >> PAGE_SHIFT;
 	zram->table = vmalloc(num_pages * sizeof(*zram->table));
@@ -548,13 +1268,23 @@ int zram_init_device(struct zram *zram)
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool();
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
 		goto fail;
 	}
 
+	if (zram->dedup_enable) {
+		ret = zram_dedup_init(zram, num_pages);
+		if (ret)
+			goto fail;
+	}
+
+	ret = zram_start_writeback(zram);
+	if (ret)
+		goto fail;
+
 	zram->init_done = 1;
 	mutex_unlock(&zram->init_lock);
 
@@ -574,7 +1304,11 @@ void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+
+	write_lock(zram_table_lock(zram, index));
 	zram_free_page(zram, index);
+	write_unlock(zram_table_lock(zram, index));
+
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -585,11 +1319,19 @@ static const struct block_device_operations zram_devops = {
 
 static int create_device(struct zram *zram, int device_id)
 {
-	int ret = 0;
+	int i, ret = 0;
 
-	mutex_init(&zram->lock);
 	mutex_init(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	spin_lock_init(&zram->dedup_lock);
+#ifdef CONFIG_ZRAM_WRITEBACK
+	spin_lock_init(&zram->bd_lock);
+	INIT_LIST_HEAD(&zram->bd_reads);
+	init_waitqueue_head(&zram->wb_wait);
+#endif
+	zram->comp = zram_default_compressor();
+	for (i = 0; i < ZRAM_NR_TABLE_LOCKS; i++)
+		rwlock_init(&zram->table_lock[i]);
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
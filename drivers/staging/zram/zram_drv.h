@@ -17,8 +17,12 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/wait.h>
 
-#include "xvmalloc.h"
+#include "zsmalloc.h"
+#include "zram_comp.h"
+#include "zram_dedup.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -26,18 +30,6 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
-};
-
 /*-- Configurable parameters */
 
 /* Default zram disk size: 25% of total RAM */
@@ -49,14 +41,32 @@ static const unsigned default_disksize_perc_ram = 25;
  */
 static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
+/*
+ * Interval at which the writeback thread ages table entries and
+ * looks for pages to move to the backing device (seconds).
+ */
+static const unsigned wb_scan_period = 10;
+
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
 
+/*
+ * Number of locks protecting the table. A table entry is covered by
+ * table_lock[index & (ZRAM_NR_TABLE_LOCKS - 1)]. Must be power of two.
+ */
+#define ZRAM_NR_TABLE_LOCKS	64
+
+/* Max. pages written to the backing device in one batch */
+#define ZRAM_WB_BATCH		32
+
+/* table.age saturates here */
+#define ZRAM_MAX_AGE		255
+
 #define SECTOR_SHIFT		9
 #define SECTOR_SIZE		(1 << SECTOR_SHIFT)
 #define SECTORS_PER_PAGE_SHIFT	(PAGE_SHIFT - SECTOR_SHIFT)
@@ -70,6 +80,18 @@ enum zram_pageflags {
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 
+	/* Page is filled with one repeated word, kept in table.element */
+	ZRAM_SAME,
+
+	/* Object is shared through table.entry (see zram_dedup.c) */
+	ZRAM_DEDUP,
+
+	/* Page lives on the backing device at block table.bd_block */
+	ZRAM_WB,
+
+	/* Page is being written to the backing device */
+	ZRAM_UNDER_WB,
+
 	__NR_ZRAM_PAGEFLAGS,
 };
 
@@ -77,9 +99,15 @@ enum zram_pageflags {
 
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
-	u8 count;	/* object ref count (not yet used) */
+	union {
+		unsigned long handle;		/* compressed object */
+		struct page *page;		/* ZRAM_UNCOMPRESSED */
+		struct zram_dedup_entry *entry;	/* ZRAM_DEDUP */
+		unsigned long element;		/* ZRAM_SAME */
+		unsigned long bd_block;		/* ZRAM_WB */
+	};
+	u16 size;	/* compressed size */
+	u8 age;		/* writeback scan periods since last access */
 	u8 flags;
 } __attribute__((aligned(4)));
 
@@ -91,23 +119,62 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 pages_expand;	/* % of incompressible pages */
+	u64 compr_time;		/* ns spent compressing pages */
+	u64 decompr_time;	/* ns spent decompressing pages */
+	u64 num_compr;		/* no. of pages passed to the compressor */
+	u64 num_decompr;	/* no. of pages passed to the decompressor */
+	u64 dup_size;		/* compressed bytes saved by deduplication */
+	atomic_t pages_zero;	/* no. of zero filled pages */
+	atomic_t pages_same;	/* no. of single-word filled pages */
+	atomic_t pages_dup;	/* no. of pages sharing another's object */
+	atomic_t pages_wb;	/* no. of pages on the backing device */
+	u64 bd_reads;		/* no. of pages read from backing device */
+	u64 bd_writes;		/* no. of pages written to backing device */
+	u64 failed_bd_writes;	/* backing device write errors */
+	atomic_t pages_stored;	/* no. of pages currently stored */
+	atomic_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic_t pages_expand;	/* % of incompressible pages */
+};
+
+/*
+ * Per-cpu compression stream. A writer normally uses the stream of the
+ * CPU it runs on; the mutex only matters when a writer sleeps in the
+ * allocator and another writer gets scheduled on the same CPU.
+ */
+struct zram_comp_stream {
+	struct mutex lock;
+	void *workmem;		/* compressor working memory */
+	void *buffer;		/* compressed output (2 pages) */
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	const struct zram_compressor *comp;
+	struct zram_comp_stream __percpu *comp_streams;
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
+	rwlock_t table_lock[ZRAM_NR_TABLE_LOCKS];	/* protect table
+							 * entries */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
+	int dedup_enable;	/* set through sysfs before init */
+	struct hlist_head *dedup_table;
+	unsigned long dedup_mask;
+	spinlock_t dedup_lock;	/* protect dedup_table and refcounts */
+#ifdef CONFIG_ZRAM_WRITEBACK
+	struct block_device *bdev;	/* backing device, set through sysfs */
+	unsigned long *bd_bitmap;	/* blocks in use on bdev */
+	unsigned long nr_bd_pages;
+	spinlock_t bd_lock;		/* protect bd_bitmap, bd_reads */
+	struct list_head bd_reads;	/* reads from bdev in flight */
+	struct task_struct *wb_thread;
+	wait_queue_head_t wb_wait;
+	atomic_t wb_pending;		/* incompressible pages not yet
+					 * written back */
+	unsigned int wb_idle_age;	/* seconds; 0 disables writeback
+					 * of idle pages */
+#endif
 	/* Prevent concurrent execution of device init and reset */
 	struct mutex init_lock;
 	/*
@@ -127,5 +194,8 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
+#ifdef CONFIG_ZRAM_WRITEBACK
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+#endif
 
 #endif
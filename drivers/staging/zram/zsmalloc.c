@@ -0,0 +1,635 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Written for zram in this tree to replace xvmalloc. The design follows
+ * the zsmalloc allocator in drivers/staging/zsmalloc of Linux 3.3
+ * (Copyright (C) 2011 Nitin Gupta); the code is not taken from it.
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * Size-class allocator for compressed pages.
+ *
+ * Each object size is rounded up to one of ZS_NR_SIZE_CLASSES classes.
+ * A class allocates its memory in "zspages": groups of 1 to
+ * ZS_MAX_PAGES_PER_ZSPAGE pages, the count being chosen so that objects
+ * of that size pack with as little waste as possible. Objects are laid
+ * out back to back and may straddle two pages of a zspage.
+ *
+ * Callers refer to objects through handles, and access them only
+ * between zs_map_object() and zs_unmap_object(). This lets zs_compact()
+ * move objects out of sparsely used zspages into denser ones, so that
+ * whole zspages can be released when the size distribution drifts.
+ */
+
+#include <linux/bitops.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/bit_spinlock.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+static unsigned int get_size_class_index(size_t size)
+{
+	if (size < ZS_MIN_ALLOC_SIZE)
+		size = ZS_MIN_ALLOC_SIZE;
+
+	return DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE, ZS_SIZE_CLASS_DELTA);
+}
+
+/*
+ * Pick the number of pages per zspage that wastes the least space
+ * for objects of the given size.
+ */
+static unsigned int get_pages_per_zspage(unsigned int size)
+{
+	unsigned int i, best = 1, best_usedpc = 0;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		unsigned int zspage_size = i * PAGE_SIZE;
+		unsigned int usedpc;
+
+		usedpc = (zspage_size - zspage_size % size) * 100 /
+				zspage_size;
+		if (usedpc > best_usedpc) {
+			best_usedpc = usedpc;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static enum fullness_group get_fullness_group(struct size_class *class,
+					struct zspage *zspage)
+{
+	if (!zspage->inuse)
+		return ZS_EMPTY;
+
+	if (zspage->inuse == class->objs_per_zspage)
+		return ZS_FULL;
+
+	if (zspage->inuse * ZS_ALMOST_EMPTY_DEN <=
+			class->objs_per_zspage * ZS_ALMOST_EMPTY_NUM)
+		return ZS_ALMOST_EMPTY;
+
+	return ZS_ALMOST_FULL;
+}
+
+/*
+ * Move zspage to the list matching its current usage.
+ * Empty zspages are unlinked; the caller frees them.
+ */
+static void fix_fullness_group(struct size_class *class,
+				struct zspage *zspage)
+{
+	enum fullness_group fullness = get_fullness_group(class, zspage);
+
+	if (fullness == zspage->fullness)
+		return;
+
+	if (fullness == ZS_EMPTY)
+		list_del(&zspage->list);
+	else
+		list_move(&zspage->list, &class->fullness_list[fullness]);
+
+	zspage->fullness = fullness;
+}
+
+/* Locate byte 'off' of a zspage */
+static struct page *zspage_page(struct zspage *zspage, unsigned long off,
+				unsigned long *page_off)
+{
+	*page_off = off & ~PAGE_MASK;
+	return zspage->pages[off >> PAGE_SHIFT];
+}
+
+/*
+ * Copy 'len' bytes between a buffer and a zspage, crossing page
+ * boundaries as needed.
+ */
+static void zspage_copy(struct zspage *zspage, unsigned long off,
+			void *buf, size_t len, int to_zspage,
+			enum km_type type)
+{
+	while (len) {
+		unsigned long page_off;
+		struct page *page = zspage_page(zspage, off, &page_off);
+		size_t n = min_t(size_t, len, PAGE_SIZE - page_off);
+		char *vaddr = kmap_atomic(page, type);
+
+		if (to_zspage)
+			memcpy(vaddr + page_off, buf, n);
+		else
+			memcpy(buf, vaddr + page_off, n);
+		kunmap_atomic(vaddr, type);
+
+		off += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+static unsigned long obj_offset(struct size_class *class, unsigned int idx)
+{
+	return (unsigned long)idx * class->size;
+}
+
+/* Object headers never straddle pages thanks to ZS_ALIGN */
+static void obj_set_handle(struct zspage *zspage, unsigned int idx,
+			struct zs_handle *handle)
+{
+	unsigned long page_off;
+	struct page *page;
+	unsigned long *vaddr;
+
+	page = zspage_page(zspage, obj_offset(zspage->class, idx), &page_off);
+	vaddr = kmap_atomic(page, KM_USER0) + page_off;
+	*vaddr = (unsigned long)handle;
+	kunmap_atomic(vaddr, KM_USER0);
+}
+
+static struct zs_handle *obj_get_handle(struct zspage *zspage,
+				unsigned int idx)
+{
+	unsigned long page_off, handle;
+	struct page *page;
+	unsigned long *vaddr;
+
+	page = zspage_page(zspage, obj_offset(zspage->class, idx), &page_off);
+	vaddr = kmap_atomic(page, KM_USER0) + page_off;
+	handle = *vaddr;
+	kunmap_atomic(vaddr, KM_USER0);
+
+	return (struct zs_handle *)handle;
+}
+
+/* Take a free object slot of zspage. Caller holds class lock. */
+static unsigned int obj_alloc(struct size_class *class, struct zspage *zspage)
+{
+	unsigned int idx;
+
+	idx = find_first_zero_bit(zspage->used_map, class->objs_per_zspage);
+	BUG_ON(idx >= class->objs_per_zspage);
+
+	__set_bit(idx, zspage->used_map);
+	zspage->inuse++;
+	class->objs_inuse++;
+
+	return idx;
+}
+
+static void obj_free(struct size_class *class, struct zspage *zspage,
+			unsigned int idx)
+{
+	BUG_ON(!test_bit(idx, zspage->used_map));
+
+	__clear_bit(idx, zspage->used_map);
+	zspage->inuse--;
+	class->objs_inuse--;
+}
+
+static void free_zspage(struct zs_pool *pool, struct zspage *zspage)
+{
+	unsigned int i;
+	struct size_class *class = zspage->class;
+
+	for (i = 0; i < class->pages_per_zspage; i++)
+		__free_page(zspage->pages[i]);
+
+	class->nr_zspages--;
+	atomic_long_sub(class->pages_per_zspage, &pool->pages_allocated);
+	kfree(zspage);
+}
+
+static struct zspage *alloc_zspage(struct size_class *class, gfp_t flags)
+{
+	unsigned int i;
+	struct zspage *zspage;
+
+	zspage = kzalloc(sizeof(*zspage), flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+
+	zspage->class = class;
+	INIT_LIST_HEAD(&zspage->list);
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		zspage->pages[i] = alloc_page(flags);
+		if (!zspage->pages[i])
+			goto fail;
+	}
+
+	return zspage;
+
+fail:
+	while (i)
+		__free_page(zspage->pages[--i]);
+	kfree(zspage);
+	return NULL;
+}
+
+/* Prefer the fullest zspages so that sparse ones can drain */
+static struct zspage *find_zspage(struct size_class *class)
+{
+	if (!list_empty(&class->fullness_list[ZS_ALMOST_FULL]))
+		return list_first_entry(&class->fullness_list[ZS_ALMOST_FULL],
+					struct zspage, list);
+
+	if (!list_empty(&class->fullness_list[ZS_ALMOST_EMPTY]))
+		return list_first_entry(
+				&class->fullness_list[ZS_ALMOST_EMPTY],
+				struct zspage, list);
+
+	return NULL;
+}
+
+/*
+ * Create a memory pool. Sets up size classes and the per-cpu
+ * buffers used to map objects that straddle pages.
+ */
+struct zs_pool *zs_create_pool(void)
+{
+	int i, cpu;
+	struct zs_pool *pool;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < ZS_NR_SIZE_CLASSES; i++) {
+		int fg;
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock_init(&class->lock);
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage * PAGE_SIZE /
+						class->size;
+		for (fg = 0; fg < __NR_ZS_FULLNESS; fg++)
+			INIT_LIST_HEAD(&class->fullness_list[fg]);
+	}
+
+	pool->map_area = alloc_percpu(struct zs_map_area);
+	if (!pool->map_area)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		struct zs_map_area *area = per_cpu_ptr(pool->map_area, cpu);
+
+		area->buf = kmalloc(ZS_MAX_ALLOC_SIZE + ZS_HANDLE_SIZE,
+					GFP_KERNEL);
+		if (!area->buf)
+			goto fail;
+	}
+
+	return pool;
+
+fail:
+	zs_destroy_pool(pool);
+	return NULL;
+}
+
+/* All objects must have been freed */
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i, cpu;
+
+	for (i = 0; i < ZS_NR_SIZE_CLASSES; i++) {
+		int fg;
+		struct size_class *class = &pool->size_class[i];
+
+		for (fg = 0; fg < __NR_ZS_FULLNESS; fg++)
+			WARN_ON(!list_empty(&class->fullness_list[fg]));
+	}
+
+	if (pool->map_area) {
+		for_each_possible_cpu(cpu)
+			kfree(per_cpu_ptr(pool->map_area, cpu)->buf);
+		free_percpu(pool->map_area);
+	}
+
+	kfree(pool);
+}
+
+/**
+ * zs_malloc - Allocate object of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of object to allocate
+ * @flags: flags for pages, in case the pool must grow
+ *
+ * Returns a handle to the object, or 0 on failure. The object must
+ * be mapped with zs_map_object() to be accessed.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags)
+{
+	unsigned int idx, class_idx;
+	struct size_class *class;
+	struct zspage *zspage, *new = NULL;
+	struct zs_handle *handle;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	size = ALIGN(size + ZS_HANDLE_SIZE, ZS_ALIGN);
+	class_idx = get_size_class_index(size);
+	class = &pool->size_class[class_idx];
+	BUG_ON(class->size < size);
+
+	handle = kmalloc(sizeof(*handle), flags & ~__GFP_HIGHMEM);
+	if (!handle)
+		return 0;
+	handle->flags = 0;
+	handle->class_idx = class_idx;
+
+	spin_lock(&class->lock);
+	zspage = find_zspage(class);
+	if (!zspage) {
+		spin_unlock(&class->lock);
+
+		new = alloc_zspage(class, flags);
+		if (!new) {
+			kfree(handle);
+			return 0;
+		}
+
+		spin_lock(&class->lock);
+		zspage = find_zspage(class);
+		if (!zspage) {
+			zspage = new;
+			zspage->fullness = ZS_ALMOST_EMPTY;
+			list_add(&zspage->list,
+				&class->fullness_list[ZS_ALMOST_EMPTY]);
+			class->nr_zspages++;
+			atomic_long_add(class->pages_per_zspage,
+					&pool->pages_allocated);
+			new = NULL;
+		}
+	}
+
+	idx = obj_alloc(class, zspage);
+	fix_fullness_group(class, zspage);
+
+	handle->zspage = zspage;
+	handle->idx = idx;
+	obj_set_handle(zspage, idx, handle);
+	spin_unlock(&class->lock);
+
+	/* Somebody else grew the class while we were allocating */
+	if (new) {
+		unsigned int i;
+
+		for (i = 0; i < class->pages_per_zspage; i++)
+			__free_page(new->pages[i]);
+		kfree(new);
+	}
+
+	return (unsigned long)handle;
+}
+
+void zs_free(struct zs_pool *pool, unsigned long obj)
+{
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct zspage *zspage;
+	struct size_class *class;
+
+	if (unlikely(!handle))
+		return;
+
+	/* The zspage of an object can only change under the class lock */
+	class = &pool->size_class[handle->class_idx];
+
+	spin_lock(&class->lock);
+	zspage = handle->zspage;
+	obj_free(class, zspage, handle->idx);
+	fix_fullness_group(class, zspage);
+	if (zspage->fullness == ZS_EMPTY)
+		free_zspage(pool, zspage);
+	spin_unlock(&class->lock);
+
+	kfree(handle);
+}
+
+/**
+ * zs_map_object - Get a pointer to the contents of an object.
+ * @pool: pool the object was allocated from
+ * @handle: handle returned by zs_malloc()
+ * @mm: how the object is going to be accessed
+ *
+ * The mapping is per-cpu and atomic, like kmap_atomic() with KM_USER1,
+ * which the caller must not be using. Only one object can be mapped at
+ * a time, and the object cannot be migrated while it is mapped.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long obj,
+			enum zs_mapmode mm)
+{
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct zs_map_area *area;
+	struct size_class *class;
+	struct zspage *zspage;
+	unsigned long off, page_off;
+	struct page *page;
+
+	bit_spin_lock(ZS_HANDLE_PIN, &handle->flags);
+
+	zspage = handle->zspage;
+	class = zspage->class;
+	off = obj_offset(class, handle->idx);
+	page = zspage_page(zspage, off, &page_off);
+
+	area = per_cpu_ptr(pool->map_area, get_cpu());
+	area->mm = mm;
+	area->straddle = page_off + class->size > PAGE_SIZE;
+
+	if (!area->straddle) {
+		area->vaddr = kmap_atomic(page, KM_USER1);
+		return area->vaddr + page_off + ZS_HANDLE_SIZE;
+	}
+
+	if (mm != ZS_MM_WO)
+		zspage_copy(zspage, off, area->buf, class->size, 0, KM_USER1);
+
+	return area->buf + ZS_HANDLE_SIZE;
+}
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long obj)
+{
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct zs_map_area *area;
+
+	area = per_cpu_ptr(pool->map_area, smp_processor_id());
+
+	if (!area->straddle) {
+		kunmap_atomic(area->vaddr, KM_USER1);
+	} else if (area->mm != ZS_MM_RO) {
+		struct zspage *zspage = handle->zspage;
+		struct size_class *class = zspage->class;
+
+		/* Leave the stored back-reference alone */
+		zspage_copy(zspage, obj_offset(class, handle->idx) +
+				ZS_HANDLE_SIZE, area->buf + ZS_HANDLE_SIZE,
+				class->size - ZS_HANDLE_SIZE, 1, KM_USER1);
+	}
+
+	put_cpu();
+	bit_spin_unlock(ZS_HANDLE_PIN, &handle->flags);
+}
+
+/*
+ * Move as many objects as fit from 'src' to 'dst'. Objects that are
+ * mapped right now are left in place. Returns no. of objects moved.
+ * Caller holds class lock.
+ */
+static unsigned int migrate_zspage(struct size_class *class,
+			struct zspage *src, struct zspage *dst, char *buf)
+{
+	unsigned int idx = 0, moved = 0;
+
+	while (dst->inuse < class->objs_per_zspage) {
+		unsigned int new_idx;
+		struct zs_handle *handle;
+
+		idx = find_next_bit(src->used_map, class->objs_per_zspage,
+					idx);
+		if (idx >= class->objs_per_zspage)
+			break;
+
+		handle = obj_get_handle(src, idx);
+		if (!bit_spin_trylock(ZS_HANDLE_PIN, &handle->flags)) {
+			idx++;
+			continue;
+		}
+
+		new_idx = obj_alloc(class, dst);
+		zspage_copy(src, obj_offset(class, idx), buf, class->size, 0,
+				KM_USER0);
+		zspage_copy(dst, obj_offset(class, new_idx), buf,
+				class->size, 1, KM_USER0);
+		obj_free(class, src, idx);
+
+		handle->zspage = dst;
+		handle->idx = new_idx;
+		bit_spin_unlock(ZS_HANDLE_PIN, &handle->flags);
+
+		moved++;
+		idx++;
+	}
+
+	return moved;
+}
+
+/*
+ * Can compaction of this class free at least one zspage?
+ * Caller holds class lock.
+ */
+static int zs_can_compact(struct size_class *class)
+{
+	unsigned long obj_free = class->nr_zspages * class->objs_per_zspage -
+					class->objs_inuse;
+
+	return obj_free >= class->objs_per_zspage;
+}
+
+static unsigned long zs_compact_class(struct zs_pool *pool,
+			struct size_class *class, char *buf)
+{
+	unsigned long freed = 0;
+	struct list_head *almost_empty, *almost_full;
+
+	almost_empty = &class->fullness_list[ZS_ALMOST_EMPTY];
+	almost_full = &class->fullness_list[ZS_ALMOST_FULL];
+
+	spin_lock(&class->lock);
+	while (zs_can_compact(class) && !list_empty(almost_empty)) {
+		struct zspage *src, *dst;
+
+		/* Drain the emptiest-looking zspage into the fullest one */
+		src = list_entry(almost_empty->prev, struct zspage, list);
+		if (!list_empty(almost_full))
+			dst = list_first_entry(almost_full, struct zspage,
+						list);
+		else
+			dst = list_first_entry(almost_empty, struct zspage,
+						list);
+		if (dst == src)
+			break;
+
+		if (!migrate_zspage(class, src, dst, buf))
+			break;
+
+		fix_fullness_group(class, dst);
+		fix_fullness_group(class, src);
+		if (src->fullness == ZS_EMPTY) {
+			free_zspage(pool, src);
+			freed += class->pages_per_zspage;
+		}
+
+		spin_unlock(&class->lock);
+		cond_resched();
+		spin_lock(&class->lock);
+	}
+	spin_unlock(&class->lock);
+
+	return freed;
+}
+
+/*
+ * Migrate objects out of sparsely used zspages and release the
+ * pages freed up. Returns no. of pages released.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	char *buf;
+	unsigned long freed = 0;
+
+	buf = kmalloc(ZS_MAX_ALLOC_SIZE + ZS_HANDLE_SIZE, GFP_KERNEL);
+	if (!buf)
+		return 0;
+
+	for (i = ZS_NR_SIZE_CLASSES - 1; i >= 0; i--) {
+		freed += zs_compact_class(pool, &pool->size_class[i], buf);
+		cond_resched();
+	}
+
+	kfree(buf);
+
+	atomic_long_add(freed, &pool->pages_compacted);
+	return freed;
+}
+
+/*
+ * Returns total memory used by allocator (userdata + metadata)
+ */
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->pages_allocated) << PAGE_SHIFT;
+}
+
+void zs_get_stats(struct zs_pool *pool, struct zs_pool_stats *stats)
+{
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (i = 0; i < ZS_NR_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock(&class->lock);
+		stats->obj_used_bytes += (u64)class->objs_inuse * class->size;
+		spin_unlock(&class->lock);
+	}
+
+	stats->pages_allocated = atomic_long_read(&pool->pages_allocated);
+	stats->pages_compacted = atomic_long_read(&pool->pages_compacted);
+}
@@ -0,0 +1,51 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Written for zram in this tree to replace xvmalloc. The design follows
+ * the zsmalloc allocator in drivers/staging/zsmalloc of Linux 3.3
+ * (Copyright (C) 2011 Nitin Gupta); the code is not taken from it.
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_H_
+#define _ZS_MALLOC_H_
+
+#include <linux/types.h>
+
+/* Objects larger than this cannot be allocated */
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+
+enum zs_mapmode {
+	ZS_MM_RO,	/* object is only read */
+	ZS_MM_WO,	/* object is only written */
+};
+
+struct zs_pool;
+
+struct zs_pool_stats {
+	u64 pages_allocated;	/* pages owned by the pool */
+	u64 obj_used_bytes;	/* bytes in live objects (incl. rounding) */
+	u64 pages_compacted;	/* pages released by zs_compact() */
+};
+
+struct zs_pool *zs_create_pool(void);
+void zs_destroy_pool(struct zs_pool *pool);
+
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags);
+void zs_free(struct zs_pool *pool, unsigned long handle);
+
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm);
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle);
+
+unsigned long zs_compact(struct zs_pool *pool);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool);
+void zs_get_stats(struct zs_pool *pool, struct zs_pool_stats *stats);
+
+#endif
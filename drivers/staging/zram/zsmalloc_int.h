@@ -0,0 +1,122 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Written for zram in this tree to replace xvmalloc. The design follows
+ * the zsmalloc allocator in drivers/staging/zsmalloc of Linux 3.3
+ * (Copyright (C) 2011 Nitin Gupta); the code is not taken from it.
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/* User configurable params */
+
+/* Objects are laid out back to back, so sizes keep this alignment */
+#define ZS_ALIGN		8
+
+/* Every object starts with a back-reference to its handle */
+#define ZS_HANDLE_SIZE		sizeof(unsigned long)
+
+#define ZS_MIN_ALLOC_SIZE	32
+
+/* Size classes are separated by ZS_SIZE_CLASS_DELTA bytes */
+#define ZS_SIZE_CLASS_DELTA	16
+#define ZS_NR_SIZE_CLASSES	(DIV_ROUND_UP(ZS_MAX_ALLOC_SIZE + \
+				ZS_HANDLE_SIZE - ZS_MIN_ALLOC_SIZE, \
+				ZS_SIZE_CLASS_DELTA) + 1)
+
+/*
+ * A zspage is a group of up to this many (not necessarily contiguous)
+ * pages holding objects of one size class. Objects may straddle the
+ * boundary between two pages of a zspage.
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+#define ZS_MAX_OBJS_PER_ZSPAGE	(ZS_MAX_PAGES_PER_ZSPAGE * PAGE_SIZE / \
+					ZS_MIN_ALLOC_SIZE)
+
+/*
+ * A zspage is "almost empty" (a compaction source) when at most
+ * this fraction of its objects are in use.
+ */
+#define ZS_ALMOST_EMPTY_NUM	3
+#define ZS_ALMOST_EMPTY_DEN	4
+
+/* End of user params */
+
+enum fullness_group {
+	ZS_EMPTY,
+	ZS_ALMOST_EMPTY,
+	ZS_ALMOST_FULL,
+	ZS_FULL,
+	__NR_ZS_FULLNESS,
+};
+
+/* zs_handle.flags */
+enum handleflags {
+	ZS_HANDLE_PIN,	/* object is mapped or being migrated */
+	__NR_HANDLEFLAGS,
+};
+
+struct size_class;
+
+struct zspage {
+	struct list_head list;		/* in class->fullness_list */
+	struct size_class *class;
+	unsigned int inuse;		/* no. of allocated objects */
+	enum fullness_group fullness;
+	unsigned long used_map[BITS_TO_LONGS(ZS_MAX_OBJS_PER_ZSPAGE)];
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+};
+
+/*
+ * What callers get from zs_malloc(). The location of an object only
+ * changes under its class lock with ZS_HANDLE_PIN held.
+ */
+struct zs_handle {
+	unsigned long flags;
+	struct zspage *zspage;
+	u16 idx;			/* object index within zspage */
+	u16 class_idx;			/* never changes */
+};
+
+struct size_class {
+	spinlock_t lock;
+	unsigned int size;		/* object size, incl. handle */
+	unsigned int pages_per_zspage;
+	unsigned int objs_per_zspage;
+	struct list_head fullness_list[__NR_ZS_FULLNESS];
+
+	/* stats */
+	unsigned long nr_zspages;
+	unsigned long objs_inuse;
+};
+
+/* Per-cpu state of the object currently mapped by zs_map_object() */
+struct zs_map_area {
+	char *buf;			/* copy of a straddling object */
+	void *vaddr;			/* kmap of a contained object */
+	enum zs_mapmode mm;
+	int straddle;
+};
+
+struct zs_pool {
+	struct size_class size_class[ZS_NR_SIZE_CLASSES];
+	struct zs_map_area __percpu *map_area;
+
+	/* stats */
+	atomic_long_t pages_allocated;
+	atomic_long_t pages_compacted;
+};
+
+#endif
@@ -913,6 +913,8 @@ static int de_thread(struct task_struct *tsk)
 		write_unlock_irq(&tasklist_lock);
 
 		release_task(leader);
+		/* We took over oom_adj bookkeeping from the old leader */
+		oom_adj_notify(tsk);
 	}
 
 	sig->group_exit_task = NULL;
@@ -1023,7 +1023,7 @@ static ssize_t oom_adjust_read(struct file *file, char __user *buf,
 static ssize_t oom_adjust_write(struct file *file, const char __user *buf,
 				size_t count, loff_t *ppos)
 {
-	struct task_struct *task;
+	struct task_struct *task, *leader = NULL;
 	char buffer[PROC_NUMBUF];
 	long oom_adjust;
 	unsigned long flags;
@@ -1093,10 +1093,17 @@ static ssize_t oom_adjust_write(struct file *file, const char __user *buf,
 	else
 		task->signal->oom_score_adj = (oom_adjust * OOM_SCORE_ADJ_MAX) /
 								-OOM_DISABLE;
+	/* The group cannot be released while we hold its siglock */
+	leader = task->group_leader;
+	get_task_struct(leader);
 err_sighand:
 	unlock_task_sighand(task, &flags);
 err_task_lock:
 	task_unlock(task);
+	if (leader) {
+		oom_adj_notify(leader);
+		put_task_struct(leader);
+	}
 	put_task_struct(task);
 out:
 	return err < 0 ? err : count;
@@ -1158,7 +1165,7 @@ static ssize_t oom_score_adj_read(struct file *file, char __user *buf,
 static ssize_t oom_score_adj_write(struct file *file, const char __user *buf,
 					size_t count, loff_t *ppos)
 {
-	struct task_struct *task;
+	struct task_struct *task, *leader = NULL;
 	char buffer[PROC_NUMBUF];
 	unsigned long flags;
 	long oom_score_adj;
@@ -1220,10 +1227,17 @@ static ssize_t oom_score_adj_write(struct file *file, const char __user *buf,
 	else
 		task->signal->oom_adj = (oom_score_adj * OOM_ADJUST_MAX) /
 							OOM_SCORE_ADJ_MAX;
+	/* The group cannot be released while we hold its siglock */
+	leader = task->group_leader;
+	get_task_struct(leader);
 err_sighand:
 	unlock_task_sighand(task, &flags);
 err_task_lock:
 	task_unlock(task);
+	if (leader) {
+		oom_adj_notify(leader);
+		put_task_struct(leader);
+	}
 	put_task_struct(task);
 out:
 	return err < 0 ? err : count;
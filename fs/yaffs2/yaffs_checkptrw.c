@@ -273,16 +273,75 @@ int yaffs2_CheckpointWrite(yaffs_Device *dev, const void *data, int nBytes)
 	return i;
 }
 
-int yaffs2_CheckpointRead(yaffs_Device *dev, void *data, int nBytes)
+/* Move the read stream on to its next chunk, reading it in if readData
+ * is set. Chunks that are skipped over are not read at all.
+ */
+static int yaffs2_CheckpointNextChunk(yaffs_Device *dev, int readData)
 {
-	int i = 0;
 	int ok = 1;
 	yaffs_ExtendedTags tags;
 
-
 	int chunk;
 	int realignedChunk;
 
+	if (dev->checkpointCurrentBlock < 0) {
+		if (dev->checkpointReopened) {
+			/*
+			 * The blocks were all found at mount. Those already
+			 * erased are -1 in the list.
+			 */
+			int i = dev->checkpointPageSequence / dev->param.nChunksPerBlock;
+
+			dev->checkpointCurrentBlock = (i < dev->checkpointMaxBlocks) ?
+				dev->checkpointBlockList[i] : -1;
+			dev->checkpointCurrentChunk =
+				dev->checkpointPageSequence % dev->param.nChunksPerBlock;
+		} else {
+			yaffs2_CheckpointFindNextCheckpointBlock(dev);
+			dev->checkpointCurrentChunk = 0;
+		}
+	}
+
+	if (dev->checkpointCurrentBlock < 0)
+		return 0;
+
+	if (readData) {
+		chunk = dev->checkpointCurrentBlock *
+			dev->param.nChunksPerBlock +
+			dev->checkpointCurrentChunk;
+
+		realignedChunk = chunk - dev->chunkOffset;
+
+		dev->nPageReads++;
+
+		/* read in the next chunk */
+		/* printf("read checkpoint page %d\n",dev->checkpointPage); */
+		dev->param.readChunkWithTagsFromNAND(dev,
+				realignedChunk,
+				dev->checkpointBuffer,
+				&tags);
+
+		if (tags.chunkId != (dev->checkpointPageSequence + 1) ||
+			tags.eccResult > YAFFS_ECC_RESULT_FIXED ||
+			tags.sequenceNumber != YAFFS_SEQUENCE_CHECKPOINT_DATA)
+			ok = 0;
+	}
+
+	dev->checkpointByteOffset = 0;
+	dev->checkpointPageSequence++;
+	dev->checkpointCurrentChunk++;
+
+	if (dev->checkpointCurrentChunk >= dev->param.nChunksPerBlock)
+		dev->checkpointCurrentBlock = -1;
+
+	return ok;
+}
+
+int yaffs2_CheckpointRead(yaffs_Device *dev, void *data, int nBytes)
+{
+	int i = 0;
+	int ok = 1;
+
 	__u8 *dataBytes = (__u8 *)data;
 
 	if (!dev->checkpointBuffer)
@@ -295,44 +354,8 @@ int yaffs2_CheckpointRead(yaffs_Device *dev, void *data, int nBytes)
 
 
 		if (dev->checkpointByteOffset < 0 ||
-			dev->checkpointByteOffset >= dev->nDataBytesPerChunk) {
-
-			if (dev->checkpointCurrentBlock < 0) {
-				yaffs2_CheckpointFindNextCheckpointBlock(dev);
-				dev->checkpointCurrentChunk = 0;
-			}
-
-			if (dev->checkpointCurrentBlock < 0)
-				ok = 0;
-			else {
-				chunk = dev->checkpointCurrentBlock *
-					dev->param.nChunksPerBlock +
-					dev->checkpointCurrentChunk;
-
-				realignedChunk = chunk - dev->chunkOffset;
-				
-				dev->nPageReads++;
-
-				/* read in the next chunk */
-				/* printf("read checkpoint page %d\n",dev->checkpointPage); */
-				dev->param.readChunkWithTagsFromNAND(dev,
-						realignedChunk,
-						dev->checkpointBuffer,
-						&tags);
-
-				if (tags.chunkId != (dev->checkpointPageSequence + 1) ||
-					tags.eccResult > YAFFS_ECC_RESULT_FIXED ||
-					tags.sequenceNumber != YAFFS_SEQUENCE_CHECKPOINT_DATA)
-					ok = 0;
-
-				dev->checkpointByteOffset = 0;
-				dev->checkpointPageSequence++;
-				dev->checkpointCurrentChunk++;
-
-				if (dev->checkpointCurrentChunk >= dev->param.nChunksPerBlock)
-					dev->checkpointCurrentBlock = -1;
-			}
-		}
+			dev->checkpointByteOffset >= dev->nDataBytesPerChunk)
+			ok = yaffs2_CheckpointNextChunk(dev, 1);
 
 		if (ok) {
 			*dataBytes = dev->checkpointBuffer[dev->checkpointByteOffset];
@@ -348,9 +371,94 @@ int yaffs2_CheckpointRead(yaffs_Device *dev, void *data, int nBytes)
 	return 	i;
 }
 
+/*
+ * Skip over nBytes of the read stream without reading them, adding in
+ * the sum and xor that reading them would have added to the checksum.
+ * Only the chunk the skip ends in is read.
+ */
+int yaffs2_CheckpointSkip(yaffs_Device *dev, int nBytes, __u32 sum, __u32 xorSum)
+{
+	int ok = 1;
+	int n;
+
+	if (!dev->checkpointBuffer)
+		return 0;
+
+	if (dev->checkpointOpenForWrite)
+		return 0;
+
+	while (nBytes > 0 && ok) {
+		if (dev->checkpointByteOffset < 0 ||
+			dev->checkpointByteOffset >= dev->nDataBytesPerChunk) {
+			ok = yaffs2_CheckpointNextChunk(dev,
+					nBytes < dev->nDataBytesPerChunk);
+			continue;
+		}
+
+		n = dev->nDataBytesPerChunk - dev->checkpointByteOffset;
+		if (n > nBytes)
+			n = nBytes;
+
+		dev->checkpointByteOffset += n;
+		dev->checkpointByteCount += n;
+		nBytes -= n;
+	}
+
+	if (ok) {
+		dev->checkpointSum += sum;
+		dev->checkpointXor ^= xorSum;
+	}
+
+	return ok;
+}
+
+/*
+ * Reopen the checkpoint after mount to read from byteOffset on. This uses
+ * the block list kept from the mount, so it only works while the
+ * checkpoint is still valid. The checksum starts again from zero.
+ */
+int yaffs2_CheckpointReopen(yaffs_Device *dev, int byteOffset)
+{
+	int ok = 1;
+
+	if (!dev->checkpointBlockList || dev->checkpointBuffer)
+		return 0;
+
+	dev->checkpointBuffer = YMALLOC_DMA(dev->param.totalBytesPerChunk);
+	if (!dev->checkpointBuffer)
+		return 0;
+
+	dev->checkpointOpenForWrite = 0;
+	dev->checkpointReopened = 1;
+
+	dev->checkpointPageSequence = byteOffset / dev->nDataBytesPerChunk;
+	dev->checkpointByteCount = byteOffset;
+	dev->checkpointSum = 0;
+	dev->checkpointXor = 0;
+	dev->checkpointCurrentBlock = -1;
+	dev->checkpointByteOffset = dev->nDataBytesPerChunk;
+
+	if (byteOffset % dev->nDataBytesPerChunk) {
+		ok = yaffs2_CheckpointNextChunk(dev, 1);
+		dev->checkpointByteOffset = byteOffset % dev->nDataBytesPerChunk;
+	}
+
+	if (!ok)
+		yaffs2_CheckpointClose(dev);
+
+	return ok;
+}
+
 int yaffs2_CheckpointClose(yaffs_Device *dev)
 {
 
+	if (dev->checkpointReopened) {
+		dev->checkpointReopened = 0;
+		YFREE(dev->checkpointBuffer);
+		dev->checkpointBuffer = NULL;
+		return 1;
+	}
+
 	if (dev->checkpointOpenForWrite) {
 		if (dev->checkpointByteOffset != 0)
 			yaffs2_CheckpointFlushBuffer(dev);
@@ -367,8 +475,11 @@ int yaffs2_CheckpointClose(yaffs_Device *dev)
 				/* Todo this looks odd... */
 			}
 		}
-		YFREE(dev->checkpointBlockList);
-		dev->checkpointBlockList = NULL;
+		/* Keep the block list while there are tnodes to be lazy loaded */
+		if (!dev->nLazyTnodeFiles) {
+			YFREE(dev->checkpointBlockList);
+			dev->checkpointBlockList = NULL;
+		}
 	}
 
 	dev->nFreeChunks -= dev->blocksInCheckpoint * dev->param.nChunksPerBlock;
@@ -387,6 +498,46 @@ int yaffs2_CheckpointClose(yaffs_Device *dev)
 		return 0;
 }
 
+/*
+ * Erase only the first block of a checkpoint kept from mount. It holds the
+ * validity marker, so this is enough to stop the checkpoint being used
+ * again, while the other blocks can still be read with
+ * yaffs2_CheckpointReopen().
+ */
+int yaffs2_CheckpointInvalidateHead(yaffs_Device *dev)
+{
+	yaffs_BlockInfo *bi;
+	int blk;
+
+	if (!dev->param.eraseBlockInNAND || !dev->checkpointBlockList)
+		return 0;
+
+	blk = dev->checkpointBlockList[0];
+	if (blk < dev->internalStartBlock || blk > dev->internalEndBlock)
+		return 0;
+
+	bi = yaffs_GetBlockInfo(dev, blk);
+	if (bi->blockState != YAFFS_BLOCK_STATE_CHECKPOINT)
+		return 0;
+
+	T(YAFFS_TRACE_CHECKPOINT, (TSTR("erasing checkpt head block %d"TENDSTR), blk));
+
+	dev->checkpointBlockList[0] = -1;
+	dev->nBlockErasures++;
+
+	if (dev->param.eraseBlockInNAND(dev, blk - dev->blockOffset /* realign */)) {
+		bi->blockState = YAFFS_BLOCK_STATE_EMPTY;
+		dev->nErasedBlocks++;
+		dev->nFreeChunks += dev->param.nChunksPerBlock;
+	} else {
+		dev->param.markNANDBlockBad(dev, blk);
+		bi->blockState = YAFFS_BLOCK_STATE_DEAD;
+	}
+	dev->blocksInCheckpoint--;
+
+	return 1;
+}
+
 int yaffs2_CheckpointInvalidateStream(yaffs_Device *dev)
 {
 	/* Erase the checkpoint data */
@@ -24,10 +24,16 @@ int yaffs2_CheckpointWrite(yaffs_Device *dev, const void *data, int nBytes);
 
 int yaffs2_CheckpointRead(yaffs_Device *dev, void *data, int nBytes);
 
+int yaffs2_CheckpointSkip(yaffs_Device *dev, int nBytes, __u32 sum, __u32 xorSum);
+
+int yaffs2_CheckpointReopen(yaffs_Device *dev, int byteOffset);
+
 int yaffs2_GetCheckpointSum(yaffs_Device *dev, __u32 *sum);
 
 int yaffs2_CheckpointClose(yaffs_Device *dev);
 
+int yaffs2_CheckpointInvalidateHead(yaffs_Device *dev);
+
 int yaffs2_CheckpointInvalidateStream(yaffs_Device *dev);
 
 
@@ -84,6 +84,7 @@ static int yaffs_AllocateChunk(yaffs_Device *dev, int useReserve,
 				yaffs_BlockInfo **blockUsedPtr);
 
 static void yaffs_CheckObjectDetailsLoaded(yaffs_Object *in);
+static int yaffs_CheckTnodesLoaded(yaffs_Object *in);
 
 static void yaffs_InvalidateWholeChunkCache(yaffs_Object *in);
 static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId);
@@ -553,6 +554,7 @@ static void yaffs_HandleUpdateChunk(yaffs_Device *dev, int chunkInNAND,
 	tags=tags;
 }
 
+/* Called with the gross lock held exclusively, see yaffs_nand.c */
 void yaffs_HandleChunkError(yaffs_Device *dev, yaffs_BlockInfo *bi)
 {
 	if (!bi->gcPrioritise) {
@@ -658,7 +660,7 @@ yaffs_Tnode *yaffs_GetTnode(yaffs_Device *dev)
 }
 
 /* FreeTnode frees up a tnode and puts it back on the free list */
-static void yaffs_FreeTnode(yaffs_Device *dev, yaffs_Tnode *tn)
+void yaffs_FreeTnode(yaffs_Device *dev, yaffs_Tnode *tn)
 {
 	yaffs_FreeRawTnode(dev,tn);
 	dev->nTnodes--;
@@ -890,6 +892,43 @@ yaffs_Tnode *yaffs_AddOrFindLevel0Tnode(yaffs_Device *dev,
 	return tn;
 }
 
+static void yaffs_FreeTnodeWorker(yaffs_Device *dev, yaffs_Tnode *tn,
+				__u32 level)
+{
+	int i;
+
+	if (!tn)
+		return;
+
+	if (level > 0)
+		for (i = 0; i < YAFFS_NTNODES_INTERNAL; i++)
+			yaffs_FreeTnodeWorker(dev, tn->internal[i], level - 1);
+
+	yaffs_FreeTnode(dev, tn);
+}
+
+/*
+ * Free every tnode of a file but the top one, which is left empty. The
+ * chunks they point to are not touched, so this is only for throwing away
+ * a tree that was never complete.
+ */
+void yaffs_EmptyFileStructure(yaffs_Device *dev,
+				yaffs_FileStructure *fStruct)
+{
+	int i;
+
+	if (!fStruct->top)
+		return;
+
+	if (fStruct->topLevel > 0)
+		for (i = 0; i < YAFFS_NTNODES_INTERNAL; i++)
+			yaffs_FreeTnodeWorker(dev, fStruct->top->internal[i],
+					fStruct->topLevel - 1);
+
+	memset(fStruct->top, 0, dev->tnodeSize);
+	fStruct->topLevel = 0;
+}
+
 static int yaffs_FindChunkInGroup(yaffs_Device *dev, int theChunk,
 				yaffs_ExtendedTags *tags, int objectId,
 				int chunkInInode)
@@ -1095,6 +1134,8 @@ static int yaffs_SoftDeleteWorker(yaffs_Object *in, yaffs_Tnode *tn,
 
 static void yaffs_SoftDeleteFile(yaffs_Object *obj)
 {
+	yaffs_CheckTnodesLoaded(obj);
+
 	if (obj->deleted &&
 	    obj->variantType == YAFFS_OBJECT_TYPE_FILE && !obj->softDeleted) {
 		if (obj->nDataChunks <= 0) {
@@ -2368,9 +2409,60 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 	return retVal;
 }
 
+/*
+ * Cost-benefit victim selection, used by background gc.
+ * Collecting a block costs reading and rewriting its live chunks and gains
+ * its free ones. Old blocks are unlikely to get any emptier by waiting, so
+ * their free space is worth more than that of recently written blocks.
+ * Picks the block with the best freeChunks * age / (nChunksPerBlock + live).
+ */
+static unsigned yaffs_FindBlockCostBenefit(yaffs_Device *dev, int threshold)
+{
+	int i;
+	int pagesUsed;
+	unsigned selected = 0;
+	__u64 benefit;
+	__u64 bestBenefit = 0;
+	__u32 cost;
+	__u32 bestCost = 1;
+	__u32 age;
+	yaffs_BlockInfo *bi;
+
+	for (i = dev->internalStartBlock; i <= dev->internalEndBlock; i++) {
+		bi = yaffs_GetBlockInfo(dev, i);
+		pagesUsed = bi->pagesInUse - bi->softDeletions;
+
+		if (bi->blockState != YAFFS_BLOCK_STATE_FULL ||
+			pagesUsed >= dev->param.nChunksPerBlock ||
+			pagesUsed > threshold ||
+			!yaffs2_BlockNotDisqualifiedFromGC(dev, bi))
+			continue;
+
+		age = 1;
+#ifdef CONFIG_YAFFS_YAFFS2
+		if (dev->param.isYaffs2 &&
+			dev->sequenceNumber > bi->sequenceNumber)
+			age += dev->sequenceNumber - bi->sequenceNumber;
+#endif
+		benefit = (__u64)(dev->param.nChunksPerBlock - pagesUsed) * age;
+		cost = dev->param.nChunksPerBlock + pagesUsed;
+
+		/* benefit / cost > bestBenefit / bestCost */
+		if (benefit * bestCost > bestBenefit * cost) {
+			selected = i;
+			bestBenefit = benefit;
+			bestCost = cost;
+			dev->gcPagesInUse = pagesUsed;
+		}
+	}
+
+	return selected;
+}
+
 /*
  * FindBlockForgarbageCollection is used to select the dirtiest block (or close enough)
  * for garbage collection.
+ * Background gc has the time to weigh every block by cost and benefit.
  */
 
 static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
@@ -2454,6 +2546,9 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 				iterations = 100;
 		}
 
+		if (background && !aggressive)
+			iterations = 0;
+
 		for (i = 0;
 			i < iterations &&
 			(dev->gcDirtiest < 1 ||
@@ -2477,7 +2572,9 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 			}
 		}
 
-		if(dev->gcDirtiest > 0 && dev->gcPagesInUse <= threshold)
+		if (background && !aggressive)
+			selected = yaffs_FindBlockCostBenefit(dev, threshold);
+		else if(dev->gcDirtiest > 0 && dev->gcPagesInUse <= threshold)
 			selected = dev->gcDirtiest;
 	}
 
@@ -2546,6 +2643,7 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev, int background)
 	int minErased;
 	int erasedChunks;
 	int checkpointBlockAdjust;
+	__u32 copiesBefore;
 
 	if(dev->param.gcControl &&
 		(dev->param.gcControl(dev) & 1) == 0)
@@ -2569,12 +2667,21 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev, int background)
 		erasedChunks = dev->nErasedBlocks * dev->param.nChunksPerBlock;
 
 		/* If we need a block soon then do aggressive gc.*/
-		if (dev->nErasedBlocks < minErased)
+		if (dev->nErasedBlocks < minErased) {
 			aggressive = 1;
-		else {
+			/* Free what is left of an invalidated checkpoint */
+			yaffs2_LoadPendingLazyTnodes(dev, 0);
+		} else {
 			if(!background && erasedChunks > (dev->nFreeChunks / 4))
 				break;
 
+			/* Leave passive gc to the background thread, if any */
+			if(!background && dev->param.gcWake &&
+				dev->param.gcWake(dev)) {
+				dev->gcWakes++;
+				break;
+			}
+
 			if(dev->gcSkip > 20)
 				dev->gcSkip = 20;
 			if(erasedChunks < dev->nFreeChunks/2 ||
@@ -2612,7 +2719,10 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev, int background)
 			   ("yaffs: GC erasedBlocks %d aggressive %d" TENDSTR),
 			   dev->nErasedBlocks, aggressive));
 
+			copiesBefore = dev->nGCCopies;
 			gcOk = yaffs_GarbageCollectBlock(dev, dev->gcBlock, aggressive);
+			if (background)
+				dev->bgGCCopies += dev->nGCCopies - copiesBefore;
 		}
 
 		if (dev->nErasedBlocks < (dev->param.nReservedBlocks) && dev->gcBlock > 0) {
@@ -2640,6 +2750,7 @@ int yaffs_BackgroundGarbageCollect(yaffs_Device *dev, unsigned urgency)
 	T(YAFFS_TRACE_BACKGROUND, (TSTR("Background gc %u" TENDSTR),urgency));
 
 	yaffs_CheckGarbageCollection(dev, 1);
+	yaffs2_LoadPendingLazyTnodes(dev, 1);
 	return erasedChunks > dev->nFreeChunks/2;
 }
 
@@ -2656,6 +2767,27 @@ static int yaffs_TagsMatch(const yaffs_ExtendedTags *tags, int objectId,
 
 /*-------------------- Data file manipulation -----------------*/
 
+/*
+ * Files restored from a checkpoint only get their tnodes on first use.
+ * If that fails the checkpoint is bad: drop it so the next mount scans,
+ * and fail reads and writes of the file rather than use a partial tree.
+ */
+static int yaffs_CheckTnodesLoaded(yaffs_Object *in)
+{
+	yaffs_Device *dev = in->myDev;
+
+	if (in->variantType != YAFFS_OBJECT_TYPE_FILE ||
+	    !in->variant.fileVariant.lazyTnodes)
+		return YAFFS_OK;
+
+	if (yaffs2_LoadLazyTnodes(in) == YAFFS_OK)
+		return YAFFS_OK;
+
+	if (!dev->readOnly && dev->isCheckpointed)
+		yaffs2_InvalidateCheckpoint(dev);
+	return YAFFS_FAIL;
+}
+
 static int yaffs_FindChunkInFile(yaffs_Object *in, int chunkInInode,
 				 yaffs_ExtendedTags *tags)
 {
@@ -2672,6 +2804,8 @@ static int yaffs_FindChunkInFile(yaffs_Object *in, int chunkInInode,
 		tags = &localTags;
 	}
 
+	yaffs_CheckTnodesLoaded(in);
+
 	tn = yaffs_FindLevel0Tnode(dev, &in->variant.fileVariant, chunkInInode);
 
 	if (tn) {
@@ -2700,6 +2834,8 @@ static int yaffs_FindAndDeleteChunkInFile(yaffs_Object *in, int chunkInInode,
 		tags = &localTags;
 	}
 
+	yaffs_CheckTnodesLoaded(in);
+
 	tn = yaffs_FindLevel0Tnode(dev, &in->variant.fileVariant, chunkInInode);
 
 	if (tn) {
@@ -2752,6 +2888,8 @@ int yaffs_PutChunkIntoFile(yaffs_Object *in, int chunkInInode,
 		return YAFFS_OK;
 	}
 
+	yaffs_CheckTnodesLoaded(in);
+
 	tn = yaffs_AddOrFindLevel0Tnode(dev,
 					&in->variant.fileVariant,
 					chunkInInode,
@@ -3449,6 +3587,9 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 
 	dev = in->myDev;
 
+	if (yaffs_CheckTnodesLoaded(in) != YAFFS_OK)
+		return -1;
+
 	while (n > 0) {
 		/* chunk = offset / dev->nDataBytesPerChunk + 1; */
 		/* start = offset % dev->nDataBytesPerChunk; */
@@ -3526,6 +3667,66 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 	return nDone;
 }
 
+/*
+ * yaffs_ReadDataFromFileShared() is for callers that only hold the gross
+ * lock shared, so other readers may be in here too. It does just what is
+ * safe among readers: whole chunks are read straight into the buffer, or
+ * copied out of the short op cache without touching its LRU. It stops at
+ * the first chunk that would need more (a partial chunk, a temp buffer,
+ * inband tags, chunk groups, tnodes not yet loaded from the checkpoint or
+ * a read with ECC errors, which have to be recorded in the block info)
+ * and returns how much it read; the caller finishes off with
+ * yaffs_ReadDataFromFile() under the exclusive lock.
+ */
+int yaffs_ReadDataFromFileShared(yaffs_Object *in, __u8 *buffer, loff_t offset,
+			int nBytes)
+{
+	int chunk;
+	__u32 start;
+	int n = nBytes;
+	int nDone = 0;
+	int chunkInNAND;
+	yaffs_ExtendedTags tags;
+	yaffs_ChunkCache *cache;
+
+	yaffs_Device *dev;
+
+	dev = in->myDev;
+
+	if (!dev->param.isYaffs2 || dev->param.inbandTags ||
+	    dev->chunkGroupSize != 1 || in->variant.fileVariant.lazyTnodes)
+		return 0;
+
+	while (n >= dev->nDataBytesPerChunk) {
+		yaffs_AddrToChunk(dev, offset, &chunk, &start);
+		chunk++;
+
+		if (start)
+			break;
+
+		cache = yaffs_FindChunkCache(in, chunk);
+		chunkInNAND = cache ? -1 : yaffs_FindChunkInFile(in, chunk, NULL);
+
+		if (cache)
+			memcpy(buffer, cache->data, dev->nDataBytesPerChunk);
+		else if (chunkInNAND < 0)
+			memset(buffer, 0, dev->nDataBytesPerChunk);
+		else {
+			yaffs_ReadChunkWithTagsFromNANDShared(dev, chunkInNAND,
+							buffer, &tags);
+			if (tags.eccResult > YAFFS_ECC_RESULT_NO_ERROR)
+				break;
+		}
+
+		n -= dev->nDataBytesPerChunk;
+		offset += dev->nDataBytesPerChunk;
+		buffer += dev->nDataBytesPerChunk;
+		nDone += dev->nDataBytesPerChunk;
+	}
+
+	return nDone;
+}
+
 int yaffs_DoWriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 			int nBytes, int writeThrough)
 {
@@ -3705,6 +3906,9 @@ int yaffs_DoWriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 int yaffs_WriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 			int nBytes, int writeThrough)
 {
+	if (yaffs_CheckTnodesLoaded(in) != YAFFS_OK)
+		return -1;
+
 	yaffs2_HandleHole(in,offset);
 	return yaffs_DoWriteDataToFile(in,buffer,offset,nBytes,writeThrough);
 }
@@ -3801,6 +4005,9 @@ int yaffs_ResizeFile(yaffs_Object *in, loff_t newSize)
 
 	if (newSize == oldFileSize)
 		return YAFFS_OK;
+
+	if (yaffs_CheckTnodesLoaded(in) != YAFFS_OK)
+		return YAFFS_FAIL;
 		
 	if(newSize > oldFileSize){
 		yaffs2_HandleHole(in,newSize);
@@ -4863,6 +5070,7 @@ YCHAR *yaffs_GetSymlinkAlias(yaffs_Object *obj)
 int yaffs_SetAttributes(yaffs_Object *obj, struct iattr *attr)
 {
 	unsigned int valid = attr->ia_valid;
+	int result = YAFFS_OK;
 
 	if (valid & ATTR_MODE)
 		obj->yst_mode = attr->ia_mode;
@@ -4879,11 +5087,11 @@ int yaffs_SetAttributes(yaffs_Object *obj, struct iattr *attr)
 		obj->yst_mtime = Y_TIME_CONVERT(attr->ia_mtime);
 
 	if (valid & ATTR_SIZE)
-		yaffs_ResizeFile(obj, attr->ia_size);
+		result = yaffs_ResizeFile(obj, attr->ia_size);
 
 	yaffs_UpdateObjectHeader(obj, NULL, 1, 0, 0, NULL);
 
-	return YAFFS_OK;
+	return result;
 
 }
 int yaffs_GetAttributes(yaffs_Object *obj, struct iattr *attr)
@@ -5270,6 +5478,8 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	dev->passiveGCs = 0;
 	dev->oldestDirtyGCs = 0;
 	dev->backgroundGCs = 0;
+	dev->bgGCCopies = 0;
+	dev->gcWakes = 0;
 	dev->gcBlockFinder = 0;
 	dev->bufferedBlock = -1;
 	dev->doingBufferedBlockRewrite = 0;
@@ -5426,6 +5636,7 @@ void yaffs_Deinitialise(yaffs_Device *dev)
 
 		yaffs_DeinitialiseBlocks(dev);
 		yaffs_DeinitialiseTnodesAndObjects(dev);
+		yaffs2_DropLazyTnodes(dev);
 		if (dev->param.nShortOpCaches > 0 &&
 		    dev->srCache) {
 
@@ -64,7 +64,7 @@
 #define YAFFS_OBJECT_SPACE		0x40000
 #define YAFFS_MAX_OBJECT_ID		(YAFFS_OBJECT_SPACE -1)
 
-#define YAFFS_CHECKPOINT_VERSION 	4
+#define YAFFS_CHECKPOINT_VERSION 	5
 
 #ifdef CONFIG_YAFFS_UNICODE
 #define YAFFS_MAX_NAME_LENGTH		127
@@ -372,8 +372,12 @@ typedef struct {
 	__u32 shrinkSize;
 	int topLevel;
 	yaffs_Tnode *top;
+	__u32 lazyTnodes;	/* Checkpoint offset of tnodes not yet loaded, or 0 */
 } yaffs_FileStructure;
 
+/* lazyTnodes of a file whose tnodes could not be loaded */
+#define YAFFS_LAZY_TNODES_FAILED	0xFFFFFFFF
+
 typedef struct {
 	struct ylist_head children;     /* list of child links */
 	struct ylist_head dirty;	/* Entry for list of dirty directories */
@@ -500,6 +504,18 @@ typedef struct {
 	__u32 fileSizeOrEquivalentObjectId;
 } yaffs_CheckpointObject;
 
+/* yaffs_CheckpointTnodes heads the tnodes of a file in the checkpoint.
+ * The tnodes are only read back when the file is first used, so the
+ * header gives their length and their share of the checkpoint checksum.
+ */
+
+typedef struct {
+	int structType;
+	__u32 nBytes;
+	__u32 sum;
+	__u32 xorSum;
+} yaffs_CheckpointTnodes;
+
 /*--------------------- Temporary buffers ----------------
  *
  * These are chunk-sized working buffers. Each device has a few
@@ -531,6 +547,8 @@ struct yaffs_DeviceParamStruct {
 	int endBlock;		/* End block we're allowed to use */
 	int nReservedBlocks;	/* We want this tuneable so that we can reduce */
 				/* reserved blocks on NOR and RAM. */
+	int nGCReserveBlocks;	/* Erased blocks a background gc keeps in hand */
+				/* on top of nReservedBlocks. */
 
 
 	int nShortOpCaches;	/* If <= 0, then short op caching is disabled, else
@@ -590,6 +608,11 @@ struct yaffs_DeviceParamStruct {
 	/*  Callback to control garbage collection. */
 	unsigned (*gcControl)(struct yaffs_DeviceStruct *dev);
 
+	/* Callback to hand passive garbage collection to a background
+	 * thread. Returns non-zero if one is running and has been woken.
+	 */
+	unsigned (*gcWake)(struct yaffs_DeviceStruct *dev);
+
         /* Debug control flags. Don't use unless you know what you're doing */
 	int useHeaderFileSize;	/* Flag to determine if we should use file sizes from the header */
 	int disableLazyLoad;	/* Disable lazy loading on this device */
@@ -663,6 +686,7 @@ struct yaffs_DeviceStruct {
 	int checkpointMaxBlocks;
 	__u32 checkpointSum;
 	__u32 checkpointXor;
+	int checkpointReopened;	/* Reading back lazy tnodes after mount */
 
 	int nCheckpointBlocksRequired; /* Number of blocks needed to store current checkpoint set */
 
@@ -684,6 +708,9 @@ struct yaffs_DeviceStruct {
 	void *allocator;
 	int nObjects;
 	int nTnodes;
+	int nLazyTnodeFiles;	/* Files with tnodes still in the checkpoint */
+	int nLazyTnodes;
+	int lazyTnodesFailed;	/* No more checkpoints, next mount rescans */
 
 	int nHardLinks;
 
@@ -759,6 +786,8 @@ struct yaffs_DeviceStruct {
 	__u32 oldestDirtyGCs;
 	__u32 nGCBlocks;
 	__u32 backgroundGCs;
+	__u32 bgGCCopies;	/* Of nGCCopies, those done by background gc */
+	__u32 gcWakes;		/* Passive gcs handed to the background */
 	__u32 nRetriedWrites;
 	__u32 nRetiredBlocks;
 	__u32 eccFixed;
@@ -855,6 +884,8 @@ int yaffs_GetAttributes(yaffs_Object *obj, struct iattr *attr);
 /* File operations */
 int yaffs_ReadDataFromFile(yaffs_Object *obj, __u8 *buffer, loff_t offset,
 				int nBytes);
+int yaffs_ReadDataFromFileShared(yaffs_Object *obj, __u8 *buffer, loff_t offset,
+				int nBytes);
 int yaffs_WriteDataToFile(yaffs_Object *obj, const __u8 *buffer, loff_t offset,
 				int nBytes, int writeThrough);
 int yaffs_ResizeFile(yaffs_Object *obj, loff_t newSize);
@@ -948,10 +979,13 @@ void yaffs_HandleShadowedObject(yaffs_Device *dev, int objId,
 				int backwardScanning);
 int yaffs_CheckSpaceForAllocation(yaffs_Device *dev, int nChunks);
 yaffs_Tnode *yaffs_GetTnode(yaffs_Device *dev);
+void yaffs_FreeTnode(yaffs_Device *dev, yaffs_Tnode *tn);
 yaffs_Tnode *yaffs_AddOrFindLevel0Tnode(yaffs_Device *dev,
 					yaffs_FileStructure *fStruct,
 					__u32 chunkId,
 					yaffs_Tnode *passedTn);
+void yaffs_EmptyFileStructure(yaffs_Device *dev,
+				yaffs_FileStructure *fStruct);
 
 int yaffs_DoWriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 			int nBytes, int writeThrough);
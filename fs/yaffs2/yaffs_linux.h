@@ -25,10 +25,14 @@ struct yaffs_LinuxContext {
 	struct super_block * superBlock;
 	struct task_struct *bgThread; /* Background thread for this device */
 	int bgRunning;
-        struct semaphore grossLock;     /* Gross locking semaphore */
+	struct task_struct *gcThread; /* Background gc thread for this device */
+	int gcWakeup;		/* Set to have the gc thread run again at once */
+	struct rw_semaphore grossLock;	/* Gross lock; readers may share it */
+	struct mutex metaLock;		/* Serialises lookup/readdir under a shared grossLock */
 	__u8 *spareBuffer;      /* For mtdif2 use. Don't know the size of the buffer
 				 * at compile time so we have to allocate it.
 				 */
+	struct mutex spareLock;		/* Protects spareBuffer for shared readers */
 	struct ylist_head searchContexts;
 	void (*putSuperFunc)(struct super_block *sb);
 
@@ -136,6 +136,8 @@ int nandmtd2_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 		retval = mtd->read(mtd, addr, dev->param.totalBytesPerChunk,
 				&dummy, data);
 	else if (tags) {
+		/* Readers can get here together under a shared gross lock */
+		mutex_lock(&yaffs_DeviceToLC(dev)->spareLock);
 		ops.mode = MTD_OOB_AUTO;
 		ops.ooblen = packed_tags_size;
 		ops.len = data ? dev->nDataBytesPerChunk : packed_tags_size;
@@ -143,6 +145,8 @@ int nandmtd2_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 		ops.datbuf = data;
 		ops.oobbuf = yaffs_DeviceToLC(dev)->spareBuffer;
 		retval = mtd->read_oob(mtd, addr, &ops);
+		memcpy(packed_tags_ptr, yaffs_DeviceToLC(dev)->spareBuffer, packed_tags_size);
+		mutex_unlock(&yaffs_DeviceToLC(dev)->spareLock);
 	}
 #else
 	if (!dev->param.inbandTags && data && tags) {
@@ -171,7 +175,9 @@ int nandmtd2_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 		}
 	} else {
 		if (tags) {
+#if (LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 17))
 			memcpy(packed_tags_ptr, yaffs_DeviceToLC(dev)->spareBuffer, packed_tags_size);
+#endif
 			yaffs_UnpackTags2(tags, &pt, !dev->param.noTagsECC);
 		}
 	}
@@ -17,29 +17,44 @@
 
 #include "yaffs_getblockinfo.h"
 
-int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
+/*
+ * For readers that only hold the gross lock shared. Unlike
+ * yaffs_ReadChunkWithTagsFromNAND() this leaves the block info alone,
+ * since other readers may be updating it too: the caller must check
+ * tags->eccResult and redo a read that had errors under the exclusive
+ * lock, which is where they are recorded.
+ */
+int yaffs_ReadChunkWithTagsFromNANDShared(yaffs_Device *dev, int chunkInNAND,
 					   __u8 *buffer,
 					   yaffs_ExtendedTags *tags)
 {
-	int result;
-	yaffs_ExtendedTags localTags;
-
 	int realignedChunkInNAND = chunkInNAND - dev->chunkOffset;
 
 	dev->nPageReads++;
 
-	/* If there are no tags provided, use local tags to get prioritised gc working */
-	if (!tags)
-		tags = &localTags;
-
 	if (dev->param.readChunkWithTagsFromNAND)
-		result = dev->param.readChunkWithTagsFromNAND(dev, realignedChunkInNAND, buffer,
+		return dev->param.readChunkWithTagsFromNAND(dev, realignedChunkInNAND, buffer,
 						      tags);
 	else
-		result = yaffs_TagsCompatabilityReadChunkWithTagsFromNAND(dev,
+		return yaffs_TagsCompatabilityReadChunkWithTagsFromNAND(dev,
 									realignedChunkInNAND,
 									buffer,
 									tags);
+}
+
+int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
+					   __u8 *buffer,
+					   yaffs_ExtendedTags *tags)
+{
+	int result;
+	yaffs_ExtendedTags localTags;
+
+	/* If there are no tags provided, use local tags to get prioritised gc working */
+	if (!tags)
+		tags = &localTags;
+
+	result = yaffs_ReadChunkWithTagsFromNANDShared(dev, chunkInNAND, buffer,
+						      tags);
 	if (tags &&
 	   tags->eccResult > YAFFS_ECC_RESULT_NO_ERROR) {
 
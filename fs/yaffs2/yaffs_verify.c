@@ -283,6 +283,10 @@ void yaffs_VerifyFile(yaffs_Object *obj)
 	if (yaffs_SkipVerification(obj->myDev))
 		return;
 
+	/* Don't pull tnodes in from the checkpoint just to verify them */
+	if (obj->variant.fileVariant.lazyTnodes)
+		return;
+
 	dev = obj->myDev;
 	objectId = obj->objectId;
 
@@ -175,6 +175,7 @@ unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
 unsigned int yaffs_gc_control = 1;
 unsigned int yaffs_bg_enable = 1;
+unsigned int yaffs_gc_reserve = 8;
 
 /* Module Parameters */
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
@@ -183,6 +184,7 @@ module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
 module_param(yaffs_gc_control, uint, 0644);
 module_param(yaffs_bg_enable, uint, 0644);
+module_param(yaffs_gc_reserve, uint, 0644);
 #else
 MODULE_PARM(yaffs_traceMask, "i");
 MODULE_PARM(yaffs_wr_attempts, "i");
@@ -515,14 +517,51 @@ static unsigned yaffs_gc_control_callback(yaffs_Device *dev)
 static void yaffs_GrossLock(yaffs_Device *dev)
 {
 	T(YAFFS_TRACE_LOCK, (TSTR("yaffs locking %p\n"), current));
-	down(&(yaffs_DeviceToLC(dev)->grossLock));
+	down_write(&(yaffs_DeviceToLC(dev)->grossLock));
 	T(YAFFS_TRACE_LOCK, (TSTR("yaffs locked %p\n"), current));
 }
 
 static void yaffs_GrossUnlock(yaffs_Device *dev)
 {
 	T(YAFFS_TRACE_LOCK, (TSTR("yaffs unlocking %p\n"), current));
-	up(&(yaffs_DeviceToLC(dev)->grossLock));
+	up_write(&(yaffs_DeviceToLC(dev)->grossLock));
+}
+
+/*
+ * The shared lock is for paths that only look at the file system: any
+ * number of them can run together, but never alongside a writer or gc.
+ * Whatever they do must be safe against each other; see
+ * yaffs_ReadDataFromFileShared().
+ */
+static void yaffs_GrossLockShared(yaffs_Device *dev)
+{
+	T(YAFFS_TRACE_LOCK, (TSTR("yaffs locking shared %p\n"), current));
+	down_read(&(yaffs_DeviceToLC(dev)->grossLock));
+	T(YAFFS_TRACE_LOCK, (TSTR("yaffs locked shared %p\n"), current));
+}
+
+static void yaffs_GrossUnlockShared(yaffs_Device *dev)
+{
+	T(YAFFS_TRACE_LOCK, (TSTR("yaffs unlocking shared %p\n"), current));
+	up_read(&(yaffs_DeviceToLC(dev)->grossLock));
+}
+
+/*
+ * Lookup and readdir don't change the file system, but they do lazy load
+ * object headers, borrow temp buffers and keep search contexts. They hold
+ * the lock shared, so they can run alongside page reads, and take
+ * metaLock to keep out of each other's way.
+ */
+static void yaffs_MetaLock(yaffs_Device *dev)
+{
+	yaffs_GrossLockShared(dev);
+	mutex_lock(&(yaffs_DeviceToLC(dev)->metaLock));
+}
+
+static void yaffs_MetaUnlock(yaffs_Device *dev)
+{
+	mutex_unlock(&(yaffs_DeviceToLC(dev)->metaLock));
+	yaffs_GrossUnlockShared(dev);
 }
 
 #ifdef YAFFS_COMPILE_EXPORTFS
@@ -787,7 +826,7 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry)
 	yaffs_Device *dev = yaffs_InodeToObject(dir)->myDev;
 
 	if(current != yaffs_DeviceToLC(dev)->readdirProcess)
-		yaffs_GrossLock(dev);
+		yaffs_MetaLock(dev);
 
 	T(YAFFS_TRACE_OS,
 		(TSTR("yaffs_lookup for %d:%s\n"),
@@ -800,7 +839,7 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry)
 
 	/* Can't hold gross lock when calling yaffs_get_inode() */
 	if(current != yaffs_DeviceToLC(dev)->readdirProcess)
-		yaffs_GrossUnlock(dev);
+		yaffs_MetaUnlock(dev);
 
 	if (obj) {
 		T(YAFFS_TRACE_OS,
@@ -992,6 +1031,7 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	yaffs_Object *obj;
 	unsigned char *pg_buf;
 	int ret;
+	int done;
 
 	yaffs_Device *dev;
 
@@ -1014,16 +1054,33 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_GrossLock(dev);
+	/*
+	 * Try to read the page alongside other readers first; anything that
+	 * can't be done that way is finished off under the exclusive lock.
+	 */
+	yaffs_GrossLockShared(dev);
 
-	ret = yaffs_ReadDataFromFile(obj, pg_buf,
+	done = yaffs_ReadDataFromFileShared(obj, pg_buf,
 				pg->index << PAGE_CACHE_SHIFT,
 				PAGE_CACHE_SIZE);
 
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossUnlockShared(dev);
+
+	ret = 0;
+	if (done < PAGE_CACHE_SIZE) {
+		yaffs_GrossLock(dev);
+
+		ret = yaffs_ReadDataFromFile(obj, pg_buf + done,
+				(pg->index << PAGE_CACHE_SHIFT) + done,
+				PAGE_CACHE_SIZE - done);
+
+		yaffs_GrossUnlock(dev);
+	}
 
 	if (ret >= 0)
 		ret = 0;
+	else
+		ret = -EIO;
 
 	if (ret) {
 		ClearPageUptodate(pg);
@@ -1140,6 +1197,8 @@ static int yaffs_writepage(struct page *page)
 	end_page_writeback(page);
 	put_page(page);
 
+	if (nWritten < 0)
+		return -EIO;
 	return (nWritten == nBytes) ? 0 : -ENOSPC;
 }
 
@@ -1489,6 +1548,8 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 
 	}
 	yaffs_GrossUnlock(dev);
+	if (nWritten < 0)
+		return -EIO;
 	return (nWritten == 0) && (n > 0) ? -ENOSPC : nWritten;
 }
 
@@ -1575,7 +1636,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 	obj = yaffs_DentryToObject(f->f_dentry);
 	dev = obj->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_MetaLock(dev);
 
 	yaffs_DeviceToLC(dev)->readdirProcess = current;
 
@@ -1593,12 +1654,12 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 		T(YAFFS_TRACE_OS,
 			(TSTR("yaffs_readdir: entry . ino %d \n"),
 			(int)inode->i_ino));
-		yaffs_GrossUnlock(dev);
+		yaffs_MetaUnlock(dev);
 		if (filldir(dirent, ".", 1, offset, inode->i_ino, DT_DIR) < 0){
-			yaffs_GrossLock(dev);
+			yaffs_MetaLock(dev);
 			goto out;
 		}
-		yaffs_GrossLock(dev);
+		yaffs_MetaLock(dev);
 		offset++;
 		f->f_pos++;
 	}
@@ -1606,13 +1667,13 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 		T(YAFFS_TRACE_OS,
 			(TSTR("yaffs_readdir: entry .. ino %d \n"),
 			(int)f->f_dentry->d_parent->d_inode->i_ino));
-		yaffs_GrossUnlock(dev);
+		yaffs_MetaUnlock(dev);
 		if (filldir(dirent, "..", 2, offset,
 			f->f_dentry->d_parent->d_inode->i_ino, DT_DIR) < 0){
-			yaffs_GrossLock(dev);
+			yaffs_MetaLock(dev);
 			goto out;
 		}
-		yaffs_GrossLock(dev);
+		yaffs_MetaLock(dev);
 		offset++;
 		f->f_pos++;
 	}
@@ -1640,7 +1701,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 			  (TSTR("yaffs_readdir: %s inode %d\n"),
 			  name, yaffs_GetObjectInode(l)));
 
-                        yaffs_GrossUnlock(dev);
+                        yaffs_MetaUnlock(dev);
 
 			if (filldir(dirent,
 					name,
@@ -1648,11 +1709,11 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 					offset,
 					this_inode,
 					this_type) < 0){
-				yaffs_GrossLock(dev);
+				yaffs_MetaLock(dev);
 				goto out;
 			}
 
-                        yaffs_GrossLock(dev);
+                        yaffs_MetaLock(dev);
 
 			offset++;
 			f->f_pos++;
@@ -1663,7 +1724,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 out:
 	yaffs_EndSearch(sc);
 	yaffs_DeviceToLC(dev)->readdirProcess = NULL;
-	yaffs_GrossUnlock(dev);
+	yaffs_MetaUnlock(dev);
 
 	return retVal;
 }
@@ -2010,7 +2071,7 @@ static int yaffs_setattr(struct dentry *dentry, struct iattr *attr)
 		if(result == YAFFS_OK) {
 			error = 0;
 		} else {
-			error = -EPERM;
+			error = -EIO;
 		}
 		yaffs_GrossUnlock(dev);
 
@@ -2261,6 +2322,31 @@ static unsigned yaffs_bg_gc_urgency(yaffs_Device *dev)
 		return 2;
 }
 
+/*
+ * The gc thread also works ahead of writers once the erased-block reserve
+ * runs low. Sync keeps using yaffs_bg_gc_urgency(), so a low reserve does
+ * not hold back checkpoints.
+ */
+static unsigned yaffs_gc_thread_urgency(yaffs_Device *dev)
+{
+	unsigned urgency = yaffs_bg_gc_urgency(dev);
+	unsigned erasedChunks = dev->nErasedBlocks * dev->param.nChunksPerBlock;
+	struct yaffs_LinuxContext *context = yaffs_DeviceToLC(dev);
+
+	if(!context->bgRunning || urgency > 1)
+		return urgency;
+	else if(erasedChunks >= dev->nFreeChunks ||
+		dev->nFreeChunks - erasedChunks < dev->param.nChunksPerBlock * 2)
+		return urgency;
+	else if(dev->nErasedBlocks <= dev->param.nReservedBlocks + 1)
+		return 2;
+	else if(dev->nErasedBlocks < dev->param.nReservedBlocks +
+					dev->param.nGCReserveBlocks)
+		return 1;
+	else
+		return urgency;
+}
+
 static int yaffs_do_sync_fs(struct super_block *sb,
 				int request_checkpoint)
 {
@@ -2318,11 +2404,8 @@ static int yaffs_BackgroundThread(void *data)
 	struct yaffs_LinuxContext *context = yaffs_DeviceToLC(dev);
 	unsigned long now = jiffies;
 	unsigned long next_dir_update = now;
-	unsigned long next_gc = now;
 	unsigned long expires;
-	unsigned int urgency;
 
-	int gcResult;
 	struct timer_list timer;
 
 	T(YAFFS_TRACE_BACKGROUND,
@@ -2351,28 +2434,9 @@ static int yaffs_BackgroundThread(void *data)
 			yaffs_UpdateDirtyDirectories(dev);
 			next_dir_update = now + HZ;
 		}
-
-		if(time_after(now,next_gc) && yaffs_bg_enable){
-			if(!dev->isCheckpointed){
-				urgency = yaffs_bg_gc_urgency(dev);
-				gcResult = yaffs_BackgroundGarbageCollect(dev, urgency);
-				if(urgency > 1)
-					next_gc = now + HZ/20+1;
-				else if(urgency > 0)
-					next_gc = now + HZ/10+1;
-				else
-					next_gc = now + HZ * 2;
-			} else /*
-				* gc not running so set to next_dir_update
-				* to cut down on wake ups
-				*/
-				next_gc = next_dir_update;
-		}
 		yaffs_GrossUnlock(dev);
 #if 1
 		expires = next_dir_update;
-		if (time_before(next_gc,expires))
-			expires = next_gc;
 		if(time_before(expires,now))
 			expires = now + HZ;
 
@@ -2393,6 +2457,90 @@ static int yaffs_BackgroundThread(void *data)
 	return 0;
 }
 
+/*
+ * yaffs_GCThread() keeps nGCReserveBlocks erased blocks in hand, so that
+ * writers seldom have to garbage collect themselves. Writers that would
+ * do passive gc wake it through yaffs_gc_wake_callback() instead.
+ * Each pass collects a few chunks and drops the lock, so writers are
+ * held up by one pass at most. A pass that neither copies a chunk nor
+ * moves on to another block (e.g. every chunk it tried hit an error)
+ * waits like an idle one rather than retrying straight away.
+ */
+static int yaffs_GCThread(void *data)
+{
+	yaffs_Device *dev = (yaffs_Device *)data;
+	struct yaffs_LinuxContext *context = yaffs_DeviceToLC(dev);
+	unsigned int urgency;
+	unsigned gcBlock, gcChunk;
+	__u32 nGCCopies;
+	int nErasedBlocks;
+	int progress;
+	long timeout;
+
+	T(YAFFS_TRACE_BACKGROUND,
+		(TSTR("yaffs_gc starting for dev %p\n"),
+		(void *)dev));
+
+#ifdef YAFFS_COMPILE_FREEZER
+	set_freezable();
+#endif
+	while(context->bgRunning){
+		if(kthread_should_stop())
+			break;
+
+#ifdef YAFFS_COMPILE_FREEZER
+		if(try_to_freeze())
+			continue;
+#endif
+		timeout = HZ * 2;
+		if(yaffs_bg_enable){
+			yaffs_GrossLock(dev);
+			if(!dev->isCheckpointed){
+				urgency = yaffs_gc_thread_urgency(dev);
+				gcBlock = dev->gcBlock;
+				gcChunk = dev->gcChunk;
+				nGCCopies = dev->nGCCopies;
+				nErasedBlocks = dev->nErasedBlocks;
+				yaffs_BackgroundGarbageCollect(dev, urgency);
+				progress = dev->gcBlock != gcBlock ||
+					dev->gcChunk != gcChunk ||
+					dev->nGCCopies != nGCCopies ||
+					dev->nErasedBlocks != nErasedBlocks;
+				/* Keep going while a block is being collected */
+				if(urgency > 0 && dev->gcBlock > 0 && progress)
+					timeout = (urgency > 1) ? 0 : 1;
+				else if(urgency > 0)
+					timeout = HZ/10 + 1;
+			}
+			yaffs_GrossUnlock(dev);
+		}
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if(context->gcWakeup || !timeout)
+			__set_current_state(TASK_RUNNING);
+		else
+			schedule_timeout(timeout);
+		context->gcWakeup = 0;
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/* Called with the grossLock held, from writers that need space. */
+static unsigned yaffs_gc_wake_callback(yaffs_Device *dev)
+{
+	struct yaffs_LinuxContext *context = yaffs_DeviceToLC(dev);
+
+	if(!context->gcThread || !yaffs_bg_enable)
+		return 0;
+	if(!context->gcWakeup){
+		context->gcWakeup = 1;
+		wake_up_process(context->gcThread);
+	}
+	return 1;
+}
+
 static int yaffs_BackgroundStart(yaffs_Device *dev)
 {
 	int retval = 0;
@@ -2410,6 +2558,15 @@ static int yaffs_BackgroundStart(yaffs_Device *dev)
 		retval = PTR_ERR(context->bgThread);
 		context->bgThread = NULL;
 		context->bgRunning = 0;
+		return retval;
+	}
+
+	context->gcThread = kthread_run(yaffs_GCThread,
+	                        (void *)dev,"yaffs-gc-%d",context->mount_id);
+
+	if(IS_ERR(context->gcThread)){
+		/* Writers will collect garbage themselves */
+		context->gcThread = NULL;
 	}
 	return retval;
 }
@@ -2420,6 +2577,10 @@ static void yaffs_BackgroundStop(yaffs_Device *dev)
 
 	ctxt->bgRunning = 0;
 
+	if( ctxt->gcThread){
+		kthread_stop(ctxt->gcThread);
+		ctxt->gcThread = NULL;
+	}
 	if( ctxt->bgThread){
 		kthread_stop(ctxt->bgThread);
 		ctxt->bgThread = NULL;
@@ -2439,6 +2600,11 @@ static int yaffs_BackgroundStart(yaffs_Device *dev)
 static void yaffs_BackgroundStop(yaffs_Device *dev)
 {
 }
+
+static unsigned yaffs_gc_wake_callback(yaffs_Device *dev)
+{
+	return 0;
+}
 #endif
 
 
@@ -2916,6 +3082,7 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	param->nChunksPerBlock = YAFFS_CHUNKS_PER_BLOCK;
 	param->totalBytesPerChunk = YAFFS_BYTES_PER_CHUNK;
 	param->nReservedBlocks = 5;
+	param->nGCReserveBlocks = yaffs_gc_reserve;
 	param->nShortOpCaches = (options.no_cache) ? 0 : 10;
 	param->inbandTags = options.inband_tags;
 
@@ -3001,6 +3168,7 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 
 	param->markSuperBlockDirty = yaffs_MarkSuperBlockDirty;
 	param->gcControl = yaffs_gc_control_callback;
+	param->gcWake = yaffs_gc_wake_callback;
 
 	yaffs_DeviceToLC(dev)->superBlock= sb;
 	
@@ -3036,7 +3204,9 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
         YINIT_LIST_HEAD(&(yaffs_DeviceToLC(dev)->searchContexts));
         param->removeObjectCallback = yaffs_RemoveObjectCallback;
 
-	init_MUTEX(&(yaffs_DeviceToLC(dev)->grossLock));
+	init_rwsem(&(yaffs_DeviceToLC(dev)->grossLock));
+	mutex_init(&(yaffs_DeviceToLC(dev)->metaLock));
+	mutex_init(&(yaffs_DeviceToLC(dev)->spareLock));
 
 	yaffs_GrossLock(dev);
 
@@ -3199,6 +3369,7 @@ static char *yaffs_dump_dev_part0(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "refreshPeriod...... %d\n", dev->param.refreshPeriod);
 	buf += sprintf(buf, "nShortOpCaches..... %d\n", dev->param.nShortOpCaches);
 	buf += sprintf(buf, "nReservedBlocks.... %d\n", dev->param.nReservedBlocks);
+	buf += sprintf(buf, "nGCReserveBlocks... %d\n", dev->param.nGCReserveBlocks);
 	buf += sprintf(buf, "alwaysCheckErased.. %d\n", dev->param.alwaysCheckErased);
 
 	buf += sprintf(buf, "\n");
@@ -3216,6 +3387,7 @@ static char *yaffs_dump_dev_part1(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "blocksInCheckpoint. %d\n", dev->blocksInCheckpoint);
 	buf += sprintf(buf, "\n");
 	buf += sprintf(buf, "nTnodes............ %d\n", dev->nTnodes);
+	buf += sprintf(buf, "nLazyTnodeFiles.... %d\n", dev->nLazyTnodeFiles);
 	buf += sprintf(buf, "nObjects........... %d\n", dev->nObjects);
 	buf += sprintf(buf, "nFreeChunks........ %d\n", dev->nFreeChunks);
 	buf += sprintf(buf, "\n");
@@ -3228,6 +3400,8 @@ static char *yaffs_dump_dev_part1(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "oldestDirtyGCs..... %u\n", dev->oldestDirtyGCs);
 	buf += sprintf(buf, "nGCBlocks.......... %u\n", dev->nGCBlocks);
 	buf += sprintf(buf, "backgroundGCs...... %u\n", dev->backgroundGCs);
+	buf += sprintf(buf, "bgGCCopies......... %u\n", dev->bgGCCopies);
+	buf += sprintf(buf, "gcWakes............ %u\n", dev->gcWakes);
 	buf += sprintf(buf, "nRetriedWrites..... %u\n", dev->nRetriedWrites);
 	buf += sprintf(buf, "nRetireBlocks...... %u\n", dev->nRetiredBlocks);
 	buf += sprintf(buf, "eccFixed........... %u\n", dev->eccFixed);
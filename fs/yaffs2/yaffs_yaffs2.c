@@ -208,6 +208,7 @@ int yaffs2_CheckpointRequired(yaffs_Device *dev)
 
 	return 	!dev->param.skipCheckpointWrite &&
 		!dev->readOnly &&
+		!dev->lazyTnodesFailed &&
 		(nblocks >= YAFFS_CHECKPOINT_MIN_BLOCKS);
 }
 
@@ -229,8 +230,8 @@ int yaffs2_CalcCheckpointBlocksRequired(yaffs_Device *dev)
 		nBytes += sizeof(yaffs_CheckpointDevice);
 		nBytes += devBlocks * sizeof(yaffs_BlockInfo);
 		nBytes += devBlocks * dev->chunkBitmapStride;
-		nBytes += (sizeof(yaffs_CheckpointObject) + sizeof(__u32)) * (dev->nObjects);
-		nBytes += (dev->tnodeSize + sizeof(__u32)) * (dev->nTnodes);
+		nBytes += (sizeof(yaffs_CheckpointObject) + sizeof(yaffs_CheckpointTnodes)) * (dev->nObjects);
+		nBytes += (dev->tnodeSize + sizeof(__u32)) * (dev->nTnodes + dev->nLazyTnodes);
 		nBytes += sizeof(yaffs_CheckpointValidity);
 		nBytes += sizeof(__u32); /* checksum*/
 
@@ -451,8 +452,23 @@ static int yaffs2_CheckpointObjectToObject(yaffs_Object *obj, yaffs_CheckpointOb
 
 
 
+static void yaffs2_SumCheckpointBytes(yaffs_CheckpointTnodes *cp,
+					const void *data, int nBytes)
+{
+	const __u8 *dataBytes = (const __u8 *)data;
+
+	cp->nBytes += nBytes;
+	while (nBytes-- > 0) {
+		cp->sum += *dataBytes;
+		cp->xorSum ^= *dataBytes;
+		dataBytes++;
+	}
+}
+
+/* Writes out the level 0 tnodes, or with cp set just sums them up into it */
 static int yaffs2_CheckpointTnodeWorker(yaffs_Object *in, yaffs_Tnode *tn,
-					__u32 level, int chunkOffset)
+					__u32 level, int chunkOffset,
+					yaffs_CheckpointTnodes *cp)
 {
 	int i;
 	yaffs_Device *dev = in->myDev;
@@ -466,11 +482,17 @@ static int yaffs2_CheckpointTnodeWorker(yaffs_Object *in, yaffs_Tnode *tn,
 					ok = yaffs2_CheckpointTnodeWorker(in,
 							tn->internal[i],
 							level - 1,
-							(chunkOffset<<YAFFS_TNODES_INTERNAL_BITS) + i);
+							(chunkOffset<<YAFFS_TNODES_INTERNAL_BITS) + i,
+							cp);
 				}
 			}
 		} else if (level == 0) {
 			__u32 baseOffset = chunkOffset <<  YAFFS_TNODES_LEVEL0_BITS;
+			if (cp) {
+				yaffs2_SumCheckpointBytes(cp, &baseOffset, sizeof(baseOffset));
+				yaffs2_SumCheckpointBytes(cp, tn, dev->tnodeSize);
+				return 1;
+			}
 			ok = (yaffs2_CheckpointWrite(dev, &baseOffset, sizeof(baseOffset)) == sizeof(baseOffset));
 			if (ok)
 				ok = (yaffs2_CheckpointWrite(dev, tn, dev->tnodeSize) == dev->tnodeSize);
@@ -481,44 +503,144 @@ static int yaffs2_CheckpointTnodeWorker(yaffs_Object *in, yaffs_Tnode *tn,
 
 }
 
+/*
+ * A file's tnodes are written after a yaffs_CheckpointTnodes header, so
+ * that a mount can skip over them and load them later. That takes two
+ * passes over the tree: one to size and sum them, one to write them.
+ */
 static int yaffs2_WriteCheckpointTnodes(yaffs_Object *obj)
 {
-	__u32 endMarker = ~0;
+	yaffs_CheckpointTnodes cp;
 	int ok = 1;
 
 	if (obj->variantType == YAFFS_OBJECT_TYPE_FILE) {
-		ok = yaffs2_CheckpointTnodeWorker(obj,
+		memset(&cp, 0, sizeof(cp));
+		yaffs2_CheckpointTnodeWorker(obj,
 					    obj->variant.fileVariant.top,
 					    obj->variant.fileVariant.topLevel,
-					    0);
+					    0, &cp);
+		cp.structType = sizeof(cp);
+
+		ok = (yaffs2_CheckpointWrite(obj->myDev, &cp, sizeof(cp)) == sizeof(cp));
 		if (ok)
-			ok = (yaffs2_CheckpointWrite(obj->myDev, &endMarker, sizeof(endMarker)) ==
-				sizeof(endMarker));
+			ok = yaffs2_CheckpointTnodeWorker(obj,
+					    obj->variant.fileVariant.top,
+					    obj->variant.fileVariant.topLevel,
+					    0, NULL);
 	}
 
 	return ok ? 1 : 0;
 }
 
+/*
+ * At mount we only note where a file's tnodes are and skip past them.
+ * They are read in by yaffs2_LoadLazyTnodes() when the file is first
+ * used, a few at a time by the background gc, or all at once before a
+ * new checkpoint is written. See yaffs2_InvalidateCheckpoint() for how
+ * the checkpoint is kept readable until then.
+ */
 static int yaffs2_ReadCheckpointTnodes(yaffs_Object *obj)
 {
+	yaffs_CheckpointTnodes cp;
+	int ok = 1;
+	yaffs_Device *dev = obj->myDev;
+	int recordSize = sizeof(__u32) + dev->tnodeSize;
+
+	ok = (yaffs2_CheckpointRead(dev, &cp, sizeof(cp)) == sizeof(cp));
+
+	if (ok && (cp.structType != sizeof(cp) || cp.nBytes % recordSize)) {
+		T(YAFFS_TRACE_CHECKPOINT, (TSTR("tnode header size %d bytes %d ok %d"TENDSTR),
+			cp.structType, cp.nBytes, ok));
+		ok = 0;
+	}
+
+	if (ok && cp.nBytes) {
+		obj->variant.fileVariant.lazyTnodes = dev->checkpointByteCount;
+		dev->nLazyTnodeFiles++;
+		dev->nLazyTnodes += cp.nBytes / recordSize;
+		ok = yaffs2_CheckpointSkip(dev, cp.nBytes, cp.sum, cp.xorSum);
+	}
+
+	T(YAFFS_TRACE_CHECKPOINT, (
+		TSTR("Checkpoint skip tnodes %d bytes. ok %d" TENDSTR),
+		cp.nBytes, ok));
+
+	return ok ? 1 : 0;
+}
+
+/*
+ * Called when another file has been dealt with. Once none are left the
+ * checkpoint is only kept if it is still valid.
+ */
+static void yaffs2_LazyTnodesDone(yaffs_Device *dev)
+{
+	dev->nLazyTnodeFiles--;
+	if (dev->nLazyTnodeFiles > 0)
+		return;
+
+	if (!dev->isCheckpointed && dev->blocksInCheckpoint > 0)
+		yaffs2_CheckpointInvalidateStream(dev);
+	yaffs2_DropLazyTnodes(dev);
+}
+
+static void yaffs2_LazyTnodesFailed(yaffs_Object *obj)
+{
+	obj->variant.fileVariant.lazyTnodes = YAFFS_LAZY_TNODES_FAILED;
+	obj->myDev->lazyTnodesFailed = 1;
+	yaffs2_LazyTnodesDone(obj->myDev);
+}
+
+int yaffs2_LoadLazyTnodes(yaffs_Object *obj)
+{
+	yaffs_CheckpointTnodes cp;
 	__u32 baseChunk;
 	int ok = 1;
 	yaffs_Device *dev = obj->myDev;
 	yaffs_FileStructure *fileStructPtr = &obj->variant.fileVariant;
 	yaffs_Tnode *tn;
 	int nread = 0;
+	int nBytes;
+
+	if (obj->variantType != YAFFS_OBJECT_TYPE_FILE || !fileStructPtr->lazyTnodes)
+		return YAFFS_OK;
+
+	/*
+	 * A file that fails to load is marked YAFFS_LAZY_TNODES_FAILED, so it
+	 * goes on failing rather than being used with a partial tree. The
+	 * checkpoint can't be trusted any more, so none is written from here
+	 * on and the next mount scans.
+	 */
+	if (fileStructPtr->lazyTnodes == YAFFS_LAZY_TNODES_FAILED)
+		return YAFFS_FAIL;
+
+	ok = yaffs2_CheckpointReopen(dev,
+			fileStructPtr->lazyTnodes - sizeof(cp));
+
+	if (!ok) {
+		T(YAFFS_TRACE_ERROR, (TSTR("Checkpoint reopen for object %d failed"
+			TENDSTR), obj->objectId));
+		yaffs2_LazyTnodesFailed(obj);
+		return YAFFS_FAIL;
+	}
+
+	ok = (yaffs2_CheckpointRead(dev, &cp, sizeof(cp)) == sizeof(cp)) &&
+		cp.structType == sizeof(cp);
 
-	ok = (yaffs2_CheckpointRead(dev, &baseChunk, sizeof(baseChunk)) == sizeof(baseChunk));
+	/* The header was checked at mount; sum just the tnodes */
+	dev->checkpointSum = 0;
+	dev->checkpointXor = 0;
 
-	while (ok && (~baseChunk)) {
+	nBytes = ok ? cp.nBytes : 0;
+
+	while (ok && nBytes > 0) {
 		nread++;
-		/* Read level 0 tnode */
 
+		ok = (yaffs2_CheckpointRead(dev, &baseChunk, sizeof(baseChunk)) == sizeof(baseChunk));
 
-		tn = yaffs_GetTnode(dev);
-		if (tn){
+		tn = ok ? yaffs_GetTnode(dev) : NULL;
+		if (tn)
 			ok = (yaffs2_CheckpointRead(dev, tn, dev->tnodeSize) == dev->tnodeSize);
-		} else
+		else
 			ok = 0;
 
 		if (tn && ok)
@@ -526,17 +648,94 @@ static int yaffs2_ReadCheckpointTnodes(yaffs_Object *obj)
 							fileStructPtr,
 							baseChunk,
 							tn) ? 1 : 0;
+		else if (tn)
+			yaffs_FreeTnode(dev, tn);
 
-		if (ok)
-			ok = (yaffs2_CheckpointRead(dev, &baseChunk, sizeof(baseChunk)) == sizeof(baseChunk));
-
+		nBytes -= sizeof(baseChunk) + dev->tnodeSize;
 	}
 
+	if (ok)
+		ok = (dev->checkpointSum == cp.sum && dev->checkpointXor == cp.xorSum);
+
+	yaffs2_CheckpointClose(dev);
+
 	T(YAFFS_TRACE_CHECKPOINT, (
-		TSTR("Checkpoint read tnodes %d records, last %d. ok %d" TENDSTR),
-		nread, baseChunk, ok));
+		TSTR("Checkpoint lazy load object %d tnodes %d records. ok %d" TENDSTR),
+		obj->objectId, nread, ok));
+
+	if (!ok) {
+		T(YAFFS_TRACE_ERROR, (TSTR("Checkpoint tnodes for object %d are bad"
+			TENDSTR), obj->objectId));
+		/* Don't leave the records that did load in a half-built tree */
+		yaffs_EmptyFileStructure(dev, fileStructPtr);
+		yaffs2_LazyTnodesFailed(obj);
+		return YAFFS_FAIL;
+	}
 
-	return ok ? 1 : 0;
+	fileStructPtr->lazyTnodes = 0;
+	dev->nLazyTnodes -= cp.nBytes / (sizeof(baseChunk) + dev->tnodeSize);
+	yaffs2_LazyTnodesDone(dev);
+
+	return YAFFS_OK;
+}
+
+/*
+ * Load the tnodes of up to nFiles files, or of all of them if nFiles is 0.
+ * A nonzero endOffset limits this to files whose records start before it.
+ */
+static void yaffs2_LoadSomeLazyTnodes(yaffs_Device *dev, int nFiles,
+					__u32 endOffset)
+{
+	yaffs_Object *obj;
+	struct ylist_head *lh, *n;
+	__u32 lazy;
+	int nLoaded = 0;
+	int i;
+
+	for (i = 0; dev->nLazyTnodeFiles > 0 && i < YAFFS_NOBJECT_BUCKETS; i++) {
+		ylist_for_each_safe(lh, n, &dev->objectBucket[i].list) {
+			obj = ylist_entry(lh, yaffs_Object, hashLink);
+			if (obj->variantType != YAFFS_OBJECT_TYPE_FILE)
+				continue;
+			lazy = obj->variant.fileVariant.lazyTnodes;
+			if (!lazy || lazy == YAFFS_LAZY_TNODES_FAILED)
+				continue;
+			if (endOffset &&
+			    lazy - sizeof(yaffs_CheckpointTnodes) >= endOffset)
+				continue;
+			yaffs2_LoadLazyTnodes(obj);
+			if (nFiles && ++nLoaded >= nFiles)
+				return;
+		}
+	}
+}
+
+/* Pull in every file's tnodes while the checkpoint can still be read */
+static void yaffs2_LoadAllLazyTnodes(yaffs_Device *dev)
+{
+	yaffs2_LoadSomeLazyTnodes(dev, 0, 0);
+	yaffs2_DropLazyTnodes(dev);
+}
+
+/*
+ * Once the checkpoint has been invalidated its remaining blocks only hold
+ * tnodes, and are freed when the last of them is loaded. gc loads them a
+ * file at a time, or all at once (nFiles 0) when it is short of blocks.
+ */
+void yaffs2_LoadPendingLazyTnodes(yaffs_Device *dev, int nFiles)
+{
+	if (dev->nLazyTnodeFiles > 0 && !dev->isCheckpointed)
+		yaffs2_LoadSomeLazyTnodes(dev, nFiles, 0);
+}
+
+void yaffs2_DropLazyTnodes(yaffs_Device *dev)
+{
+	dev->nLazyTnodeFiles = 0;
+	dev->nLazyTnodes = 0;
+	if (dev->checkpointBlockList) {
+		YFREE(dev->checkpointBlockList);
+		dev->checkpointBlockList = NULL;
+	}
 }
 
 
@@ -749,19 +948,36 @@ static int yaffs2_ReadCheckpointData(yaffs_Device *dev)
 
 	if (ok)
 		dev->isCheckpointed = 1;
-	else
+	else {
 		dev->isCheckpointed = 0;
+		yaffs2_DropLazyTnodes(dev);
+	}
 
 	return ok ? 1 : 0;
 
 }
 
+/*
+ * The checkpoint must be gone from flash before anything else is written.
+ * While files still have their tnodes in it, only its first block, which
+ * holds the validity marker, is erased: the files with records in that
+ * block are loaded first, and the rest of the blocks are erased by
+ * yaffs2_LazyTnodesDone() when the last file has been loaded.
+ */
 void yaffs2_InvalidateCheckpoint(yaffs_Device *dev)
 {
 	if (dev->isCheckpointed ||
 			dev->blocksInCheckpoint > 0) {
 		dev->isCheckpointed = 0;
-		yaffs2_CheckpointInvalidateStream(dev);
+		if (dev->nLazyTnodeFiles == 0)
+			yaffs2_CheckpointInvalidateStream(dev);
+		else if (dev->checkpointBlockList &&
+			 dev->checkpointBlockList[0] >= 0) {
+			yaffs2_LoadSomeLazyTnodes(dev, 0,
+				dev->param.nChunksPerBlock * dev->nDataBytesPerChunk);
+			if (dev->nLazyTnodeFiles > 0)
+				yaffs2_CheckpointInvalidateHead(dev);
+		}
 	}
 	if (dev->param.markSuperBlockDirty)
 		dev->param.markSuperBlockDirty(dev);
@@ -778,6 +994,9 @@ int yaffs_CheckpointSave(yaffs_Device *dev)
 	yaffs_VerifyFreeChunks(dev);
 
 	if (!dev->isCheckpointed) {
+		/* Writing the checkpoint erases the blocks they are read from */
+		if (dev->nLazyTnodeFiles > 0)
+			yaffs2_LoadAllLazyTnodes(dev);
 		yaffs2_InvalidateCheckpoint(dev);
 		yaffs2_WriteCheckpointData(dev);
 	}
@@ -29,6 +29,9 @@ int yaffs2_CalcCheckpointBlocksRequired(yaffs_Device *dev);
 void yaffs2_InvalidateCheckpoint(yaffs_Device *dev);
 int yaffs2_CheckpointSave(yaffs_Device *dev);
 int yaffs2_CheckpointRestore(yaffs_Device *dev);
+int yaffs2_LoadLazyTnodes(yaffs_Object *obj);
+void yaffs2_LoadPendingLazyTnodes(yaffs_Device *dev, int nFiles);
+void yaffs2_DropLazyTnodes(yaffs_Device *dev);
 
 int yaffs2_HandleHole(yaffs_Object *obj, loff_t newSize);
 int yaffs2_ScanBackwards(yaffs_Device *dev);
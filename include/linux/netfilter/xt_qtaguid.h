@@ -4,10 +4,41 @@
 /* For now we just replace the xt_owner.
  * FIXME: make iptables aware of qtaguid. */
 #include <linux/netfilter/xt_owner.h>
+#include <linux/if.h>
+#include <linux/types.h>
 
 #define XT_QTAGUID_UID    XT_OWNER_UID
 #define XT_QTAGUID_GID    XT_OWNER_GID
 #define XT_QTAGUID_SOCKET XT_OWNER_SOCKET
 #define xt_qtaguid_match_info xt_owner_match_info
 
+/*
+ * Binary stats, read from /proc/net/xt_qtaguid/stats_bin.
+ * A read returns one header followed by one record per {iface, tag}.
+ * Writing a generation (in decimal) to the file before reading limits the
+ * records to those that changed since the dump whose header carried that
+ * generation. Deleted tags are never reported, so a full dump (generation
+ * 0, the default) is needed to notice them.
+ */
+#define XT_QTAGUID_STATS_BIN_MAGIC	0x71746731	/* "qtg1" */
+#define XT_QTAGUID_STATS_BIN_VERSION	1
+
+struct xt_qtaguid_stats_bin_hdr {
+	__u32 magic;
+	__u16 version;
+	__u16 rec_size;		/* sizeof(struct xt_qtaguid_stats_bin_rec) */
+	__u32 gen;		/* pass back to only get later changes */
+	__u32 since;		/* generation the records were filtered on */
+};
+
+struct xt_qtaguid_stats_bin_rec {
+	char iface[IFNAMSIZ];
+	__u64 tag;		/* acct_tag in the upper 32 bits, uid below */
+	/* Indexed by [cnt_set][rx, tx][tcp, udp, other] */
+	struct {
+		__u64 bytes;
+		__u64 packets;
+	} bpc[2][2][3];
+};
+
 #endif /* _XT_QTAGUID_MATCH_H */
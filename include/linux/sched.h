@@ -1249,6 +1249,11 @@ struct task_struct {
 #if defined(SPLIT_RSS_COUNTING)
 	struct task_rss_stat	rss_stat;
 #endif
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	/* oom_adj bucket of the lowmemorykiller and rss cached there */
+	struct list_head lowmem_node;
+	unsigned long lowmem_rss;
+#endif
 /* task state */
 	int exit_state;
 	int exit_code, exit_signal;
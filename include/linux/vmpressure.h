@@ -0,0 +1,20 @@
+#ifndef __LINUX_VMPRESSURE_H
+#define __LINUX_VMPRESSURE_H
+
+#include <linux/gfp.h>
+#include <linux/notifier.h>
+
+/*
+ * Reclaim efficiency, reported to listeners once per window of scanned
+ * pages as a pressure value from 0 (everything scanned was reclaimed)
+ * to 100 (nothing was).
+ */
+#define VMPRESSURE_MAX		100
+
+extern void vmpressure(gfp_t gfp, unsigned long scanned,
+		       unsigned long reclaimed);
+
+extern int register_vmpressure_notifier(struct notifier_block *nb);
+extern int unregister_vmpressure_notifier(struct notifier_block *nb);
+
+#endif /* __LINUX_VMPRESSURE_H */
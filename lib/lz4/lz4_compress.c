@@ -0,0 +1,144 @@
+/*
+ *  LZ4 Compressor
+ *
+ *  Produces the LZ4 block format (as described by Yann Collet's LZ4
+ *  library, http://code.google.com/p/lz4/) using a single-probe hash
+ *  table, favouring speed over ratio.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+/*
+ * Emit a run length continuation: 'len' has already had the nibble
+ * value stored in the token subtracted from it.
+ */
+static inline unsigned char *lz4_put_length(unsigned char *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = (unsigned char)len;
+
+	return op;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+	const unsigned char * const in_end = src + src_len;
+	const unsigned char * const mflimit = in_end - MFLIMIT;
+	const unsigned char * const matchlimit = in_end - LASTLITERALS;
+	unsigned char * const out_end = dst + *dst_len;
+	u32 *hash_table = wrkmem;
+	const unsigned char *ip = src, *anchor = src;
+	unsigned char *op = dst, *token;
+	size_t lit_len, match_len;
+
+	memset(hash_table, 0, LZ4_MEM_COMPRESS);
+
+	if (src_len < MFLIMIT + 1)
+		goto last_literals;
+
+	ip++;
+	while (ip < mflimit) {
+		const unsigned char *ref, *mp, *rp;
+		u32 seq, attempts = (1U << SKIP_STRENGTH) + 3;
+
+		/* Find a match */
+		for (;;) {
+			u32 h;
+
+			seq = get_unaligned((const u32 *)ip);
+			h = LZ4_HASH(seq);
+			ref = src + hash_table[h];
+			hash_table[h] = ip - src;
+
+			if (ref < ip && ip - ref <= MAX_DISTANCE &&
+			    get_unaligned((const u32 *)ref) == seq)
+				break;
+
+			ip += attempts++ >> SKIP_STRENGTH;
+			if (unlikely(ip >= mflimit))
+				goto last_literals;
+		}
+
+		/* Extend the match backwards into pending literals */
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		/* ... and forwards, stopping before the last literals */
+		mp = ip + MINMATCH;
+		rp = ref + MINMATCH;
+		while (mp < matchlimit && *mp == *rp) {
+			mp++;
+			rp++;
+		}
+
+		lit_len = ip - anchor;
+		match_len = mp - ip - MINMATCH;
+
+		if (unlikely(op + 1 + lit_len + lit_len / 255 + 1 + 2 +
+				match_len / 255 + 1 > out_end))
+			return LZ4_E_OUTPUT_OVERRUN;
+
+		token = op++;
+		if (lit_len >= RUN_MASK) {
+			*token = RUN_MASK << ML_BITS;
+			op = lz4_put_length(op, lit_len - RUN_MASK);
+		} else {
+			*token = lit_len << ML_BITS;
+		}
+
+		memcpy(op, anchor, lit_len);
+		op += lit_len;
+
+		put_unaligned_le16(ip - ref, op);
+		op += 2;
+
+		if (match_len >= ML_MASK) {
+			*token |= ML_MASK;
+			op = lz4_put_length(op, match_len - ML_MASK);
+		} else {
+			*token |= match_len;
+		}
+
+		ip = anchor = mp;
+
+		/* Prime the table with a position inside the match */
+		if (ip < mflimit)
+			hash_table[LZ4_HASH(get_unaligned(
+				(const u32 *)(ip - 2)))] = ip - 2 - src;
+	}
+
+last_literals:
+	lit_len = in_end - anchor;
+	if (unlikely(op + 1 + lit_len + lit_len / 255 + 1 > out_end))
+		return LZ4_E_OUTPUT_OVERRUN;
+
+	if (lit_len >= RUN_MASK) {
+		*op++ = RUN_MASK << ML_BITS;
+		op = lz4_put_length(op, lit_len - RUN_MASK);
+	} else {
+		*op++ = lit_len << ML_BITS;
+	}
+
+	memcpy(op, anchor, lit_len);
+	op += lit_len;
+
+	*dst_len = op - dst;
+	return LZ4_E_OK;
+}
+EXPORT_SYMBOL_GPL(lz4_compress);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Compressor");
@@ -0,0 +1,127 @@
+/*
+ *  LZ4 Decompressor
+ *
+ *  Decodes the LZ4 block format (as described by Yann Collet's LZ4
+ *  library, http://code.google.com/p/lz4/). Every read and write is
+ *  bounds checked, so corrupt input cannot overrun either buffer.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#ifndef STATIC
+#include <linux/module.h>
+#include <linux/kernel.h>
+#endif
+
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+/* Decode a length continuation; returns 0 on input overrun */
+static inline int lz4_get_length(const unsigned char **ip,
+			const unsigned char *ip_end, size_t *len)
+{
+	unsigned char s;
+
+	do {
+		if (unlikely(*ip >= ip_end))
+			return 0;
+		s = *(*ip)++;
+		*len += s;
+	} while (s == 255);
+
+	return 1;
+}
+
+int lz4_decompress_safe(const unsigned char *in, size_t in_len,
+			unsigned char *out, size_t *out_len)
+{
+	const unsigned char * const ip_end = in + in_len;
+	unsigned char * const op_end = out + *out_len;
+	const unsigned char *ip = in, *m_pos;
+	unsigned char *op = out;
+	unsigned int token;
+	size_t len, m_off;
+
+	*out_len = 0;
+
+	for (;;) {
+		if (unlikely(ip >= ip_end))
+			goto input_overrun;
+		token = *ip++;
+
+		/* Literals */
+		len = token >> ML_BITS;
+		if (len == RUN_MASK && !lz4_get_length(&ip, ip_end, &len))
+			goto input_overrun;
+
+		if (unlikely((size_t)(ip_end - ip) < len))
+			goto input_overrun;
+		if (unlikely((size_t)(op_end - op) < len))
+			goto output_overrun;
+
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+
+		/* The last sequence carries literals only */
+		if (ip == ip_end)
+			break;
+
+		/* Match */
+		if (unlikely(ip_end - ip < 2))
+			goto input_overrun;
+		m_off = get_unaligned_le16(ip);
+		ip += 2;
+
+		if (unlikely(m_off == 0 || m_off > (size_t)(op - out)))
+			goto lookbehind_overrun;
+		m_pos = op - m_off;
+
+		len = token & ML_MASK;
+		if (len == ML_MASK && !lz4_get_length(&ip, ip_end, &len))
+			goto input_overrun;
+		len += MINMATCH;
+
+		if (unlikely((size_t)(op_end - op) < len))
+			goto output_overrun;
+
+		if (m_off >= 8) {
+			/* Source and destination never overlap within a word */
+			while (len >= 8) {
+				put_unaligned(get_unaligned((const u64 *)m_pos),
+					(u64 *)op);
+				op += 8;
+				m_pos += 8;
+				len -= 8;
+			}
+		}
+		while (len--)
+			*op++ = *m_pos++;
+	}
+
+	*out_len = op - out;
+	return LZ4_E_OK;
+
+input_overrun:
+	*out_len = op - out;
+	return LZ4_E_INPUT_OVERRUN;
+
+output_overrun:
+	*out_len = op - out;
+	return LZ4_E_OUTPUT_OVERRUN;
+
+lookbehind_overrun:
+	*out_len = op - out;
+	return LZ4_E_LOOKBEHIND_OVERRUN;
+}
+#ifndef STATIC
+EXPORT_SYMBOL_GPL(lz4_decompress_safe);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Decompressor");
+
+#endif
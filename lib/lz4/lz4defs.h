@@ -0,0 +1,27 @@
+/*
+ *  lz4defs.h -- LZ4 block format constants
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#define MINMATCH	4
+
+/* Last match must start at least MFLIMIT bytes before end of input */
+#define MFLIMIT		12
+/* Last LASTLITERALS bytes of input are always emitted as literals */
+#define LASTLITERALS	5
+
+#define MAX_DISTANCE	0xffff
+
+#define ML_BITS		4
+#define ML_MASK		((1U << ML_BITS) - 1)
+#define RUN_BITS	(8 - ML_BITS)
+#define RUN_MASK	((1U << RUN_BITS) - 1)
+
+/* Search step grows by one every (1 << SKIP_STRENGTH) failed lookups */
+#define SKIP_STRENGTH	6
+
+#define LZ4_HASH(seq)	\
+	(((seq) * 2654435761U) >> (32 - LZ4_HASH_LOG))
@@ -0,0 +1,107 @@
+/*
+ * linux/mm/vmpressure.c
+ *
+ * Global memory pressure as seen by page reclaim.
+ *
+ * vmscan reports how many pages it scanned and how many of those it
+ * reclaimed. Once a window worth of pages has been scanned, the share
+ * that could not be reclaimed is passed to the notifier chain as the
+ * current pressure. Listeners run from a workqueue, never from within
+ * reclaim itself.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/spinlock.h>
+#include <linux/swap.h>
+#include <linux/workqueue.h>
+#include <linux/vmpressure.h>
+
+/* Scanned pages per pressure sample, 512 pages on 4k systems */
+static const unsigned long vmpressure_win = SWAP_CLUSTER_MAX * 16;
+
+static DEFINE_SPINLOCK(vmpressure_lock);
+static unsigned long vmpressure_scanned;
+static unsigned long vmpressure_reclaimed;
+
+static BLOCKING_NOTIFIER_HEAD(vmpressure_notify_list);
+
+int register_vmpressure_notifier(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_register(&vmpressure_notify_list, nb);
+}
+EXPORT_SYMBOL_GPL(register_vmpressure_notifier);
+
+int unregister_vmpressure_notifier(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_unregister(&vmpressure_notify_list, nb);
+}
+EXPORT_SYMBOL_GPL(unregister_vmpressure_notifier);
+
+static unsigned long vmpressure_calc(unsigned long scanned,
+				     unsigned long reclaimed)
+{
+	if (reclaimed >= scanned)
+		return 0;
+
+	return VMPRESSURE_MAX - reclaimed * VMPRESSURE_MAX / scanned;
+}
+
+static void vmpressure_work_fn(struct work_struct *work)
+{
+	unsigned long scanned, reclaimed;
+
+	spin_lock(&vmpressure_lock);
+	scanned = vmpressure_scanned;
+	reclaimed = vmpressure_reclaimed;
+	vmpressure_scanned = 0;
+	vmpressure_reclaimed = 0;
+	spin_unlock(&vmpressure_lock);
+
+	/* Raced with another instance of ourselves */
+	if (!scanned)
+		return;
+
+	blocking_notifier_call_chain(&vmpressure_notify_list,
+				     vmpressure_calc(scanned, reclaimed), NULL);
+}
+
+static DECLARE_WORK(vmpressure_work, vmpressure_work_fn);
+
+/**
+ * vmpressure() - account reclaim efficiency
+ * @gfp:	reclaimer's gfp mask
+ * @scanned:	number of pages scanned
+ * @reclaimed:	number of pages reclaimed
+ *
+ * Called by vmscan after each pass over a zone of the global LRU.
+ */
+void vmpressure(gfp_t gfp, unsigned long scanned, unsigned long reclaimed)
+{
+	unsigned long total;
+
+	/*
+	 * Only allocations that could have used the pages we failed to
+	 * reclaim say anything about pressure on userspace memory.
+	 */
+	if (!(gfp & (__GFP_HIGHMEM | __GFP_MOVABLE | __GFP_IO | __GFP_FS)))
+		return;
+
+	if (!scanned)
+		return;
+
+	spin_lock(&vmpressure_lock);
+	vmpressure_scanned += scanned;
+	vmpressure_reclaimed += reclaimed;
+	total = vmpressure_scanned;
+	spin_unlock(&vmpressure_lock);
+
+	if (total < vmpressure_win)
+		return;
+
+	schedule_work(&vmpressure_work);
+}
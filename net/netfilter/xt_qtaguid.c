@@ -15,8 +15,13 @@
 #define DEBUG
 
 #include <linux/file.h>
+#include <linux/hash.h>
 #include <linux/inetdevice.h>
 #include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/rculist.h>
+#include <linux/seq_file.h>
+#include <linux/seqlock.h>
 #include <linux/netfilter/x_tables.h>
 #include <linux/netfilter/xt_qtaguid.h>
 #include <linux/skbuff.h>
@@ -49,6 +54,7 @@ static unsigned int proc_iface_perms = S_IRUGO;
 module_param_named(iface_perms, proc_iface_perms, uint, S_IRUGO | S_IWUSR);
 
 static struct proc_dir_entry *xt_qtaguid_stats_file;
+static struct proc_dir_entry *xt_qtaguid_stats_bin_file;
 static unsigned int proc_stats_perms = S_IRUGO;
 module_param_named(stats_perms, proc_stats_perms, uint, S_IRUGO | S_IWUSR);
 
@@ -182,15 +188,12 @@ static struct proc_dir_entry *iface_stat_all_procfile;
  * qtaguid_mt()
  *   account_for_uid()
  *     if_tag_stat_update()
- *       get_sock_stat()
- *         sock_tag_list_lock
- *       struct iface_stat->tag_stat_list_lock
- *         tag_stat_update()
- *           get_active_counter_set()
- *             tag_counter_set_list_lock
- *         tag_stat_update()
- *           get_active_counter_set()
- *             tag_counter_set_list_lock
+ *       (rcu: sock_tag_hash, iface_stat_list, tag_stat_cache)
+ *       Only on a tag_stat_cache miss:
+ *       if_tag_stat_lookup()
+ *         struct iface_stat->tag_stat_list_lock
+ *       get_active_counter_set()
+ *         tag_counter_set_list_lock
  *
  *
  * qtaguid_ctrl_parse()
@@ -220,6 +223,14 @@ static DEFINE_SPINLOCK(iface_stat_list_lock);
 
 static struct rb_root sock_tag_tree = RB_ROOT;
 static DEFINE_SPINLOCK(sock_tag_list_lock);
+/*
+ * The per packet path finds sock_tags through sock_tag_hash under rcu.
+ * Both are updated under sock_tag_list_lock; re-tagging a socket bumps
+ * sock_tag_seq so a 64bit tag is never read half updated.
+ */
+#define SOCK_TAG_HASH_BITS 8
+static struct hlist_head sock_tag_hash[1 << SOCK_TAG_HASH_BITS];
+static seqcount_t sock_tag_seq = SEQCNT_ZERO;
 
 static struct rb_root tag_counter_set_tree = RB_ROOT;
 static DEFINE_SPINLOCK(tag_counter_set_list_lock);
@@ -231,6 +242,33 @@ static struct rb_root proc_qtu_data_tree = RB_ROOT;
 /* No proc_qtu_data_tree_lock; use uid_tag_data_tree_lock */
 
 static struct qtaguid_event_counts qtu_events;
+
+/*
+ * Last {net_dev, tag} each cpu billed a packet to, so a flow's packets
+ * skip the iface_stat, tag_stat and counter set lookups.
+ * An entry is only used while its gen matches tag_stat_gen, which is
+ * bumped whenever a tag_stat is freed, a counter set changes, or an
+ * iface_stat changes its net_dev.
+ */
+struct tag_stat_cache {
+	unsigned int gen;
+	const struct net_device *net_dev;
+	tag_t tag;
+	struct tag_stat *ts_entry;
+	int active_set;
+};
+static DEFINE_PER_CPU(struct tag_stat_cache, tag_stat_cache);
+static atomic_t tag_stat_gen = ATOMIC_INIT(1);
+
+/* Bumped by each open of stats_bin, stamped into changing tag_stats. */
+static atomic_t qtu_stats_gen = ATOMIC_INIT(1);
+
+static void tag_stat_cache_invalidate(void)
+{
+	smp_mb__before_atomic_inc();
+	atomic_inc(&tag_stat_gen);
+	smp_mb__after_atomic_inc();
+}
 /*----------------------------------------------*/
 static bool can_manipulate_uids(void)
 {
@@ -412,6 +450,35 @@ static void sock_tag_tree_insert(struct sock_tag *data, struct rb_root *root)
 	rb_insert_color(&data->sock_node, root);
 }
 
+static void sock_tag_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct sock_tag, rcu));
+}
+
+/* Caller must hold sock_tag_list_lock */
+static void sock_tag_hash_add(struct sock_tag *st_entry)
+{
+	hlist_add_head_rcu(&st_entry->sock_hnode,
+			   &sock_tag_hash[hash_ptr(st_entry->sk,
+						   SOCK_TAG_HASH_BITS)]);
+}
+
+/* Caller must hold rcu_read_lock */
+static struct sock_tag *sock_tag_hash_search(const struct sock *sk)
+{
+	struct sock_tag *st_entry;
+	struct hlist_node *node;
+
+	hlist_for_each_entry_rcu(st_entry, node,
+				 &sock_tag_hash[hash_ptr((void *)sk,
+							 SOCK_TAG_HASH_BITS)],
+				 sock_hnode) {
+		if (st_entry->sk == sk)
+			return st_entry;
+	}
+	return NULL;
+}
+
 static void sock_tag_tree_erase(struct rb_root *st_to_free_tree)
 {
 	struct rb_node *node;
@@ -428,7 +495,7 @@ static void sock_tag_tree_erase(struct rb_root *st_to_free_tree)
 			 get_uid_from_tag(st_entry->tag));
 		rb_erase(&st_entry->sock_node, st_to_free_tree);
 		sockfd_put(st_entry->socket);
-		kfree(st_entry);
+		call_rcu(&st_entry->rcu, sock_tag_free_rcu);
 	}
 }
 
@@ -781,6 +848,26 @@ done:
 	return iface_entry;
 }
 
+/*
+ * Find the entry for the device a packet went through.
+ * The device pointer is tried first, it is only set for active entries.
+ * Caller must hold rcu_read_lock; iface_stat entries are never freed.
+ */
+static struct iface_stat *get_iface_entry_rcu(const struct net_device *net_dev)
+{
+	struct iface_stat *iface_entry;
+
+	list_for_each_entry_rcu(iface_entry, &iface_stat_list, list) {
+		if (iface_entry->net_dev == net_dev)
+			return iface_entry;
+	}
+	list_for_each_entry_rcu(iface_entry, &iface_stat_list, list) {
+		if (!strcmp(net_dev->name, iface_entry->ifname))
+			return iface_entry;
+	}
+	return NULL;
+}
+
 static int iface_stat_all_proc_read(char *page, char **num_items_returned,
 				    off_t items_to_skip, int char_count,
 				    int *eof, void *data)
@@ -904,6 +991,7 @@ static void _iface_stat_set_active(struct iface_stat *entry,
 			 percpu_read(*net_dev->pcpu_refcnt));
 
 	}
+	tag_stat_cache_invalidate();
 }
 
 /* Caller must hold iface_stat_list_lock */
@@ -945,7 +1033,7 @@ static struct iface_stat *iface_alloc(struct net_device *net_dev)
 	isw->iface_entry = new_iface;
 	INIT_WORK(&isw->iface_work, iface_create_proc_worker);
 	schedule_work(&isw->iface_work);
-	list_add(&new_iface->list, &iface_stat_list);
+	list_add_rcu(&new_iface->list, &iface_stat_list);
 	return new_iface;
 }
 
@@ -1136,16 +1224,26 @@ static struct sock_tag *get_sock_stat_nl(const struct sock *sk)
 	return sock_tag_tree_search(&sock_tag_tree, sk);
 }
 
-static struct sock_tag *get_sock_stat(const struct sock *sk)
+/*
+ * Returns the tag the socket's traffic is billed to, or the plain uid tag
+ * if it was not tagged.
+ * Caller must hold rcu_read_lock.
+ */
+static tag_t get_sock_tag_rcu(const struct sock *sk, uid_t uid)
 {
 	struct sock_tag *sock_tag_entry;
-	MT_DEBUG("qtaguid: get_sock_stat(sk=%p)\n", sk);
-	if (!sk)
-		return NULL;
-	spin_lock_bh(&sock_tag_list_lock);
-	sock_tag_entry = get_sock_stat_nl(sk);
-	spin_unlock_bh(&sock_tag_list_lock);
-	return sock_tag_entry;
+	unsigned int seq;
+	tag_t tag;
+
+	MT_DEBUG("qtaguid: get_sock_tag_rcu(sk=%p)\n", sk);
+	sock_tag_entry = sk ? sock_tag_hash_search(sk) : NULL;
+	if (!sock_tag_entry)
+		return make_tag_from_uid(uid);
+	do {
+		seq = read_seqcount_begin(&sock_tag_seq);
+		tag = sock_tag_entry->tag;
+	} while (read_seqcount_retry(&sock_tag_seq, seq));
+	return tag;
 }
 
 static void
@@ -1222,20 +1320,43 @@ static void iface_stat_update(struct net_device *net_dev, bool stash_only)
 	spin_unlock_bh(&iface_stat_list_lock);
 }
 
-static void tag_stat_update(struct tag_stat *tag_entry,
+/*
+ * Called with bottom halves disabled, so nothing else on this cpu
+ * touches its counters and the syncp sections can't nest.
+ */
+static void tag_stat_update(struct tag_stat *tag_entry, int active_set,
 			enum ifs_tx_rx direction, int proto, int bytes)
 {
-	int active_set;
-	active_set = get_active_counter_set(tag_entry->tn.tag);
+	int cpu = smp_processor_id();
+	unsigned int stats_gen = atomic_read(&qtu_stats_gen);
+	struct tag_stat_cpu *tsc;
+
 	MT_DEBUG("qtaguid: tag_stat_update(tag=0x%llx (uid=%u) set=%d "
 		 "dir=%d proto=%d bytes=%d)\n",
 		 tag_entry->tn.tag, get_uid_from_tag(tag_entry->tn.tag),
 		 active_set, direction, proto, bytes);
-	data_counters_update(&tag_entry->counters, active_set, direction,
-			     proto, bytes);
-	if (tag_entry->parent_counters)
-		data_counters_update(tag_entry->parent_counters, active_set,
-				     direction, proto, bytes);
+	tsc = &tag_entry->counters[cpu];
+	u64_stats_update_begin(&tsc->syncp);
+	data_counters_update(&tsc->dc, active_set, direction, proto, bytes);
+	u64_stats_update_end(&tsc->syncp);
+	/* Only dirty the shared line once per stats_bin dump */
+	if (unlikely(tag_entry->stats_gen != stats_gen))
+		tag_entry->stats_gen = stats_gen;
+	tag_entry = tag_entry->parent;
+	if (tag_entry) {
+		tsc = &tag_entry->counters[cpu];
+		u64_stats_update_begin(&tsc->syncp);
+		data_counters_update(&tsc->dc, active_set, direction, proto,
+				     bytes);
+		u64_stats_update_end(&tsc->syncp);
+		if (unlikely(tag_entry->stats_gen != stats_gen))
+			tag_entry->stats_gen = stats_gen;
+	}
+}
+
+static void tag_stat_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct tag_stat, rcu));
 }
 
 /*
@@ -1250,7 +1371,10 @@ static struct tag_stat *create_if_tag_stat(struct iface_stat *iface_entry,
 	IF_DEBUG("qtaguid: iface_stat: %s(): ife=%p tag=0x%llx"
 		 " (uid=%u)\n", __func__,
 		 iface_entry, tag, get_uid_from_tag(tag));
-	new_tag_stat_entry = kzalloc(sizeof(*new_tag_stat_entry), GFP_ATOMIC);
+	new_tag_stat_entry = kzalloc(sizeof(*new_tag_stat_entry)
+				     + nr_cpu_ids *
+				     sizeof(new_tag_stat_entry->counters[0]),
+				     GFP_ATOMIC);
 	if (!new_tag_stat_entry) {
 		pr_err("qtaguid: iface_stat: tag stat alloc failed\n");
 		goto done;
@@ -1261,97 +1385,112 @@ done:
 	return new_tag_stat_entry;
 }
 
-static void if_tag_stat_update(const char *ifname, uid_t uid,
-			       const struct sock *sk, enum ifs_tx_rx direction,
-			       int proto, int bytes)
+/*
+ * Find the {acct_tag, uid_tag} entry within the interface, creating it and
+ * its {0, uid_tag} parent as needed.
+ * Caller must hold rcu_read_lock, the returned entry is valid until it is
+ * dropped.
+ */
+static struct tag_stat *if_tag_stat_lookup(struct iface_stat *iface_entry,
+					   tag_t tag)
 {
 	struct tag_stat *tag_stat_entry;
-	tag_t tag, acct_tag;
-	tag_t uid_tag;
-	struct data_counters *uid_tag_counters;
-	struct sock_tag *sock_tag_entry;
-	struct iface_stat *iface_entry;
-	struct tag_stat *new_tag_stat = NULL;
-	MT_DEBUG("qtaguid: if_tag_stat_update(ifname=%s "
-		"uid=%u sk=%p dir=%d proto=%d bytes=%d)\n",
-		 ifname, uid, sk, direction, proto, bytes);
+	struct tag_stat *uid_tag_stat_entry;
+	tag_t acct_tag = get_atag_from_tag(tag);
+	tag_t uid_tag = get_utag_from_tag(tag);
 
-
-	iface_entry = get_iface_entry(ifname);
-	if (!iface_entry) {
-		pr_err("qtaguid: iface_stat: stat_update() %s not found\n",
-		       ifname);
-		return;
-	}
-	/* It is ok to process data when an iface_entry is inactive */
-
-	MT_DEBUG("qtaguid: iface_stat: stat_update() dev=%s entry=%p\n",
-		 ifname, iface_entry);
-
-	/*
-	 * Look for a tagged sock.
-	 * It will have an acct_uid.
-	 */
-	sock_tag_entry = get_sock_stat(sk);
-	if (sock_tag_entry) {
-		tag = sock_tag_entry->tag;
-		acct_tag = get_atag_from_tag(tag);
-		uid_tag = get_utag_from_tag(tag);
-	} else {
-		acct_tag = make_atag_from_value(0);
-		tag = combine_atag_with_uid(acct_tag, uid);
-		uid_tag = make_tag_from_uid(uid);
-	}
 	MT_DEBUG("qtaguid: iface_stat: stat_update(): "
 		 " looking for tag=0x%llx (uid=%u) in ife=%p\n",
 		 tag, get_uid_from_tag(tag), iface_entry);
-	/* Loop over tag list under this interface for {acct_tag,uid_tag} */
 	spin_lock_bh(&iface_entry->tag_stat_list_lock);
-
+	/*
+	 * Updating the {acct_tag, uid_tag} entry handles both stats:
+	 * {0, uid_tag} will also get updated.
+	 */
 	tag_stat_entry = tag_stat_tree_search(&iface_entry->tag_stat_tree,
 					      tag);
-	if (tag_stat_entry) {
-		/*
-		 * Updating the {acct_tag, uid_tag} entry handles both stats:
-		 * {0, uid_tag} will also get updated.
-		 */
-		tag_stat_update(tag_stat_entry, direction, proto, bytes);
-		spin_unlock_bh(&iface_entry->tag_stat_list_lock);
-		return;
-	}
+	if (tag_stat_entry)
+		goto unlock;
 
-	/* Loop over tag list under this interface for {0,uid_tag} */
-	tag_stat_entry = tag_stat_tree_search(&iface_entry->tag_stat_tree,
-					      uid_tag);
-	if (!tag_stat_entry) {
-		/* Here: the base uid_tag did not exist */
-		/*
-		 * No parent counters. So
-		 *  - No {0, uid_tag} stats and no {acc_tag, uid_tag} stats.
-		 */
-		new_tag_stat = create_if_tag_stat(iface_entry, uid_tag);
-		uid_tag_counters = &new_tag_stat->counters;
-	} else {
-		uid_tag_counters = &tag_stat_entry->counters;
+	/* Look for {0, uid_tag}, the parent of {acct_tag, uid_tag} */
+	uid_tag_stat_entry = tag_stat_tree_search(&iface_entry->tag_stat_tree,
+						  uid_tag);
+	if (!uid_tag_stat_entry) {
+		uid_tag_stat_entry = create_if_tag_stat(iface_entry, uid_tag);
+		if (!uid_tag_stat_entry)
+			goto unlock;
 	}
 
 	if (acct_tag) {
 		/* Create the child {acct_tag, uid_tag} and hook up parent. */
-		new_tag_stat = create_if_tag_stat(iface_entry, tag);
-		new_tag_stat->parent_counters = uid_tag_counters;
+		tag_stat_entry = create_if_tag_stat(iface_entry, tag);
+		if (tag_stat_entry)
+			tag_stat_entry->parent = uid_tag_stat_entry;
 	} else {
-		/*
-		 * For new_tag_stat to be still NULL here would require:
-		 *  {0, uid_tag} exists
-		 *  and {acct_tag, uid_tag} doesn't exist
-		 *  AND acct_tag == 0.
-		 * Impossible. This reassures us that new_tag_stat
-		 * below will always be assigned.
-		 */
-		BUG_ON(!new_tag_stat);
+		tag_stat_entry = uid_tag_stat_entry;
 	}
-	tag_stat_update(new_tag_stat, direction, proto, bytes);
+unlock:
 	spin_unlock_bh(&iface_entry->tag_stat_list_lock);
+	return tag_stat_entry;
+}
+
+static void if_tag_stat_update(const struct net_device *net_dev, uid_t uid,
+			       const struct sock *sk, enum ifs_tx_rx direction,
+			       int proto, int bytes)
+{
+	struct tag_stat_cache *cache;
+	struct tag_stat *tag_stat_entry;
+	struct iface_stat *iface_entry;
+	unsigned int gen;
+	int active_set;
+	tag_t tag;
+
+	MT_DEBUG("qtaguid: if_tag_stat_update(ifname=%s "
+		"uid=%u sk=%p dir=%d proto=%d bytes=%d)\n",
+		 net_dev->name, uid, sk, direction, proto, bytes);
+
+	rcu_read_lock();
+	local_bh_disable();
+	/*
+	 * Look for a tagged sock.
+	 * It will have an acct_uid.
+	 */
+	tag = get_sock_tag_rcu(sk, uid);
+	/* Read before any lookup, so a concurrent change voids what we cache */
+	gen = atomic_read(&tag_stat_gen);
+	cache = &__get_cpu_var(tag_stat_cache);
+	if (likely(cache->gen == gen && cache->net_dev == net_dev
+		   && cache->tag == tag)) {
+		tag_stat_update(cache->ts_entry, cache->active_set, direction,
+				proto, bytes);
+		goto out;
+	}
+
+	iface_entry = get_iface_entry_rcu(net_dev);
+	if (!iface_entry) {
+		pr_err("qtaguid: iface_stat: stat_update() %s not found\n",
+		       net_dev->name);
+		goto out;
+	}
+	/* It is ok to process data when an iface_entry is inactive */
+
+	MT_DEBUG("qtaguid: iface_stat: stat_update() dev=%s entry=%p\n",
+		 net_dev->name, iface_entry);
+
+	tag_stat_entry = if_tag_stat_lookup(iface_entry, tag);
+	if (!tag_stat_entry)
+		goto out;
+	active_set = get_active_counter_set(tag);
+
+	cache->gen = gen;
+	cache->net_dev = net_dev;
+	cache->tag = tag;
+	cache->ts_entry = tag_stat_entry;
+	cache->active_set = active_set;
+	tag_stat_update(tag_stat_entry, active_set, direction, proto, bytes);
+out:
+	local_bh_enable();
+	rcu_read_unlock();
 }
 
 static int iface_netdev_event_handler(struct notifier_block *nb,
@@ -1606,7 +1745,7 @@ static void account_for_uid(const struct sk_buff *skb,
 			 par->hooknum, el_dev->name, el_dev->type,
 			 par->family, proto);
 
-		if_tag_stat_update(el_dev->name, uid,
+		if_tag_stat_update(el_dev, uid,
 				skb->sk ? skb->sk : alternate_sk,
 				par->in ? IFS_RX : IFS_TX,
 				proto, skb->len);
@@ -1906,6 +2045,7 @@ static int ctrl_cmd_delete(const char *input)
 	struct rb_node *node;
 	struct sock_tag *st_entry;
 	struct rb_root st_to_free_tree = RB_ROOT;
+	struct rb_root ts_to_free_tree = RB_ROOT;
 	struct tag_stat *ts_entry;
 	struct tag_counter_set *tcs_entry;
 	struct tag_ref *tr_entry;
@@ -1954,6 +2094,7 @@ static int ctrl_cmd_delete(const char *input)
 
 		if (!acct_tag || st_entry->tag == tag) {
 			rb_erase(&st_entry->sock_node, &sock_tag_tree);
+			hlist_del_rcu(&st_entry->sock_hnode);
 			/* Can't sockfd_put() within spinlock, do it later. */
 			sock_tag_tree_insert(st_entry, &st_to_free_tree);
 			tr_entry = lookup_tag_ref(st_entry->tag, NULL);
@@ -2017,13 +2158,28 @@ static int ctrl_cmd_delete(const char *input)
 					 entry_uid);
 				rb_erase(&ts_entry->tn.node,
 					 &iface_entry->tag_stat_tree);
-				kfree(ts_entry);
+				/* Free once no tag_stat_cache can use it */
+				tag_stat_tree_insert(ts_entry,
+						     &ts_to_free_tree);
 			}
 		}
 		spin_unlock_bh(&iface_entry->tag_stat_list_lock);
 	}
 	spin_unlock_bh(&iface_stat_list_lock);
 
+	/*
+	 * Only after the tag_stats and tcs are unreachable, so a cache entry
+	 * can't get refilled with them.
+	 */
+	tag_stat_cache_invalidate();
+	node = rb_first(&ts_to_free_tree);
+	while (node) {
+		ts_entry = rb_entry(node, struct tag_stat, tn.node);
+		node = rb_next(node);
+		rb_erase(&ts_entry->tn.node, &ts_to_free_tree);
+		call_rcu(&ts_entry->rcu, tag_stat_free_rcu);
+	}
+
 	/* Cleanup the uid_tag_data */
 	spin_lock_bh(&uid_tag_data_tree_lock);
 	node = rb_first(&uid_tag_data_tree);
@@ -2106,6 +2262,7 @@ static int ctrl_cmd_counter_set(const char *input)
 	}
 	tcs->active_set = counter_set;
 	spin_unlock_bh(&tag_counter_set_list_lock);
+	tag_stat_cache_invalidate();
 	atomic64_inc(&qtu_events.counter_set_changes);
 	res = 0;
 
@@ -2198,7 +2355,9 @@ static int ctrl_cmd_tag(const char *input)
 		BUG_ON(IS_ERR_OR_NULL(prev_tag_ref_entry));
 		BUG_ON(prev_tag_ref_entry->num_sock_tags <= 0);
 		prev_tag_ref_entry->num_sock_tags--;
+		write_seqcount_begin(&sock_tag_seq);
 		sock_tag_entry->tag = full_tag;
+		write_seqcount_end(&sock_tag_seq);
 	} else {
 		CT_DEBUG("qtaguid: ctrl_tag(%s): newtag for sk=%p\n",
 			 input, el_socket->sk);
@@ -2238,6 +2397,7 @@ static int ctrl_cmd_tag(const char *input)
 		spin_unlock_bh(&uid_tag_data_tree_lock);
 
 		sock_tag_tree_insert(sock_tag_entry, &sock_tag_tree);
+		sock_tag_hash_add(sock_tag_entry);
 		atomic64_inc(&qtu_events.sockets_tagged);
 	}
 	spin_unlock_bh(&sock_tag_list_lock);
@@ -2302,6 +2462,7 @@ static int ctrl_cmd_untag(const char *input)
 	 * so it can do whatever it wants to it.
 	 */
 	rb_erase(&sock_tag_entry->sock_node, &sock_tag_tree);
+	hlist_del_rcu(&sock_tag_entry->sock_hnode);
 
 	tag_ref_entry = lookup_tag_ref(sock_tag_entry->tag, &utd_entry);
 	BUG_ON(!tag_ref_entry);
@@ -2338,7 +2499,7 @@ static int ctrl_cmd_untag(const char *input)
 		 atomic_long_read(&el_socket->file->f_count) - 1);
 	sockfd_put(el_socket);
 
-	kfree(sock_tag_entry);
+	call_rcu(&sock_tag_entry->rcu, sock_tag_free_rcu);
 	atomic64_inc(&qtu_events.sockets_untagged);
 
 	return 0;
@@ -2422,7 +2583,8 @@ struct proc_print_info {
 static int pp_stats_line(struct proc_print_info *ppi, int cnt_set)
 {
 	int len;
-	struct data_counters *cnts;
+	struct data_counters cnts_sum;
+	struct data_counters *cnts = &cnts_sum;
 
 	if (!ppi->item_index) {
 		if (ppi->item_index++ < ppi->items_to_skip)
@@ -2453,7 +2615,7 @@ static int pp_stats_line(struct proc_print_info *ppi, int cnt_set)
 		}
 		if (ppi->item_index++ < ppi->items_to_skip)
 			return 0;
-		cnts = &ppi->ts_entry->counters;
+		tag_stat_sum_counters(ppi->ts_entry->counters, cnts);
 		len = snprintf(
 			ppi->outp, ppi->char_count,
 			"%d %s 0x%llx %u %u "
@@ -2580,6 +2742,217 @@ static int qtaguid_stats_proc_read(char *page, char **num_items_returned,
 	return ppi.outp - page;
 }
 
+/*
+ * stats_bin: the same counters as stats, as fixed size records.
+ * The walk resumes from the last {iface_entry, tag} it returned, so each
+ * record costs a tree lookup instead of a rescan from the start.
+ */
+struct stats_bin_iter {
+	unsigned int gen;
+	unsigned int since;
+	struct iface_stat *iface_entry;
+	bool tag_valid;  /* tag is the last one returned from iface_entry */
+	tag_t tag;
+	loff_t pos;  /* of rec */
+	struct xt_qtaguid_stats_bin_rec rec;
+};
+
+/* Returns the first tag_stat with a tag greater than tag. */
+static struct tag_stat *tag_stat_tree_search_after(struct rb_root *root,
+						   tag_t tag)
+{
+	struct rb_node *node = root->rb_node;
+	struct tag_stat *res = NULL;
+
+	while (node) {
+		struct tag_stat *data = rb_entry(node, struct tag_stat,
+						 tn.node);
+		if (tag_compare(tag, data->tn.tag) < 0) {
+			res = data;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+	return res;
+}
+
+static bool stats_bin_wanted(struct stats_bin_iter *it, struct tag_stat *ts)
+{
+	tag_t tag = ts->tn.tag;
+
+	if (it->since && (int)(ts->stats_gen - it->since) < 0)
+		return false;
+	/* Detailed tags are not available to everybody */
+	return !get_atag_from_tag(tag)
+		|| can_read_other_uid_stats(get_uid_from_tag(tag));
+}
+
+/* Fills it->rec with the next record, returns false at the end. */
+static bool stats_bin_advance(struct stats_bin_iter *it)
+{
+	struct iface_stat *iface_entry;
+	struct rb_node *node;
+	struct tag_stat *ts_entry;
+
+	BUILD_BUG_ON(sizeof(it->rec.bpc) != sizeof(struct data_counters));
+
+	rcu_read_lock();
+	iface_entry = it->iface_entry;
+	if (!iface_entry)
+		iface_entry = list_entry_rcu(iface_stat_list.next,
+					     struct iface_stat, list);
+	for (; &iface_entry->list != &iface_stat_list;
+	     iface_entry = list_entry_rcu(iface_entry->list.next,
+					  struct iface_stat, list),
+	     it->tag_valid = false) {
+		spin_lock_bh(&iface_entry->tag_stat_list_lock);
+		if (it->tag_valid) {
+			ts_entry = tag_stat_tree_search_after(
+				&iface_entry->tag_stat_tree, it->tag);
+			node = ts_entry ? &ts_entry->tn.node : NULL;
+		} else {
+			node = rb_first(&iface_entry->tag_stat_tree);
+		}
+		for (; node; node = rb_next(node)) {
+			ts_entry = rb_entry(node, struct tag_stat, tn.node);
+			if (!stats_bin_wanted(it, ts_entry))
+				continue;
+			strlcpy(it->rec.iface, iface_entry->ifname,
+				sizeof(it->rec.iface));
+			it->rec.tag = ts_entry->tn.tag;
+			tag_stat_sum_counters(
+				ts_entry->counters,
+				(struct data_counters *)it->rec.bpc);
+			spin_unlock_bh(&iface_entry->tag_stat_list_lock);
+			rcu_read_unlock();
+
+			it->iface_entry = iface_entry;
+			it->tag_valid = true;
+			it->tag = ts_entry->tn.tag;
+			it->pos++;
+			return true;
+		}
+		spin_unlock_bh(&iface_entry->tag_stat_list_lock);
+	}
+	rcu_read_unlock();
+	it->iface_entry = NULL;
+	it->tag_valid = false;
+	return false;
+}
+
+static void *stats_bin_seq_start(struct seq_file *m, loff_t *pos)
+{
+	struct stats_bin_iter *it = m->private;
+
+	if (!*pos)
+		return SEQ_START_TOKEN;
+	if (unlikely(module_passive))
+		return NULL;
+	/* Picking up where the previous read() stopped? */
+	if (it->pos == *pos)
+		return &it->rec;
+	if (it->pos > *pos) {
+		it->iface_entry = NULL;
+		it->tag_valid = false;
+		it->pos = 0;
+	}
+	while (it->pos < *pos)
+		if (!stats_bin_advance(it))
+			return NULL;
+	return &it->rec;
+}
+
+static void *stats_bin_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	struct stats_bin_iter *it = m->private;
+
+	++*pos;
+	if (unlikely(module_passive))
+		return NULL;
+	if (it->pos == *pos)
+		return &it->rec;
+	return stats_bin_advance(it) ? &it->rec : NULL;
+}
+
+static void stats_bin_seq_stop(struct seq_file *m, void *v)
+{
+}
+
+static int stats_bin_seq_show(struct seq_file *m, void *v)
+{
+	struct stats_bin_iter *it = m->private;
+	struct xt_qtaguid_stats_bin_hdr hdr;
+
+	if (v != SEQ_START_TOKEN)
+		return seq_write(m, &it->rec, sizeof(it->rec));
+
+	hdr.magic = XT_QTAGUID_STATS_BIN_MAGIC;
+	hdr.version = XT_QTAGUID_STATS_BIN_VERSION;
+	hdr.rec_size = sizeof(it->rec);
+	hdr.gen = it->gen;
+	hdr.since = it->since;
+	return seq_write(m, &hdr, sizeof(hdr));
+}
+
+static const struct seq_operations stats_bin_seq_ops = {
+	.start = stats_bin_seq_start,
+	.next = stats_bin_seq_next,
+	.stop = stats_bin_seq_stop,
+	.show = stats_bin_seq_show,
+};
+
+static int stats_bin_open(struct inode *inode, struct file *file)
+{
+	struct stats_bin_iter *it;
+
+	it = __seq_open_private(file, &stats_bin_seq_ops, sizeof(*it));
+	if (!it)
+		return -ENOMEM;
+	/*
+	 * Tag_stats changing from here on get stamped with a later gen.
+	 * Those changing while being read keep this one, so the next dump
+	 * starting at it still sees them.
+	 */
+	it->gen = atomic_inc_return(&qtu_stats_gen) - 1;
+	return 0;
+}
+
+/* Sets the generation the records are filtered on, before reading. */
+static ssize_t stats_bin_write(struct file *file, const char __user *buffer,
+			       size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct stats_bin_iter *it = m->private;
+	char input_buf[16];
+	unsigned int since;
+
+	if (count >= sizeof(input_buf))
+		return -EINVAL;
+	if (copy_from_user(input_buf, buffer, count))
+		return -EFAULT;
+	input_buf[count] = '\0';
+	if (sscanf(input_buf, "%u", &since) != 1)
+		return -EINVAL;
+	/* seq_read() uses the iterator under m->lock */
+	mutex_lock(&m->lock);
+	it->since = since;
+	it->iface_entry = NULL;
+	it->tag_valid = false;
+	it->pos = 0;
+	mutex_unlock(&m->lock);
+	return count;
+}
+
+static const struct file_operations stats_bin_fops = {
+	.owner = THIS_MODULE,
+	.open = stats_bin_open,
+	.read = seq_read,
+	.write = stats_bin_write,
+	.llseek = seq_lseek,
+	.release = seq_release_private,
+};
+
 /*------------------------------------------*/
 static int qtudev_open(struct inode *inode, struct file *file)
 {
@@ -2698,6 +3071,7 @@ static int qtudev_release(struct inode *inode, struct file *file)
 		free_tag_ref_from_utd_entry(tr, utd_entry);
 
 		rb_erase(&st_entry->sock_node, &sock_tag_tree);
+		hlist_del_rcu(&st_entry->sock_hnode);
 		list_del(&st_entry->list);
 		/* Can't sockfd_put() within spinlock, do it later. */
 		sock_tag_tree_insert(st_entry, &st_to_free_tree);
@@ -2777,8 +3151,25 @@ static int __init qtaguid_proc_register(struct proc_dir_entry **res_procdir)
 	 * TODO: add support counter hacking
 	 * xt_qtaguid_stats_file->write_proc = qtaguid_stats_proc_write;
 	 */
+
+	/*
+	 * Writing only picks the generation for that open file, so whoever
+	 * may read the stats may write too.
+	 */
+	xt_qtaguid_stats_bin_file = proc_create("stats_bin",
+						proc_stats_perms |
+						((proc_stats_perms & S_IRUGO) >> 1),
+						*res_procdir, &stats_bin_fops);
+	if (!xt_qtaguid_stats_bin_file) {
+		pr_err("qtaguid: failed to create xt_qtaguid/stats_bin "
+			"file\n");
+		ret = -ENOMEM;
+		goto no_stats_bin_entry;
+	}
 	return 0;
 
+no_stats_bin_entry:
+	remove_proc_entry("stats", *res_procdir);
 no_stats_entry:
 	remove_proc_entry("ctrl", *res_procdir);
 no_ctrl_entry:
@@ -11,8 +11,14 @@
 #define __XT_QTAGUID_INTERNAL_H__
 
 #include <linux/types.h>
+#include <linux/cache.h>
+#include <linux/cpumask.h>
+#include <linux/list.h>
 #include <linux/rbtree.h>
+#include <linux/rcupdate.h>
 #include <linux/spinlock_types.h>
+#include <linux/string.h>
+#include <linux/u64_stats_sync.h>
 #include <linux/workqueue.h>
 
 /* Iface handling */
@@ -179,6 +185,15 @@ struct data_counters {
 	struct byte_packet_counters bpc[IFS_MAX_COUNTER_SETS][IFS_MAX_DIRECTIONS][IFS_MAX_PROTOS];
 };
 
+/*
+ * One cpu's share of a tag_stat's counters. syncp lets readers on 32-bit
+ * SMP see each u64 whole while that cpu is updating it.
+ */
+struct tag_stat_cpu {
+	struct data_counters dc;
+	struct u64_stats_sync syncp;
+};
+
 /* Generic X based nodes used as a base for rb_tree ops */
 struct tag_node {
 	struct rb_node node;
@@ -187,14 +202,44 @@ struct tag_node {
 
 struct tag_stat {
 	struct tag_node tn;
-	struct data_counters counters;
+	/* tag_stats are freed after a grace period, see ctrl_cmd_delete() */
+	struct rcu_head rcu;
 	/*
 	 * If this tag is acct_tag based, we need to count against the
 	 * matching parent uid_tag.
 	 */
-	struct data_counters *parent_counters;
+	struct tag_stat *parent;
+	/* qtu_stats_gen when the counters last changed, for stats_bin */
+	unsigned int stats_gen;
+	/*
+	 * One set of counters per possible cpu, so the per-packet update
+	 * needs no lock. Use tag_stat_sum_counters() to read them.
+	 */
+	struct tag_stat_cpu counters[0] ____cacheline_aligned_in_smp;
 };
 
+static inline void tag_stat_sum_counters(const struct tag_stat_cpu *cpu_stats,
+					 struct data_counters *sum)
+{
+	struct data_counters snap;
+	const uint64_t *src = (const uint64_t *)&snap;
+	uint64_t *dst = (uint64_t *)sum;
+	int cpu, i, n = sizeof(*sum) / sizeof(uint64_t);
+	unsigned int start;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		const struct tag_stat_cpu *tsc = &cpu_stats[cpu];
+
+		do {
+			start = u64_stats_fetch_begin_bh(&tsc->syncp);
+			snap = tsc->dc;
+		} while (u64_stats_fetch_retry_bh(&tsc->syncp, start));
+		for (i = 0; i < n; i++)
+			dst[i] += src[i];
+	}
+}
+
 struct iface_stat {
 	struct list_head list;  /* in iface_stat_list */
 	char *ifname;
@@ -235,6 +280,9 @@ struct iface_stat_work {
  */
 struct sock_tag {
 	struct rb_node sock_node;
+	/* In sock_tag_hash, for the lockless lookup done per packet */
+	struct hlist_node sock_hnode;
+	struct rcu_head rcu;
 	struct sock *sk;  /* Only used as a number, never dereferenced */
 	/* The socket is needed for sockfd_put() */
 	struct socket *socket;
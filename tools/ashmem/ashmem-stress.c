@@ -0,0 +1,475 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -g -lpthread -o ashmem-stress ashmem-stress.c */
+
+/*
+ * ashmem-stress: concurrent pin/unpin benchmark and checker for ashmem
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * Each thread unpins and re-pins random runs of pages, by default in an
+ * area of its own, so the threads only meet on the LRU lock. With -S they
+ * all work on disjoint slices of one area, which serializes them on its
+ * mutex instead; comparing the two shows what per-area locking buys.
+ * With -P ms, another thread calls ASHMEM_PURGE_ALL_CACHES at that
+ * interval, so the shrinker runs against the pinning threads.
+ *
+ * A pinned page holds a pattern naming its page and the number of times
+ * it was pinned. When a pin returns ASHMEM_NOT_PURGED, every page it
+ * covers must still hold its pattern; after ASHMEM_WAS_PURGED, each page
+ * must hold its pattern or be zero.
+ *
+ * With -R N, a single thread instead unpins every other page of one area
+ * to leave N separate unpinned ranges, then pins, unpins, queries and,
+ * now and then, purges random runs among them. Nothing else purges, so a
+ * per-page model predicts every ASHMEM_GET_PIN_STATUS result, and which
+ * pins must return ASHMEM_WAS_PURGED with zeroed pages; only the shrinker
+ * may purge more on its own. The mean time of each operation with that
+ * many ranges in the area is printed, 10000 being the interesting case.
+ *
+ *	ashmem-stress [-t threads] [-p pages] [-s seconds] [-P ms] [-S]
+ *	ashmem-stress -R ranges [-p pages] [-s seconds]
+ *
+ * Prints pin+unpin pairs per second, or the times per operation, and
+ * exits non-zero on the first page or result that comes back wrong.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* from include/linux/ashmem.h, which is not exported to userspace */
+#define ASHMEM_NAME_LEN		256
+#define ASHMEM_NOT_PURGED	0
+#define ASHMEM_WAS_PURGED	1
+#define ASHMEM_IS_UNPINNED	0
+#define ASHMEM_IS_PINNED	1
+
+struct ashmem_pin {
+	__u32 offset;
+	__u32 len;
+};
+
+#define __ASHMEMIOC		0x77
+#define ASHMEM_SET_NAME		_IOW(__ASHMEMIOC, 1, char[ASHMEM_NAME_LEN])
+#define ASHMEM_SET_SIZE		_IOW(__ASHMEMIOC, 3, size_t)
+#define ASHMEM_PIN		_IOW(__ASHMEMIOC, 7, struct ashmem_pin)
+#define ASHMEM_UNPIN		_IOW(__ASHMEMIOC, 8, struct ashmem_pin)
+#define ASHMEM_GET_PIN_STATUS	_IO(__ASHMEMIOC, 9)
+#define ASHMEM_PURGE_ALL_CACHES	_IO(__ASHMEMIOC, 10)
+
+#define MAX_RUN		8
+
+enum {
+	PAGE_UNPINNED,
+	PAGE_PINNED,
+	PAGE_PURGED,	/* unpinned, and purged by ASHMEM_PURGE_ALL_CACHES */
+};
+
+struct worker {
+	pthread_t thread;
+	int id;
+	int fd;
+	char *map;
+	size_t first;		/* first page of this thread's slice */
+	unsigned char *state;	/* PAGE_* for each page of the slice */
+	uint32_t *gen;		/* per page of the slice */
+	unsigned int seed;
+	unsigned long ops;
+};
+
+static int nthreads = 4;
+static size_t npages = 256;
+static int seconds = 10;
+static int purge_ms;
+static int shared;
+static long page_size;
+static volatile int stop;
+static volatile int failed;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int area_create(const char *name, size_t size, char **map)
+{
+	char buf[ASHMEM_NAME_LEN];
+	int fd = open("/dev/ashmem", O_RDWR);
+
+	if (fd < 0) {
+		perror("/dev/ashmem");
+		return -1;
+	}
+	snprintf(buf, sizeof(buf), "%s", name);
+	if (ioctl(fd, ASHMEM_SET_NAME, buf) < 0 ||
+	    ioctl(fd, ASHMEM_SET_SIZE, size) < 0) {
+		perror("ashmem");
+		return -1;
+	}
+	*map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (*map == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	return fd;
+}
+
+static int pin_op(int fd, int cmd, size_t page, size_t n)
+{
+	struct ashmem_pin pin = {
+		.offset = page * page_size,
+		.len = n * page_size,
+	};
+
+	return ioctl(fd, cmd, &pin);
+}
+
+static void fill_page(struct worker *w, size_t i)
+{
+	uint32_t *p = (uint32_t *)(w->map + (w->first + i) * page_size);
+	size_t j;
+
+	for (j = 0; j < page_size / sizeof(*p); j++)
+		p[j] = (w->first + i) ^ (w->gen[i] << 16) ^ j;
+}
+
+/* 1 if the page holds its pattern, 0 if it is zero, -1 otherwise */
+static int check_page(struct worker *w, size_t i)
+{
+	uint32_t *p = (uint32_t *)(w->map + (w->first + i) * page_size);
+	size_t j, n = page_size / sizeof(*p);
+
+	for (j = 0; j < n; j++)
+		if (p[j] != ((w->first + i) ^ (w->gen[i] << 16) ^ j))
+			break;
+	if (j == n)
+		return 1;
+	for (j = 0; j < n; j++)
+		if (p[j])
+			return -1;
+	return 0;
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	size_t i, start, n;
+	int ret, page;
+
+	while (!stop && !failed) {
+		n = 1 + rand_r(&w->seed) % MAX_RUN;
+		start = rand_r(&w->seed) % (npages - n + 1);
+
+		if (rand_r(&w->seed) % 2) {
+			if (pin_op(w->fd, ASHMEM_UNPIN, w->first + start, n) < 0) {
+				perror("ASHMEM_UNPIN");
+				failed = 1;
+			}
+			for (i = start; i < start + n; i++)
+				w->state[i] = PAGE_UNPINNED;
+			w->ops++;
+			continue;
+		}
+
+		ret = pin_op(w->fd, ASHMEM_PIN, w->first + start, n);
+		if (ret < 0) {
+			perror("ASHMEM_PIN");
+			failed = 1;
+			break;
+		}
+		for (i = start; i < start + n; i++) {
+			if (w->state[i] == PAGE_PINNED)
+				continue;
+			page = check_page(w, i);
+			if (page < 0 || (page == 0 && ret == ASHMEM_NOT_PURGED)) {
+				fprintf(stderr, "thread %d: page %zu %s after "
+					"pin returned %d\n", w->id,
+					w->first + i, page ? "corrupt" : "zero",
+					ret);
+				failed = 1;
+			}
+			w->gen[i]++;
+			fill_page(w, i);
+			w->state[i] = PAGE_PINNED;
+		}
+		w->ops++;
+	}
+
+	return NULL;
+}
+
+static int count_ranges(struct worker *w)
+{
+	size_t i;
+	int n = 0;
+
+	for (i = 0; i < npages; i++)
+		if (w->state[i] != PAGE_PINNED &&
+		    (!i || w->state[i - 1] == PAGE_PINNED))
+			n++;
+	return n;
+}
+
+/*
+ * Pins a run of pages in range mode, where nothing but this thread
+ * purges: the result and the contents must match the model exactly,
+ * except that the shrinker may still purge unpinned pages on its own.
+ */
+static int ranges_pin(struct worker *w, size_t start, size_t n)
+{
+	int ret, page, purged = 0;
+	size_t i;
+
+	for (i = start; i < start + n; i++)
+		purged |= w->state[i] == PAGE_PURGED;
+	ret = pin_op(w->fd, ASHMEM_PIN, start, n);
+	if (ret < 0) {
+		perror("ASHMEM_PIN");
+		return -1;
+	}
+	if (purged && ret != ASHMEM_WAS_PURGED) {
+		fprintf(stderr, "pin %zu+%zu missed a purge\n", start, n);
+		return -1;
+	}
+	for (i = start; i < start + n; i++) {
+		if (w->state[i] == PAGE_PINNED)
+			continue;
+		page = check_page(w, i);
+		if (page < 0 || (page == 0 && ret == ASHMEM_NOT_PURGED) ||
+		    (page > 0 && w->state[i] == PAGE_PURGED)) {
+			fprintf(stderr, "page %zu %s after pin returned %d\n",
+				i, page < 0 ? "corrupt" :
+				page ? "not purged" : "zero", ret);
+			return -1;
+		}
+		w->gen[i]++;
+		fill_page(w, i);
+		w->state[i] = PAGE_PINNED;
+	}
+	return 0;
+}
+
+/*
+ * Fragments one area into nranges unpinned ranges, then pins, unpins,
+ * purges and queries random runs for the given time, checking every
+ * result against a per-page model and timing each kind of operation.
+ */
+static int ranges(int nranges)
+{
+	struct worker w;
+	struct ashmem_pin pin;
+	double t, elapsed[4] = { 0 };
+	unsigned long count[4] = { 0 };
+	const char *names[4] = { "pin", "unpin", "status", "purge all" };
+	size_t i, start, n;
+	int op, ret, any;
+
+	memset(&w, 0, sizeof(w));
+	w.seed = 1;
+	w.fd = area_create("ashmem-ranges", npages * page_size, &w.map);
+	if (w.fd < 0)
+		return 1;
+	w.state = malloc(npages);
+	w.gen = calloc(npages, sizeof(*w.gen));
+	memset(w.state, PAGE_PINNED, npages);
+	for (i = 0; i < npages; i++)
+		fill_page(&w, i);
+
+	t = now();
+	for (i = 1; i < npages && (int)(i / 2) < nranges; i += 2) {
+		if (pin_op(w.fd, ASHMEM_UNPIN, i, 1) < 0) {
+			perror("ASHMEM_UNPIN");
+			return 1;
+		}
+		w.state[i] = PAGE_UNPINNED;
+	}
+	printf("%d ranges unpinned in %.3fs\n", count_ranges(&w), now() - t);
+
+	t = now() + seconds;
+	while (now() < t) {
+		n = 1 + rand_r(&w.seed) % MAX_RUN;
+		start = rand_r(&w.seed) % (npages - n + 1);
+		op = rand_r(&w.seed) % 1000;
+		op = op == 0 ? 3 : op % 3;
+
+		elapsed[op] -= now();
+		switch (op) {
+		case 0:
+			if (ranges_pin(&w, start, n))
+				return 1;
+			break;
+		case 1:
+			if (pin_op(w.fd, ASHMEM_UNPIN, start, n) < 0) {
+				perror("ASHMEM_UNPIN");
+				return 1;
+			}
+			for (i = start; i < start + n; i++)
+				if (w.state[i] == PAGE_PINNED)
+					w.state[i] = PAGE_UNPINNED;
+			break;
+		case 2:
+			pin.offset = start * page_size;
+			pin.len = n * page_size;
+			ret = ioctl(w.fd, ASHMEM_GET_PIN_STATUS, &pin);
+			for (any = 0, i = start; i < start + n; i++)
+				any |= w.state[i] != PAGE_PINNED;
+			if (ret != (any ? ASHMEM_IS_UNPINNED :
+				    ASHMEM_IS_PINNED)) {
+				fprintf(stderr, "status of %zu+%zu is %d\n",
+					start, n, ret);
+				return 1;
+			}
+			break;
+		case 3:
+			if (ioctl(w.fd, ASHMEM_PURGE_ALL_CACHES) < 0) {
+				perror("ASHMEM_PURGE_ALL_CACHES");
+				return 1;
+			}
+			for (i = 0; i < npages; i++)
+				if (w.state[i] == PAGE_UNPINNED)
+					w.state[i] = PAGE_PURGED;
+			break;
+		}
+		elapsed[op] += now();
+		count[op]++;
+	}
+
+	printf("%d ranges left\n", count_ranges(&w));
+	for (op = 0; op < 4; op++)
+		printf("  %-9s %8lu calls, %.1f us each\n", names[op],
+		       count[op], count[op] ? elapsed[op] / count[op] * 1e6 : 0);
+	return 0;
+}
+
+static void *purge_fn(void *arg)
+{
+	int fd = *(int *)arg;
+
+	while (!stop && !failed) {
+		if (ioctl(fd, ASHMEM_PURGE_ALL_CACHES) < 0) {
+			perror("ASHMEM_PURGE_ALL_CACHES");
+			failed = 1;
+		}
+		usleep(purge_ms * 1000);
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct worker *workers;
+	pthread_t purger;
+	unsigned long ops = 0;
+	char *map = NULL;
+	double start;
+	size_t j;
+	int c, i, fd = -1, nranges = 0;
+
+	while ((c = getopt(argc, argv, "t:p:s:P:SR:")) != -1) {
+		switch (c) {
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'p':
+			npages = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'P':
+			purge_ms = atoi(optarg);
+			break;
+		case 'S':
+			shared = 1;
+			break;
+		case 'R':
+			nranges = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc || nthreads < 1 || npages < MAX_RUN)
+		goto usage;
+	page_size = sysconf(_SC_PAGESIZE);
+	if (nranges > 0) {
+		/* one pinned page between ranges keeps them apart */
+		if (npages < (size_t)nranges * 2 + 1)
+			npages = nranges * 2 + 1;
+		return ranges(nranges);
+	}
+
+	workers = calloc(nthreads, sizeof(*workers));
+	if (shared) {
+		fd = area_create("ashmem-stress", npages * nthreads * page_size,
+				 &map);
+		if (fd < 0)
+			return 1;
+	}
+	for (i = 0; i < nthreads; i++) {
+		struct worker *w = &workers[i];
+
+		w->id = i;
+		w->seed = i + 1;
+		w->fd = fd;
+		w->map = map;
+		w->first = shared ? i * npages : 0;
+		if (!shared) {
+			w->fd = area_create("ashmem-stress", npages * page_size,
+					    &w->map);
+			if (w->fd < 0)
+				return 1;
+		}
+		w->state = malloc(npages);
+		w->gen = calloc(npages, sizeof(*w->gen));
+		memset(w->state, PAGE_PINNED, npages);
+		for (j = 0; j < npages; j++)
+			fill_page(w, j);
+	}
+
+	start = now();
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&workers[i].thread, NULL, worker_fn,
+			       &workers[i]);
+	if (purge_ms)
+		pthread_create(&purger, NULL, purge_fn, &workers[0].fd);
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		ops += workers[i].ops;
+	}
+	if (purge_ms)
+		pthread_join(purger, NULL);
+
+	printf("%d threads, %s: %.0f pin+unpin/s%s\n", nthreads,
+	       shared ? "one area" : "an area each",
+	       ops / 2 / (now() - start), failed ? ", FAILED" : "");
+	return failed;
+
+usage:
+	fprintf(stderr, "usage: %s [-t threads] [-p pages] [-s seconds] "
+		"[-P ms] [-S] [-R ranges]\n", argv[0]);
+	return 2;
+}
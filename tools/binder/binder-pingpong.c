@@ -0,0 +1,383 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -g -I../../drivers/staging/android -o binder-pingpong binder-pingpong.c */
+
+/*
+ * binder-pingpong: transaction round trip benchmark for the binder driver
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * A server process becomes the context manager, and a client sends it
+ * transactions on handle 0. The server checks the payload, frees the
+ * buffer and replies with a payload of the same size, which the client
+ * checks and frees in turn. Both buffers therefore go through the
+ * driver's allocator on every round trip. Freed buffer pages stay
+ * mapped, so after the first few round trips neither side should be
+ * allocating or mapping pages.
+ *
+ * Sizes cycle through the list given with -z (default 64 bytes to 128K),
+ * so consecutive buffers cover different pages. With -d N, the client
+ * writes 2 to /proc/sys/vm/drop_caches every N round trips. That runs the
+ * binder shrinker, and the next transactions have to map pages again.
+ *
+ *	binder-pingpong [-n round trips] [-z size,size,...] [-d N]
+ *
+ * Prints round trips per second and the mean latency per size, followed
+ * by the driver's page cache line from the binder stats file. Exits
+ * non-zero if a payload comes back wrong.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "binder.h"
+
+#define MAP_SIZE	(1024 * 1024)
+#define MAX_SIZES	16
+#define PING		1
+
+static size_t sizes[MAX_SIZES] = { 64, 1024, 4096, 16384, 65536, 131072 };
+static int nsizes = 6;
+static long iterations = 100000;
+static long drop_every;
+
+struct binder {
+	int fd;
+	void *map;
+};
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int binder_open(struct binder *b)
+{
+	struct binder_version version;
+
+	b->fd = open("/dev/binder", O_RDWR);
+	if (b->fd < 0) {
+		perror("/dev/binder");
+		return -1;
+	}
+	if (ioctl(b->fd, BINDER_VERSION, &version) < 0 ||
+	    version.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder protocol version mismatch\n");
+		return -1;
+	}
+	b->map = mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, b->fd, 0);
+	if (b->map == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	return 0;
+}
+
+static int binder_write(struct binder *b, void *data, size_t len)
+{
+	struct binder_write_read bwr;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_size = len;
+	bwr.write_buffer = (unsigned long)data;
+	if (ioctl(b->fd, BINDER_WRITE_READ, &bwr) < 0) {
+		perror("BINDER_WRITE_READ");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Reads until a transaction or reply arrives and returns its command,
+ * with the transaction data in *txn. Other returns are skipped. Returns
+ * 0 if the ioctl fails.
+ */
+static uint32_t binder_wait(struct binder *b, struct binder_transaction_data *txn)
+{
+	uint32_t buf[128];
+	struct binder_write_read bwr;
+	char *p, *end;
+	uint32_t cmd;
+
+	for (;;) {
+		memset(&bwr, 0, sizeof(bwr));
+		bwr.read_size = sizeof(buf);
+		bwr.read_buffer = (unsigned long)buf;
+		if (ioctl(b->fd, BINDER_WRITE_READ, &bwr) < 0) {
+			perror("BINDER_WRITE_READ");
+			return 0;
+		}
+		p = (char *)buf;
+		end = p + bwr.read_consumed;
+		while (p < end) {
+			cmd = *(uint32_t *)p;
+			p += sizeof(cmd);
+			switch (cmd) {
+			case BR_TRANSACTION:
+			case BR_REPLY:
+				memcpy(txn, p, sizeof(*txn));
+				return cmd;
+			case BR_DEAD_REPLY:
+			case BR_FAILED_REPLY:
+				return cmd;
+			case BR_ERROR:
+				fprintf(stderr, "BR_ERROR %d\n", *(int *)p);
+				return cmd;
+			}
+			p += _IOC_SIZE(cmd);
+		}
+	}
+}
+
+/* sends data_size bytes of payload, as a transaction or as a reply */
+static int binder_send(struct binder *b, uint32_t cmd, void *free_buffer,
+		       const void *data, size_t data_size)
+{
+	struct {
+		uint32_t free_cmd;
+		void *free_ptr;
+		uint32_t cmd;
+		struct binder_transaction_data txn;
+	} __attribute__((packed)) out;
+	char *start = (char *)&out.cmd;
+	size_t len = sizeof(out.cmd) + sizeof(out.txn);
+
+	memset(&out, 0, sizeof(out));
+	if (free_buffer) {
+		out.free_cmd = BC_FREE_BUFFER;
+		out.free_ptr = free_buffer;
+		start = (char *)&out;
+		len = sizeof(out);
+	}
+	out.cmd = cmd;
+	out.txn.target.handle = 0;
+	out.txn.code = PING;
+	out.txn.data_size = data_size;
+	out.txn.data.ptr.buffer = data;
+	return binder_write(b, start, len);
+}
+
+static void fill(char *buf, size_t size, unsigned long seq)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		buf[i] = (char)(seq * 31 + i);
+}
+
+static int check(const char *buf, size_t size, unsigned long seq)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		if (buf[i] != (char)(seq * 31 + i))
+			return -1;
+	return 0;
+}
+
+static int server(int ready)
+{
+	struct binder_transaction_data txn;
+	static char reply[MAP_SIZE / 4];
+	uint32_t enter = BC_ENTER_LOOPER;
+	unsigned long seq = 0;
+	struct binder b;
+	uint32_t cmd;
+
+	if (binder_open(&b) < 0)
+		return 1;
+	if (ioctl(b.fd, BINDER_SET_CONTEXT_MGR, 0) < 0) {
+		perror("BINDER_SET_CONTEXT_MGR");
+		return 1;
+	}
+	if (binder_write(&b, &enter, sizeof(enter)) < 0)
+		return 1;
+	if (write(ready, "r", 1) != 1)
+		return 1;
+
+	for (;;) {
+		cmd = binder_wait(&b, &txn);
+		if (cmd != BR_TRANSACTION)
+			return 1;
+		if (check(txn.data.ptr.buffer, txn.data_size, seq)) {
+			fprintf(stderr, "server: payload %lu corrupt\n", seq);
+			return 1;
+		}
+		fill(reply, txn.data_size, ~seq);
+		if (binder_send(&b, BC_REPLY, (void *)txn.data.ptr.buffer,
+				reply, txn.data_size) < 0)
+			return 1;
+		seq++;
+	}
+}
+
+static void drop_caches(void)
+{
+	int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+
+	if (fd < 0 || write(fd, "2\n", 2) != 2)
+		perror("drop_caches");
+	if (fd >= 0)
+		close(fd);
+}
+
+static void print_page_cache_stats(void)
+{
+	const char *files[] = {
+		"/sys/kernel/debug/binder/stats", "/proc/binder/stats",
+	};
+	char line[256];
+	unsigned int i;
+	FILE *f;
+
+	for (i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		f = fopen(files[i], "r");
+		if (!f)
+			continue;
+		while (fgets(line, sizeof(line), f))
+			if (!strncmp(line, "page cache:", 11))
+				fputs(line, stdout);
+		fclose(f);
+		return;
+	}
+}
+
+static int client(void)
+{
+	struct binder_transaction_data txn;
+	static char payload[MAP_SIZE / 4];
+	double elapsed[MAX_SIZES] = { 0 };
+	long count[MAX_SIZES] = { 0 };
+	void *free_buffer = NULL;
+	double start, t;
+	struct binder b;
+	uint32_t cmd;
+	long seq;
+	int i;
+
+	if (binder_open(&b) < 0)
+		return 1;
+
+	start = now();
+	for (seq = 0; seq < iterations; seq++) {
+		i = seq % nsizes;
+		if (drop_every && seq && seq % drop_every == 0)
+			drop_caches();
+		fill(payload, sizes[i], seq);
+
+		t = now();
+		if (binder_send(&b, BC_TRANSACTION, free_buffer, payload,
+				sizes[i]) < 0)
+			return 1;
+		cmd = binder_wait(&b, &txn);
+		elapsed[i] += now() - t;
+		count[i]++;
+
+		if (cmd != BR_REPLY) {
+			fprintf(stderr, "round trip %ld failed\n", seq);
+			return 1;
+		}
+		if (txn.data_size != sizes[i] ||
+		    check(txn.data.ptr.buffer, txn.data_size, ~seq)) {
+			fprintf(stderr, "client: reply %ld corrupt\n", seq);
+			return 1;
+		}
+		free_buffer = (void *)txn.data.ptr.buffer;
+	}
+
+	printf("%ld round trips, %.0f/s\n", iterations,
+	       iterations / (now() - start));
+	for (i = 0; i < nsizes; i++)
+		printf("  %7zu bytes: %.1f us\n", sizes[i],
+		       count[i] ? elapsed[i] / count[i] * 1e6 : 0);
+	print_page_cache_stats();
+	return 0;
+}
+
+static int parse_sizes(char *arg)
+{
+	char *tok;
+
+	nsizes = 0;
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		if (nsizes == MAX_SIZES)
+			return -1;
+		sizes[nsizes] = strtoul(tok, NULL, 0);
+		if (!sizes[nsizes] || sizes[nsizes] > MAP_SIZE / 4)
+			return -1;
+		nsizes++;
+	}
+	return nsizes ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	int ready[2];
+	pid_t pid;
+	char c;
+	int opt, ret, status;
+
+	while ((opt = getopt(argc, argv, "n:z:d:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = atol(optarg);
+			break;
+		case 'z':
+			if (parse_sizes(optarg))
+				goto usage;
+			break;
+		case 'd':
+			drop_every = atol(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc || iterations < 1)
+		goto usage;
+
+	if (pipe(ready))
+		return 1;
+	pid = fork();
+	if (!pid) {
+		close(ready[0]);
+		exit(server(ready[1]));
+	}
+	close(ready[1]);
+	if (pid < 0 || read(ready[0], &c, 1) != 1) {
+		fprintf(stderr, "server failed to start\n");
+		return 1;
+	}
+
+	ret = client();
+
+	kill(pid, SIGKILL);
+	waitpid(pid, &status, 0);
+	return ret;
+
+usage:
+	fprintf(stderr, "usage: %s [-n round trips] [-z size,size,...] "
+		"[-d N]\n", argv[0]);
+	return 2;
+}
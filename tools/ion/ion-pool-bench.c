@@ -0,0 +1,226 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -g -lpthread -o ion-pool-bench ion-pool-bench.c */
+
+/*
+ * ion-pool-bench: allocation throughput of the ion system heap page pools
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * Every thread allocates and frees buffers from the system heap as fast
+ * as it can, cycling through the sizes given with -z; the defaults hit
+ * each of the heap's page orders (4K, 64K and 1M). Once the pools are
+ * warm, nearly all of this should be served from the per-cpu magazines
+ * without touching a pool's mutex, so allocations per second should
+ * scale with the number of threads.
+ *
+ * With -v, each buffer is also mapped, checked to be all zeroes, and
+ * filled with a pattern before it is freed. Pages come back to the pools
+ * dirty and are only handed out again once zeroed, so a non-zero byte in
+ * a new buffer means another client's data leaked through a magazine.
+ *
+ * The heap's debugfs file (/sys/kernel/debug/ion/<heap>) shows the pool
+ * contents and the per-order allocation latency histograms afterwards.
+ *
+ *	ion-pool-bench [-t threads] [-s seconds] [-z size,...] [-m heap mask] [-v]
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "../../include/linux/ion.h"
+
+#define MAX_SIZES	16
+
+struct worker {
+	pthread_t thread;
+	int id;
+	unsigned long allocs;
+	double alloc_time;
+};
+
+static size_t sizes[MAX_SIZES] = { 4096, 65536, 1048576 };
+static int nsizes = 3;
+static int nthreads = 4;
+static int seconds = 10;
+static unsigned int heap_mask = ION_HEAP(ION_SYSTEM_HEAP_ID);
+static int verify;
+static volatile int stop;
+static volatile int failed;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* maps the buffer, checks it is zeroed and dirties it for the next user */
+static int check_and_dirty(int ion, struct ion_handle *handle, size_t len,
+			   int id)
+{
+	struct ion_fd_data data = { .handle = handle };
+	unsigned char *p;
+	size_t i;
+	int ret = 0;
+
+	if (ioctl(ion, ION_IOC_MAP, &data) < 0) {
+		perror("ION_IOC_MAP");
+		return -1;
+	}
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, data.fd, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		close(data.fd);
+		return -1;
+	}
+	for (i = 0; i < len; i++) {
+		if (p[i]) {
+			fprintf(stderr, "thread %d: byte %zu of a new %zu byte "
+				"buffer is %#x\n", id, i, len, p[i]);
+			ret = -1;
+			break;
+		}
+	}
+	memset(p, 0xa5, len);
+	munmap(p, len);
+	close(data.fd);
+	return ret;
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	struct ion_allocation_data alloc;
+	struct ion_handle_data free_data;
+	unsigned long n = 0;
+	double t;
+	int ion;
+
+	ion = open("/dev/ion", O_RDWR);
+	if (ion < 0) {
+		perror("/dev/ion");
+		failed = 1;
+		return NULL;
+	}
+
+	while (!stop && !failed) {
+		memset(&alloc, 0, sizeof(alloc));
+		alloc.len = sizes[n++ % nsizes];
+		alloc.align = 4096;
+		alloc.heap_mask = heap_mask;
+
+		t = now();
+		if (ioctl(ion, ION_IOC_ALLOC, &alloc) < 0) {
+			perror("ION_IOC_ALLOC");
+			failed = 1;
+			break;
+		}
+		w->alloc_time += now() - t;
+		w->allocs++;
+
+		if (verify && check_and_dirty(ion, alloc.handle, alloc.len,
+					      w->id))
+			failed = 1;
+
+		free_data.handle = alloc.handle;
+		if (ioctl(ion, ION_IOC_FREE, &free_data) < 0) {
+			perror("ION_IOC_FREE");
+			failed = 1;
+		}
+	}
+
+	close(ion);
+	return NULL;
+}
+
+static int parse_sizes(char *arg)
+{
+	char *tok;
+
+	nsizes = 0;
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		if (nsizes == MAX_SIZES)
+			return -1;
+		sizes[nsizes] = strtoul(tok, NULL, 0);
+		if (!sizes[nsizes])
+			return -1;
+		nsizes++;
+	}
+	return nsizes ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	struct worker *workers;
+	unsigned long allocs = 0;
+	double start, elapsed, alloc_time = 0;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "t:s:z:m:v")) != -1) {
+		switch (c) {
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'z':
+			if (parse_sizes(optarg))
+				goto usage;
+			break;
+		case 'm':
+			heap_mask = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			verify = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc || nthreads < 1)
+		goto usage;
+
+	workers = calloc(nthreads, sizeof(*workers));
+	start = now();
+	for (i = 0; i < nthreads; i++) {
+		workers[i].id = i;
+		pthread_create(&workers[i].thread, NULL, worker_fn,
+			       &workers[i]);
+	}
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		allocs += workers[i].allocs;
+		alloc_time += workers[i].alloc_time;
+	}
+	elapsed = now() - start;
+
+	printf("%d threads: %.0f allocs/s, %.1f us per alloc%s\n", nthreads,
+	       allocs / elapsed, allocs ? alloc_time / allocs * 1e6 : 0,
+	       failed ? ", FAILED" : "");
+	return failed;
+
+usage:
+	fprintf(stderr, "usage: %s [-t threads] [-s seconds] [-z size,...] "
+		"[-m heap mask] [-v]\n", argv[0]);
+	return 2;
+}
@@ -0,0 +1,78 @@
+#!/bin/sh
+# sio-latency: fio latency runs for the SIO I/O scheduler
+#
+# Usage: sio-latency.sh <block device> <directory on it> [seconds]
+#
+# e.g.	sio-latency.sh mmcblk0 /data/local/tmp 30
+#
+# Runs two mixes on the device with SIO selected, once with the default
+# tunables and once with io_context_rr enabled, and prints each job's
+# bandwidth and completion latency percentiles:
+#
+# starve	a sync random reader at queue depth 1 against a buffered
+#		sequential writer. Without writes_starved the writer's
+#		bandwidth collapses while the reader runs; with it, writes
+#		get through every writes_starved sync batches and the
+#		reader's p99 should move only a little.
+#
+# fairness	one process keeping 32 random reads in flight against one
+#		issuing 50 reads a second. With io_context_rr the light
+#		reader waits at most a quantum behind the flood, so its
+#		p99 should drop to near its p50.
+#
+# Needs fio with libaio support. Files are created in, and removed from,
+# the given directory; nothing is written to the raw device. The
+# scheduler and tunables in use before the run are restored afterwards.
+
+if [ $# -lt 2 ] ; then
+	echo "usage: $0 <block device> <directory on it> [seconds]" >&2
+	exit 2
+fi
+
+DEV=$1
+DIR=$2
+RUNTIME=${3:-30}
+QUEUE=/sys/block/$DEV/queue
+IOSCHED=$QUEUE/iosched
+
+if ! grep -q sio $QUEUE/scheduler 2>/dev/null ; then
+	echo "$0: sio is not available for $DEV" >&2
+	exit 1
+fi
+
+OLD_SCHED=$(sed -e 's/.*\[\(.*\)\].*/\1/' $QUEUE/scheduler)
+echo sio > $QUEUE/scheduler || exit 1
+OLD_RR=$(cat $IOSCHED/io_context_rr)
+
+restore() {
+	echo $OLD_RR > $IOSCHED/io_context_rr
+	echo $OLD_SCHED > $QUEUE/scheduler
+	rm -f $DIR/sio-latency.*
+}
+trap restore EXIT INT TERM
+
+COMMON="--directory=$DIR --filename_format=sio-latency.\$jobname
+	--size=256m --runtime=$RUNTIME --time_based
+	--percentile_list=50:90:99:99.9"
+
+# only the job headers, bandwidth and percentile lines of fio's report
+report() {
+	grep -E '^[a-z]+: \(groupid|bw=|percentiles|th=\['
+}
+
+for rr in 0 1 ; do
+	echo $rr > $IOSCHED/io_context_rr
+	echo "=== io_context_rr=$rr writes_starved=$(cat $IOSCHED/writes_starved)"
+
+	echo "--- starve"
+	fio $COMMON \
+		--name=reader --rw=randread --bs=4k --direct=1 --iodepth=1 \
+		--name=writer --rw=write --bs=128k --end_fsync=1 | report
+
+	echo "--- fairness"
+	fio $COMMON \
+		--name=flood --rw=randread --bs=4k --direct=1 \
+			--ioengine=libaio --iodepth=32 \
+		--name=light --rw=randread --bs=4k --direct=1 \
+			--iodepth=1 --rate_iops=50 | report
+done
@@ -0,0 +1,320 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -g -I../../drivers/staging/android -lpthread -o logger-stress logger-stress.c */
+
+/*
+ * logger-stress: concurrent writers and readers on an Android log
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * Writers reserve space in the log with an atomic add and copy their
+ * entries in parallel, and readers detect being lapped on their own
+ * instead of being fixed up by writers. This runs many writers against
+ * readers small enough to get lapped, and checks every entry a reader
+ * gets:
+ *
+ *  - the payload is a priority, a tag naming the writer thread and a
+ *    message whose sequence number and filler are derived from the tag,
+ *    so a torn or half copied entry fails to parse or to match;
+ *  - the header's tid is the writer thread's;
+ *  - per writer, sequence numbers only go up. Gaps are fine (the reader
+ *    was lapped, or the log was flushed), going back or repeating is not.
+ *
+ * With -f, one more thread flushes the log every millisecond. With -b,
+ * readers use LOGGER_SET_BATCH_READ and take many entries per read().
+ *
+ *	logger-stress [-w writers] [-r readers] [-s seconds] [-f] [-b] [log]
+ *
+ * The log defaults to /dev/log/main. Prints the write rate, and exits
+ * non-zero on the first bad entry.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+#define MAX_WRITERS	64
+#define TAG_FMT		"lgstress%02d"
+#define MSG_MAX		512
+
+struct writer {
+	pthread_t thread;
+	int id;
+	pid_t tid;
+	unsigned long writes;
+};
+
+struct reader {
+	pthread_t thread;
+	int id;
+	unsigned long entries;
+	unsigned long last_seq[MAX_WRITERS];
+};
+
+static const char *log_path = "/dev/log/main";
+static int nwriters = 8;
+static int nreaders = 2;
+static int seconds = 10;
+static int flush;
+static int batch;
+static volatile int stop;
+static volatile int failed;
+static struct writer writers[MAX_WRITERS];
+
+static char filler(int writer, unsigned long seq, int i)
+{
+	return 'a' + (writer * 7 + seq * 13 + i) % 26;
+}
+
+/* seq 12 of writer 3 is "12:" followed by 12 % MSG_MAX filler chars */
+static int make_msg(char *buf, int writer, unsigned long seq)
+{
+	int len = sprintf(buf, "%lu:", seq);
+	int i, n = seq % MSG_MAX;
+
+	for (i = 0; i < n; i++)
+		buf[len++] = filler(writer, seq, i);
+	buf[len++] = '\0';
+	return len;
+}
+
+static void *writer_fn(void *arg)
+{
+	struct writer *w = arg;
+	char tag[16], msg[MSG_MAX + 32];
+	unsigned char prio = 4;
+	struct iovec vec[3];
+	unsigned long seq = 0;
+	int fd;
+
+	w->tid = syscall(SYS_gettid);
+	fd = open(log_path, O_WRONLY);
+	if (fd < 0) {
+		perror(log_path);
+		failed = 1;
+		return NULL;
+	}
+	snprintf(tag, sizeof(tag), TAG_FMT, w->id);
+
+	while (!stop && !failed) {
+		vec[0].iov_base = &prio;
+		vec[0].iov_len = 1;
+		vec[1].iov_base = tag;
+		vec[1].iov_len = strlen(tag) + 1;
+		vec[2].iov_base = msg;
+		vec[2].iov_len = make_msg(msg, w->id, ++seq);
+		if (writev(fd, vec, 3) < 0) {
+			perror("writev");
+			failed = 1;
+			break;
+		}
+		w->writes++;
+	}
+
+	close(fd);
+	return NULL;
+}
+
+static int bad_entry(struct reader *r, struct logger_entry *e, const char *why)
+{
+	fprintf(stderr, "reader %d: %s: pid %d tid %d len %u \"%.*s\"\n",
+		r->id, why, e->pid, e->tid, e->len, e->len > 64 ? 64 : e->len,
+		e->msg + 1);
+	failed = 1;
+	return -1;
+}
+
+static int check_entry(struct reader *r, struct logger_entry *e)
+{
+	char *tag = e->msg + 1, *msg, *end = e->msg + e->len;
+	char expect[MSG_MAX + 32];
+	unsigned long seq;
+	int id, len;
+
+	if (e->len < 2 || end[-1] != '\0')
+		return bad_entry(r, e, "not terminated");
+	/* other processes may log to the same buffer */
+	if (sscanf(tag, TAG_FMT, &id) != 1 || e->pid != getpid())
+		return 0;
+	if (id < 0 || id >= nwriters)
+		return bad_entry(r, e, "bad tag");
+	if (e->tid != writers[id].tid)
+		return bad_entry(r, e, "tid doesn't match the tag");
+	msg = tag + strlen(tag) + 1;
+	if (msg >= end || sscanf(msg, "%lu:", &seq) != 1)
+		return bad_entry(r, e, "no sequence number");
+	len = make_msg(expect, id, seq);
+	if (end - msg != len || memcmp(msg, expect, len))
+		return bad_entry(r, e, "payload corrupt");
+	if (seq <= r->last_seq[id])
+		return bad_entry(r, e, "sequence went back");
+	r->last_seq[id] = seq;
+	r->entries++;
+	return 0;
+}
+
+static void *reader_fn(void *arg)
+{
+	struct reader *r = arg;
+	char buf[64 * LOGGER_ENTRY_MAX_LEN];
+	ssize_t n, off;
+	int fd;
+
+	fd = open(log_path, O_RDONLY | O_NONBLOCK);
+	if (fd < 0) {
+		perror(log_path);
+		failed = 1;
+		return NULL;
+	}
+	if (batch && ioctl(fd, LOGGER_SET_BATCH_READ, 1) < 0) {
+		perror("LOGGER_SET_BATCH_READ");
+		failed = 1;
+	}
+
+	while (!stop && !failed) {
+		n = read(fd, buf, batch ? sizeof(buf) : LOGGER_ENTRY_MAX_LEN);
+		if (n < 0 && errno == EAGAIN) {
+			usleep(100);
+			continue;
+		}
+		if (n < 0) {
+			perror("read");
+			failed = 1;
+			break;
+		}
+		for (off = 0; off < n && !failed; ) {
+			struct logger_entry *e = (void *)(buf + off);
+
+			if (n - off < (ssize_t)sizeof(*e) ||
+			    n - off < (ssize_t)(sizeof(*e) + e->len)) {
+				bad_entry(r, e, "entry cut short");
+				break;
+			}
+			check_entry(r, e);
+			off += sizeof(*e) + e->len;
+		}
+	}
+
+	close(fd);
+	return NULL;
+}
+
+static void *flush_fn(void *arg)
+{
+	int fd = open(log_path, O_WRONLY);
+
+	(void)arg;
+	if (fd < 0) {
+		perror(log_path);
+		failed = 1;
+		return NULL;
+	}
+	while (!stop && !failed) {
+		if (ioctl(fd, LOGGER_FLUSH_LOG) < 0) {
+			perror("LOGGER_FLUSH_LOG");
+			failed = 1;
+		}
+		usleep(1000);
+	}
+	close(fd);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct reader *readers;
+	struct timeval start, end;
+	unsigned long writes = 0;
+	pthread_t flusher;
+	double elapsed;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "w:r:s:fb")) != -1) {
+		switch (c) {
+		case 'w':
+			nwriters = atoi(optarg);
+			break;
+		case 'r':
+			nreaders = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'f':
+			flush = 1;
+			break;
+		case 'b':
+			batch = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind < argc)
+		log_path = argv[optind++];
+	if (optind != argc || nwriters < 1 || nwriters > MAX_WRITERS ||
+	    nreaders < 0)
+		goto usage;
+	if (access(log_path, R_OK | W_OK)) {
+		perror(log_path);
+		return 1;
+	}
+
+	readers = calloc(nreaders, sizeof(*readers));
+	for (i = 0; i < nreaders; i++) {
+		readers[i].id = i;
+		pthread_create(&readers[i].thread, NULL, reader_fn,
+			       &readers[i]);
+	}
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nwriters; i++) {
+		writers[i].id = i;
+		pthread_create(&writers[i].thread, NULL, writer_fn,
+			       &writers[i]);
+	}
+	if (flush)
+		pthread_create(&flusher, NULL, flush_fn, NULL);
+
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < nwriters; i++) {
+		pthread_join(writers[i].thread, NULL);
+		writes += writers[i].writes;
+	}
+	gettimeofday(&end, NULL);
+	for (i = 0; i < nreaders; i++)
+		pthread_join(readers[i].thread, NULL);
+	if (flush)
+		pthread_join(flusher, NULL);
+
+	elapsed = (end.tv_sec - start.tv_sec) +
+		  (end.tv_usec - start.tv_usec) / 1e6;
+	printf("%d writers: %.0f entries/s", nwriters, writes / elapsed);
+	for (i = 0; i < nreaders; i++)
+		printf(", reader %d checked %lu", i, readers[i].entries);
+	printf("%s\n", failed ? ", FAILED" : "");
+	return failed;
+
+usage:
+	fprintf(stderr, "usage: %s [-w writers] [-r readers] [-s seconds] "
+		"[-f] [-b] [log]\n", argv[0]);
+	return 2;
+}
@@ -0,0 +1,314 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -g -lpthread -o lmk-stress lmk-stress.c */
+
+/*
+ * lmk-stress: exercise the lowmemorykiller oom_adj buckets
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * The killer picks victims from per-oom_adj lists of thread group leaders
+ * kept up to date by the oom_adj notifier, instead of walking every task.
+ * This drives every way a task gets onto, moves between or leaves those
+ * lists, then runs the machine out of memory and checks who died:
+ *
+ *  - children are forked holding some memory, a third of them after
+ *    exec'ing from a second thread, so de_thread hands the group to a
+ *    new leader;
+ *  - for a while, their oom_adj is rewritten at random while short lived
+ *    processes are forked and reaped, and the rate of both is reported;
+ *  - each child then gets a final oom_adj and the parent, itself at
+ *    OOM_DISABLE, allocates until half the children are gone.
+ *
+ * Whatever order the kills happen in, no child may outlive one with a
+ * lower oom_adj. That is checked and is the exit status. A child that
+ * outlives a smaller one at the same oom_adj is only reported, since the
+ * killer compares cached sizes there.
+ *
+ * Run as root on a device you can afford to push into the killer:
+ *
+ *	lmk-stress [-n children] [-m MB] [-c churn seconds]
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define OOM_DISABLE	(-17)
+#define MAX_ADJ		15
+
+struct child {
+	pid_t pid;
+	int adj;
+	int mb;
+	int killed;
+};
+
+static struct child *children;
+static int nchildren = 32;
+static int child_mb = 8;
+static int churn_seconds = 10;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int set_oom_adj(pid_t pid, int adj)
+{
+	char path[64], val[16];
+	int fd, len, ret;
+
+	snprintf(path, sizeof(path), "/proc/%d/oom_adj", pid);
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	len = snprintf(val, sizeof(val), "%d\n", adj);
+	ret = write(fd, val, len) == len ? 0 : -1;
+	close(fd);
+	return ret;
+}
+
+/* touch mb megabytes, tell the parent through fd, and wait to be killed */
+static void hold_memory(int mb, int fd)
+{
+	size_t size = (size_t)mb << 20;
+	char *p = malloc(size);
+
+	if (!p)
+		exit(1);
+	memset(p, 0x5a, size);
+	if (write(fd, "r", 1) != 1)
+		exit(1);
+	for (;;)
+		pause();
+}
+
+struct exec_args {
+	char *argv[5];
+};
+
+static void *exec_from_thread(void *data)
+{
+	struct exec_args *args = data;
+
+	execv("/proc/self/exe", args->argv);
+	perror("execv");
+	exit(1);
+}
+
+static pid_t spawn_child(int mb, int via_thread, int fd)
+{
+	pid_t pid = fork();
+	static char mb_str[16], fd_str[16];
+	struct exec_args args;
+	pthread_t thread;
+
+	if (pid)
+		return pid;
+
+	if (!via_thread)
+		hold_memory(mb, fd);
+
+	snprintf(mb_str, sizeof(mb_str), "%d", mb);
+	snprintf(fd_str, sizeof(fd_str), "%d", fd);
+	args.argv[0] = "lmk-stress";
+	args.argv[1] = "--hold";
+	args.argv[2] = mb_str;
+	args.argv[3] = fd_str;
+	args.argv[4] = NULL;
+	pthread_create(&thread, NULL, exec_from_thread, &args);
+	for (;;)
+		pause();
+}
+
+static void churn(void)
+{
+	double start = now(), end = start + churn_seconds;
+	unsigned long adj_writes = 0, forks = 0;
+	unsigned int seed = 1;
+	pid_t pid;
+
+	while (now() < end) {
+		int i = rand_r(&seed) % nchildren;
+
+		if (!set_oom_adj(children[i].pid, rand_r(&seed) % (MAX_ADJ + 1)))
+			adj_writes++;
+		if (adj_writes % 16)
+			continue;
+
+		pid = fork();
+		if (!pid)
+			_exit(0);
+		if (pid > 0 && waitpid(pid, NULL, 0) == pid)
+			forks++;
+	}
+	printf("churn: %.0f oom_adj writes/s, %.0f fork+exit/s\n",
+	       adj_writes / (now() - start), forks / (now() - start));
+}
+
+static int reap(void)
+{
+	int status, i, n = 0;
+	pid_t pid;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (i = 0; i < nchildren; i++) {
+			if (children[i].pid != pid)
+				continue;
+			if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGKILL)
+				fprintf(stderr, "child %d exited, status %#x\n",
+					pid, status);
+			children[i].killed = 1;
+			n++;
+		}
+	}
+	return n;
+}
+
+static void pressure(void)
+{
+	double start = now(), first = 0;
+	long mb = 0, killed = 0;
+	char *p;
+
+	while (killed < nchildren / 2) {
+		p = malloc(1 << 20);
+		if (!p)
+			break;
+		memset(p, 0xa5, 1 << 20);
+		mb++;
+		killed += reap();
+		if (killed && !first)
+			first = now();
+	}
+	printf("pressure: %ld kills after %ld MB, first after %.2fs, "
+	       "all after %.2fs\n", killed, mb,
+	       first ? first - start : 0, now() - start);
+}
+
+static int check(void)
+{
+	int i, j, bad = 0;
+
+	for (i = 0; i < nchildren; i++) {
+		if (!children[i].killed)
+			continue;
+		for (j = 0; j < nchildren; j++) {
+			if (children[j].killed)
+				continue;
+			if (children[j].adj > children[i].adj) {
+				printf("FAIL: %d (adj %d) killed, %d (adj %d) "
+				       "alive\n", children[i].pid,
+				       children[i].adj, children[j].pid,
+				       children[j].adj);
+				bad = 1;
+			} else if (children[j].adj == children[i].adj &&
+				   children[j].mb > children[i].mb) {
+				printf("note: %d (adj %d, %d MB) killed, %d "
+				       "(%d MB) alive\n", children[i].pid,
+				       children[i].adj, children[i].mb,
+				       children[j].pid, children[j].mb);
+			}
+		}
+	}
+	return bad;
+}
+
+int main(int argc, char **argv)
+{
+	int pipefd[2];
+	char c;
+	int i, opt, bad;
+
+	if (argc == 4 && !strcmp(argv[1], "--hold"))
+		hold_memory(atoi(argv[2]), atoi(argv[3]));
+
+	while ((opt = getopt(argc, argv, "n:m:c:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nchildren = atoi(optarg);
+			break;
+		case 'm':
+			child_mb = atoi(optarg);
+			break;
+		case 'c':
+			churn_seconds = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc || nchildren < 2 || child_mb < 1)
+		goto usage;
+
+	if (set_oom_adj(getpid(), OOM_DISABLE)) {
+		perror("oom_adj");
+		return 1;
+	}
+
+	children = calloc(nchildren, sizeof(*children));
+	if (pipe(pipefd))
+		return 1;
+	for (i = 0; i < nchildren; i++) {
+		children[i].mb = child_mb * (1 + i % 4);
+		children[i].pid = spawn_child(children[i].mb, i % 3 == 0,
+					      pipefd[1]);
+		if (children[i].pid < 0) {
+			perror("fork");
+			return 1;
+		}
+		/* children inherit OOM_DISABLE, move them to a bucket */
+		set_oom_adj(children[i].pid, 0);
+	}
+	for (i = 0; i < nchildren; i++) {
+		if (read(pipefd[0], &c, 1) != 1) {
+			perror("read");
+			return 1;
+		}
+	}
+
+	churn();
+
+	for (i = 0; i < nchildren; i++) {
+		children[i].adj = i % (MAX_ADJ + 1);
+		if (set_oom_adj(children[i].pid, children[i].adj)) {
+			perror("oom_adj");
+			return 1;
+		}
+	}
+
+	pressure();
+	bad = check();
+
+	for (i = 0; i < nchildren; i++)
+		if (!children[i].killed)
+			kill(children[i].pid, SIGKILL);
+	while (wait(NULL) > 0)
+		;
+	printf("%s\n", bad ? "FAILED" : "ok");
+	return bad;
+
+usage:
+	fprintf(stderr, "usage: %s [-n children] [-m MB] [-c churn seconds]\n",
+		argv[0]);
+	return 2;
+}
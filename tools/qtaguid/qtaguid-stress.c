@@ -0,0 +1,279 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -g -lpthread -o qtaguid-stress qtaguid-stress.c */
+
+/*
+ * qtaguid-stress: check xt_qtaguid's per-cpu tag counters under load
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * Packets are now counted into per-cpu counters without taking any lock,
+ * and /proc/net/xt_qtaguid/stats sums them up. This sends UDP datagrams
+ * over loopback from several threads, each from a socket with its own
+ * tag, while another thread keeps reading the stats file. Threads are
+ * not pinned, so the scheduler moves them, and their counts, across cpus.
+ *
+ *  - While sending, no tag's tx counters may ever go down between two
+ *    reads of the stats file: a torn 64-bit read shows up as a drop or a
+ *    jump of 2^32.
+ *  - Afterwards, each tag must show exactly the datagrams sent on it, and
+ *    the same number of bytes per datagram as every other tag; a lost
+ *    update shows up as a shortfall.
+ *
+ * The match only accounts packets that hit an owner rule, e.g.
+ *
+ *	iptables -I OUTPUT -o lo -m owner --socket-exists
+ *
+ *	qtaguid-stress [-t threads] [-n datagrams per thread] [-z size]
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define CTRL		"/proc/net/xt_qtaguid/ctrl"
+#define STATS		"/proc/net/xt_qtaguid/stats"
+#define TAG_BASE	0x5157u		/* "QW" */
+#define MAX_THREADS	64
+
+struct sender {
+	pthread_t thread;
+	int id;
+	int fd;
+	uint64_t tag;
+	uint64_t last_bytes;
+	uint64_t last_packets;
+};
+
+static struct sender senders[MAX_THREADS];
+static int nthreads = 8;
+static long count = 100000;
+static int size = 256;
+static struct sockaddr_in sink;
+static volatile int done;
+static volatile int failed;
+
+static int ctrl(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static int ctrl(const char *fmt, ...)
+{
+	char buf[128];
+	va_list ap;
+	int fd, len, ret;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	fd = open(CTRL, O_WRONLY);
+	if (fd < 0) {
+		perror(CTRL);
+		return -1;
+	}
+	ret = write(fd, buf, len) == len ? 0 : -1;
+	if (ret)
+		fprintf(stderr, "%s: \"%s\" failed\n", CTRL, buf);
+	close(fd);
+	return ret;
+}
+
+/*
+ * Reads the lo tx counters of every sender's tag, summed over counter
+ * sets. Returns -1 if the stats file can't be read.
+ */
+static int read_stats(uint64_t *bytes, uint64_t *packets)
+{
+	char line[512], iface[32];
+	unsigned long long tag, b, p;
+	unsigned int uid, set;
+	int idx, i;
+	FILE *f;
+
+	memset(bytes, 0, nthreads * sizeof(*bytes));
+	memset(packets, 0, nthreads * sizeof(*packets));
+	f = fopen(STATS, "r");
+	if (!f) {
+		perror(STATS);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%d %31s %llx %u %u %*u %*u %llu %llu",
+			   &idx, iface, &tag, &uid, &set, &b, &p) != 7)
+			continue;
+		if (strcmp(iface, "lo") || uid != getuid())
+			continue;
+		for (i = 0; i < nthreads; i++) {
+			if (senders[i].tag != tag)
+				continue;
+			bytes[i] += b;
+			packets[i] += p;
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+static void *sender_fn(void *arg)
+{
+	struct sender *s = arg;
+	char *buf = calloc(1, size);
+	long n;
+
+	for (n = 0; n < count && !failed; n++) {
+		if (sendto(s->fd, buf, size, 0, (struct sockaddr *)&sink,
+			   sizeof(sink)) != size) {
+			perror("sendto");
+			failed = 1;
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+static void *reader_fn(void *arg)
+{
+	uint64_t bytes[MAX_THREADS], packets[MAX_THREADS];
+	unsigned long *reads = arg;
+	int i;
+
+	while (!done && !failed) {
+		if (read_stats(bytes, packets)) {
+			failed = 1;
+			break;
+		}
+		(*reads)++;
+		for (i = 0; i < nthreads; i++) {
+			struct sender *s = &senders[i];
+
+			if (bytes[i] < s->last_bytes ||
+			    packets[i] < s->last_packets ||
+			    packets[i] - s->last_packets > (1ull << 31)) {
+				fprintf(stderr, "tag %#" PRIx64 " went from "
+					"%" PRIu64 "/%" PRIu64 " to %" PRIu64
+					"/%" PRIu64 " bytes/packets\n",
+					s->tag, s->last_bytes,
+					s->last_packets, bytes[i], packets[i]);
+				failed = 1;
+			}
+			s->last_bytes = bytes[i];
+			s->last_packets = packets[i];
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t bytes[MAX_THREADS], packets[MAX_THREADS];
+	unsigned long reads = 0;
+	socklen_t len = sizeof(sink);
+	struct timeval start, end;
+	pthread_t reader;
+	double elapsed;
+	int c, i, sink_fd;
+
+	while ((c = getopt(argc, argv, "t:n:z:")) != -1) {
+		switch (c) {
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'n':
+			count = atol(optarg);
+			break;
+		case 'z':
+			size = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc || nthreads < 1 || nthreads > MAX_THREADS ||
+	    count < 1 || size < 1 || size > 1400)
+		goto usage;
+
+	/* a sink that never reads: overflowing its buffer only drops rx */
+	sink_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	memset(&sink, 0, sizeof(sink));
+	sink.sin_family = AF_INET;
+	sink.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (sink_fd < 0 || bind(sink_fd, (struct sockaddr *)&sink,
+				sizeof(sink)) < 0 ||
+	    getsockname(sink_fd, (struct sockaddr *)&sink, &len) < 0) {
+		perror("sink");
+		return 1;
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		struct sender *s = &senders[i];
+
+		s->id = i;
+		s->tag = (uint64_t)(TAG_BASE + i) << 32;
+		s->fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if (s->fd < 0) {
+			perror("socket");
+			return 1;
+		}
+		/* start from zero in case an earlier run left stats behind */
+		if (ctrl("d %" PRIu64 " %u", s->tag, getuid()) ||
+		    ctrl("t %d %" PRIu64 " %u", s->fd, s->tag, getuid()))
+			return 1;
+	}
+
+	gettimeofday(&start, NULL);
+	pthread_create(&reader, NULL, reader_fn, &reads);
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&senders[i].thread, NULL, sender_fn,
+			       &senders[i]);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(senders[i].thread, NULL);
+	gettimeofday(&end, NULL);
+	done = 1;
+	pthread_join(reader, NULL);
+
+	if (!failed && !read_stats(bytes, packets)) {
+		for (i = 0; i < nthreads; i++) {
+			if (packets[i] != (uint64_t)count ||
+			    bytes[i] * packets[0] != bytes[0] * packets[i]) {
+				fprintf(stderr, "tag %#" PRIx64 ": %" PRIu64
+					" bytes, %" PRIu64 " packets, sent "
+					"%ld\n", senders[i].tag, bytes[i],
+					packets[i], count);
+				failed = 1;
+			}
+		}
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		ctrl("u %d", senders[i].fd);
+		ctrl("d %" PRIu64 " %u", senders[i].tag, getuid());
+	}
+
+	elapsed = (end.tv_sec - start.tv_sec) +
+		  (end.tv_usec - start.tv_usec) / 1e6;
+	printf("%d threads: %.0f datagrams/s, %lu stats reads%s\n", nthreads,
+	       nthreads * count / elapsed, reads, failed ? ", FAILED" : "");
+	return failed;
+
+usage:
+	fprintf(stderr, "usage: %s [-t threads] [-n datagrams per thread] "
+		"[-z size]\n", argv[0]);
+	return 2;
+}
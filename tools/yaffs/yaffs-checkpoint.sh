@@ -0,0 +1,138 @@
+#!/bin/sh
+# yaffs-checkpoint: mount time and lazy tnode loading from a yaffs2 checkpoint
+#
+# Usage: yaffs-checkpoint.sh <mtd block device> <mountpoint> [files]
+#
+# e.g.	yaffs-checkpoint.sh /dev/block/mtdblock5 /mnt/test 2000
+#
+# Fills a directory on the mount with files of 16K to 256K of random data
+# and records their md5sums, then unmounts so that a checkpoint is
+# written. From there:
+#
+#  - The remount is timed. It must come from the checkpoint and leave
+#    every file's tnodes unloaded (nLazyTnodeFiles in /proc/yaffs).
+#  - Reading three files must load exactly those three. The device is
+#    mounted noatime throughout, so reads never write.
+#  - The first write invalidates the checkpoint. It may load the files
+#    whose tnodes sit in the first checkpoint block, but not all of them;
+#    the background gc then loads the rest one per pass, and the count
+#    must drain to zero.
+#  - Every file must still match its md5sum, read through freshly
+#    dropped caches, before and after another remount.
+#  - For comparison, a mount with no-checkpoint-read is timed too: that
+#    is the full scan the checkpoint saves.
+#
+# The device must hold a yaffs2 file system with room for the files. The
+# test directory is removed and the device unmounted at the end. Needs a
+# date(1) that knows %N.
+
+if [ $# -lt 2 ] ; then
+	echo "usage: $0 <mtd block device> <mountpoint> [files]" >&2
+	exit 2
+fi
+
+DEV=$1
+MNT=$2
+NFILES=${3:-1000}
+NAME=$(basename $DEV)
+DIR=$MNT/yaffs-checkpoint
+SUMS=/tmp/yaffs-checkpoint.md5
+
+fail() {
+	echo "$0: $*" >&2
+	exit 1
+}
+
+cleanup() {
+	if grep -q " $MNT " /proc/mounts ; then
+		rm -rf $DIR
+		umount $MNT
+	fi
+	rm -f $SUMS
+}
+trap cleanup EXIT INT TERM
+
+# the value of a counter in the device's section of /proc/yaffs
+yaffs_stat() {
+	awk -v dev="\"$NAME\"" -v key=$1 '
+		/^Device / { in_dev = (index($0, dev) > 0) }
+		in_dev && index($1, key ".") == 1 { print $2; exit }
+	' /proc/yaffs
+}
+
+now_ms() {
+	echo $(( $(date +%s%N) / 1000000 ))
+}
+
+# mounts with the given options and prints how long it took
+timed_mount() {
+	start=$(now_ms)
+	mount -t yaffs2 -o noatime${1:+,$1} $DEV $MNT || fail "mount failed"
+	echo "mount${1:+ -o $1}: $(( $(now_ms) - start ))ms"
+}
+
+drop_caches() {
+	sync
+	echo 3 > /proc/sys/vm/drop_caches
+}
+
+verify() {
+	drop_caches
+	(cd $DIR && md5sum -c $SUMS) | grep -v ': OK$' && fail "$1: md5 mismatch"
+	echo "$1: all $(wc -l < $SUMS) files match"
+}
+
+[ $NFILES -ge 4 ] || fail "need at least 4 files"
+grep -q " $MNT " /proc/mounts && fail "$MNT is already mounted"
+mount -t yaffs2 -o noatime $DEV $MNT || fail "mount failed"
+rm -rf $DIR
+mkdir $DIR || exit 1
+
+echo "writing $NFILES files"
+i=0
+while [ $i -lt $NFILES ] ; do
+	dd if=/dev/urandom of=$DIR/f.$i bs=16k count=$(( i % 16 + 1 )) \
+		2>/dev/null || fail "write failed"
+	i=$(( i + 1 ))
+done
+(cd $DIR && md5sum f.*) > $SUMS
+umount $MNT
+
+timed_mount
+[ "$(yaffs_stat blocksInCheckpoint)" -gt 0 ] || fail "mount did not use the checkpoint"
+lazy=$(yaffs_stat nLazyTnodeFiles)
+echo "after mount: $lazy lazy files"
+[ "$lazy" -ge $NFILES ] || fail "expected at least $NFILES lazy files"
+
+drop_caches
+for i in 1 2 3 ; do
+	cat $DIR/f.$(( i * NFILES / 4 )) > /dev/null
+done
+after_read=$(yaffs_stat nLazyTnodeFiles)
+echo "after reading 3 files: $after_read lazy files"
+[ "$after_read" -eq $(( lazy - 3 )) ] || fail "expected $(( lazy - 3 ))"
+
+dd if=/dev/urandom of=$DIR/new bs=16k count=4 2>/dev/null || fail "write failed"
+(cd $DIR && md5sum new) >> $SUMS
+after_write=$(yaffs_stat nLazyTnodeFiles)
+echo "after the first write: $after_write lazy files"
+[ "$after_write" -gt 0 ] || echo "(the first write loaded all of them)"
+
+start=$(now_ms)
+waited=0
+while [ "$(yaffs_stat nLazyTnodeFiles)" -gt 0 ] ; do
+	[ $waited -lt 120 ] || fail "$(yaffs_stat nLazyTnodeFiles) files still lazy after 120s"
+	sleep 1
+	waited=$(( waited + 1 ))
+done
+echo "background gc loaded the rest in $(( $(now_ms) - start ))ms"
+
+verify "after loading"
+umount $MNT
+
+timed_mount no-checkpoint-read
+verify "after a full scan"
+umount $MNT
+
+timed_mount
+verify "after remounting from the checkpoint"
@@ -0,0 +1,385 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -g -lpthread -o yaffs-churn yaffs-churn.c */
+
+/*
+ * yaffs-churn: overwrite load and garbage collection statistics for yaffs2
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * Fills a directory on a yaffs2 mount with files up to the given share of
+ * the file system, then has writer threads overwrite random files in
+ * bursts. Every overwrite turns the file's old chunks into garbage, so
+ * the device soon needs collecting all the time. Between bursts the
+ * writers sleep for -i ms, which is when the background gc thread should
+ * catch up.
+ *
+ * Collection done in the foreground shows up as slow write() calls, so
+ * the write latency percentiles are printed, together with how much the
+ * gc counters in /proc/yaffs moved during the run: with the gc thread
+ * doing its job, most copies are bgGCCopies and few writes stall.
+ *
+ * With -r, a quarter of the files are written once with a pattern and
+ * left alone by the writers, and reader threads read them back whole,
+ * dropping each file's page cache first so that every read goes to
+ * yaffs. Readers share the file system lock, so read throughput should
+ * grow with their number when nothing writes (-w 0), and they check
+ * every byte, since the writers' gc keeps moving the chunks they read.
+ *
+ *	yaffs-churn [-d device] [-w writers] [-r readers] [-s seconds]
+ *		    [-f fill%] [-z file size] [-b burst ms] [-i idle ms]
+ *		    directory
+ *
+ * The device is the name /proc/yaffs shows for the mount (the first one
+ * by default). Files named churn.* are left in the directory.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/statvfs.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define CHUNK		4096
+#define BUCKETS		32	/* log2 of the latency in us */
+
+static const char *gc_stats[] = {
+	"nGCCopies", "bgGCCopies", "allGCs", "passiveGCs", "oldestDirtyGCs",
+	"backgroundGCs", "gcWakes", "nBlockErasures", "nErasedBlocks",
+};
+#define NR_GC_STATS	(sizeof(gc_stats) / sizeof(gc_stats[0]))
+
+/* a writer, or a reader when reading */
+struct writer {
+	pthread_t thread;
+	int id;
+	int reading;
+	unsigned int seed;
+	unsigned long ops;		/* writes, or reads */
+	unsigned long latency[BUCKETS];
+};
+
+static const char *dir;
+static const char *device;
+static int nwriters = 2;
+static int nreaders;
+static int seconds = 60;
+static int fill_pct = 70;
+static long file_size = 64 * 1024;
+static int burst_ms = 500;
+static int idle_ms;
+static long nfiles;
+static long ncold;		/* files 0 to ncold - 1 are only read */
+static volatile int stop;
+static volatile int failed;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * Reads the named counters of the device from /proc/yaffs. Returns -1 if
+ * there is no such device.
+ */
+static int read_gc_stats(long *values)
+{
+	char line[256], name[64], quoted[64];
+	int in_dev = 0, found = 0;
+	unsigned int i;
+	long v;
+	FILE *f = fopen("/proc/yaffs", "r");
+
+	if (!f) {
+		perror("/proc/yaffs");
+		return -1;
+	}
+	snprintf(quoted, sizeof(quoted), "\"%s\"", device ? device : "");
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, "Device ", 7)) {
+			in_dev = !found && (!device || strstr(line, quoted));
+			found |= in_dev;
+			continue;
+		}
+		if (!in_dev || sscanf(line, "%63[A-Za-z]%*[.] %ld", name, &v) != 2)
+			continue;
+		for (i = 0; i < NR_GC_STATS; i++)
+			if (!strcmp(name, gc_stats[i]))
+				values[i] = v;
+	}
+	fclose(f);
+	if (!found)
+		fprintf(stderr, "/proc/yaffs: no device %s\n",
+			device ? device : "at all");
+	return found ? 0 : -1;
+}
+
+static void account(unsigned long *latency, double t)
+{
+	int b;
+
+	t = (now() - t) * 1e6;
+	for (b = 0; b < BUCKETS - 1 && t >= 2; b++)
+		t /= 2;
+	latency[b]++;
+}
+
+/* the contents of a chunk of a cold file */
+static void cold_chunk(char *buf, long n, long off)
+{
+	int i;
+
+	for (i = 0; i < CHUNK; i++)
+		buf[i] = (char)(n * 131 + off / CHUNK * 7 + i);
+}
+
+/* overwrites file n, or writes it with the cold pattern if buf is NULL */
+static int write_file(long n, char *buf, unsigned long *latency,
+		      unsigned long *writes)
+{
+	char path[256], cold[CHUNK];
+	double t;
+	long off;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/churn.%ld", dir, n);
+	fd = open(path, O_WRONLY | O_CREAT, 0644);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	for (off = 0; off < file_size; off += CHUNK) {
+		if (!buf)
+			cold_chunk(cold, n, off);
+		t = now();
+		if (pwrite(fd, buf ? buf : cold, CHUNK, off) != CHUNK) {
+			perror(path);
+			close(fd);
+			return -1;
+		}
+		if (latency) {
+			account(latency, t);
+			(*writes)++;
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+static int read_file(long n, unsigned long *latency, unsigned long *reads)
+{
+	char path[256], buf[CHUNK], expect[CHUNK];
+	double t;
+	long off;
+	int fd, ret = 0;
+
+	snprintf(path, sizeof(path), "%s/churn.%ld", dir, n);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	for (off = 0; off < file_size && !ret; off += CHUNK) {
+		t = now();
+		if (pread(fd, buf, CHUNK, off) != CHUNK) {
+			perror(path);
+			ret = -1;
+			break;
+		}
+		account(latency, t);
+		(*reads)++;
+		cold_chunk(expect, n, off);
+		if (memcmp(buf, expect, CHUNK)) {
+			fprintf(stderr, "%s: chunk at %ld is corrupt\n", path,
+				off);
+			ret = -1;
+		}
+	}
+	close(fd);
+	return ret;
+}
+
+static void *writer_fn(void *arg)
+{
+	struct writer *w = arg;
+	char *buf = malloc(CHUNK);
+	double burst_end;
+
+	while (w->reading && !stop && !failed) {
+		if (read_file(rand_r(&w->seed) % ncold, w->latency,
+			      &w->ops))
+			failed = 1;
+	}
+
+	while (!stop && !failed) {
+		burst_end = now() + burst_ms / 1000.0;
+		while (!stop && !failed && now() < burst_end) {
+			memset(buf, rand_r(&w->seed), CHUNK);
+			if (write_file(ncold + rand_r(&w->seed) %
+				       (nfiles - ncold), buf, w->latency,
+				       &w->ops))
+				failed = 1;
+		}
+		if (idle_ms)
+			usleep(idle_ms * 1000);
+	}
+	free(buf);
+	return NULL;
+}
+
+/* the latency below which pct percent of the calls completed */
+static unsigned long percentile(unsigned long *latency, unsigned long total,
+				double pct)
+{
+	unsigned long sum = 0;
+	int b;
+
+	for (b = 0; b < BUCKETS; b++) {
+		sum += latency[b];
+		if (sum >= total * pct / 100)
+			break;
+	}
+	return 1ul << b;
+}
+
+int main(int argc, char **argv)
+{
+	long before[NR_GC_STATS] = { 0 }, after[NR_GC_STATS] = { 0 };
+	unsigned long latency[BUCKETS] = { 0 }, writes = 0;
+	unsigned long read_latency[BUCKETS] = { 0 }, reads = 0;
+	struct writer *writers;
+	struct statvfs st;
+	double start, elapsed;
+	char *buf;
+	unsigned int j;
+	long n;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "d:w:r:s:f:z:b:i:")) != -1) {
+		switch (c) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'w':
+			nwriters = atoi(optarg);
+			break;
+		case 'r':
+			nreaders = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'f':
+			fill_pct = atoi(optarg);
+			break;
+		case 'z':
+			file_size = atol(optarg);
+			break;
+		case 'b':
+			burst_ms = atoi(optarg);
+			break;
+		case 'i':
+			idle_ms = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1 || nwriters < 0 || nreaders < 0 ||
+	    nwriters + nreaders < 1 || fill_pct < 1 ||
+	    fill_pct > 95 || file_size < CHUNK || burst_ms < 1)
+		goto usage;
+	dir = argv[optind];
+	file_size -= file_size % CHUNK;
+
+	if (statvfs(dir, &st)) {
+		perror(dir);
+		return 1;
+	}
+	nfiles = (double)st.f_blocks * st.f_frsize * fill_pct / 100 /
+		 file_size;
+	ncold = nreaders ? nfiles / 4 : 0;
+	if (nfiles - ncold < 1 || (nreaders && ncold < 1)) {
+		fprintf(stderr, "%s: no room for enough files\n", dir);
+		return 1;
+	}
+	if (read_gc_stats(before))
+		return 1;
+
+	printf("writing %ld files of %ld bytes\n", nfiles, file_size);
+	buf = calloc(1, CHUNK);
+	for (n = 0; n < nfiles; n++)
+		if (write_file(n, n < ncold ? NULL : buf, NULL, NULL))
+			return 1;
+	sync();
+
+	read_gc_stats(before);
+	writers = calloc(nwriters + nreaders, sizeof(*writers));
+	start = now();
+	for (i = 0; i < nwriters + nreaders; i++) {
+		writers[i].id = i;
+		writers[i].reading = i >= nwriters;
+		writers[i].seed = i + 1;
+		pthread_create(&writers[i].thread, NULL, writer_fn,
+			       &writers[i]);
+	}
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < nwriters + nreaders; i++) {
+		struct writer *w = &writers[i];
+
+		pthread_join(w->thread, NULL);
+		for (c = 0; c < BUCKETS; c++) {
+			if (w->reading)
+				read_latency[c] += w->latency[c];
+			else
+				latency[c] += w->latency[c];
+		}
+		if (w->reading)
+			reads += w->ops;
+		else
+			writes += w->ops;
+	}
+	elapsed = now() - start;
+	read_gc_stats(after);
+
+	printf("%lu writes of %d bytes, %.0f KB/s\n", writes, CHUNK,
+	       writes * CHUNK / elapsed / 1024);
+	if (writes)
+		printf("write latency: p50 <%luus p99 <%luus p99.9 <%luus\n",
+		       percentile(latency, writes, 50),
+		       percentile(latency, writes, 99),
+		       percentile(latency, writes, 99.9));
+	if (reads)
+		printf("%lu reads of %d bytes, %.0f KB/s\n"
+		       "read latency: p50 <%luus p99 <%luus p99.9 <%luus\n",
+		       reads, CHUNK, reads * CHUNK / elapsed / 1024,
+		       percentile(read_latency, reads, 50),
+		       percentile(read_latency, reads, 99),
+		       percentile(read_latency, reads, 99.9));
+	for (j = 0; j < NR_GC_STATS; j++)
+		printf("  %-15s %+ld\n", gc_stats[j], after[j] - before[j]);
+	return failed;
+
+usage:
+	fprintf(stderr, "usage: %s [-d device] [-w writers] [-r readers] "
+		"[-s seconds] [-f fill%%] [-z file size] [-b burst ms] "
+		"[-i idle ms] directory\n", argv[0]);
+	return 2;
+}
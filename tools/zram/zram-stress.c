@@ -0,0 +1,267 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -g -lpthread -o zram-stress zram-stress.c */
+
+/*
+ * zram-stress: concurrent read/write stress and throughput test for zram
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * Every thread owns the pages whose index modulo the thread count equals
+ * its number. It overwrites random pages of its own with a new generation,
+ * and reads back random pages of the whole device. A page carries its
+ * index, generation and a checksum, so a reader catches both torn pages
+ * (a decompress racing a store to the same slot) and pages that landed in
+ * the wrong slot; for its own pages the thread also checks the generation.
+ *
+ * One page in eight is written as zeroes to exercise the zero page path,
+ * and the fill pattern changes every few words, so the rest compresses
+ * but not to nothing.
+ *
+ * Usage, with disksize already set (echo $((64<<20)) > .../disksize):
+ *
+ *	zram-stress [-t threads] [-s seconds] [-r read%] /dev/zram0
+ *
+ * Prints MB/s for reads and writes, and exits non-zero on the first
+ * corrupted page.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <linux/fs.h>
+
+#define PAGE	4096
+#define WORDS	(PAGE / sizeof(uint64_t))
+
+struct page_hdr {
+	uint64_t index;
+	uint64_t gen;
+	uint64_t sum;
+};
+
+struct worker {
+	pthread_t thread;
+	int id;
+	unsigned int seed;
+	uint64_t *gens;		/* generation of each owned page, 0 = zero page */
+	uint64_t reads;
+	uint64_t writes;
+};
+
+static int fd;
+static int nthreads = 4;
+static int seconds = 10;
+static int read_pct = 50;
+static uint64_t npages;
+static volatile int stop;
+static volatile int failed;
+
+static uint64_t checksum(const uint64_t *w)
+{
+	uint64_t sum = 0;
+	size_t i;
+
+	for (i = 3; i < WORDS; i++)
+		sum = sum * 31 + w[i];
+	return sum;
+}
+
+static void fill(uint64_t *w, uint64_t index, uint64_t gen)
+{
+	struct page_hdr *h = (struct page_hdr *)w;
+	size_t i;
+
+	if (!gen) {
+		memset(w, 0, PAGE);
+		return;
+	}
+	for (i = 3; i < WORDS; i++)
+		w[i] = (index << 32) ^ gen ^ (i / 8);
+	h->index = index;
+	h->gen = gen;
+	h->sum = checksum(w);
+}
+
+static int is_zero(const uint64_t *w)
+{
+	size_t i;
+
+	for (i = 0; i < WORDS; i++)
+		if (w[i])
+			return 0;
+	return 1;
+}
+
+/* returns the generation found in the page, or -1 if it is corrupt */
+static int64_t check(const uint64_t *w, uint64_t index)
+{
+	const struct page_hdr *h = (const struct page_hdr *)w;
+
+	if (is_zero(w))
+		return 0;
+	if (h->index != index || h->sum != checksum(w))
+		return -1;
+	return h->gen;
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *wk = arg;
+	uint64_t *buf;
+	uint64_t owned = (npages - wk->id + nthreads - 1) / nthreads;
+
+	if (posix_memalign((void **)&buf, PAGE, PAGE))
+		return NULL;
+
+	while (!stop && !failed) {
+		uint64_t slot, index;
+		int64_t gen;
+
+		if ((int)(rand_r(&wk->seed) % 100) >= read_pct) {
+			slot = rand_r(&wk->seed) % owned;
+			index = slot * nthreads + wk->id;
+			wk->gens[slot]++;
+			if (rand_r(&wk->seed) % 8 == 0)
+				wk->gens[slot] = 0;
+			fill(buf, index, wk->gens[slot]);
+			if (pwrite(fd, buf, PAGE, index * PAGE) != PAGE) {
+				perror("pwrite");
+				failed = 1;
+				break;
+			}
+			wk->writes++;
+			continue;
+		}
+
+		index = rand_r(&wk->seed) % npages;
+		if (pread(fd, buf, PAGE, index * PAGE) != PAGE) {
+			perror("pread");
+			failed = 1;
+			break;
+		}
+		wk->reads++;
+		gen = check(buf, index);
+		if (gen < 0) {
+			fprintf(stderr, "page %" PRIu64 " is corrupt\n", index);
+			failed = 1;
+		} else if (index % nthreads == (uint64_t)wk->id &&
+			   (uint64_t)gen != wk->gens[index / nthreads]) {
+			fprintf(stderr, "page %" PRIu64 ": generation %" PRId64
+				", expected %" PRIu64 "\n", index, gen,
+				wk->gens[index / nthreads]);
+			failed = 1;
+		}
+	}
+
+	free(buf);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct worker *workers;
+	struct timeval start, end;
+	struct stat st;
+	uint64_t bytes, index, reads = 0, writes = 0;
+	void *zero;
+	double elapsed;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "t:s:r:")) != -1) {
+		switch (c) {
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'r':
+			read_pct = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1 || nthreads < 1 || read_pct < 0 ||
+	    read_pct > 100)
+		goto usage;
+
+	/* a plain file works too, to check the harness itself */
+	fd = open(argv[optind], O_RDWR | O_DIRECT);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	bytes = st.st_size;
+	if (!S_ISREG(st.st_mode) && ioctl(fd, BLKGETSIZE64, &bytes) < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	npages = bytes / PAGE;
+	if (npages < (uint64_t)nthreads) {
+		fprintf(stderr, "%s: set disksize first\n", argv[optind]);
+		return 1;
+	}
+
+	/* start from a known state: every page zero */
+	workers = calloc(nthreads, sizeof(*workers));
+	for (i = 0; i < nthreads; i++) {
+		workers[i].id = i;
+		workers[i].seed = i + 1;
+		workers[i].gens = calloc(npages / nthreads + 1,
+					 sizeof(uint64_t));
+	}
+	if (posix_memalign((void **)&zero, PAGE, PAGE))
+		return 1;
+	memset(zero, 0, PAGE);
+	for (index = 0; index < npages; index++) {
+		if (pwrite(fd, zero, PAGE, index * PAGE) != PAGE) {
+			perror("pwrite");
+			return 1;
+		}
+	}
+	free(zero);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&workers[i].thread, NULL, worker_fn,
+			       &workers[i]);
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		reads += workers[i].reads;
+		writes += workers[i].writes;
+	}
+	gettimeofday(&end, NULL);
+
+	elapsed = (end.tv_sec - start.tv_sec) +
+		  (end.tv_usec - start.tv_usec) / 1e6;
+	printf("%d threads, %" PRIu64 " pages: read %.1f MB/s, "
+	       "write %.1f MB/s%s\n", nthreads, npages,
+	       reads * PAGE / elapsed / 1e6, writes * PAGE / elapsed / 1e6,
+	       failed ? ", FAILED" : "");
+	return failed;
+
+usage:
+	fprintf(stderr, "usage: %s [-t threads] [-s seconds] [-r read%%] "
+		"device\n", argv[0]);
+	return 2;
+}